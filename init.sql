@@ -28,12 +28,15 @@ CREATE TABLE cmd_log (
 	cmd_type TEXT NOT NULL,
 	cmd_opts TEXT[],
 	status TEXT DEFAULT 'waiting' NOT NULL,
+	-- commands with higher priority go first, see cmd_priority
+	priority int DEFAULT 0 NOT NULL,
 
 	-- available commands
 	CONSTRAINT check_cmd_type
 	CHECK (cmd_type IN ('add_node', 'rm_node', 'create_hash_partitions',
 						 'move_part', 'create_replica', 'rebalance',
-						 'set_replevel')),
+						 'set_replevel', 'promote_replica', 'failover',
+						 'rereplicate', 'drain_node')),
 
 	-- command status
 	CONSTRAINT check_cmd_status
@@ -41,6 +44,67 @@ CREATE TABLE cmd_log (
 					  'success', 'done'))
 );
 
+-- Progress of copy part tasks of the last command executing them, updated by
+-- shardlord as tasks go on. Lives only on shardlord; see copy_progress for
+-- human-readable form.
+CREATE UNLOGGED TABLE copy_tasks (
+	part_name text,
+	dst int,
+	src int NOT NULL,
+	task_type text NOT NULL,
+	phase text NOT NULL,
+	total_bytes bigint, -- size of src table, if known
+	total_rows bigint, -- estimated number of rows in src table, if known
+	copied_bytes bigint NOT NULL DEFAULT 0,
+	remaining_bytes bigint, -- data or WAL left to transfer in current phase
+	throughput float8, -- in current phase, bytes per second
+	started timestamptz NOT NULL DEFAULT now(),
+	updated timestamptz NOT NULL DEFAULT now(),
+	PRIMARY KEY (part_name, dst)
+);
+
+CREATE VIEW copy_progress AS
+	SELECT part_name, src, dst, task_type, phase,
+		   pg_size_pretty(total_bytes) AS total_size,
+		   pg_size_pretty(copied_bytes) AS copied_size,
+		   round(100.0 * least(copied_bytes, total_bytes) /
+				 nullif(total_bytes, 0), 1) AS copied_percent,
+		   (total_rows * least(copied_bytes, total_bytes) /
+			nullif(total_bytes, 0)) AS copied_rows_estimate,
+		   pg_size_pretty(remaining_bytes) AS remaining_size,
+		   pg_size_pretty(throughput::bigint) || '/s' AS throughput,
+		   CASE WHEN throughput > 0 AND remaining_bytes IS NOT NULL THEN
+				make_interval(secs => remaining_bytes / throughput)
+		   END AS eta,
+		   now() - started AS elapsed,
+		   updated
+	FROM copy_tasks;
+
+-- Worker failovers performed by shardlord, see failover(). rto is time from
+-- the last successful probe of the node until its primaries were promoted.
+CREATE TABLE failovers (
+	cmd_id bigint,
+	node int NOT NULL,
+	last_seen timestamptz,
+	promoted_at timestamptz NOT NULL,
+	promoted_parts int NOT NULL,
+	rto interval
+);
+
+-- Health of workers as seen by shardlord heartbeats, see monitor.c. Lives
+-- only on shardlord. rtt_ms is smoothed round trip of connect and query,
+-- repl_lag_bytes is how far the slowest subscriber of node's data channels
+-- lags behind it. Degraded nodes get no new tasks.
+CREATE UNLOGGED TABLE node_health (
+	node int PRIMARY KEY,
+	status text NOT NULL CHECK (status IN ('healthy', 'degraded', 'failed')),
+	rtt_ms float8,
+	repl_lag_bytes bigint,
+	failures int NOT NULL, -- heartbeats and connections failed in a row
+	last_seen timestamptz,
+	updated timestamptz NOT NULL DEFAULT now()
+);
+
 
 -- Interface functions
 
@@ -58,6 +122,14 @@ BEGIN
 END
 $$ LANGUAGE plpgsql;
 
+-- Add several nodes at once, bootstrapping them in parallel. Nodes which
+-- failed to bootstrap are not added, others are.
+CREATE FUNCTION add_nodes(connstrings text[]) RETURNS int AS $$
+BEGIN
+	RETURN @extschema@.register_cmd('add_node', connstrings);
+END
+$$ LANGUAGE plpgsql;
+
 -- Remove node. Its state will be reset, all shardman data lost.
 CREATE FUNCTION rm_node(node_id int, force bool DEFAULT false) RETURNS int AS $$
 DECLARE
@@ -71,6 +143,20 @@ BEGIN
 END
 $$ LANGUAGE plpgsql;
 
+-- Move all shards off the node, balancing them by size among other healthy
+-- workers, and remove it.
+CREATE FUNCTION drain_node(node_id int) RETURNS int AS $$
+DECLARE
+	cmd		text;
+	opts	text[];
+BEGIN
+	cmd = 'drain_node';
+	opts = ARRAY[node_id::text];
+
+	RETURN @extschema@.register_cmd(cmd, opts);
+END
+$$ LANGUAGE plpgsql STRICT;
+
 -- Shard table with hash partitions. Params as in pathman, except for relation
 -- (lord doesn't know oid of the table)
 CREATE FUNCTION create_hash_partitions(
@@ -133,6 +219,20 @@ BEGIN
 END
 $$ LANGUAGE plpgsql;
 
+-- Make replica of 'part_name' on node 'dst' primary. Replica must be fed by
+-- primary directly. Primary is dropped, so use it when primary node is lost.
+CREATE FUNCTION promote_replica(part_name text, dst int) RETURNS int AS $$
+DECLARE
+	cmd		text;
+	opts	text[];
+BEGIN
+	cmd = 'promote_replica';
+	opts = ARRAY[part_name::text, dst::text];
+
+	RETURN @extschema@.register_cmd(cmd, opts);
+END
+$$ LANGUAGE plpgsql STRICT;
+
 -- Evenly distribute partitions of table 'relation' across all nodes.
 CREATE FUNCTION rebalance(relation text) RETURNS int AS $$
 DECLARE
@@ -149,6 +249,8 @@ $$ LANGUAGE plpgsql;
 -- Add replicas to partitions of table 'relation' until we reach replevel
 -- replicas for each one. Note that it is pointless to set replevel to more than
 -- number of active workers - 1. Replica deletions is not implemented yet.
+-- replevel is remembered, and lost replicas are recreated later by
+-- 'rereplicate' commands, see rereplicate.c.
 CREATE FUNCTION set_replevel(relation text, replevel int) RETURNS int AS $$
 DECLARE
 	cmd		text;
@@ -161,6 +263,49 @@ BEGIN
 END
 $$ LANGUAGE plpgsql STRICT;
 
+-- With sync replicas, let commits on partitions of table 'relation' wait only
+-- for quorum replicas of the partition instead of all of them; NULL quorum
+-- means all. Must be called on shardlord; nodes pick up the change via
+-- metadata replication.
+CREATE FUNCTION set_sync_quorum(relation text, quorum int) RETURNS void AS $$
+BEGIN
+	IF NOT @extschema@.me_lord() THEN
+		RAISE EXCEPTION 'set_sync_quorum must be called on shardlord';
+	END IF;
+	IF NOT EXISTS (SELECT 1 FROM @extschema@.tables t
+				   WHERE t.relation = set_sync_quorum.relation) THEN
+		RAISE EXCEPTION 'Table % is not sharded', relation;
+	END IF;
+	UPDATE @extschema@.tables t SET sync_quorum = quorum
+	 WHERE t.relation = set_sync_quorum.relation;
+END
+$$ LANGUAGE plpgsql;
+
+-- Set replication mode of table 'relation': 'sync', 'async' or 'none'. Must be
+-- called on shardlord; nodes reconfigure sync standbys for existing replicas
+-- via metadata replication. 'none' is allowed only if the table has no
+-- replicas, and then set_replevel and create_replica refuse to add them.
+CREATE FUNCTION set_replication_mode(relation text, mode text)
+	RETURNS void AS $$
+BEGIN
+	IF NOT @extschema@.me_lord() THEN
+		RAISE EXCEPTION 'set_replication_mode must be called on shardlord';
+	END IF;
+	IF NOT EXISTS (SELECT 1 FROM @extschema@.tables t
+				   WHERE t.relation = set_replication_mode.relation) THEN
+		RAISE EXCEPTION 'Table % is not sharded', relation;
+	END IF;
+	IF mode = 'none' AND EXISTS (
+		SELECT 1 FROM @extschema@.partitions p
+		 WHERE p.relation = set_replication_mode.relation
+		   AND p.prv IS NOT NULL) THEN
+		RAISE EXCEPTION 'Table % has replicas', relation;
+	END IF;
+	UPDATE @extschema@.tables t SET replication_mode = mode
+	 WHERE t.relation = set_replication_mode.relation;
+END
+$$ LANGUAGE plpgsql STRICT;
+
 
 -- Internal functions
 
@@ -174,8 +319,8 @@ BEGIN
 		RETURN @extschema@.execute_on_lord_c(cmd_type, cmd_opts);
 	END IF;
 
-	INSERT INTO @extschema@.cmd_log
-		VALUES (DEFAULT, cmd_type, cmd_opts)
+	INSERT INTO @extschema@.cmd_log (cmd_type, cmd_opts, priority)
+		VALUES (cmd_type, cmd_opts, @extschema@.cmd_priority(cmd_type))
 		RETURNING id INTO cmd_id;
 
 	NOTIFY shardman_cmd_log_update; -- Notify bgw about the job
@@ -184,6 +329,33 @@ BEGIN
 END
 $$ LANGUAGE plpgsql STRICT;
 
+-- Default priority of command. Restoring availability goes first, then
+-- restoring redundancy, then everything else. Long batch commands (rebalance,
+-- set_replevel, drain_node, rereplicate) are postponed between tasks when a
+-- command with higher priority is waiting.
+CREATE FUNCTION cmd_priority(cmd_type text) RETURNS int AS $$
+	SELECT CASE
+		WHEN cmd_type IN ('failover', 'promote_replica') THEN 100
+		WHEN cmd_type IN ('create_replica', 'rereplicate') THEN 50
+		ELSE 0
+	END;
+$$ LANGUAGE sql IMMUTABLE STRICT;
+
+-- Change priority of not yet finished command.
+CREATE FUNCTION set_cmd_priority(cmd_id bigint, priority int) RETURNS void AS $$
+BEGIN
+	IF NOT @extschema@.me_lord() THEN
+		RAISE EXCEPTION 'set_cmd_priority must be called on shardlord';
+	END IF;
+	UPDATE @extschema@.cmd_log c SET priority = set_cmd_priority.priority
+		WHERE id = cmd_id AND status IN ('waiting', 'in progress');
+	IF NOT FOUND THEN
+		RAISE EXCEPTION 'There is no unfinished command %', cmd_id;
+	END IF;
+	NOTIFY shardman_cmd_log_update;
+END
+$$ LANGUAGE plpgsql STRICT;
+
 -- Called on shardlord bgw start. Add itself to nodes table, set id, create
 -- publication.
 CREATE FUNCTION lord_boot() RETURNS void AS $$
@@ -239,39 +411,93 @@ BEGIN
 END
 $$ LANGUAGE plpgsql;
 
+-- Create logical pgoutput replication slot, if it doesn't exist yet. Must be
+-- called in transaction which hasn't written anything.
+CREATE FUNCTION ensure_repslot(slot_name text) RETURNS void AS $$
+DECLARE
+	slot_exists bool;
+BEGIN
+	EXECUTE format('SELECT EXISTS (SELECT * FROM pg_replication_slots
+				   WHERE slot_name = %L)', slot_name) INTO slot_exists;
+	IF NOT slot_exists THEN
+		EXECUTE format('SELECT pg_create_logical_replication_slot(%L, %L)',
+					   slot_name, 'pgoutput');
+	END IF;
+END
+$$ LANGUAGE plpgsql STRICT;
+
 -- Drop replication slot, if it exists.
--- About 'hard' option: we can't just drop replication slots because
+-- About 'with_fire' option: we can't just drop replication slots because
 -- pg_drop_replication_slot will bail out with ERROR if connection is active.
--- Therefore the caller must either ensure that the connection is dead (e.g.
--- drop subscription on far end) or pass 'true' to 'with_fire' option, which
--- does the following dirty hack. It kills several times active walsender with 1
--- second interval. After the first kill, replica will immediately try to
--- reconnect, so the connection resurrects instantly. However, if we kill it
--- second time, replica won't try to reconnect until wal_retrieve_retry_interval
--- after its first reaction passes, which is 5 secs by default. Of course, this
--- is not reliable and should be redesigned.
+-- Therefore the caller must either ensure that the connection is dead or pass
+-- 'true' to 'with_fire'. Then we first wait for the subscriber to release the
+-- slot: it disables or drops the subscription while handling the same
+-- metadata change, and its walsender exits, which acknowledges the teardown.
+-- Slot is dropped as soon as this happens, usually in a few milliseconds. If
+-- the subscriber doesn't release the slot during slot_release_timeout (e.g.
+-- it is dead or doesn't know the channel is gone), we terminate the walsender
+-- and grab the slot before subscriber reconnects, retrying if it wins the
+-- race.
 CREATE FUNCTION drop_repslot(slot_name text, with_fire bool DEFAULT false)
 	RETURNS void AS $$
 DECLARE
 	slot_exists bool;
-	kill_ws_times int := 2;
+	slot_active bool;
+	slot_release_timeout interval := '5 s';
+	fire_timeout interval := '10 s';
+	poll_interval float8 := 0.005; -- seconds
+	started timestamptz := clock_timestamp();
 BEGIN
 	RAISE DEBUG '[SHMN] Dropping repslot %', slot_name;
 	EXECUTE format('SELECT EXISTS (SELECT * FROM pg_replication_slots
 				   WHERE slot_name = %L)', slot_name) INTO slot_exists;
-	IF slot_exists THEN
-		IF with_fire THEN -- kill walsender several times
-			RAISE DEBUG '[SHMN] Killing repslot % with fire', slot_name;
-			FOR i IN 1..kill_ws_times LOOP
-				RAISE DEBUG '[SHMN] Killing walsender for slot %', slot_name;
-				PERFORM shardman.terminate_repslot_walsender(slot_name);
-				IF i != kill_ws_times THEN
-					PERFORM pg_sleep(1);
-				END IF;
-			END LOOP;
-		END IF;
+	IF NOT slot_exists THEN
+		RETURN;
+	END IF;
+	IF NOT with_fire THEN
 		EXECUTE format('SELECT pg_drop_replication_slot(%L)', slot_name);
+		RETURN;
 	END IF;
+
+	LOOP
+		SELECT active FROM pg_replication_slots s WHERE s.slot_name =
+			drop_repslot.slot_name INTO slot_active;
+		IF slot_active IS NULL THEN -- somebody else has dropped it
+			RETURN;
+		END IF;
+		IF NOT slot_active THEN
+			BEGIN
+				EXECUTE format('SELECT pg_drop_replication_slot(%L)', slot_name);
+				RETURN;
+			EXCEPTION WHEN object_in_use THEN
+				-- subscriber reconnected in between
+				RAISE DEBUG '[SHMN] Repslot % was grabbed, retrying', slot_name;
+			END;
+		ELSEIF clock_timestamp() - started > fire_timeout THEN
+			-- give up and let pg_drop_replication_slot complain
+			EXECUTE format('SELECT pg_drop_replication_slot(%L)', slot_name);
+			RETURN;
+		ELSEIF clock_timestamp() - started > slot_release_timeout THEN
+			RAISE DEBUG '[SHMN] Killing walsender for slot %', slot_name;
+			PERFORM shardman.terminate_repslot_walsender(slot_name);
+		END IF;
+		PERFORM pg_sleep(poll_interval);
+	END LOOP;
+END
+$$ LANGUAGE plpgsql STRICT;
+-- Drop repslot unless somebody holds it; unlike drop_repslot, never fails
+-- because of that. Returns true if the slot doesn't exist anymore.
+CREATE FUNCTION try_drop_repslot(slot_name text) RETURNS bool AS $$
+BEGIN
+	IF EXISTS (SELECT 1 FROM pg_replication_slots s
+			   WHERE s.slot_name = try_drop_repslot.slot_name AND s.active) THEN
+		RETURN false;
+	END IF;
+	PERFORM shardman.drop_repslot(slot_name);
+	RETURN true;
+EXCEPTION WHEN object_in_use THEN
+	-- subscriber reconnected in between
+	RETURN false;
 END
 $$ LANGUAGE plpgsql STRICT;
 CREATE FUNCTION terminate_repslot_walsender(slot_name text) RETURNS void AS $$
@@ -290,6 +516,17 @@ BEGIN
 END
 $$ LANGUAGE plpgsql STRICT;
 
+-- Remove table from publication, if it is there.
+CREATE FUNCTION drop_table_from_pub(pub name, relation text) RETURNS void AS $$
+BEGIN
+	IF EXISTS (SELECT 1 FROM pg_publication_rel pr JOIN pg_publication p
+			   ON p.oid = pr.prpubid
+			   WHERE p.pubname = pub AND pr.prrelid = to_regclass(relation)) THEN
+		EXECUTE format('ALTER PUBLICATION %I DROP TABLE %I', pub, relation);
+	END IF;
+END
+$$ LANGUAGE plpgsql STRICT;
+
 -- If sub exists, disable it, detach repslot from it and possibly drop. We
 -- manage repslots ourselves, so it is essential to detach rs before dropping
 -- sub, and repslots can't be detached while subscription is active.
@@ -21,7 +21,17 @@ CREATE TABLE tables (
 	-- Node on which table was partitioned at the beginning. Used only during
 	-- initial tables inflation to distinguish between table owner and other
 	-- nodes, probably cleaner keep it in separate table.
-	initial_node int NOT NULL REFERENCES nodes(id)
+	initial_node int NOT NULL REFERENCES nodes(id),
+	-- With sync replicas, how many replicas of each partition must confirm
+	-- commit; NULL means all of them. See sync_standbys_may_lag.
+	sync_quorum int CHECK (sync_quorum > 0),
+	-- 'sync': commits wait for replicas, 'async': they don't, 'none': table
+	-- is not replicated at all. NULL means shardman.sync_replicas of the
+	-- shardlord decides between the first two.
+	replication_mode text CHECK (replication_mode IN ('sync', 'async', 'none')),
+	-- Replicas each partition should have, as last set by set_replevel; lost
+	-- ones are recreated by shardlord. NULL means not tracked.
+	replevel int CHECK (replevel >= 0)
 );
 
 -- On adding new table, create this table on non-owner nodes using provided sql
@@ -66,6 +76,48 @@ $$ LANGUAGE plpgsql;
 CREATE TRIGGER new_table_lord_side AFTER INSERT ON shardman.tables
 	FOR EACH ROW EXECUTE PROCEDURE new_table_lord_side();
 
+-- Sync standbys quorum depends on sync_quorum of tables and on how many
+-- replicas of each partition we feed, so recompute it when they change.
+CREATE FUNCTION sync_quorum_changed() RETURNS TRIGGER AS $$
+BEGIN
+	PERFORM shardman.requorum_sync_standbys();
+	RETURN NULL;
+END
+$$ LANGUAGE plpgsql;
+CREATE TRIGGER sync_quorum_changed AFTER UPDATE ON shardman.tables
+	FOR EACH ROW WHEN (OLD.sync_quorum IS DISTINCT FROM NEW.sync_quorum)
+	EXECUTE PROCEDURE sync_quorum_changed();
+-- fire trigger only on worker nodes
+ALTER TABLE shardman.tables ENABLE REPLICA TRIGGER sync_quorum_changed;
+
+-- Replication mode of table changed: add channels feeding its replicas from
+-- us to sync standbys or remove them from there.
+CREATE FUNCTION replication_mode_changed() RETURNS TRIGGER AS $$
+DECLARE
+	lnames text[];
+	lname text;
+BEGIN
+	lnames := ARRAY(
+		SELECT shardman.get_data_lname(part_name, prv, owner)
+		  FROM shardman.partitions
+		 WHERE relation = NEW.relation AND prv = shardman.my_id());
+	IF NEW.replication_mode = 'sync' THEN
+		PERFORM shardman.ensure_sync_standbys(lnames);
+	ELSE
+		FOREACH lname IN ARRAY lnames LOOP
+			PERFORM shardman.remove_sync_standby(lname);
+		END LOOP;
+	END IF;
+	RETURN NULL;
+END
+$$ LANGUAGE plpgsql;
+CREATE TRIGGER replication_mode_changed AFTER UPDATE ON shardman.tables
+	FOR EACH ROW
+	WHEN (OLD.replication_mode IS DISTINCT FROM NEW.replication_mode)
+	EXECUTE PROCEDURE replication_mode_changed();
+-- fire trigger only on worker nodes
+ALTER TABLE shardman.tables ENABLE REPLICA TRIGGER replication_mode_changed;
+
 ------------------------------------------------------------
 -- Partitions
 ------------------------------------------------------------
@@ -73,8 +125,11 @@ CREATE TRIGGER new_table_lord_side AFTER INSERT ON shardman.tables
 -- Primary shard and its replicas compose a doubly-linked list: nxt refers to
 -- the node containing next replica, prv to node with previous replica (or
 -- primary, if we are the first replica). If prv is NULL, this is primary
--- replica. We don't number parts separately since we are not ever going to
--- allow several copies of the same partition on one node.
+-- replica. With shardman.replica_topology = 'star', replicas are fed by
+-- primary directly, so they all have it as prv, and nxt is not used; that's
+-- why code looking for replicas fed by some node should search by prv. We
+-- don't number parts separately since we are not ever going to allow several
+-- copies of the same partition on one node.
 CREATE TABLE partitions (
 	part_name text,
 	owner int NOT NULL REFERENCES nodes(id), -- node on which partition lies
@@ -84,6 +139,12 @@ CREATE TABLE partitions (
 	PRIMARY KEY (part_name, owner)
 );
 
+CREATE TRIGGER sync_quorum_changed AFTER INSERT OR UPDATE OR DELETE
+	ON shardman.partitions
+	FOR EACH ROW EXECUTE PROCEDURE sync_quorum_changed();
+-- fire trigger only on worker nodes
+ALTER TABLE shardman.partitions ENABLE REPLICA TRIGGER sync_quorum_changed;
+
 ------------------------------------------------------------
 -- Metadata triggers and funcs called from libpq updating metadata & LR channels
 ------------------------------------------------------------
@@ -115,41 +176,32 @@ DECLARE
 	me int := shardman.my_id();
 	lname text := shardman.get_data_lname(p_name, me, dst);
 BEGIN
-	PERFORM shardman.drop_repslot(lname);
-	-- Create publication for new data channel prev replica -> dst, make it sync
-	EXECUTE format('DROP PUBLICATION IF EXISTS %I', lname);
-	EXECUTE format('CREATE PUBLICATION %I FOR TABLE %I', lname, p_name);
+	-- Create publication for new data channel prev replica -> dst
+	PERFORM shardman.data_pub_add_table(lname, p_name);
 END $$ LANGUAGE plpgsql STRICT;
 
 -- Executed on node with new part, see mp_rebuild_lr
 CREATE FUNCTION part_moved_dst(p_name name, src int, dst int)
 	RETURNS void AS $$
 DECLARE
-	next_rep int := nxt FROM shardman.partitions WHERE part_name = p_name
-				 AND owner = src;
 	prev_rep int := prv FROM shardman.partitions WHERE part_name = p_name
 				 AND owner = src;
+	next_rep int;
 	next_lname text;
 	prev_lname text;
-	prev_connstr text;
 BEGIN
 	ASSERT dst = shardman.my_id(), 'part_moved_dst must be called on dst';
-	IF next_rep IS NOT NULL THEN -- we need to setup channel dst -> next replica
+	-- We need to setup channels dst -> next replicas: one in replica chain,
+	-- all replicas of moved primary in star
+	FOR next_rep IN SELECT owner FROM shardman.partitions
+					 WHERE part_name = p_name AND prv = src LOOP
 		next_lname := shardman.get_data_lname(p_name, dst, next_rep);
-		PERFORM shardman.drop_repslot(next_lname);
-		EXECUTE format('DROP PUBLICATION IF EXISTS %I', next_lname);
-		EXECUTE format('CREATE PUBLICATION %I FOR TABLE %I',
-					   next_lname, p_name);
-	END IF;
+		PERFORM shardman.data_pub_add_table(next_lname, p_name);
+	END LOOP;
 
 	IF prev_rep IS NOT NULL THEN -- we need to setup channel prev replica -> dst
 		prev_lname := shardman.get_data_lname(p_name, prev_rep, dst);
-		prev_connstr := shardman.get_worker_node_connstr(prev_rep);
-		PERFORM shardman.eliminate_sub(prev_lname);
-		EXECUTE format(
-			'CREATE SUBSCRIPTION %I connection %L
-		PUBLICATION %I with (create_slot = false, slot_name = %L, copy_data = false, synchronous_commit = local);',
-		prev_lname, prev_connstr, prev_lname, prev_lname);
+		PERFORM shardman.data_sub_add_table(prev_lname, prev_rep);
 		-- If we have prev, we are replica
 		PERFORM shardman.readonly_replica_on(p_name::regclass);
 	END IF;
@@ -161,15 +213,9 @@ CREATE FUNCTION part_moved_next(p_name name, src int, dst int)
 DECLARE
 	me int := shardman.my_id();
 	lname text := shardman.get_data_lname(p_name, dst, me);
-	dst_connstr text := shardman.get_worker_node_connstr(dst);
 BEGIN
 	-- Create subscription for new data channel dst -> next replica
-	-- It should never exist at this moment, but just in case...
-	PERFORM shardman.eliminate_sub(lname);
-	EXECUTE format(
-		'CREATE SUBSCRIPTION %I connection %L
-		PUBLICATION %I with (create_slot = false, slot_name = %L, copy_data = false, synchronous_commit = local);',
-		lname, dst_connstr, lname, lname);
+	PERFORM shardman.data_sub_add_table(lname, dst);
 END $$ LANGUAGE plpgsql STRICT;
 
 -- Partition moved, update fdw and drop old LR channels.
@@ -177,8 +223,12 @@ CREATE FUNCTION part_moved() RETURNS TRIGGER AS $$
 DECLARE
 	cp_logname text := shardman.get_cp_logname(NEW.part_name, OLD.owner, NEW.owner);
 	me int := shardman.my_id();
+	-- Replicas fed by src; their prv is not updated yet. At most one in
+	-- replica chain, any number in star.
+	next_reps int[] := ARRAY(SELECT owner FROM shardman.partitions
+							  WHERE part_name = NEW.part_name AND prv = OLD.owner);
+	next_rep int;
 	prev_src_lname text;
-	src_next_lname text;
 BEGIN
 	ASSERT NEW.owner != OLD.owner, 'part_moved handles only moved parts';
 	RAISE DEBUG '[SHMN] part_moved trigger called for part %, owner % -> %',
@@ -190,9 +240,6 @@ BEGIN
 	IF NEW.prv IS NOT NULL THEN
 		prev_src_lname := shardman.get_data_lname(NEW.part_name, NEW.prv, OLD.owner);
 	END IF;
-	IF NEW.nxt IS NOT NULL THEN
-		src_next_lname := shardman.get_data_lname(NEW.part_name, OLD.owner, NEW.nxt);
-	END IF;
 
 	IF me = OLD.owner THEN -- src node
 		-- Drop publication & repslot used for copy
@@ -204,30 +251,46 @@ BEGIN
 		ELSE
 			-- On the other hand, if prev replica existed, drop sub for old
 			-- channel prev -> src
-			PERFORM shardman.eliminate_sub(prev_src_lname);
-		END IF;
-		IF NEW.nxt IS NOT NULL THEN
-			-- If next replica existed, drop pub for old channel src -> next
-			PERFORM shardman.drop_repslot_and_pub(src_next_lname);
-			PERFORM shardman.remove_sync_standby(src_next_lname);
+			PERFORM shardman.data_sub_drop_table(prev_src_lname, NEW.prv,
+												 NEW.part_name);
 		END IF;
+		-- If next replicas existed, drop pubs for old channels src -> next
+		FOREACH next_rep IN ARRAY next_reps LOOP
+			PERFORM shardman.data_pub_drop_table(
+				shardman.get_data_lname(NEW.part_name, OLD.owner, next_rep),
+				NEW.part_name);
+		END LOOP;
 		-- Drop old table anyway;
 		EXECUTE format('DROP TABLE IF EXISTS %I', NEW.part_name);
 	ELSEIF me = NEW.owner THEN -- dst node
 		RAISE DEBUG '[SHMN] part_moved trigger on dst node';
 		-- Drop subscription used for copy
 		PERFORM shardman.eliminate_sub(cp_logname);
+		-- Primary might have been copied from its next replica
+		IF NEW.prv IS NULL THEN
+			FOREACH next_rep IN ARRAY next_reps LOOP
+				PERFORM shardman.eliminate_sub(
+					shardman.get_cp_logname(NEW.part_name, next_rep, NEW.owner));
+			END LOOP;
+		END IF;
 		-- If primary part was moved, replace moved table with foreign one
 		IF NEW.prv IS NULL THEN
 			PERFORM shardman.replace_foreign_part_with_usual(NEW);
 		END IF;
 	ELSEIF me = NEW.prv THEN -- node with prev replica
 		-- Drop pub for old channel prev -> src
-		PERFORM shardman.drop_repslot_and_pub(prev_src_lname);
-		PERFORM shardman.remove_sync_standby(prev_src_lname);
-	ELSEIF me = NEW.nxt THEN -- node with next replica
+		PERFORM shardman.data_pub_drop_table(prev_src_lname, NEW.part_name);
+	ELSEIF me = ANY(next_reps) THEN -- node with next replica
 		-- Drop sub for old channel src -> next
-		PERFORM shardman.eliminate_sub(src_next_lname);
+		PERFORM shardman.data_sub_drop_table(
+			shardman.get_data_lname(NEW.part_name, OLD.owner, me), OLD.owner,
+			NEW.part_name);
+		-- Drop publication & repslot used for copy, if primary was copied
+		-- from us
+		IF NEW.prv IS NULL THEN
+			PERFORM shardman.drop_repslot_and_pub(
+				shardman.get_cp_logname(NEW.part_name, me, NEW.owner));
+		END IF;
 	END IF;
 
 	-- And update fdw almost everywhere
@@ -244,26 +307,37 @@ ALTER TABLE shardman.partitions ENABLE REPLICA TRIGGER part_moved;
 
 
 -- Partition removed: drop LR channel and promote replica if primary was
--- removed. Since for now we support only 2 copies (1 replica), we promote
--- replica immediately if needed. Case with several replicas is much more
--- complex because we need to rebuild LR channels, so later we will have
--- separate cmd promote_replica(), while part deletion will just perform
--- cleanup. Here we do nothing if we are removing the last copy of data, the
--- caller is responsible for tracking that.
+-- removed. Replica fed by the primary is promoted immediately. If there are
+-- several of them (star), the one on node with the smallest id is promoted and
+-- the rest, siblings, are repointed to it: new primary publishes the partition
+-- for them, but stays read-only until finish_star_promotions creates the
+-- repslots and subscribes siblings. Siblings keep what they have applied from
+-- old primary, which might differ from what the promoted one has; that's why
+-- promote_replica and failover commands remove them first and recreate them
+-- afterwards instead. Here we do nothing if we are removing the last copy of
+-- data, the caller is responsible for tracking that.
 CREATE FUNCTION part_removed() RETURNS TRIGGER AS $$
 DECLARE
 	replica_removed bool := OLD.prv IS NOT NULL; -- replica or primary removed?
+	-- replicas fed by removed part: at most one in replica chain, any number
+	-- in star; the order is the same on all nodes
+	next_reps int[] := ARRAY(SELECT owner FROM shardman.partitions
+							  WHERE part_name = OLD.part_name AND prv = OLD.owner
+							  ORDER BY owner);
+	next_rep int := next_reps[1];
+	-- in star, replicas of removed primary not promoted
+	siblings int[] := next_reps[2:cardinality(next_reps)];
+	sibling int;
 	 -- if primary removed, is there replica that we will promote?
-	replica_exists bool := OLD.nxt IS NOT NULL;
+	replica_exists bool := next_rep IS NOT NULL;
 	prim_repl_lname text; -- channel between primary and replica
 	me int := shardman.my_id();
 	new_primary shardman.partitions;
-	drop_slot_delay int := 2; -- two seconds
 BEGIN
 	RAISE DEBUG '[SHMN] part_removed trigger called for part %, owner %',
 		OLD.part_name, OLD.owner;
 
-	IF OLD.prv IS NOT NULL AND OLD.nxt IS NOT NULL THEN
+	IF OLD.prv IS NOT NULL AND replica_exists THEN
 		RAISE WARNING '[SHMN] part_removed is not yet implemented for redundancy level > 2';
 		RETURN NULL;
 	END IF;
@@ -274,10 +348,10 @@ BEGIN
 	ELSE -- Primary is removed
 		IF replica_exists THEN -- Primary removed, and it has replica
 			prim_repl_lname := shardman.get_data_lname(OLD.part_name, OLD.owner,
-													   OLD.nxt);
+													   next_rep);
 			-- This replica is new primary
 			SELECT * FROM shardman.partitions
-			 WHERE owner = OLD.nxt AND part_name= OLD.part_name INTO new_primary;
+			 WHERE owner = next_rep AND part_name= OLD.part_name INTO new_primary;
 			-- whole record nullability seems to be non-working
 			ASSERT new_primary.part_name IS NOT NULL;
 		END IF;
@@ -285,14 +359,20 @@ BEGIN
 
 	IF me = OLD.owner THEN -- part dropped on us
 		IF replica_removed THEN -- replica removed on us
-			PERFORM shardman.eliminate_sub(prim_repl_lname);
+			PERFORM shardman.data_sub_drop_table(prim_repl_lname, OLD.prv,
+												 OLD.part_name);
 		ELSE -- primary removed on us
 			IF replica_exists THEN
-				-- If next replica existed, drop pub & rs for data channel
- 				-- Wait sometime to let replica first remove subscription
-				PERFORM pg_sleep(drop_slot_delay);
-				PERFORM shardman.drop_repslot_and_pub(prim_repl_lname);
-				PERFORM shardman.remove_sync_standby(prim_repl_lname);
+				-- If next replicas existed, drop pub & rs for data channels;
+				-- repslot is dropped once replica releases it, dropping the
+				-- subscription
+				PERFORM shardman.data_pub_drop_table(prim_repl_lname,
+													 OLD.part_name);
+				FOREACH sibling IN ARRAY siblings LOOP
+					PERFORM shardman.data_pub_drop_table(
+						shardman.get_data_lname(OLD.part_name, OLD.owner, sibling),
+						OLD.part_name);
+				END LOOP;
 				-- replace removed table with foreign one on promoted replica
 				PERFORM shardman.replace_usual_part_with_foreign(new_primary);
 			END IF;
@@ -300,19 +380,34 @@ BEGIN
 		-- Drop old table anyway
 		EXECUTE format('DROP TABLE IF EXISTS %I', OLD.part_name);
 	ELSEIF me = OLD.prv THEN -- node with primary for which replica was dropped
-		-- Wait sometime to let other node first remove subscription
-		PERFORM pg_sleep(drop_slot_delay);
-		-- Drop pub & rs for data channel
-		PERFORM shardman.drop_repslot_and_pub(prim_repl_lname);
-		PERFORM shardman.remove_sync_standby(prim_repl_lname);
-	ELSEIF me = OLD.nxt THEN -- node with replica for which primary was dropped
+		-- Drop pub & rs for data channel, as soon as the other node releases
+		-- the slot
+		PERFORM shardman.data_pub_drop_table(prim_repl_lname, OLD.part_name);
+	ELSEIF me = next_rep THEN -- node with replica for which primary was dropped
 		-- Drop sub for data channel
-		PERFORM shardman.eliminate_sub(prim_repl_lname);
+		PERFORM shardman.data_sub_drop_table(prim_repl_lname, OLD.owner,
+											 OLD.part_name);
 	    -- This replica is promoted to primary node, so drop trigger disabling
-	    -- writes to the table and replace fdw with normal part
-		PERFORM shardman.readonly_replica_off(OLD.part_name);
+	    -- writes to the table and replace fdw with normal part. With siblings,
+	    -- writes wait for star_replica_promoted.
+		IF cardinality(siblings) = 0 THEN
+			PERFORM shardman.readonly_replica_off(OLD.part_name::regclass);
+		END IF;
 		-- Replace FDW with local partition
 	    PERFORM shardman.replace_foreign_part_with_usual(new_primary);
+		-- Publish it for siblings; repslots are created in separate
+		-- transactions, see finish_star_promotions
+		FOREACH sibling IN ARRAY siblings LOOP
+			PERFORM shardman.data_pub_add_table(
+				shardman.get_data_lname(OLD.part_name, me, sibling),
+				OLD.part_name);
+		END LOOP;
+	ELSEIF me = ANY(siblings) THEN -- replica repointed to promoted one
+		-- Drop sub for old data channel; the new one is created by
+		-- finish_star_promotions
+		PERFORM shardman.data_sub_drop_table(
+			shardman.get_data_lname(OLD.part_name, OLD.owner, me), OLD.owner,
+			OLD.part_name);
  	END IF;
 
 	IF NOT replica_removed AND shardman.me_worker() THEN
@@ -325,10 +420,12 @@ BEGIN
 		-- removal or remove link to dropped replica.
 		IF replica_removed THEN
 			UPDATE shardman.partitions SET nxt = NULL WHERE owner = OLD.prv AND
-			part_name = OLD.part_name;
+			part_name = OLD.part_name AND nxt = OLD.owner;
 		ELSE
 			UPDATE shardman.partitions SET prv = NULL
-			 WHERE owner = OLD.nxt AND part_name = OLD.part_name;
+			 WHERE owner = next_rep AND part_name = OLD.part_name;
+			UPDATE shardman.partitions SET prv = next_rep
+			 WHERE owner = ANY(siblings) AND part_name = OLD.part_name;
 		END IF;
 	END IF;
 
@@ -345,6 +442,33 @@ ALTER TABLE shardman.partitions ENABLE ALWAYS TRIGGER part_removed;
 
 
 
+-- Executed on replica promoted in star by part_removed, see
+-- finish_star_promotions. Fails until the promotion reaches us: only then
+-- publications for siblings exist and their repslots may be created.
+CREATE FUNCTION star_promotion_arrived(p_name name) RETURNS void AS $$
+BEGIN
+	IF NOT EXISTS (SELECT 1 FROM shardman.partitions WHERE part_name = p_name
+				   AND owner = shardman.my_id() AND prv IS NULL) THEN
+		RAISE EXCEPTION '[SHMN] promotion of % has not arrived yet', p_name;
+	END IF;
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Executed on promoted replica once its siblings are subscribed to it, see
+-- finish_star_promotions: now it may take writes.
+CREATE FUNCTION star_replica_promoted(p_name name, siblings int[])
+	RETURNS void AS $$
+BEGIN
+	IF (SELECT t.replication_mode FROM shardman.tables t
+		  JOIN shardman.partitions p ON p.relation = t.relation
+		 WHERE p.part_name = p_name AND p.owner = shardman.my_id()) = 'sync'
+	THEN
+		PERFORM shardman.ensure_sync_standbys(ARRAY(
+			SELECT shardman.get_data_lname(p_name, shardman.my_id(), s)
+			  FROM unnest(siblings) s));
+	END IF;
+	PERFORM shardman.readonly_replica_off(p_name::regclass);
+END $$ LANGUAGE plpgsql STRICT;
+
 -- Executed on newtail node, see cr_rebuild_lr
 CREATE FUNCTION replica_created_drop_cp_sub(
 	part_name name, oldtail int, newtail int) RETURNS void AS $$
@@ -362,12 +486,10 @@ DECLARE
 	cp_logname text := shardman.get_cp_logname(part_name, oldtail, newtail);
 	lname name := shardman.get_data_lname(part_name, oldtail, newtail);
 BEGIN
-    PERFORM shardman.drop_repslot(lname);
 	-- Drop publication & repslot used for copy
 	PERFORM shardman.drop_repslot_and_pub(cp_logname);
 	-- Create publication for new data channel
-	EXECUTE format('DROP PUBLICATION IF EXISTS %I', lname);
-	EXECUTE format('CREATE PUBLICATION %I FOR TABLE %I', lname, part_name);
+	PERFORM shardman.data_pub_add_table(lname, part_name);
 END $$ LANGUAGE plpgsql;
 
 -- Executed on newtail node, see cr_rebuild_lr
@@ -375,20 +497,10 @@ CREATE FUNCTION replica_created_create_data_sub(
 	part_name name, oldtail int, newtail int) RETURNS void AS $$
 DECLARE
 	lname name := shardman.get_data_lname(part_name, oldtail, newtail);
-	oldtail_connstr text := shardman.get_worker_node_connstr(oldtail);
 BEGIN
 	PERFORM shardman.readonly_replica_on(part_name::regclass);
 	-- Create subscription for new data channel
-	-- It should never exist at this moment, but just in case...
-	PERFORM shardman.eliminate_sub(lname);
-	-- It is important to set synchronous_commit to local in apply
-	-- worker. Otherwise deadlocks arise because currently in sync replication
-	-- PG waits for any transaction remote commit regardless of which relations
-	-- it touches.
-	EXECUTE format(
-		'CREATE SUBSCRIPTION %I connection %L
-		PUBLICATION %I with (create_slot = false, slot_name = %L, copy_data = false, synchronous_commit = local);',
-		lname, oldtail_connstr, lname, lname);
+	PERFORM shardman.data_sub_add_table(lname, oldtail);
 END $$ LANGUAGE plpgsql;
 
 -- Otherwise partitioned tables on worker nodes not will be dropped properly,
@@ -664,39 +776,35 @@ BEGIN
 	EXECUTE format('DROP TRIGGER IF EXISTS shardman_readonly_stmt ON %s', relation);
 END $$ LANGUAGE plpgsql STRICT;
 
--- Make replica read-only, i.e. readonly for all but LR apply workers
-CREATE FUNCTION readonly_replica_on(relation regclass)
-	RETURNS void AS $$
-BEGIN
-	RAISE DEBUG '[SHMN] table % made read-only for all but apply workers',
-		relation;
-	-- PERFORM shardman.readonly_replica_off(relation);
-	-- PERFORM shardman.create_modification_triggers(relation, 'shardman_readonly_replica', 'shardman.ror_go_away()');
-END $$ LANGUAGE plpgsql STRICT;
--- This function is impudent because it is used as both stmt and row trigger.
--- The idea is that we must never reach RETURN NEW after stmt row trigger,
--- because stmt trigger fires only on TRUNCATE which is impossible in LR.
--- Besides, I checked that nothing bad happens if we return NEW from stmt
--- trigger function anyway.
-CREATE FUNCTION ror_go_away() RETURNS TRIGGER AS $$
-BEGIN
-	IF NOT shardman.inside_apply_worker() THEN
-		RAISE EXCEPTION '[SHMN] The "%" table is read only for non-apply workers', TG_TABLE_NAME
-		USING HINT =
-		'If you see this, most probably node with primary part has failed and' ||
-		' you need to promote replica. Promotion is not yet implemented, sorry :(';
-	END IF;
-  RETURN NEW;
-END $$ LANGUAGE plpgsql;
+-- Make replica read-only, i.e. readonly for all but LR apply workers. Relids
+-- of such replicas are kept in shared memory and writes are rejected by
+-- executor and utility hooks, so applying changes costs nothing extra.
+CREATE FUNCTION readonly_replica_on(relation regclass) RETURNS void
+	AS 'pg_shardman' LANGUAGE C STRICT;
 -- And make replica writable again
-CREATE FUNCTION readonly_replica_off(relation regclass) RETURNS void AS $$
-BEGIN
-	EXECUTE format('DROP TRIGGER IF EXISTS shardman_readonly_replica ON %s',
-				   relation);
-	EXECUTE format('DROP TRIGGER IF EXISTS shardman_readonly_replica_stmt ON %s',
-				   relation);
-END $$ LANGUAGE plpgsql STRICT;
+CREATE FUNCTION readonly_replica_off(relation regclass) RETURNS void
+	AS 'pg_shardman' LANGUAGE C STRICT;
 CREATE FUNCTION inside_apply_worker() RETURNS bool AS 'pg_shardman' LANGUAGE C;
+-- Called by shardlord heartbeats: renew lease of our primaries for millis ms,
+-- extending it from the heartbeat acked by shardlord, see primary_lease_renew.
+CREATE FUNCTION renew_lease(acked bigint, token bigint, millis int)
+	RETURNS void AS 'pg_shardman' LANGUAGE C STRICT;
+-- Is relation our primary partition or sharded table, i.e. should writes to it
+-- be rejected when the lease is expired?
+CREATE FUNCTION holds_primary(rel oid) RETURNS bool AS $$
+	SELECT EXISTS (
+		SELECT 1 FROM pg_class c WHERE c.oid = rel AND
+		(EXISTS (SELECT 1 FROM shardman.partitions p
+				  WHERE p.part_name = c.relname AND p.owner = shardman.my_id()
+					AND p.prv IS NULL) OR
+		 EXISTS (SELECT 1 FROM shardman.tables t WHERE t.relation = c.relname)));
+$$ LANGUAGE sql STABLE SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+-- Replicas this node holds, to fill read-only set after restart. It is read by
+-- whatever user happens to write first, so it runs with owner's rights.
+CREATE FUNCTION my_replicas() RETURNS SETOF oid AS $$
+	SELECT to_regclass(part_name)::oid FROM shardman.partitions
+	 WHERE owner = shardman.my_id() AND prv IS NOT NULL;
+$$ LANGUAGE sql STABLE SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
 
 -- Create two triggers firing exec_proc before any modification operation, make
 -- them ALWAYS ENABLE. We need two triggers because TRUNCATE doesn't work with
@@ -731,6 +839,63 @@ CREATE FUNCTION gen_create_table_sql(relation text, connstring text) RETURNS tex
 CREATE FUNCTION reconstruct_table_attrs(relation regclass)
 	RETURNS text AS 'pg_shardman' LANGUAGE C STRICT;
 
+-- Relation file level copy of cold partitions, see relfile.c
+CREATE FUNCTION relfile_copy_check(part regclass) RETURNS void
+	AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION relfile_read(rel regclass, blkno bigint, nblocks int)
+	RETURNS bytea AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION relfile_changed_blocks(rel regclass, since pg_lsn)
+	RETURNS bigint[] AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION relfile_copy_prepare(part regclass) RETURNS void
+	AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION relfile_write(rel regclass, blkno bigint, pages bytea)
+	RETURNS void AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION relfile_copy_finish(part regclass) RETURNS void
+	AS 'pg_shardman' LANGUAGE C STRICT;
+-- They read and write raw pages, bypassing table privileges
+REVOKE EXECUTE ON FUNCTION relfile_copy_check(regclass),
+	relfile_read(regclass, bigint, int),
+	relfile_changed_blocks(regclass, pg_lsn),
+	relfile_copy_prepare(regclass),
+	relfile_write(regclass, bigint, bytea),
+	relfile_copy_finish(regclass) FROM PUBLIC;
+
+-- Buffer cache warm up of moved partitions, see prewarm.c
+CREATE FUNCTION cached_blocks(rel regclass) RETURNS bigint[]
+	AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION prewarm_blocks(rel regclass, blocks bigint[], src_nblocks bigint)
+	RETURNS bigint AS 'pg_shardman' LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION cached_blocks(regclass),
+	prewarm_blocks(regclass, bigint[], bigint) FROM PUBLIC;
+
+-- Relations whose files are copied along with partition: the table itself and
+-- its indexes. sig describes tuple descriptor or index definition; pages can
+-- be copied only between relations with equal sigs. Ordered by sig, so that
+-- lord can pair src and dst relations.
+CREATE FUNCTION relfile_layout(part regclass)
+	RETURNS TABLE (rel regclass, sig text, nblocks bigint) AS $$
+	SELECT part,
+		   'heap ' || (SELECT string_agg(format('%s:%s:%s:%s', a.attnum,
+												a.atttypid, a.atttypmod,
+												a.attisdropped),
+										 ',' ORDER BY a.attnum)
+					   FROM pg_attribute a
+					   WHERE a.attrelid = part AND a.attnum > 0),
+		   pg_relation_size(part) / current_setting('block_size')::int
+	UNION ALL
+	SELECT i.indexrelid::regclass,
+		   format('index %s %s %s %s %s %s %s', am.amname, i.indisunique,
+				  i.indkey, i.indclass, i.indoption,
+				  pg_get_expr(i.indexprs, i.indrelid),
+				  pg_get_expr(i.indpred, i.indrelid)),
+		   pg_relation_size(i.indexrelid) / current_setting('block_size')::int
+	FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid
+		 JOIN pg_am am ON am.oid = c.relam
+	WHERE i.indrelid = part
+	ORDER BY 2;
+$$ LANGUAGE sql STRICT;
+REVOKE EXECUTE ON FUNCTION relfile_layout(regclass) FROM PUBLIC;
+
 ------------------------------------------------------------
 -- Other funcs
 ------------------------------------------------------------
@@ -771,42 +936,229 @@ END $$ LANGUAGE plpgsql STRICT;
  * Convention about pub, repslot, sub and application_name used for data
  * replication. We recreate sub while switching pub and recreate pub when
  * switching sub, so including both in the name. See top comment on why we
- * don't reuse pubs and subs.
+ * don't reuse pubs and subs. If data channels are shared, all partitions
+ * replicated from pub_node to sub_node use one channel, and part_name is
+ * ignored.
  */
 CREATE FUNCTION get_data_lname(part_name text, pub_node int, sub_node int)
 	RETURNS name AS $$
 BEGIN
+	IF shardman.shared_data_channels() THEN
+		RETURN format('shardman_data_%s_%s', pub_node, sub_node);
+	END IF;
 	RETURN format('shardman_data_%s_%s_%s', part_name, pub_node, sub_node);
 END $$ LANGUAGE plpgsql STRICT;
 
+-- Are data channels shared by all partitions replicated between two nodes?
+CREATE FUNCTION shared_data_channels() RETURNS bool AS $$
+BEGIN
+	RETURN current_setting('shardman.shared_data_channels')::bool;
+END $$ LANGUAGE plpgsql;
+
+-- Make sure p_name is published via data channel lname. With per-partition
+-- channels, or if shared channel doesn't exist yet, publication is recreated
+-- and stale repslot is dropped; otherwise table is just added to the
+-- publication. Repslot must be then created with ensure_repslot in separate
+-- transaction.
+CREATE FUNCTION data_pub_add_table(lname name, p_name name) RETURNS void AS $$
+BEGIN
+	IF shardman.shared_data_channels() AND
+		EXISTS (SELECT 1 FROM pg_publication WHERE pubname = lname) THEN
+		IF NOT EXISTS (SELECT 1 FROM pg_publication_rel pr JOIN pg_publication p
+					   ON p.oid = pr.prpubid
+					   WHERE p.pubname = lname AND pr.prrelid = p_name::regclass)
+		THEN
+			EXECUTE format('ALTER PUBLICATION %I ADD TABLE %I', lname, p_name);
+		END IF;
+		RETURN;
+	END IF;
+
+	PERFORM shardman.drop_repslot(lname);
+	EXECUTE format('DROP PUBLICATION IF EXISTS %I', lname);
+	EXECUTE format('CREATE PUBLICATION %I FOR TABLE %I', lname, p_name);
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Make sure we receive data via data channel lname from pub_node: create
+-- subscription or, if channels are shared and it already exists, refresh it to
+-- learn about the new table. Subscription paused by data_sub_pause is
+-- recreated on its repslot instead, so the new table is known to it from the
+-- start.
+CREATE FUNCTION data_sub_add_table(lname name, pub_node int) RETURNS void AS $$
+DECLARE
+	pub_connstr text := shardman.get_worker_node_connstr(pub_node);
+BEGIN
+	IF shardman.shared_data_channels() AND
+		EXISTS (SELECT 1 FROM pg_subscription WHERE subname = lname AND subenabled)
+	THEN
+		EXECUTE format(
+			'ALTER SUBSCRIPTION %I REFRESH PUBLICATION WITH (copy_data = false)',
+			lname);
+		RETURN;
+	END IF;
+
+	-- Paused shared sub is dropped here, keeping its repslot
+	PERFORM shardman.eliminate_sub(lname);
+	-- It is important to set synchronous_commit to local in apply
+	-- worker. Otherwise deadlocks arise because currently in sync replication
+	-- PG waits for any transaction remote commit regardless of which relations
+	-- it touches.
+	EXECUTE format(
+		'CREATE SUBSCRIPTION %I connection %L
+		PUBLICATION %I with (create_slot = false, slot_name = %L, copy_data = false, synchronous_commit = local);',
+		lname, pub_connstr, lname, lname);
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Apply worker of shared data channel skips changes of tables it doesn't know
+-- yet, and it learns about the table added to the publication only on
+-- refresh, so changes committed in between would be lost. Hence, before the
+-- table is added to the publication, the subscription is disabled here, and
+-- data_sub_add_table recreates it on the same repslot: changes accumulated
+-- meanwhile are then streamed with the table already known. Replication of
+-- other tables of the channel stalls until then. No-op without shared
+-- channels, since the channel is created anew.
+CREATE FUNCTION data_sub_pause(lname name) RETURNS void AS $$
+BEGIN
+	IF shardman.shared_data_channels() AND
+		EXISTS (SELECT 1 FROM pg_subscription WHERE subname = lname AND subenabled)
+	THEN
+		EXECUTE format('ALTER SUBSCRIPTION %I DISABLE', lname);
+	END IF;
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Wait until apply worker of subscription paused by data_sub_pause (in
+-- separate transaction) exits: until then it might still skip changes.
+CREATE FUNCTION data_sub_wait_paused(lname name) RETURNS void AS $$
+DECLARE
+	started timestamptz := clock_timestamp();
+BEGIN
+	WHILE EXISTS (SELECT 1 FROM pg_stat_subscription
+				  WHERE subname = lname AND pid IS NOT NULL) LOOP
+		IF clock_timestamp() - started > interval '10 seconds' THEN
+			RAISE EXCEPTION '[SHMN] apply worker of % did not exit', lname;
+		END IF;
+		PERFORM pg_sleep(0.01);
+	END LOOP;
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Stop publishing p_name via data channel lname. Publication, repslot and sync
+-- standby are dropped when nothing is published via the channel anymore, i.e.
+-- always with per-partition channels.
+CREATE FUNCTION data_pub_drop_table(lname name, p_name name) RETURNS void AS $$
+BEGIN
+	IF shardman.shared_data_channels() THEN
+		PERFORM shardman.drop_table_from_pub(lname, p_name);
+		IF EXISTS (SELECT 1 FROM pg_publication_rel pr JOIN pg_publication p
+				   ON p.oid = pr.prpubid WHERE p.pubname = lname) THEN
+			RETURN;
+		END IF;
+	END IF;
+
+	PERFORM shardman.drop_repslot_and_pub(lname);
+	PERFORM shardman.remove_sync_standby(lname);
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Stop receiving p_name via data channel lname from pub_node. Subscription is
+-- dropped when, according to metadata, no other our partitions are fed from
+-- pub_node, i.e. always with per-partition channels.
+CREATE FUNCTION data_sub_drop_table(lname name, pub_node int, p_name name)
+	RETURNS void AS $$
+BEGIN
+	IF shardman.shared_data_channels() AND
+		EXISTS (SELECT 1 FROM shardman.partitions WHERE owner = shardman.my_id()
+				AND prv = pub_node AND part_name != p_name) THEN
+		RETURN;
+	END IF;
+
+	PERFORM shardman.eliminate_sub(lname);
+END $$ LANGUAGE plpgsql STRICT;
+
+-- How many of our sync standbys may lag behind so that each partition we feed
+-- still has at least sync_quorum replicas confirming the commit. Every data
+-- channel is a separate standby, so that's the smallest surplus of channels
+-- over quorum among our partitions; 0 if any of them wants all replicas. Note
+-- that with replica chain we feed only one replica of each partition, so
+-- quorum makes difference only if it is less than the number of channels.
+CREATE FUNCTION sync_standbys_may_lag() RETURNS int AS $$
+	SELECT coalesce(min(greatest(
+		p.nchannels - coalesce(t.sync_quorum, p.nchannels), 0)), 0)::int
+	  FROM (SELECT relation, part_name, count(*) AS nchannels
+			  FROM shardman.partitions WHERE prv = shardman.my_id()
+			 GROUP BY relation, part_name) p
+	  JOIN shardman.tables t USING (relation)
+	 WHERE t.replication_mode IS DISTINCT FROM 'async';
+$$ LANGUAGE sql;
+
 -- Make sure that standby_name is present in synchronous_standby_names. If not,
 -- add it via ALTER SYSTEM and SIGHUP postmaster to reread conf.
 CREATE FUNCTION ensure_sync_standby(standby text) RETURNS void AS $$
+BEGIN
+	PERFORM shardman.ensure_sync_standbys(ARRAY[standby]);
+END $$ LANGUAGE plpgsql STRICT;
+
+-- Same for several standbys at once: synchronous_standby_names is rewritten
+-- and config reloaded only once, so adding many channels doesn't make every
+-- backend and walsender reparse the setting again and again. Data channels
+-- whose repslot is gone, e.g. left by failed tasks, are removed on the way,
+-- since nobody would ever confirm commits for them.
+CREATE FUNCTION ensure_sync_standbys(standbys text[]) RETURNS void AS $$
 DECLARE
-	newval text := shardman.ensure_sync_standby_c(standby);
+	newval text;
 BEGIN
+	newval := shardman.ensure_sync_standbys_c(
+		standbys, shardman.sync_standbys_may_lag(),
+		ARRAY(SELECT slot_name::text FROM pg_replication_slots));
 	IF newval IS NOT NULL THEN
-		RAISE DEBUG '[SHMN] Adding standby %, new value is %', standby, newval;
+		RAISE DEBUG '[SHMN] Adding standbys %, new value is %', standbys, newval;
 		PERFORM shardman.set_sync_standbys(newval);
 	END IF;
 END $$ LANGUAGE plpgsql STRICT;
-CREATE FUNCTION ensure_sync_standby_c(standby text) RETURNS text
-    AS 'pg_shardman' LANGUAGE C STRICT;
+CREATE FUNCTION ensure_sync_standbys_c(standbys text[], may_lag int,
+									   slots text[])
+	RETURNS text AS 'pg_shardman' LANGUAGE C STRICT;
 
 -- Remove 'standby' from synchronous_standby_names, if it is there, and SIGHUP
 -- postmaster.
 CREATE FUNCTION remove_sync_standby(standby text) RETURNS void AS $$
 DECLARE
-	newval text := shardman.remove_sync_standby_c(standby);
+	newval text := shardman.remove_sync_standby_c(
+		standby, shardman.sync_standbys_may_lag());
 BEGIN
 	IF newval IS NOT NULL THEN
 		RAISE DEBUG '[SHMN] Removing standby %, new value is %', standby, newval;
 		PERFORM shardman.set_sync_standbys(newval);
 	END IF;
 END $$ LANGUAGE plpgsql STRICT;
-CREATE FUNCTION remove_sync_standby_c(standby text) RETURNS text
+CREATE FUNCTION remove_sync_standby_c(standby text, may_lag int) RETURNS text
 	AS 'pg_shardman' LANGUAGE C STRICT;
 
+-- Update quorum in synchronous_standby_names according to
+-- sync_standbys_may_lag, if needed.
+CREATE FUNCTION requorum_sync_standbys() RETURNS void AS $$
+DECLARE
+	newval text := shardman.requorum_sync_standbys_c(
+		shardman.sync_standbys_may_lag());
+BEGIN
+	IF newval IS NOT NULL THEN
+		RAISE DEBUG '[SHMN] Changing sync standbys quorum, new value is %', newval;
+		PERFORM shardman.set_sync_standbys(newval);
+	END IF;
+END $$ LANGUAGE plpgsql STRICT;
+CREATE FUNCTION requorum_sync_standbys_c(may_lag int) RETURNS text
+	AS 'pg_shardman' LANGUAGE C STRICT;
+
+-- Sync data channels replicating our partitions of relids (sharded tables or
+-- their partitions). With shardman.table_sync_commit, transaction which has
+-- written none of them doesn't wait for sync standbys on commit.
+CREATE FUNCTION sync_channels(relids oid[]) RETURNS SETOF name AS $$
+	SELECT DISTINCT shardman.get_data_lname(p.part_name, p.prv, p.owner)
+	  FROM shardman.partitions p
+	  JOIN shardman.tables t USING (relation)
+	 WHERE p.prv = shardman.my_id()
+	   AND t.replication_mode IS DISTINCT FROM 'async'
+	   AND (to_regclass(p.relation) = ANY(relids) OR
+			to_regclass(p.part_name) = ANY(relids));
+$$ LANGUAGE sql;
+
 CREATE FUNCTION set_sync_standbys(standby text) RETURNS void AS $$
 BEGIN
 	PERFORM shardman.alter_system_c('synchronous_standby_names', standby);
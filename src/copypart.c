@@ -22,12 +22,8 @@
  * issues: for example, if we move primary and at the same time add replica by
  * copying this primary to some node, replica might lost some data which has
  * written at new primary location when LR channel between new primary and and
- * replica was not yet established. To simplify things, we should not allow
- * parallel execution of copy part tasks involving the same src partition, but
- * this is not yet checked.
- *
- * We have other issues as well. Imagine the following nodes with primary part
- * on A and replica on B:
+ * replica was not yet established. Or imagine the following nodes with
+ * primary part on A and replica on B:
  * A --> B
  * |     |
  * C --- D
@@ -35,9 +31,15 @@
  * D. Rr has moved first, Pr second, A quickly learns about this and drops
  * partition & repslot since it has moved to C. Now slow D learns what
  * happened; since Rr move was first, it creates subscription pointing to the
- * table on A, but the repslot doesn't exist anymore, so we will see a
- * bunch of errors in the log. Happily, this doesn't mean that CREATE
- * SUBSCRIPTION fails, so things will get fixed eventually.
+ * table on A, but the repslot doesn't exist anymore.
+ * All such conflicts are between tasks touching the same partition: its
+ * primary and replicas form one chain, and LR channels, repslots and
+ * metadata rows of a partition are touched only by tasks copying it. So
+ * exec_tasks builds dependency graph in which each task waits for the
+ * previous task (in tasks order) on the same partition, and runs everything
+ * else concurrently. State of waiting task is computed again when it is
+ * unblocked, since metadata it was built from is stale by then. Node-wide
+ * resources are guarded by admission control, see task_admitted.
  *
  * As with most actions, we can create/alter/drop pubs, subs and repslots in
  * two ways: via triggers on tables with metadata and manually via libpq.  The
@@ -88,21 +90,79 @@
 #include "utils/pg_lsn.h"
 #include "utils/builtins.h"
 #include "lib/ilist.h"
+#include "lib/stringinfo.h"
+#include "utils/memutils.h"
 
 #include <unistd.h>
 #include <time.h>
 #include <limits.h>
+#include <poll.h>
 #include <sys/epoll.h>
 
 #include "copypart.h"
+#include "monitor.h"
 #include "timeutils.h"
 
 /* epoll max events */
 #define MAX_EVENTS 64
 
+/*
+ * Max number of COPY chunks fan-out task relays in one iteration before
+ * yielding to other tasks.
+ */
+#define FANOUT_CHUNKS_PER_ITER 1024
+
+/*
+ * Fan-out task pushes relayed COPY data to dsts after that many bytes; if
+ * some dst can't take it, we stop reading src until it can.
+ */
+#define FANOUT_FLUSH_BYTES (64 * 1024)
+
+/*
+ * Relation file copy transfers that many blocks per query, and that many
+ * queries in one iteration before yielding to other tasks.
+ */
+#define FILECOPY_BLOCKS_PER_CHUNK 128
+#define FILECOPY_CHUNKS_PER_ITER 16
+
+/* Task progress is written to shardman.copy_tasks not more often, in ms */
+#define PROGRESS_REPORT_INTERVAL 1000
+
+/*
+ * First retry delays after failure, in ms; they double on each next failure
+ * of the same step up to cmd_retry_naptime. Connection failures are usually
+ * short blips, while failed query probably waits for something to change.
+ */
+#define RETRY_CONN_BASE 100
+#define RETRY_QUERY_BASE 1000
+/* First poll delay, in ms; doubles while waiting up to poll_interval */
+#define POLL_INTERVAL_MIN 10
+/* Preemptible tasks look for more urgent commands that often, in ms */
+#define PREEMPTION_CHECK_INTERVAL 1000
+/* rm node: kill walsender holding meta repslot after, in ms */
+#define RM_NODE_RELEASE_TIMEOUT 5000
+/* rm node: give up waiting for meta repslot release after, in ms */
+#define RM_NODE_FIRE_TIMEOUT 10000
+/* Give up configuring sync standbys of a node after, in ms */
+#define SYNC_STANDBYS_TIMEOUT 60000
+/* One attempt to configure them may take that long, in ms */
+#define SYNC_STANDBYS_ATTEMPT_TIMEOUT 10000
+/* connect_timeout for dropping abandoned copy channels, in seconds */
+#define ABANDONED_CHANNEL_CONNECT_TIMEOUT "5"
+
+typedef enum
+{
+	RETRY_CONN, /* connection is broken */
+	RETRY_QUERY /* connection is fine, but query failed */
+} RetryClass;
+
 /* Bitmask for ensure_pqconn */
 #define ENSURE_PQCONN_SRC (1 << 0)
 #define ENSURE_PQCONN_DST (1 << 1)
+#define ENSURE_PQCONN_COPY_SRC (1 << 2)
+
+/* Are we reading the data not from the partition owner itself? */
+#define CP_FROM_REPLICA(cps) ((cps)->copy_src_node != (cps)->src_node)
 
 typedef struct
 {
@@ -110,36 +170,184 @@ typedef struct
 	CopyPartState *cps;
 } CopyPartStateNode;
 
+/* Sync standbys to be added on one node */
+typedef struct
+{
+	int32 node;
+	const char *connstr;
+	List *standbys; /* of char *, data channel names */
+	List *waiters; /* of CopyPartState *, tasks waiting for the flush */
+	/* flush in progress, see flush_sync_standbys */
+	PGconn *conn;
+	PostgresPollingStatusType polling;
+	bool sent;
+	char *sql;
+	List *sent_standbys; /* standbys the query adds */
+	List *sent_waiters; /* tasks waiting for them */
+	struct timespec deadline; /* attempt fails if not done by then */
+	int npolls;
+	struct timespec next_tm; /* when to look at this node again */
+} PendingSyncStandbys;
+
+/* Copies running on one node, see task_admitted */
+typedef struct
+{
+	int32 node;
+	int ncopies;
+} NodeCopies;
+
+/* of NodeCopies, for tasks of current exec_tasks */
+static List *node_copies = NIL;
+
+/*
+ * Of CopyPartState *, tasks of current exec_tasks which may start but wait
+ * for a free slot in active tasks window, see start_tasks.
+ */
+static List *ready_tasks = NIL;
+/*
+ * Of CopyPartState *, ready tasks which are not admitted to their nodes yet.
+ * They are tried again when some copy is done, see task_release.
+ */
+static List *admission_waiting = NIL;
+static bool copy_slots_freed;
+static int active_tasks;
+/* Where allocations outliving single task go */
+static MemoryContext exec_tasks_cxt;
+
+/* Task and its position in exec_tasks array, see build_task_dag */
+typedef struct
+{
+	CopyPartState *cps;
+	int idx;
+} TaskKey;
+
+/* of PendingSyncStandbys, accumulated by tasks of current exec_tasks */
+static List *pending_sync_standbys = NIL;
+/* when they must be flushed */
+static struct timespec pending_sync_standbys_tm;
+/* of CopyChannel *, shared copy channels of current exec_tasks */
+static List *copy_channels = NIL;
+
 static void init_cp_state(CopyPartState *cps);
+static void setup_copy_channels(CopyPartState **tasks, int ntasks);
+static bool uses_copy_channel(CopyPartState *cps);
+static int cp_leave_channel(CopyPartState *cps);
+static void cp_channel_depart(CopyPartState *cps);
+static void drop_abandoned_channels(void);
 static void finalize_cp_state(CopyPartState *cps);
 static int calc_timeout(slist_head *timeout_states);
+static bool run_tasks(CopyPartState **tasks, int ntasks, bool preemptible);
+static void build_task_dag(CopyPartState **tasks, int ntasks);
+static int task_key_cmp(const void *a, const void *b);
+static void init_task(CopyPartState *cps);
+static void start_tasks(slist_head *timeout_states, int *unfinished_tasks);
+static void task_finished(CopyPartState *cps, slist_head *timeout_states,
+						  int *unfinished_tasks);
+static bool task_admitted(CopyPartState *cps);
+static bool wait_nodes_saturated(CopyPartState *cps);
+static void abort_failed_over_tasks(CopyPartState **tasks, int ntasks,
+									int epfd, slist_head *timeout_states);
+static bool task_on_failed_node(CopyPartState *cps);
+static void task_release(CopyPartState *cps);
+static int task_copy_nodes(CopyPartState *cps, int32 **nodes);
+static NodeCopies *get_node_copies(int32 node);
 static void epoll_subscribe(int epfd, CopyPartState *cps);
 static void exec_task(CopyPartState *cps);
 static void exec_cp(CopyPartState *cps);
 static void exec_move_part(MovePartState *cps);
 static void exec_create_replica(CreateReplicaState *cps);
+static void exec_fanout_replicas(FanoutReplicaState *frs);
+static int exec_remote_query(CopyPartState *cps, PGconn **conn,
+							 const char *connstr, const char *sql, bool *sent,
+							 PGresult **res);
+static void exec_add_node(AddNodeState *ans);
+static void exec_rm_node(RmNodeState *rns);
+static void exec_hash_partition(HashPartitionState *hps);
+static char *an_query(AddNodeState *ans);
+static int an_handle_result(AddNodeState *ans, PGresult *res);
+static int fr_start_copy(FanoutReplicaState *frs);
+static int fr_relay(FanoutReplicaState *frs);
+static int fr_flush_dsts(FanoutReplicaState *frs);
+static int fr_rebuild_lr(FanoutReplicaState *frs);
+static void fr_reset_conns(FanoutReplicaState *frs);
+static void fr_retry(FanoutReplicaState *frs);
 static int mp_rebuild_lr(MovePartState *cps);
+static int mp_prewarm(MovePartState *mps);
 static int cr_rebuild_lr(CreateReplicaState *cps);
+static void defer_sync_standby(CopyPartState *cps, int32 node,
+							   const char *connstr, const char *lname);
+static int await_sync_standbys(CopyPartState *cps);
+static int sync_standbys_flush_timeout(void);
+static void flush_sync_standbys(void);
+static int start_sync_standbys_flush(PendingSyncStandbys *pss);
+static void sync_standbys_flush_step(PendingSyncStandbys *pss);
+static void sync_standbys_flush_failed(PendingSyncStandbys *pss);
+static void abort_sync_standbys_flushes(void);
+static int cp_filecopy_start(CopyPartState *cps);
+static int cp_filecopy_relay(CopyPartState *cps);
+static int cp_filecopy_chunk(CopyPartState *cps, PGconn *src_conn,
+							 int relfile, int64 blkno, int64 nblocks);
+static int filecopy_result(CopyPartState *cps, PGconn *conn,
+						   const char *what, PGresult **res);
+static int cp_filecopy_verify(CopyPartState *cps);
+static int cp_filecopy_reship(CopyPartState *cps);
+static int cp_filecopy_finish(CopyPartState *cps);
+static void cp_filecopy_fallback(CopyPartState *cps);
+static int check_meta_sub_sync(CopyPartState *cps);
 static int cp_start_tablesync(CopyPartState *cpts);
 static int check_sub_sync(const char *subname, PGconn **conn,
-						  XLogRecPtr ref_lsn, const char *log_pref);
+						  XLogRecPtr ref_lsn, const char *log_pref,
+						  XLogRecPtr *received_lsn_out);
+static int cp_wait_tablesync(CopyPartState *cps);
+static int cp_prewarm(CopyPartState *cps);
 static int cp_start_finalsync(CopyPartState *cpts);
+static int cp_catchup_copy_src(CopyPartState *cpts);
 static int cp_finalize(CopyPartState *cpts);
+static int cp_analyze(CopyPartState *cps);
 static int ensure_pqconn_cp(CopyPartState *cpts, int nodes);
+static PGconn **copy_src_conn(CopyPartState *cps);
 static int ensure_pqconn(PGconn **conn, const char *connstr,
 								CopyPartState *cps);
 static void configure_retry(CopyPartState *cpts, int millis);
+static void configure_backoff(CopyPartState *cps, RetryClass rclass);
+static void configure_poll(CopyPartState *cps, int64 remaining);
+static RetryClass pq_retry_class(PGconn *conn);
+static void task_iteration_done(CopyPartState *cps, int epfd,
+								slist_head *timeout_states,
+								int *unfinished_tasks);
+static int64 cp_report_tablesync(CopyPartState *cps);
+static void report_progress(CopyPartState *cps, const char *phase,
+							int64 counter, int64 remaining);
+static void report_result(CopyPartState *cps);
+static const char *task_type_name(CopyPartTaskType type);
+static void measure_src_size(CopyPartState *cps, PGconn *conn);
 static char *received_lsn_sql(const char *subname);
 static XLogRecPtr pg_lsn_in_c(const char *lsn);
 static struct timespec timespec_now_plus_millis(int millis);
 struct timespec timespec_now(void);
 
+/* Must be in sync with get_data_lname in shard.sql */
 static char*
 get_data_lname(char const* part_name, int pub_node, int sub_node)
 {
+	if (shardman_shared_data_channels)
+		return psprintf("shardman_data_%d_%d", pub_node, sub_node);
 	return psprintf("shardman_data_%s_%d_%d", part_name, pub_node, sub_node);
 }
 
+/*
+ * SQL pausing shared data channel lname on subscriber before a table is added
+ * to it on publisher, see data_sub_pause in shard.sql. Statements run in
+ * separate transactions: worker exits only when disabling is committed.
+ */
+static char *
+data_sub_pause_sql(const char *lname)
+{
+	return psprintf("select shardman.data_sub_pause('%s');"
+					" select shardman.data_sub_wait_paused('%s');",
+					lname, lname);
+}
+
 /*
  * Fill MovePartState for moving partition. If src_node is
  * SHMN_INVALID_NODE_ID, assume primary partition must be moved. If something
@@ -194,21 +402,48 @@ init_mp_state(MovePartState *mps, const char *part_name, int32 src_node,
 	}
 	mps->cp.dst_node = dst_node;
 
-	/* Fields common among copy part tasks */
-	init_cp_state((CopyPartState *) mps);
-	if (mps->cp.res == TASK_FAILED)
-		return;
-
-	if ((mps->next_node = get_next_node(mps->cp.part_name, mps->cp.src_node))
-		!= SHMN_INVALID_NODE_ID)
+	mps->next_nodes = get_next_nodes(mps->cp.part_name, mps->cp.src_node,
+									 &mps->nnext);
+	if (mps->nnext > 0)
 	{
+		int i;
+
+		/*
+		 * This part has replicas, so after moving part we have to
+		 * reconfigure LR channels properly.
+		 */
+		mps->next_connstrs = palloc(sizeof(char *) * mps->nnext);
+		mps->next_conns = palloc0(sizeof(PGconn *) * mps->nnext);
+		for (i = 0; i < mps->nnext; i++)
+			mps->next_connstrs[i] = get_node_connstr(mps->next_nodes[i],
+													 SNT_WORKER);
+
 		/*
-		 * This part has replica, so after moving part we have to
-		 * reconfigure LR channel properly.
+		 * Replica of the primary is kept up-to-date by the data channel, so
+		 * we can do the bulk copy from it and leave the (most probably
+		 * busiest) primary alone until the final catch-up.
 		 */
-		mps->next_connstr = get_node_connstr(mps->next_node, SNT_WORKER);
+		if (mps->cp.type == COPYPARTTASK_MOVE_PRIMARY && !shardman_file_copy &&
+			shardman_copy_from_replica && mps->next_nodes[0] != dst_node &&
+			!node_degraded(mps->next_nodes[0]))
+		{
+			mps->cp.copy_src_node = mps->next_nodes[0];
+		}
 	}
 
+	/*
+	 * Write fence on the primary stops all writes to the partition, so
+	 * relation files can be copied. Fence on replica wouldn't stop writes on
+	 * prev, and they would be lost for dst.
+	 */
+	if (mps->cp.type == COPYPARTTASK_MOVE_PRIMARY && shardman_file_copy)
+		mps->cp.file_copy = true;
+
+	/* Fields common among copy part tasks */
+	init_cp_state((CopyPartState *) mps);
+	if (mps->cp.res == TASK_FAILED)
+		return;
+
 	mps->cp.update_metadata_sql = psprintf(
 		"update shardman.partitions set owner = %d where part_name = '%s'"
 		" and owner = %d;"
@@ -222,32 +457,43 @@ init_mp_state(MovePartState *mps, const char *part_name, int32 src_node,
 
 	if (mps->prev_node != SHMN_INVALID_NODE_ID)
 	{
-		char *prev_dst_lname = get_data_lname(part_name, shardman_my_id,
+		char *prev_dst_lname = get_data_lname(part_name, mps->prev_node,
 											  mps->cp.dst_node);
 		mps->prev_sql = psprintf(
 			"select shardman.part_moved_prev('%s', %d, %d);"
-            " select pg_create_logical_replication_slot('%s', 'pgoutput');",
+            " select shardman.ensure_repslot('%s');",
 			part_name, mps->cp.src_node, mps->cp.dst_node, prev_dst_lname);
 
-		mps->sync_standby_prev_sql = psprintf(
-			"select shardman.ensure_sync_standby('%s');", prev_dst_lname);
+		mps->prev_dst_lname = prev_dst_lname;
+		mps->dst_pause_sql = data_sub_pause_sql(prev_dst_lname);
 	}
 	mps->dst_sql = psprintf(
 		"select shardman.part_moved_dst('%s', %d, %d);",
 		part_name, mps->cp.src_node, mps->cp.dst_node);
-	if (mps->next_node != SHMN_INVALID_NODE_ID)
+	mps->src_cached_blocks_sql = psprintf(
+		"select sig, shardman.cached_blocks(rel), nblocks"
+		" from shardman.relfile_layout('%s');", part_name);
+	mps->dst_layout_sql = psprintf(
+		"select rel::oid, sig from shardman.relfile_layout('%s');", part_name);
+	if (mps->nnext > 0)
 	{
-		char *dst_next_lname = get_data_lname(part_name, mps->cp.dst_node,
-											  mps->next_node);
+		int i;
+
 		mps->next_sql = psprintf(
 			"select shardman.part_moved_next('%s', %d, %d);",
 			part_name, mps->cp.src_node, mps->cp.dst_node);
-		mps->dst_sql = psprintf(
-			"%s select pg_create_logical_replication_slot('%s', 'pgoutput');",
-			mps->dst_sql, dst_next_lname);
-
-		mps->sync_standby_dst_sql = psprintf(
-			"select shardman.ensure_sync_standby('%s');", dst_next_lname);
+		mps->dst_next_lnames = palloc(sizeof(char *) * mps->nnext);
+		mps->next_pause_sqls = palloc(sizeof(char *) * mps->nnext);
+		for (i = 0; i < mps->nnext; i++)
+		{
+			mps->dst_next_lnames[i] = get_data_lname(
+				part_name, mps->cp.dst_node, mps->next_nodes[i]);
+			mps->next_pause_sqls[i] =
+				data_sub_pause_sql(mps->dst_next_lnames[i]);
+			mps->dst_sql = psprintf(
+				"%s select shardman.ensure_repslot('%s');",
+				mps->dst_sql, mps->dst_next_lnames[i]);
+		}
 	}
 }
 
@@ -261,7 +507,12 @@ init_cr_state(CreateReplicaState *crs, const char *part_name, int32 dst_node)
 	/* Set up fields neccesary to call init_cp_state */
 	crs->cp.dst_node = dst_node;
 	crs->cp.part_name = part_name;
-	if ((crs->cp.src_node = get_reptail_owner(part_name)) == SHMN_INVALID_NODE_ID)
+	/* New replica is fed by primary in star and by chain tail otherwise */
+	if (shardman_replica_topology == REPLICA_TOPOLOGY_STAR)
+		crs->cp.src_node = get_primary_owner(part_name);
+	else
+		crs->cp.src_node = get_reptail_owner(part_name);
+	if (crs->cp.src_node == SHMN_INVALID_NODE_ID)
 	{
 		shmn_elog(WARNING, "Primary part %s doesn't exist, not creating"
 				  "replica for it it", part_name);
@@ -273,33 +524,319 @@ init_cr_state(CreateReplicaState *crs, const char *part_name, int32 dst_node)
 	init_cp_state((CopyPartState *) crs);
 	if (crs->cp.res == TASK_FAILED)
 		return;
+	if (crs->cp.repmode == REPLICATION_MODE_NONE)
+	{
+		shmn_elog(WARNING, "Table %s is not replicated, not creating replica"
+				  " of %s", crs->cp.relation, part_name);
+		crs->cp.res = TASK_FAILED;
+		return;
+	}
 
 	crs->cp.update_metadata_sql = psprintf(
 		"insert into shardman.partitions values "
-		" ('%s', %d, %d, NULL, '%s');"
-		" update shardman.partitions set nxt = %d where part_name = '%s' and "
-		" owner = %d",
-		part_name, dst_node, crs->cp.src_node, crs->cp.relation,
-		dst_node, part_name, crs->cp.src_node);
+		" ('%s', %d, %d, NULL, '%s');",
+		part_name, dst_node, crs->cp.src_node, crs->cp.relation);
+	/* In star, replicas are found by prv and primary's nxt is not used */
+	if (shardman_replica_topology != REPLICA_TOPOLOGY_STAR)
+		crs->cp.update_metadata_sql = psprintf(
+			"%s update shardman.partitions set nxt = %d where part_name = '%s'"
+			" and owner = %d;",
+			crs->cp.update_metadata_sql, dst_node, part_name, crs->cp.src_node);
 	crs->cp.type = COPYPARTTASK_CREATE_REPLICA;
 
+	crs->data_lname = get_data_lname(part_name, crs->cp.src_node,
+									 crs->cp.dst_node);
 	crs->drop_cp_sub_sql = psprintf(
-		"select shardman.replica_created_drop_cp_sub('%s', %d, %d);",
-		part_name, crs->cp.src_node, crs->cp.dst_node);
-
+		"select shardman.replica_created_drop_cp_sub('%s', %d, %d); %s",
+		part_name, crs->cp.src_node, crs->cp.dst_node,
+		data_sub_pause_sql(crs->data_lname));
 	crs->create_data_pub_sql =
 		psprintf("select shardman.replica_created_create_data_pub('%s', %d, %d);"
-				 " select pg_create_logical_replication_slot('%s', 'pgoutput');",
+				 " select shardman.ensure_repslot('%s');",
 				 part_name, crs->cp.src_node, crs->cp.dst_node,
-				 get_data_lname(part_name, crs->cp.src_node, crs->cp.dst_node));
+				 crs->data_lname);
+	crs->readonly_off_sql = psprintf(
+		"select shardman.readonly_table_off('%s'::regclass);", part_name);
 	crs->create_data_sub_sql = psprintf(
 		"select shardman.replica_created_create_data_sub('%s', %d, %d);",
 		part_name, crs->cp.src_node, crs->cp.dst_node);
-	crs->sync_standby_sql = psprintf(
-		"select shardman.ensure_sync_standby('%s');"
-		" select shardman.readonly_table_off('%s'::regclass);",
-		get_data_lname(part_name, crs->cp.src_node, crs->cp.dst_node),
-		part_name);
+}
+
+/*
+ * Fill FanoutReplicaState for creating ndsts replicas at once. dst_nodes
+ * must be distinct. If something goes wrong, we don't bother to fill the rest
+ * of fields and mark task as failed.
+ */
+void
+init_fr_state(FanoutReplicaState *frs, const char *part_name,
+			  int32 *dst_nodes, int ndsts)
+{
+	StringInfoData metadata_sql;
+	int32 src_node;
+	int i;
+
+	Assert(ndsts > 0);
+	frs->cp.type = COPYPARTTASK_FANOUT_REPLICAS;
+	frs->cp.part_name = part_name;
+	frs->cp.dst_node = dst_nodes[0];
+	frs->ndsts = ndsts;
+	frs->dst_nodes = dst_nodes;
+	if ((src_node = get_reptail_owner(part_name)) == SHMN_INVALID_NODE_ID)
+	{
+		shmn_elog(WARNING, "Primary part %s doesn't exist, not creating"
+				  " replicas for it", part_name);
+		frs->cp.res = TASK_FAILED;
+		return;
+	}
+	frs->cp.src_node = src_node;
+	frs->cp.copy_src_node = src_node;
+	if (node_degraded(src_node))
+	{
+		shmn_elog(WARNING, "Won't create replicas of %s: node %d is degraded",
+				  part_name, src_node);
+		frs->cp.res = TASK_FAILED;
+		return;
+	}
+	for (i = 0; i < ndsts; i++)
+	{
+		if (node_degraded(dst_nodes[i]))
+		{
+			shmn_elog(WARNING, "Won't copy shard %s to %d: node is degraded",
+					  part_name, dst_nodes[i]);
+			frs->cp.res = TASK_FAILED;
+			return;
+		}
+		if (node_has_partition(dst_nodes[i], part_name))
+		{
+			shmn_elog(WARNING,
+					  "Shard %s already exists on node %d, won't copy it from %d.",
+					  part_name, dst_nodes[i], src_node);
+			frs->cp.res = TASK_FAILED;
+			return;
+		}
+	}
+
+	/* Task is ready to be processed right now */
+	frs->cp.waketm = timespec_now();
+	frs->cp.fd_to_epoll = -1;
+	frs->cp.fd_in_epoll_set = -1;
+
+	frs->cp.src_connstr = get_node_connstr(src_node, SNT_WORKER);
+	Assert(frs->cp.src_connstr != NULL);
+	frs->cp.copy_src_connstr = frs->cp.src_connstr;
+	frs->cp.relation = get_partition_relation(part_name);
+	Assert(frs->cp.relation != NULL);
+	frs->cp.repmode = get_replication_mode(frs->cp.relation);
+	if (frs->cp.repmode == REPLICATION_MODE_NONE)
+	{
+		shmn_elog(WARNING, "Table %s is not replicated, not creating replicas"
+				  " of %s", frs->cp.relation, part_name);
+		frs->cp.res = TASK_FAILED;
+		return;
+	}
+	/* repslot created on src becomes data channel src -> dst_nodes[0] */
+	frs->cp.logname = get_data_lname(part_name, src_node, dst_nodes[0]);
+
+	frs->src_create_pub_sql = psprintf(
+		"drop publication if exists %s cascade;"
+		"create publication %s for table %s;"
+		"select shardman.drop_repslot('%s');",
+		frs->cp.logname, frs->cp.logname, part_name, frs->cp.logname);
+	frs->src_create_rs_cmd = psprintf(
+		"CREATE_REPLICATION_SLOT %s LOGICAL pgoutput EXPORT_SNAPSHOT",
+		frs->cp.logname);
+	frs->copy_out_sql = psprintf("copy %s to stdout (format binary)",
+								 part_name);
+	frs->copy_in_sql = psprintf("copy %s from stdin (format binary)",
+								part_name);
+
+	frs->dst_connstrs = palloc(sizeof(char *) * ndsts);
+	frs->dst_conns = palloc0(sizeof(PGconn *) * ndsts);
+	frs->dst_create_tab_sql = palloc(sizeof(char *) * ndsts);
+	frs->create_data_pub_sql = palloc0(sizeof(char *) * ndsts);
+	frs->create_data_sub_sql = palloc(sizeof(char *) * ndsts);
+	frs->prev_lnames = palloc(sizeof(char *) * ndsts);
+	initStringInfo(&metadata_sql);
+	for (i = 0; i < ndsts; i++)
+	{
+		int32 prev = i == 0 ? src_node : dst_nodes[i - 1];
+		char *prev_lname = get_data_lname(part_name, prev, dst_nodes[i]);
+
+		frs->dst_connstrs[i] = get_node_connstr(dst_nodes[i], SNT_WORKER);
+		Assert(frs->dst_connstrs[i] != NULL);
+		/*
+		 * Sub to prev node might exist if previous attempt has failed; it
+		 * must be disabled to let us drop repslot on prev.
+		 */
+		frs->dst_create_tab_sql[i] = psprintf(
+			"select shardman.eliminate_sub('%s');"
+			" drop table if exists %s cascade;"
+			" create table %s (like %s including defaults including indexes"
+			" including storage);",
+			prev_lname, part_name, part_name, frs->cp.relation);
+		if (i != ndsts - 1)
+		{
+			frs->create_data_pub_sql[i] = psprintf(
+				"select shardman.replica_created_create_data_pub('%s', %d, %d);"
+				" select shardman.ensure_repslot('%s');",
+				part_name, dst_nodes[i], dst_nodes[i + 1],
+				get_data_lname(part_name, dst_nodes[i], dst_nodes[i + 1]));
+		}
+		frs->create_data_sub_sql[i] = psprintf(
+			"select shardman.replica_created_create_data_sub('%s', %d, %d);",
+			part_name, prev, dst_nodes[i]);
+		frs->prev_lnames[i] = prev_lname;
+
+		appendStringInfo(&metadata_sql,
+						 "insert into shardman.partitions values"
+						 " ('%s', %d, %d, %s, '%s');",
+						 part_name, dst_nodes[i], prev,
+						 i == ndsts - 1 ? "NULL" :
+						 psprintf("%d", dst_nodes[i + 1]),
+						 frs->cp.relation);
+	}
+	appendStringInfo(&metadata_sql,
+					 " update shardman.partitions set nxt = %d"
+					 " where part_name = '%s' and owner = %d;",
+					 dst_nodes[0], part_name, src_node);
+	frs->update_metadata_sql = metadata_sql.data;
+
+	frs->step = FANOUT_START_COPY;
+	frs->cp.res = TASK_IN_PROGRESS;
+}
+
+/*
+ * Fill AddNodeState for bootstrapping node with given connstr under id
+ * node_id, generated by caller.
+ */
+void
+init_an_state(AddNodeState *ans, const char *connstr, int32 node_id)
+{
+	ans->cp.type = COPYPARTTASK_ADD_NODE;
+	ans->cp.part_name = connstr;
+	ans->cp.waketm = timespec_now();
+	ans->cp.fd_to_epoll = -1;
+	ans->cp.fd_in_epoll_set = -1;
+	ans->connstr = connstr;
+	ans->node_id = node_id;
+	ans->step = ADDNODE_CHECK_INSTALLED;
+	ans->cp.res = TASK_IN_PROGRESS;
+}
+
+/*
+ * Plan move of part_name from src_node (primary owner, if invalid) to
+ * dst_node. Unlike init_mp_state, nothing is checked or computed until
+ * exec_tasks starts the task, so that thousands of tasks cost nearly nothing.
+ */
+void
+plan_mp_state(MovePartState *mps, const char *part_name, int32 src_node,
+			  int32 dst_node)
+{
+	mps->cp.type = src_node == SHMN_INVALID_NODE_ID ?
+		COPYPARTTASK_MOVE_PRIMARY : COPYPARTTASK_MOVE_REPLICA;
+	mps->cp.part_name = part_name;
+	mps->cp.src_node = src_node;
+	mps->cp.copy_src_node = src_node;
+	mps->cp.dst_node = dst_node;
+	mps->cp.needs_init = true;
+}
+
+/*
+ * Plan creation of part_name replica on dst_node, see plan_mp_state.
+ */
+void
+plan_cr_state(CreateReplicaState *crs, const char *part_name, int32 dst_node)
+{
+	crs->cp.type = COPYPARTTASK_CREATE_REPLICA;
+	crs->cp.part_name = part_name;
+	crs->cp.src_node = SHMN_INVALID_NODE_ID;
+	crs->cp.dst_node = dst_node;
+	crs->cp.needs_init = true;
+}
+
+/*
+ * Plan creation of part_name replicas on dst_nodes, see plan_mp_state.
+ */
+void
+plan_fr_state(FanoutReplicaState *frs, const char *part_name,
+			  int32 *dst_nodes, int ndsts)
+{
+	frs->cp.type = COPYPARTTASK_FANOUT_REPLICAS;
+	frs->cp.part_name = part_name;
+	frs->cp.src_node = SHMN_INVALID_NODE_ID;
+	frs->cp.dst_node = dst_nodes[0];
+	frs->ndsts = ndsts;
+	frs->dst_nodes = dst_nodes;
+	frs->cp.needs_init = true;
+}
+
+/*
+ * Fill RmNodeState for node node_id already marked as rm_in_progress.
+ */
+void
+init_rn_state(RmNodeState *rns, int32 node_id)
+{
+	rns->cp.type = COPYPARTTASK_RM_NODE;
+	rns->cp.part_name = psprintf("node %d", node_id);
+	rns->cp.waketm = timespec_now();
+	rns->cp.fd_to_epoll = -1;
+	rns->cp.fd_in_epoll_set = -1;
+	rns->node_id = node_id;
+	rns->slot_name = psprintf("shardman_meta_sub_%d", node_id);
+	rns->started = timespec_now();
+	rns->cp.res = TASK_IN_PROGRESS;
+}
+
+/*
+ * Fill HashPartitionState. If table is already sharded or node doesn't
+ * exist, res is set to TASK_FAILED.
+ */
+void
+init_hp_state(HashPartitionState *hps, int32 node_id, const char *relation,
+			  const char *expr, int partitions_count)
+{
+	char *sql;
+
+	hps->cp.type = COPYPARTTASK_HASH_PARTITION;
+	hps->cp.part_name = relation;
+	hps->cp.waketm = timespec_now();
+	hps->cp.fd_to_epoll = -1;
+	hps->cp.fd_in_epoll_set = -1;
+	hps->node_id = node_id;
+
+	/* Check that table with such name is not already sharded */
+	sql = psprintf(
+		"select relation from shardman.tables where relation = '%s'",
+		relation);
+	if (void_spi(sql) != 0)
+	{
+		shmn_elog(WARNING, "table %s already sharded, won't partition it.",
+				  relation);
+		hps->cp.res = TASK_FAILED;
+		return;
+	}
+	pfree(sql);
+	/* connstr mem freed with ctxt */
+	if ((hps->connstr = get_node_connstr(node_id, SNT_WORKER)) == NULL)
+	{
+		shmn_elog(WARNING, "create_hash_partitions failed, no such worker node: %d",
+				  node_id);
+		hps->cp.res = TASK_FAILED;
+		return;
+	}
+
+	/*
+	 * Note that we have to run statements in separate transactions, otherwise
+	 * we have a deadlock between pathman and pg_dump.
+	 */
+	hps->sql = psprintf(
+		"begin; select shardman.drop_parts('%s', '%d');"
+		" select create_hash_partitions('%s', '%s', %d); end;"
+		"select shardman.gen_create_table_sql('%s', '%s');",
+		relation, partitions_count,
+		relation, expr, partitions_count,
+		relation, hps->connstr);
+	hps->cp.res = TASK_IN_PROGRESS;
 }
 
 /*
@@ -318,6 +855,21 @@ init_cp_state(CopyPartState *cps)
 	Assert(cps->dst_node != 0);
 	Assert(cps->part_name != NULL);
 
+	/* Unless caller said otherwise, read the data from src itself */
+	if (cps->copy_src_node == 0)
+		cps->copy_src_node = cps->src_node;
+
+	/* Degraded nodes get no new tasks */
+	if (node_degraded(cps->src_node) || node_degraded(cps->dst_node) ||
+		node_degraded(cps->copy_src_node))
+	{
+		shmn_elog(WARNING,
+				  "Won't copy shard %s from %d to %d: node is degraded",
+				  cps->part_name, cps->copy_src_node, cps->dst_node);
+		cps->res = TASK_FAILED;
+		return;
+	}
+
 	/* Check that table with such name does not already exist on dst node */
 	sql = psprintf(
 		"select owner from shardman.partitions where part_name = '%s' and owner = %d",
@@ -342,10 +894,21 @@ init_cp_state(CopyPartState *cps)
 	Assert(cps->src_connstr != NULL);
 	cps->dst_connstr = get_node_connstr(cps->dst_node, SNT_WORKER);
 	Assert(cps->dst_connstr != NULL);
+	if (CP_FROM_REPLICA(cps))
+	{
+		cps->copy_src_connstr = get_node_connstr(cps->copy_src_node, SNT_WORKER);
+		Assert(cps->copy_src_connstr != NULL);
+		cps->copy_src_lname = get_data_lname(cps->part_name, cps->src_node,
+											 cps->copy_src_node);
+		shmn_elog(DEBUG1, "cp %s: copying data from replica on node %d",
+				  cps->part_name, cps->copy_src_node);
+	}
+	else
+		cps->copy_src_connstr = cps->src_connstr;
 
 	/* constant strings */
 	cps->logname = psprintf("shardman_copy_%s_%d_%d",
-							 cps->part_name, cps->src_node, cps->dst_node);
+							 cps->part_name, cps->copy_src_node, cps->dst_node);
 	cps->dst_drop_sub_sql = psprintf(
 		"drop subscription if exists %s cascade;", cps->logname);
 	/*
@@ -361,6 +924,7 @@ init_cp_state(CopyPartState *cps)
 		);
 	cps->relation = get_partition_relation(cps->part_name);
 	Assert(cps->relation != NULL);
+	cps->repmode = get_replication_mode(cps->relation);
 	cps->dst_create_tab_and_sub_sql = psprintf(
 		"drop table if exists %s cascade;"
 		/*
@@ -380,14 +944,44 @@ init_cp_state(CopyPartState *cps)
 		cps->part_name,
 		cps->part_name, cps->relation,
 		cps->logname,
-		cps->logname, cps->src_connstr, cps->logname, cps->logname);
+		cps->logname, cps->copy_src_connstr, cps->logname, cps->logname);
 	cps->substate_sql = get_substate_sql(cps->logname);
 	cps->readonly_sql = psprintf(
 		"select shardman.readonly_table_on('%s')", cps->part_name
 		);
 	cps->received_lsn_sql = received_lsn_sql(cps->logname);
+	cps->analyze_sql = psprintf("analyze %s;", cps->part_name);
 
 	cps->curstep = COPYPART_START_TABLESYNC;
+	if (cps->file_copy)
+	{
+		cps->freeze_sql = psprintf("vacuum (freeze) %s", cps->part_name);
+		/* PQexec returns the result of the last query */
+		cps->layout_sql = psprintf(
+			"select shardman.relfile_copy_check('%s');"
+			" select rel::oid, sig, nblocks, pg_current_wal_insert_lsn()"
+			" from shardman.relfile_layout('%s');",
+			cps->part_name, cps->part_name);
+		cps->fence_sql = psprintf(
+			"begin; lock table %s in exclusive mode;"
+			" select shardman.relfile_copy_check('%s');"
+			" select rel::oid, nblocks from shardman.relfile_layout('%s');",
+			cps->part_name, cps->part_name, cps->part_name);
+		cps->dst_filecopy_prepare_sql = psprintf(
+			"begin; drop table if exists %s cascade;"
+			" create table %s (like %s including defaults including indexes"
+			" including storage);"
+			" select shardman.relfile_copy_prepare('%s');"
+			" select rel::oid, sig from shardman.relfile_layout('%s');",
+			cps->part_name, cps->part_name, cps->relation, cps->part_name,
+			cps->part_name);
+		cps->dst_filecopy_finish_sql = psprintf(
+			"select shardman.relfile_copy_finish('%s'); commit;",
+			cps->part_name);
+		cps->chunk_step = FILECOPY_CHUNK_IDLE;
+		cps->filecopy_sent = false;
+		cps->curstep = COPYPART_FILECOPY_START;
+	}
 	cps->res = TASK_IN_PROGRESS;
 }
 
@@ -401,13 +995,26 @@ static void finalize_cp_state(CopyPartState *cps)
 	{
 		reset_pqconn(&cps->src_conn);
 		reset_pqconn(&cps->dst_conn);
+		reset_pqconn(&cps->copy_src_conn);
+		reset_pqconn(&cps->fence_conn);
+		PQclear(cps->changed_blocks);
+		cps->changed_blocks = NULL;
 		if (cps->type == COPYPARTTASK_MOVE_PRIMARY ||
 			cps->type == COPYPARTTASK_MOVE_REPLICA)
 		{
 			MovePartState *mps = (MovePartState *) cps;
+			int i;
+
 			reset_pqconn(&mps->prev_conn);
-			reset_pqconn(&mps->next_conn);
+			for (i = 0; i < mps->nnext; i++)
+				reset_pqconn(&mps->next_conns[i]);
 		}
+		else if (cps->type == COPYPARTTASK_FANOUT_REPLICAS)
+			fr_reset_conns((FanoutReplicaState *) cps);
+		else if (cps->type == COPYPARTTASK_ADD_NODE)
+			reset_pqconn(&((AddNodeState *) cps)->conn);
+		else if (cps->type == COPYPARTTASK_HASH_PARTITION)
+			reset_pqconn(&((HashPartitionState *) cps)->conn);
 	}
 }
 
@@ -417,11 +1024,35 @@ static void finalize_cp_state(CopyPartState *cps)
  * if needed, we can easily generalize this by excluding common task state
  * from CopyPartState to separate struct and inheriting from it.  Results (and
  * general state) is saved in this array too. Executes tasks until all have
- * have failed/succeeded or sigusr1/sigterm is caugth.
+ * have failed/succeeded or sigusr1/sigterm is caugth. At most
+ * max_active_tasks are in progress at once; each task closes its connections
+ * and frees its memory as soon as it is done, see task_finished.
  *
  */
 void
 exec_tasks(CopyPartState **tasks, int ntasks)
+{
+	run_tasks(tasks, ntasks, false);
+}
+
+/*
+ * Same as exec_tasks, but gives way to more urgent commands: if such command
+ * is waiting, new tasks are not started anymore and we return after running
+ * ones are done. Returns true in this case; tasks not started are left with
+ * TASK_IN_PROGRESS res, caller is expected to postpone the command and be
+ * able to continue it from current metadata.
+ */
+bool
+exec_tasks_preemptible(CopyPartState **tasks, int ntasks)
+{
+	return run_tasks(tasks, ntasks, true);
+}
+
+/*
+ * Implementation of exec_tasks.
+ */
+bool
+run_tasks(CopyPartState **tasks, int ntasks, bool preemptible)
 {
 	/* list of sleeping cp states we need to wake after specified timeout */
 	slist_head timeout_states = SLIST_STATIC_INIT(timeout_states);
@@ -434,21 +1065,55 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 	int e;
 	int epfd;
 	struct epoll_event evlist[MAX_EVENTS];
+	bool preempted = false;
+	struct timespec preempt_check_tm = timespec_now();
+	struct timespec flush_deadline;
+
+	/*
+	 * If all tasks fit into active window anyway, compute their state right
+	 * away, so that all of them can share channels. Otherwise tasks started
+	 * together share them, see start_tasks.
+	 */
+	if (shardman_max_active_tasks == 0 || ntasks <= shardman_max_active_tasks)
+	{
+		for (i = 0; i < ntasks; i++)
+		{
+			if (tasks[i]->needs_init)
+				init_task(tasks[i]);
+		}
+	}
+	/* Order conflicting tasks; waiting ones don't join channels */
+	build_task_dag(tasks, ntasks);
+	/* Tasks copying between the same nodes share LR channel */
+	copy_channels = NIL;
+	setup_copy_channels(tasks, ntasks);
+	pending_sync_standbys = NIL;
+	node_copies = NIL;
+	ready_tasks = NIL;
+	admission_waiting = NIL;
+	copy_slots_freed = false;
+	active_tasks = 0;
+	exec_tasks_cxt = CurrentMemoryContext;
+
+	/* Progress of previous command's tasks is not interesting anymore */
+	if (ntasks > 0 && IS_COPY_TASK(tasks[0]))
+		void_spi("delete from shardman.copy_tasks;");
 
 	/*
-	 * In the beginning, all tasks are ready for execution, so we need to put
-	 * all tasks to the timeout_states list to invoke them.
+	 * In the beginning, all tasks not waiting for others are ready for
+	 * execution; start_tasks puts as many of them as allowed to the
+	 * timeout_states list to invoke them.
 	 */
 	for (i = 0; i < ntasks; i++)
 	{
-		/* TODO: make sure one part is touched only by one task */
+		tasks[i]->finished = false;
 		if (tasks[i]->res != TASK_FAILED)
 		{
-			CopyPartStateNode *cps_node = palloc(sizeof(CopyPartStateNode));
-			elog(DEBUG2, "Adding task %s to timeout lst", tasks[i]->part_name);
-			cps_node->cps = tasks[i];
-			slist_push_head(&timeout_states, &cps_node->list_node);
 			unfinished_tasks++;
+			report_progress(tasks[i], "waiting", 0, -1);
+			/* others are made ready by task_finished of the last blocker */
+			if (tasks[i]->nblockers == 0)
+				ready_tasks = lappend(ready_tasks, tasks[i]);
 		}
 	}
 
@@ -457,7 +1122,47 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 
 	while (unfinished_tasks > 0 && !signal_pending())
 	{
+		if (preemptible && !preempted &&
+			timespeccmp(preempt_check_tm, timespec_now()) <= 0)
+		{
+			preempt_check_tm =
+				timespec_now_plus_millis(PREEMPTION_CHECK_INTERVAL);
+			if (urgent_cmd_waiting())
+			{
+				shmn_elog(LOG, "More urgent command is waiting, not starting"
+						  " new tasks; %d tasks are in progress", active_tasks);
+				preempted = true;
+				/* postponed tasks won't use their channels */
+				for (i = 0; i < ntasks; i++)
+				{
+					if (!tasks[i]->started && !tasks[i]->finished)
+						cp_channel_depart(tasks[i]);
+				}
+			}
+		}
+		if (preempted && active_tasks == 0)
+			break;
+		/* Commands may run for long, don't stop noticing failed nodes */
+		if (monitor_timeout() == 0)
+		{
+			monitor_nodes();
+			abort_failed_over_tasks(tasks, ntasks, epfd, &timeout_states);
+		}
+		if (!preempted)
+			start_tasks(&timeout_states, &unfinished_tasks);
+		if (unfinished_tasks == 0)
+			break;
+
 		timeout = calc_timeout(&timeout_states);
+		if (pending_sync_standbys != NIL &&
+			(timeout == -1 || timeout > sync_standbys_flush_timeout()))
+			timeout = sync_standbys_flush_timeout();
+		if (monitor_timeout() != -1 &&
+			(timeout == -1 || timeout > monitor_timeout()))
+			timeout = monitor_timeout();
+		if (preemptible && !preempted &&
+			(timeout == -1 || timeout > PREEMPTION_CHECK_INTERVAL))
+			timeout = PREEMPTION_CHECK_INTERVAL;
 		e = epoll_wait(epfd, evlist, MAX_EVENTS, timeout);
 		if (e == -1)
 		{
@@ -467,6 +1172,16 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 				shmn_elog(FATAL, "epoll_wait failed, %s", strerror(e));
 		}
 
+		/* Run all tasks whose sockets have become readable */
+		for (i = 0; i < e; i++)
+		{
+			CopyPartState *cps = (CopyPartState *) evlist[i].data.ptr;
+
+			shmn_elog(DEBUG1, "%s is ready for exec after epoll", cps->part_name);
+			exec_task(cps);
+			task_iteration_done(cps, epfd, &timeout_states, &unfinished_tasks);
+		}
+
 		/* Run all tasks for which it is time to wake */
 		slist_foreach_modify(iter, &timeout_states)
 		{
@@ -477,8 +1192,16 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 
 			if (timespeccmp(cps->waketm, curtm) <= 0)
 			{
-				shmn_elog(DEBUG1, "%s is ready for exec", cps->part_name);
-				exec_task(cps);
+				if (cps->aborted)
+				{
+					cps->res = TASK_FAILED;
+					cps->exec_res = TASK_DONE;
+				}
+				else
+				{
+					shmn_elog(DEBUG1, "%s is ready for exec", cps->part_name);
+					exec_task(cps);
+				}
 				switch (cps->exec_res)
 				{
 					case TASK_WAKEMEUP:
@@ -493,7 +1216,7 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 
 					case TASK_DONE:
 						/* Task is done, decrement the counter */
-						unfinished_tasks--;
+						task_finished(cps, &timeout_states, &unfinished_tasks);
 						break;
 				}
 				/* If we are still here, remove node from timeouts_list */
@@ -502,7 +1225,35 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 				pfree(cps_node);
 			}
 		}
+
+		if (pending_sync_standbys != NIL && sync_standbys_flush_timeout() == 0)
+			flush_sync_standbys();
+	}
+
+	drop_abandoned_channels();
+
+	/*
+	 * Tasks don't finish before their standbys are flushed, but failed ones
+	 * might leave some while their channels are still there; add them, dead
+	 * ones are cleaned up by ensure_sync_standbys later.
+	 */
+	flush_deadline = timespec_now_plus_millis(SYNC_STANDBYS_TIMEOUT);
+	while (pending_sync_standbys != NIL && !signal_pending())
+	{
+		flush_sync_standbys();
+		if (pending_sync_standbys == NIL)
+			break;
+		if (timespeccmp(flush_deadline, timespec_now()) <= 0)
+		{
+			shmn_elog(WARNING, "Failed to add sync standbys of failed tasks"
+					  " on %d nodes in %d ms, giving up",
+					  list_length(pending_sync_standbys),
+					  SYNC_STANDBYS_TIMEOUT);
+			break;
+		}
+		pg_usleep(sync_standbys_flush_timeout() * 1000L);
 	}
+	abort_sync_standbys_flushes();
 
 	/* Free timeout_states list */
 	slist_foreach_modify(iter, &timeout_states)
@@ -512,38 +1263,347 @@ exec_tasks(CopyPartState **tasks, int ntasks)
 		slist_delete_current(&iter);
 		pfree(cps_node);
 	}
-	/* libpq manages memory on its own */
+	/* Finished tasks are already finalized; libpq manages memory on its own */
 	for (i = 0; i < ntasks; i++)
-		finalize_cp_state(tasks[i]);
+	{
+		if (tasks[i]->finished)
+			continue;
+		/* never started tasks have nothing to close */
+		if (!tasks[i]->needs_init)
+			finalize_cp_state(tasks[i]);
+		if (preempted && tasks[i]->res == TASK_IN_PROGRESS)
+			report_progress(tasks[i], "postponed", 0, -1);
+		else
+			report_result(tasks[i]);
+		if (tasks[i]->mcxt != NULL)
+		{
+			MemoryContextDelete(tasks[i]->mcxt);
+			tasks[i]->mcxt = NULL;
+		}
+	}
+	list_free(ready_tasks);
+	ready_tasks = NIL;
+	list_free(admission_waiting);
+	admission_waiting = NIL;
 	close(epfd);
+	return preempted;
 }
 
 /*
- * Calculate when we need to wake if no epoll events are happening.
- * Returned value is ready for epoll_wait.
+ * Put task executed after epoll event where it wants to be: back to epoll
+ * set, to the timeout list, or nowhere if it is done.
  */
-int
-calc_timeout(slist_head *timeout_states)
+void
+task_iteration_done(CopyPartState *cps, int epfd, slist_head *timeout_states,
+					int *unfinished_tasks)
 {
-	slist_iter iter;
-	struct timespec curtm;
-	int timeout;
-	/* could use timespec field for this, but that's more readable */
-	bool waketm_set = false;
-	struct timespec waketm; /* min of all waketms */
+	CopyPartStateNode *cps_node;
 
-	/* calc min waketm */
-	slist_foreach(iter, timeout_states)
+	switch (cps->exec_res)
 	{
-		CopyPartStateNode *cps_node =
-			slist_container(CopyPartStateNode, list_node, iter.cur);
-		CopyPartState *cps = cps_node->cps;
+		case TASK_WAKEMEUP:
+			cps_node = palloc(sizeof(CopyPartStateNode));
+			cps_node->cps = cps;
+			slist_push_head(timeout_states, &cps_node->list_node);
+			break;
 
-		/* If waketm is not set, what this node does in this list? */
-		Assert(!(cps->waketm.tv_sec == 0 && cps->waketm.tv_nsec == 0));
-		if (!waketm_set || timespeccmp(cps->waketm, waketm) < 0)
-		{
-			shmn_elog(DEBUG5, "Waketm updated, old %d s, new %d s",
+		case TASK_EPOLL:
+			epoll_subscribe(epfd, cps);
+			break;
+
+		case TASK_DONE:
+			task_finished(cps, timeout_states, unfinished_tasks);
+			break;
+	}
+}
+
+/*
+ * May the task start? Each node runs at most shardman.max_copies_per_node
+ * copies, as copy src or dst. Members of shared copy channel ride on the
+ * copy of channel owner and are not counted.
+ */
+bool
+task_admitted(CopyPartState *cps)
+{
+	int32 *nodes;
+	int nnodes;
+	int i;
+
+	if (cps->admitted)
+		return true;
+	if (shardman_max_copies_per_node == 0 || !IS_COPY_TASK(cps) ||
+		(cps->channel != NULL && cps->channel->owner != cps))
+	{
+		cps->admitted = true;
+		return true;
+	}
+
+	nnodes = task_copy_nodes(cps, &nodes);
+	for (i = 0; i < nnodes; i++)
+	{
+		if (get_node_copies(nodes[i])->ncopies >= shardman_max_copies_per_node)
+		{
+			shmn_elog(DEBUG1, "%s waits: node %d runs %d copies already",
+					  cps->part_name, nodes[i], shardman_max_copies_per_node);
+			pfree(nodes);
+			return false;
+		}
+	}
+	for (i = 0; i < nnodes; i++)
+		get_node_copies(nodes[i])->ncopies++;
+	pfree(nodes);
+	cps->admitted = true;
+	cps->holds_copy_slots = true;
+	return true;
+}
+
+/*
+ * Task is done: free its copy slots and let tasks waiting for them try again.
+ */
+void
+task_release(CopyPartState *cps)
+{
+	int32 *nodes;
+	int nnodes;
+	int i;
+
+	if (!cps->holds_copy_slots)
+		return;
+	nnodes = task_copy_nodes(cps, &nodes);
+	for (i = 0; i < nnodes; i++)
+		get_node_copies(nodes[i])->ncopies--;
+	pfree(nodes);
+	cps->holds_copy_slots = false;
+	copy_slots_freed = true;
+}
+
+/*
+ * Would some of the nodes which refused to admit the task refuse it again?
+ * Saves us from computing state of the task just to learn that.
+ */
+bool
+wait_nodes_saturated(CopyPartState *cps)
+{
+	int i;
+
+	if (shardman_max_copies_per_node == 0)
+		return false;
+	for (i = 0; i < cps->nwait_nodes; i++)
+	{
+		if (get_node_copies(cps->wait_nodes[i])->ncopies >=
+			shardman_max_copies_per_node)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Nodes the task copies data from or to, i.e. copy src and dsts. Returns
+ * their number, array is palloced.
+ */
+int
+task_copy_nodes(CopyPartState *cps, int32 **nodes)
+{
+	int nnodes = 0;
+
+	if (cps->type == COPYPARTTASK_FANOUT_REPLICAS)
+	{
+		FanoutReplicaState *frs = (FanoutReplicaState *) cps;
+		int i;
+
+		*nodes = palloc(sizeof(int32) * (frs->ndsts + 1));
+		for (i = 0; i < frs->ndsts; i++)
+			(*nodes)[nnodes++] = frs->dst_nodes[i];
+	}
+	else
+	{
+		*nodes = palloc(sizeof(int32) * 2);
+		(*nodes)[nnodes++] = cps->dst_node;
+	}
+	(*nodes)[nnodes++] = cps->copy_src_node;
+	return nnodes;
+}
+
+/*
+ * Copies counter of given node, created if needed.
+ */
+NodeCopies *
+get_node_copies(int32 node)
+{
+	ListCell *lc;
+	NodeCopies *nc;
+
+	foreach(lc, node_copies)
+	{
+		nc = (NodeCopies *) lfirst(lc);
+		if (nc->node == node)
+			return nc;
+	}
+	nc = palloc0(sizeof(NodeCopies));
+	nc->node = node;
+	node_copies = lappend(node_copies, nc);
+	return nc;
+}
+
+/*
+ * Does task copy data via its own LR copy channel, i.e. can it be moved to
+ * the shared one?
+ */
+bool
+uses_copy_channel(CopyPartState *cps)
+{
+	return cps->res != TASK_FAILED && cps->channel == NULL && !cps->file_copy &&
+		cps->nblockers == 0 && !cps->needs_init &&
+		(cps->type == COPYPARTTASK_MOVE_PRIMARY ||
+		 cps->type == COPYPARTTASK_MOVE_REPLICA ||
+		 cps->type == COPYPARTTASK_CREATE_REPLICA);
+}
+
+/*
+ * Group copy part tasks by (copy src, dst) pair and make each group of
+ * several tasks use one publication, repslot and subscription containing all
+ * their tables. The first task of the group creates the channel, others wait
+ * for it; each task then tracks sync of its own table and detaches it from
+ * the channel when done. The last one drops the channel. Members which fail
+ * or are postponed just go away, see cp_channel_depart.
+ */
+void
+setup_copy_channels(CopyPartState **tasks, int ntasks)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < ntasks; i++)
+	{
+		CopyPartState *owner = tasks[i];
+		CopyChannel *ch;
+		StringInfoData pub_tables;
+		StringInfoData dst_tables_sql;
+
+		if (!uses_copy_channel(owner))
+			continue;
+
+		/* count members */
+		ch = palloc0(sizeof(CopyChannel));
+		ch->owner = owner;
+		for (j = i; j < ntasks; j++)
+		{
+			if (uses_copy_channel(tasks[j]) &&
+				tasks[j]->copy_src_node == owner->copy_src_node &&
+				tasks[j]->dst_node == owner->dst_node)
+				ch->nmembers++;
+		}
+		if (ch->nmembers < 2)
+		{
+			pfree(ch);
+			continue;
+		}
+		copy_channels = lappend(copy_channels, ch);
+		ch->copy_src_connstr = pstrdup(owner->copy_src_connstr);
+		ch->dst_connstr = pstrdup(owner->dst_connstr);
+
+		/* batches started later might copy between the same nodes */
+		ch->logname = psprintf("shardman_copy_batch_%d_%d_%d",
+							   owner->copy_src_node, owner->dst_node,
+							   list_length(copy_channels));
+		ch->drop_sub_sql = psprintf("select shardman.eliminate_sub('%s');",
+									ch->logname);
+		ch->drop_pub_and_rs_sql = psprintf(
+			"select shardman.drop_repslot_and_pub('%s');", ch->logname);
+		initStringInfo(&pub_tables);
+		initStringInfo(&dst_tables_sql);
+		for (j = i; j < ntasks; j++)
+		{
+			CopyPartState *cps = tasks[j];
+
+			if (!(uses_copy_channel(cps) &&
+				  cps->copy_src_node == owner->copy_src_node &&
+				  cps->dst_node == owner->dst_node))
+				continue;
+
+			appendStringInfo(&pub_tables, "%s%s",
+							 pub_tables.len == 0 ? "" : ", ", cps->part_name);
+			appendStringInfo(&dst_tables_sql,
+							 " drop table if exists %s cascade;"
+							 " create table %s (like %s including defaults"
+							 " including indexes including storage);",
+							 cps->part_name, cps->part_name, cps->relation);
+			cps->channel = ch;
+			ch->members = lappend(ch->members, cps);
+			/* member rides on the owner's copy */
+			if (cps != owner)
+				task_release(cps);
+		}
+
+		/* Now that we know all the tables, set channel-wide strings */
+		for (j = i; j < ntasks; j++)
+		{
+			CopyPartState *cps = tasks[j];
+
+			if (cps->channel != ch)
+				continue;
+
+			cps->logname = ch->logname;
+			cps->dst_drop_sub_sql = psprintf(
+				"drop subscription if exists %s cascade;", ch->logname);
+			cps->src_create_pub_and_rs_sql = psprintf(
+				"drop publication if exists %s cascade;"
+				"create publication %s for table %s;"
+				"select shardman.drop_repslot('%s');"
+				"select pg_create_logical_replication_slot('%s', 'pgoutput');",
+				ch->logname, ch->logname, pub_tables.data, ch->logname,
+				ch->logname);
+			cps->dst_create_tab_and_sub_sql = psprintf(
+				"%s"
+				" drop subscription if exists %s cascade;"
+				" create subscription %s connection '%s' publication %s with"
+				"   (create_slot = false, slot_name = '%s',"
+				"    synchronous_commit = local);",
+				dst_tables_sql.data,
+				ch->logname,
+				ch->logname, cps->copy_src_connstr, ch->logname, ch->logname);
+			/* we are interested only in our table */
+			cps->substate_sql = psprintf(
+				"select srsubstate, srrelid from pg_subscription_rel srel join"
+				" pg_subscription s on srel.srsubid = s.oid where subname = '%s'"
+				" and srrelid = '%s'::regclass;", ch->logname, cps->part_name);
+			cps->received_lsn_sql = received_lsn_sql(ch->logname);
+			cps->leave_channel_sql = psprintf(
+				"select shardman.drop_table_from_pub('%s', '%s');",
+				ch->logname, cps->part_name);
+		}
+		shmn_elog(DEBUG1, "%d tasks will copy data %d -> %d via channel %s",
+				  ch->nmembers, owner->copy_src_node, owner->dst_node,
+				  ch->logname);
+	}
+}
+
+/*
+ * Calculate when we need to wake if no epoll events are happening.
+ * Returned value is ready for epoll_wait.
+ */
+int
+calc_timeout(slist_head *timeout_states)
+{
+	slist_iter iter;
+	struct timespec curtm;
+	int timeout;
+	/* could use timespec field for this, but that's more readable */
+	bool waketm_set = false;
+	struct timespec waketm; /* min of all waketms */
+
+	/* calc min waketm */
+	slist_foreach(iter, timeout_states)
+	{
+		CopyPartStateNode *cps_node =
+			slist_container(CopyPartStateNode, list_node, iter.cur);
+		CopyPartState *cps = cps_node->cps;
+
+		/* If waketm is not set, what this node does in this list? */
+		Assert(!(cps->waketm.tv_sec == 0 && cps->waketm.tv_nsec == 0));
+		if (!waketm_set || timespeccmp(cps->waketm, waketm) < 0)
+		{
+			shmn_elog(DEBUG5, "Waketm updated, old %d s, new %d s",
 					  waketm_set ? (int) waketm.tv_sec : 0,
 					  (int) cps->waketm.tv_sec);
 			waketm = cps->waketm;
@@ -580,17 +1640,31 @@ epoll_subscribe(int epfd, CopyPartState *cps)
 	int e;
 
 	ev.data.ptr = cps;
-	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.events = (cps->epoll_out ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
 	Assert(cps->fd_to_epoll != -1);
 	if (cps->fd_to_epoll == cps->fd_in_epoll_set)
 	{
-		if ((e = epoll_ctl(epfd, EPOLL_CTL_MOD, cps->fd_to_epoll, &ev)) == -1)
-			shmn_elog(FATAL, "epoll_ctl failed, %s", strerror(e));
+		e = epoll_ctl(epfd, EPOLL_CTL_MOD, cps->fd_to_epoll, &ev);
+		/*
+		 * If connection was reestablished, the same fd number might belong
+		 * to another socket which is not in the set yet, so fall back to ADD.
+		 */
+		if (e == -1 && errno != ENOENT)
+			shmn_elog(FATAL, "epoll_ctl failed, %s", strerror(errno));
+		if (e == -1)
+			cps->fd_in_epoll_set = -1;
 	}
-	else
+	if (cps->fd_to_epoll != cps->fd_in_epoll_set)
 	{
-		if ((e = epoll_ctl(epfd, EPOLL_CTL_ADD, cps->fd_to_epoll, &ev)) == -1)
-			shmn_elog(FATAL, "epoll_ctl failed, %s", strerror(e));
+		e = epoll_ctl(epfd, EPOLL_CTL_ADD, cps->fd_to_epoll, &ev);
+		/*
+		 * Task waiting on several sockets in turn (see fr_relay) might have
+		 * registered this one earlier.
+		 */
+		if (e == -1 && errno == EEXIST)
+			e = epoll_ctl(epfd, EPOLL_CTL_MOD, cps->fd_to_epoll, &ev);
+		if (e == -1)
+			shmn_elog(FATAL, "epoll_ctl failed, %s", strerror(errno));
 		cps->fd_in_epoll_set = cps->fd_to_epoll;
 	}
 	shmn_elog(DEBUG1, "socket for task %s added to epoll", cps->part_name);
@@ -602,6 +1676,12 @@ epoll_subscribe(int epfd, CopyPartState *cps)
 void
 exec_task(CopyPartState *cps)
 {
+	MemoryContext oldcxt = CurrentMemoryContext;
+
+	if (cps->mcxt != NULL)
+		MemoryContextSwitchTo(cps->mcxt);
+	/* Task waits for readability unless it asks otherwise */
+	cps->epoll_out = false;
 	switch (cps->type)
 	{
 		case COPYPARTTASK_CREATE_REPLICA:
@@ -612,7 +1692,24 @@ exec_task(CopyPartState *cps)
 		case COPYPARTTASK_MOVE_REPLICA:
 			exec_move_part((MovePartState *) cps);
 			break;
+
+		case COPYPARTTASK_FANOUT_REPLICAS:
+			exec_fanout_replicas((FanoutReplicaState *) cps);
+			break;
+
+		case COPYPARTTASK_ADD_NODE:
+			exec_add_node((AddNodeState *) cps);
+			break;
+
+		case COPYPARTTASK_RM_NODE:
+			exec_rm_node((RmNodeState *) cps);
+			break;
+
+		case COPYPARTTASK_HASH_PARTITION:
+			exec_hash_partition((HashPartitionState *) cps);
+			break;
 	}
+	MemoryContextSwitchTo(oldcxt);
 }
 
 /*
@@ -620,7 +1717,8 @@ exec_task(CopyPartState *cps)
  *
  * Maximum 4 nodes are actively involved here: src, dst, previous replica (or
  * primary) and next replica. The whole task workflow:
- * - copy part
+ * - copy part, warming up dst buffer cache with blocks cached on src
+ *   before src is made read-only
  * - create pub, repslot, turn on sync rep for prev -> dst channel
  * - create pub, repslot, turn on sync rep for dst -> next channel
  * - create sub for prev -> dst channel
@@ -639,11 +1737,23 @@ exec_move_part(MovePartState *mps)
 	if (mps->cp.curstep != COPYPART_DONE)
 		return;
 
-	if (((mps->next_node != SHMN_INVALID_NODE_ID) ||
-		 mps->prev_node != SHMN_INVALID_NODE_ID) && (mp_rebuild_lr(mps) == -1))
+	if (!mps->cp.lr_rebuilt)
+	{
+		if (cp_leave_channel((CopyPartState *) mps) == -1)
+			return;
+
+		if (((mps->nnext > 0) ||
+			 mps->prev_node != SHMN_INVALID_NODE_ID) &&
+			(mp_rebuild_lr(mps) == -1))
+			return;
+		mps->cp.lr_rebuilt = true;
+	}
+	if (await_sync_standbys((CopyPartState *) mps) == -1)
 		return;
 
 	void_spi(mps->cp.update_metadata_sql);
+	/* Let src learn that the part has gone */
+	reset_pqconn(&mps->cp.fence_conn);
 	shmn_elog(LOG, "Part move %s: %d -> %d successfully done",
 			  mps->cp.part_name, mps->cp.src_node, mps->cp.dst_node);
 	mps->cp.res = TASK_SUCCESS;
@@ -651,150 +1761,1740 @@ exec_move_part(MovePartState *mps)
 }
 
 /*
- * Execute given statement in separate transactions. In case of any failure
- * return false, destroy connection and configure_retry on given cps.
- * This function is used only for internal SQL, where we guarantee no ';'
- * in statements.
- */
-static bool remote_exec(PGconn** conn, CopyPartState *cps, char* stmts)
-{
-	char *sql = stmts;
-	char *sep;
-	PGresult *res;
-	while ((sep = strchr(sql, ';')) != NULL) {
-		*sep = '\0';
-		res = PQexec(*conn, sql);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK &&
-			PQresultStatus(res) != PGRES_COMMAND_OK)
-		{
-			shmn_elog(LOG, "REMOTE_EXEC: execution of query '%s' failed for paritions %s: %s",
-					  sql, cps->part_name, PQerrorMessage(*conn));
-			*sep = ';';
-			reset_pqconn_and_res(conn, res);
-			configure_retry(cps, shardman_cmd_retry_naptime);
-			return false;
-		}
-		PQclear(res);
-		*sep = ';';
-		sql = sep + 1;
-	}
-	return true;
-}
-
-/*
- * Reconfigure LR channel for moved primary: prev to moved, moved to next or
- * both, if they exist.
- *
- * We execute code on nodes in the following order: prev, dst, next, so that
- * every time we create sub, pub already exists.
+ * Run sql on connstr node without blocking, for tasks whose every step is
+ * one query. sql is sent if *sent is false, it may be NULL otherwise. Returns
+ * 0 and the result of the last statement in *res (caller must PQclear it)
+ * if all statements succeeded. Otherwise returns 1 if we are waiting for the
+ * result (exec_res is TASK_EPOLL) or -1 if something failed and the task is
+ * configured to retry; then query will be sent again on next call.
+ * Such tasks (add node, hash partition) are not preemptible, the command
+ * holds the lord until they are done; see readme.
  */
 int
-mp_rebuild_lr(MovePartState *mps)
+exec_remote_query(CopyPartState *cps, PGconn **conn, const char *connstr,
+				  const char *sql, bool *sent, PGresult **res)
 {
-	if (mps->prev_node != SHMN_INVALID_NODE_ID)
+	PGresult *r;
+	bool failed = false;
+
+	*res = NULL;
+	if (!*sent)
 	{
-		if (ensure_pqconn(&mps->prev_conn, mps->prev_connstr,
-					   (CopyPartState *) mps) == -1)
+		if (ensure_pqconn(conn, connstr, cps) == -1)
 			return -1;
-		if (!remote_exec(&mps->prev_conn, (CopyPartState *) mps, mps->prev_sql))
+		if (PQsendQuery(*conn, sql) != 1)
+		{
+			shmn_elog(NOTICE, "Failed to send query to %s: %s", connstr,
+					  PQerrorMessage(*conn));
+			reset_pqconn(conn);
+			configure_backoff(cps, RETRY_CONN);
 			return -1;
-		shmn_elog(DEBUG1, "mp %s: LR conf on prev done", mps->cp.part_name);
+		}
+		*sent = true;
 	}
 
-	if (ensure_pqconn_cp((CopyPartState *) mps,
-						 ENSURE_PQCONN_DST) == -1)
-		return -1;
-	if (!remote_exec(&mps->cp.dst_conn, (CopyPartState *) mps, mps->dst_sql))
+	if (PQconsumeInput(*conn) == 0)
+	{
+		shmn_elog(NOTICE, "Connection to %s failed: %s", connstr,
+				  PQerrorMessage(*conn));
+		*sent = false;
+		reset_pqconn(conn);
+		configure_backoff(cps, RETRY_CONN);
 		return -1;
-	shmn_elog(DEBUG1, "mp %s: LR conf on dst done", mps->cp.part_name);
-
-	if (mps->prev_node != SHMN_INVALID_NODE_ID)
+	}
+	if (PQisBusy(*conn))
 	{
-		if (shardman_sync_replicas &&
-			!remote_exec(&mps->prev_conn, (CopyPartState *) mps,
-						 mps->sync_standby_prev_sql))
-			return -1;
-		shmn_elog(DEBUG1, "mp %s: make sync standby on prev", mps->cp.part_name);
+		cps->fd_to_epoll = PQsocket(*conn);
+		cps->exec_res = TASK_EPOLL;
+		return 1;
 	}
+	*sent = false;
 
-	if (mps->next_node != SHMN_INVALID_NODE_ID)
+	/* The result of the last statement matters, but errors of any */
+	while ((r = PQgetResult(*conn)) != NULL)
 	{
-		if (ensure_pqconn(&mps->next_conn, mps->next_connstr,
-						  (CopyPartState *) mps) == -1)
-			return -1;
-		if (!remote_exec(&mps->next_conn, (CopyPartState *) mps, mps->next_sql))
-			return -1;
-		shmn_elog(DEBUG1, "mp %s: LR conf on next done", mps->cp.part_name);
-
-		if (shardman_sync_replicas &&
-			!remote_exec(&mps->cp.dst_conn, (CopyPartState *) mps,
-						 mps->sync_standby_dst_sql))
-			return -1;
+		if (PQresultStatus(r) != PGRES_COMMAND_OK &&
+			PQresultStatus(r) != PGRES_TUPLES_OK)
+		{
+			shmn_elog(NOTICE, "%s %s: query failed on %s: %s",
+					  task_type_name(cps->type), cps->part_name, connstr,
+					  PQresultErrorMessage(r));
+			failed = true;
+		}
+		PQclear(*res);
+		*res = r;
+	}
+	if (failed)
+	{
+		PQclear(*res);
+		*res = NULL;
+		configure_backoff(cps, RETRY_QUERY);
+		return -1;
 	}
-
 	return 0;
 }
 
 /*
- * One iteration of add replica task execution.
- *
- * Only two nodes involved here, old and new tail of replica chain.
+ * One iteration of add node task. Each step sends one query to the node and
+ * waits for the result via epoll, so that any number of nodes is
+ * bootstrapped at once:
+ * - learn whether pg_shardman is installed on the node and, if yes, whether
+ *   it is already in the cluster;
+ * - reinstall the extension to reset its state;
+ * - create metadata repslot on lord and subscription on the node, set node
+ *   id on it;
+ * - wait until initial metadata tablesync is done, otherwise e.g. UPDATEs of
+ *   partitions table might be missed and triggers on the node wouldn't fire.
+ * All the steps are idempotent (subscribing drops sub left by previous
+ * attempt), if anything fails, the step is retried. The node is added to
+ * shardman.nodes by the command after all tasks end; it drops repslots of
+ * nodes which failed.
  */
 void
-exec_create_replica(CreateReplicaState *crs)
+exec_add_node(AddNodeState *ans)
 {
-	exec_cp((CopyPartState *) crs);
-	if (crs->cp.curstep != COPYPART_DONE)
-		return;
+	CopyPartState *cps = (CopyPartState *) ans;
+	PGresult *res;
+	int rc;
 
-	if (cr_rebuild_lr(crs) == -1)
-		return;
+	while (ans->step != ADDNODE_DONE)
+	{
+		/*
+		 * Lord's side of metadata channel goes first. On retry, the slot
+		 * made by previous attempt is reused: sub might still hold it.
+		 */
+		if (!ans->sent && ans->step == ADDNODE_SUBSCRIBE)
+			void_spi(psprintf(
+						 "select shardman.ensure_repslot('shardman_meta_sub_%d');",
+						 ans->node_id));
+		rc = exec_remote_query(cps, &ans->conn, ans->connstr,
+							   ans->sent ? NULL : an_query(ans), &ans->sent,
+							   &res);
+		if (rc != 0)
+			return;
+		rc = an_handle_result(ans, res);
+		PQclear(res);
+		if (rc == 1) /* wait */
+			return;
+		if (cps->res == TASK_FAILED)
+		{
+			cps->exec_res = TASK_DONE;
+			return;
+		}
+	}
 
-	void_spi(crs->cp.update_metadata_sql);
-	shmn_elog(LOG, "Creating replica %s on node %d successfully done",
-			  crs->cp.part_name, crs->cp.dst_node);
-	crs->cp.res = TASK_SUCCESS;
-	crs->cp.exec_res = TASK_DONE;
+	shmn_elog(LOG, "add_node %s: node bootstrapped with id %d", ans->connstr,
+			  ans->node_id);
+	reset_pqconn(&ans->conn);
+	cps->res = TASK_SUCCESS;
+	cps->exec_res = TASK_DONE;
 }
 
 /*
- * Reconfigure LR channels for freshly created replica.
- *
- * TODO: simplify things and drop cp channel in triggers, or better let cp
- * part code itself do that.
- *
- * Work to do in general is described below. We execute them in steps written
- * in parentheses so that every time we create sub, pub is already exist and
- * every time we drop pub, sub is already dropped.
+ * One iteration of rm node task. Node disables its meta subscription on
+ * status update; once its walsender exits, acknowledging that, we drop the
+ * slot. If it is still held after RM_NODE_RELEASE_TIMEOUT, we kill the
+ * walsender on each poll. It is extremely unlikely that node still keeps
+ * reconnecting after RM_NODE_FIRE_TIMEOUT, ignoring our node status update;
+ * if it does, the task fails, and so does the command, which can be retried.
+ * Slot is polled via SPI, other tasks and commands run meanwhile.
  */
-int
-cr_rebuild_lr(CreateReplicaState *crs)
+void
+exec_rm_node(RmNodeState *rns)
 {
-	if (ensure_pqconn_cp((CopyPartState *) crs,
-						 ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
-		return -1;
+	CopyPartState *cps = (CopyPartState *) rns;
+	int waited = timespec_diff_millis(timespec_now(), rns->started);
+	char *sql;
 
-	if (!remote_exec(&crs->cp.dst_conn, (CopyPartState *) crs,
-					 crs->drop_cp_sub_sql))
-		return -1;
-	shmn_elog(DEBUG1, "cr %s: drop_cp_sub done", crs->cp.part_name);
+	/* released or dropped by somebody else? */
+	sql = psprintf("select 1 where shardman.try_drop_repslot('%s');",
+				   rns->slot_name);
+	if (void_spi(sql) > 0)
+	{
+		pfree(sql);
+		shmn_elog(DEBUG1, "Repslot %s dropped after %d ms", rns->slot_name,
+				  waited);
+		cps->res = TASK_SUCCESS;
+		cps->exec_res = TASK_DONE;
+		return;
+	}
+	pfree(sql);
 
-	if (!remote_exec(&crs->cp.src_conn, (CopyPartState *) crs, crs->create_data_pub_sql))
+	if (waited > RM_NODE_FIRE_TIMEOUT)
+	{
+		shmn_elog(WARNING, "Repslot %s is still held after %d ms, not"
+				  " dropping it", rns->slot_name, waited);
+		cps->res = TASK_FAILED;
+		cps->exec_res = TASK_DONE;
+		return;
+	}
+	if (waited > RM_NODE_RELEASE_TIMEOUT)
+	{
+		shmn_elog(DEBUG1, "Killing walsender for slot %s", rns->slot_name);
+		sql = psprintf("select shardman.terminate_repslot_walsender('%s');",
+					   rns->slot_name);
+		void_spi(sql);
+		pfree(sql);
+	}
+	configure_poll(cps, -1);
+}
+
+/*
+ * One iteration of hash partition task: send partitioning sql to the node
+ * and remember sql to create the table returned by it. Retried until success
+ * or cancellation.
+ */
+void
+exec_hash_partition(HashPartitionState *hps)
+{
+	CopyPartState *cps = (CopyPartState *) hps;
+	PGresult *res;
+
+	/* TODO: if lord fails after the node partitioned the table, after
+	 * restart it will try to partition table again and fail. We should check
+	 * if the table is already partitioned and don't do that again, except
+	 * for, probably, the case when it was partitioned by someone else.
+	 */
+	if (exec_remote_query(cps, &hps->conn, hps->connstr, hps->sql,
+						  &hps->sent, &res) != 0)
+		return;
+	hps->create_table_sql = pstrdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+	reset_pqconn(&hps->conn);
+	cps->res = TASK_SUCCESS;
+	cps->exec_res = TASK_DONE;
+}
+
+/*
+ * Query of the current add node step.
+ */
+char *
+an_query(AddNodeState *ans)
+{
+	switch (ans->step)
+	{
+		case ADDNODE_CHECK_INSTALLED:
+			return "select installed_version from pg_available_extensions"
+				" where name = 'pg_shardman';";
+		case ADDNODE_CHECK_ID:
+			return "select shardman.my_id();";
+		case ADDNODE_REINSTALL:
+			return "drop extension if exists pg_shardman;"
+				" create extension pg_shardman;";
+		case ADDNODE_SUBSCRIBE:
+			/* sub might be left by previous attempt whose reply was lost */
+			return psprintf(
+				"select shardman.eliminate_sub('shardman_meta_sub');"
+				" create subscription shardman_meta_sub connection '%s'"
+				" publication shardman_meta_pub with (create_slot = false,"
+				" slot_name = 'shardman_meta_sub_%d');"
+				" select shardman.set_my_id(%d);",
+				shardman_shardlord_connstring, ans->node_id, ans->node_id);
+		case ADDNODE_ALTER_SYSTEM:
+			return psprintf("alter system set shardman.my_id to %d;",
+							ans->node_id);
+		case ADDNODE_RELOAD:
+			return "select pg_reload_conf();";
+		case ADDNODE_WAIT_SYNC:
+			return GET_SUBSTATE_SQL("shardman_meta_sub");
+		case ADDNODE_DONE:
+			break;
+	}
+	Assert(false);
+	return NULL;
+}
+
+/*
+ * Process successful result of the current add node step and move to the
+ * next one. Returns 0 if we can go on right away (also if task has failed),
+ * 1 if the task is configured to wait.
+ */
+int
+an_handle_result(AddNodeState *ans, PGresult *res)
+{
+	CopyPartState *cps = (CopyPartState *) ans;
+	int i;
+
+	switch (ans->step)
+	{
+		case ADDNODE_CHECK_INSTALLED:
+			if (PQntuples(res) == 1 && !PQgetisnull(res, 0, 0))
+				ans->step = ADDNODE_CHECK_ID;
+			else
+				ans->step = ADDNODE_REINSTALL;
+			break;
+
+		case ADDNODE_CHECK_ID:
+			/* Node is in cluster. Was it there before we started adding? */
+			if (!PQgetisnull(res, 0, 0))
+			{
+				int32 node_id = atoi(PQgetvalue(res, 0, 0));
+
+				if (node_in_cluster(node_id))
+				{
+					shmn_elog(WARNING, "node %d with connstring %s is already"
+							  " in cluster, won't add it.", node_id,
+							  ans->connstr);
+					cps->res = TASK_FAILED;
+					return 0;
+				}
+				ans->node_id = node_id;
+			}
+			ans->step = ADDNODE_REINSTALL;
+			break;
+
+		case ADDNODE_REINSTALL:
+			ans->step = ADDNODE_SUBSCRIBE;
+			break;
+
+		case ADDNODE_SUBSCRIBE:
+			ans->step = ADDNODE_ALTER_SYSTEM;
+			break;
+
+		case ADDNODE_ALTER_SYSTEM:
+			ans->step = ADDNODE_RELOAD;
+			break;
+
+		case ADDNODE_RELOAD:
+			ans->step = ADDNODE_WAIT_SYNC;
+			break;
+
+		case ADDNODE_WAIT_SYNC:
+			for (i = 0; i < PQntuples(res); i++)
+			{
+				char subrelstate = PQgetvalue(res, i, 0)[0];
+
+				if (subrelstate != SUBREL_STATE_READY)
+				{
+					shmn_elog(DEBUG1,
+							  "add_node %s: init sync is not yet finished"
+							  " for rel %s, its state is %c", ans->connstr,
+							  PQgetvalue(res, i, 1), subrelstate);
+					configure_poll(cps, -1);
+					return 1;
+				}
+			}
+			ans->step = ADDNODE_DONE;
+			break;
+
+		case ADDNODE_DONE:
+			Assert(false);
+	}
+	return 0;
+}
+
+/*
+ * Make each task wait for the previous one touching the same partition.
+ * Tasks are keyed by part_name, which is also set by tasks not copying
+ * partitions (connstr of added node, sharded relation); for them there is
+ * nothing to re-check later, so duplicates are just failed.
+ */
+void
+build_task_dag(CopyPartState **tasks, int ntasks)
+{
+	TaskKey *keys = palloc(sizeof(TaskKey) * Max(ntasks, 1));
+	int nkeys = 0;
+	int i;
+
+	for (i = 0; i < ntasks; i++)
+	{
+		tasks[i]->nblockers = 0;
+		tasks[i]->dependents = NIL;
+		if (tasks[i]->res != TASK_FAILED && tasks[i]->part_name != NULL)
+		{
+			keys[nkeys].cps = tasks[i];
+			keys[nkeys++].idx = i;
+		}
+	}
+	qsort(keys, nkeys, sizeof(TaskKey), task_key_cmp);
+
+	for (i = 1; i < nkeys; i++)
+	{
+		CopyPartState *prev = keys[i - 1].cps;
+		CopyPartState *cps = keys[i].cps;
+
+		if (strcmp(prev->part_name, cps->part_name) != 0)
+			continue;
+		if (!IS_COPY_TASK(cps))
+		{
+			shmn_elog(WARNING, "Duplicate %s task for %s, skipping it",
+					  task_type_name(cps->type), cps->part_name);
+			cps->res = TASK_FAILED;
+			/* keep chaining to the one which runs */
+			keys[i].cps = prev;
+			continue;
+		}
+		shmn_elog(DEBUG1, "%s task for %s waits for %s task on it",
+				  task_type_name(cps->type), cps->part_name,
+				  task_type_name(prev->type));
+		prev->dependents = lappend(prev->dependents, cps);
+		cps->nblockers++;
+	}
+	pfree(keys);
+}
+
+/*
+ * Order by partition, then by position in tasks array.
+ */
+int
+task_key_cmp(const void *a, const void *b)
+{
+	const TaskKey *ka = (const TaskKey *) a;
+	const TaskKey *kb = (const TaskKey *) b;
+	int c = strcmp(ka->cps->part_name, kb->cps->part_name);
+
+	if (c != 0)
+		return c;
+	return ka->idx - kb->idx;
+}
+
+/*
+ * Compute task state from current metadata: either it was only planned, or
+ * tasks we waited for have changed metadata it was computed from. Execution
+ * state and dependents are kept.
+ */
+void
+init_task(CopyPartState *cps)
+{
+	const char *part_name = cps->part_name;
+	int32 src_node = cps->src_node;
+	int32 dst_node = cps->dst_node;
+	List *dependents = cps->dependents;
+	MemoryContext mcxt = cps->mcxt;
+	bool aborted = cps->aborted;
+
+	shmn_elog(DEBUG1, "Preparing %s task for %s", task_type_name(cps->type),
+			  part_name);
+	switch (cps->type)
+	{
+		case COPYPARTTASK_MOVE_PRIMARY:
+		case COPYPARTTASK_MOVE_REPLICA:
+			memset(cps, 0, sizeof(MovePartState));
+			init_mp_state((MovePartState *) cps, part_name, src_node,
+						  dst_node);
+			break;
+
+		case COPYPARTTASK_CREATE_REPLICA:
+			memset(cps, 0, sizeof(CreateReplicaState));
+			init_cr_state((CreateReplicaState *) cps, part_name, dst_node);
+			break;
+
+		case COPYPARTTASK_FANOUT_REPLICAS:
+			{
+				FanoutReplicaState *frs = (FanoutReplicaState *) cps;
+				int32 *dst_nodes = frs->dst_nodes;
+				int ndsts = frs->ndsts;
+
+				memset(frs, 0, sizeof(FanoutReplicaState));
+				init_fr_state(frs, part_name, dst_nodes, ndsts);
+				break;
+			}
+
+		default:
+			/* only copies are planned and chained, see build_task_dag */
+			Assert(false);
+	}
+	cps->dependents = dependents;
+	cps->mcxt = mcxt;
+	cps->aborted = aborted;
+}
+
+/*
+ * Put ready tasks in progress while there is room in active tasks window.
+ * Only tasks admitted to their nodes take a slot, see task_admitted; others
+ * wait in admission_waiting, so that tasks on saturated nodes don't keep
+ * tasks on other nodes from starting. Each copy task gets memory context of
+ * its own, which is deleted when it is done. Lazily started task has to
+ * compute its state to learn its nodes; if it must wait, the state is freed
+ * again and only the nodes are remembered. Lazily started tasks admitted
+ * together share copy channels, as eagerly initialized ones do.
+ */
+void
+start_tasks(slist_head *timeout_states, int *unfinished_tasks)
+{
+	List *batch = NIL;
+
+	if (copy_slots_freed)
+	{
+		ready_tasks = list_concat(admission_waiting, ready_tasks);
+		admission_waiting = NIL;
+		copy_slots_freed = false;
+	}
+
+	while (ready_tasks != NIL &&
+		   (shardman_max_active_tasks == 0 ||
+			active_tasks < shardman_max_active_tasks))
+	{
+		CopyPartState *cps = (CopyPartState *) linitial(ready_tasks);
+		CopyPartStateNode *cps_node;
+		bool lazy = cps->needs_init;
+
+		ready_tasks = list_delete_first(ready_tasks);
+		if (!cps->aborted && wait_nodes_saturated(cps))
+		{
+			admission_waiting = lappend(admission_waiting, cps);
+			continue;
+		}
+		if (IS_COPY_TASK(cps) && cps->mcxt == NULL)
+			cps->mcxt = AllocSetContextCreate(exec_tasks_cxt,
+											  "shardman copy task",
+											  ALLOCSET_DEFAULT_SIZES);
+		if (cps->needs_init)
+		{
+			MemoryContext oldcxt = MemoryContextSwitchTo(cps->mcxt);
+
+			if (cps->wait_nodes != NULL)
+				pfree(cps->wait_nodes);
+			init_task(cps);
+			MemoryContextSwitchTo(oldcxt);
+			if (cps->res == TASK_FAILED)
+			{
+				task_finished(cps, timeout_states, unfinished_tasks);
+				continue;
+			}
+		}
+		/* Aborted task just fails, see the timeout loop */
+		if (!cps->aborted && !task_admitted(cps))
+		{
+			if (lazy)
+			{
+				MemoryContext oldcxt = MemoryContextSwitchTo(exec_tasks_cxt);
+
+				cps->nwait_nodes = task_copy_nodes(cps, &cps->wait_nodes);
+				MemoryContextSwitchTo(oldcxt);
+				MemoryContextDelete(cps->mcxt);
+				cps->mcxt = NULL;
+				cps->needs_init = true;
+			}
+			admission_waiting = lappend(admission_waiting, cps);
+			continue;
+		}
+		active_tasks++;
+		elog(DEBUG2, "Adding task %s to timeout lst", cps->part_name);
+		cps->started = true;
+		cps->waketm = timespec_now();
+		cps_node = palloc(sizeof(CopyPartStateNode));
+		cps_node->cps = cps;
+		slist_push_head(timeout_states, &cps_node->list_node);
+		if (lazy && !cps->aborted)
+			batch = lappend(batch, cps);
+	}
+
+	/* Nothing is executed yet, so they may still switch to shared channel */
+	if (list_length(batch) > 1)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(exec_tasks_cxt);
+		CopyPartState **batch_tasks =
+			palloc(sizeof(CopyPartState *) * list_length(batch));
+		ListCell *lc;
+		int i = 0;
+
+		foreach(lc, batch)
+			batch_tasks[i++] = (CopyPartState *) lfirst(lc);
+		setup_copy_channels(batch_tasks, i);
+		pfree(batch_tasks);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	list_free(batch);
+}
+
+/*
+ * Fail tasks involving nodes whose failover monitor_nodes has registered:
+ * they would retry until the node is back, holding up the command and the
+ * failover waiting behind it. Running tasks are woken to fail, so that those
+ * waiting for a dead socket don't wait forever; tasks not started yet fail
+ * when they get a slot.
+ */
+void
+abort_failed_over_tasks(CopyPartState **tasks, int ntasks, int epfd,
+						slist_head *timeout_states)
+{
+	int i;
+
+	for (i = 0; i < ntasks; i++)
+	{
+		CopyPartState *cps = tasks[i];
+		slist_iter iter;
+		bool sleeping = false;
+		CopyPartStateNode *cps_node;
+
+		if (cps->finished || cps->aborted || cps->res == TASK_FAILED ||
+			!task_on_failed_node(cps))
+			continue;
+		shmn_elog(WARNING, "%s %s: its node is failed over, aborting the task",
+				  task_type_name(cps->type), cps->part_name);
+		cps->aborted = true;
+		if (!cps->started)
+		{
+			/* it might wait for admission, let it fail right away */
+			copy_slots_freed = true;
+			continue;
+		}
+
+		/* Running task either sleeps till waketm or waits for its socket */
+		slist_foreach(iter, timeout_states)
+		{
+			cps_node = slist_container(CopyPartStateNode, list_node, iter.cur);
+			if (cps_node->cps == cps)
+			{
+				sleeping = true;
+				break;
+			}
+		}
+		if (!sleeping)
+		{
+			if (cps->fd_in_epoll_set != -1)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, cps->fd_in_epoll_set, NULL);
+			cps->fd_in_epoll_set = -1;
+			cps_node = palloc(sizeof(CopyPartStateNode));
+			cps_node->cps = cps;
+			slist_push_head(timeout_states, &cps_node->list_node);
+		}
+		cps->waketm = timespec_now();
+	}
+}
+
+/*
+ * Does the task involve any node being failed over?
+ */
+bool
+task_on_failed_node(CopyPartState *cps)
+{
+	int i;
+
+	switch (cps->type)
+	{
+		case COPYPARTTASK_MOVE_PRIMARY:
+		case COPYPARTTASK_MOVE_REPLICA:
+			{
+				MovePartState *mps = (MovePartState *) cps;
+
+				if (node_failed_over(mps->prev_node))
+					return true;
+				for (i = 0; i < mps->nnext; i++)
+				{
+					if (node_failed_over(mps->next_nodes[i]))
+						return true;
+				}
+				break;
+			}
+
+		case COPYPARTTASK_FANOUT_REPLICAS:
+			{
+				FanoutReplicaState *frs = (FanoutReplicaState *) cps;
+
+				for (i = 0; i < frs->ndsts; i++)
+				{
+					if (node_failed_over(frs->dst_nodes[i]))
+						return true;
+				}
+				break;
+			}
+
+		case COPYPARTTASK_HASH_PARTITION:
+			return node_failed_over(((HashPartitionState *) cps)->node_id);
+
+		default:
+			/* added node is not monitored yet; rm node is lord-only */
+			break;
+	}
+	return node_failed_over(cps->src_node) ||
+		node_failed_over(cps->dst_node) ||
+		node_failed_over(cps->copy_src_node);
+}
+
+/*
+ * Task is done: close its connections, report result, free its memory and
+ * let tasks which waited for it start. They start even if it failed, since
+ * its partition might still be there; their state is computed again anyway.
+ */
+void
+task_finished(CopyPartState *cps, slist_head *timeout_states,
+			  int *unfinished_tasks)
+{
+	ListCell *lc;
+
+	(*unfinished_tasks)--;
+	if (cps->started)
+		active_tasks--;
+	/* Failed task doesn't wait for its sync standbys anymore */
+	if (cps->sync_standbys_pending > 0)
+	{
+		foreach(lc, pending_sync_standbys)
+		{
+			PendingSyncStandbys *pss = (PendingSyncStandbys *) lfirst(lc);
+
+			pss->waiters = list_delete_ptr(pss->waiters, cps);
+			pss->sent_waiters = list_delete_ptr(pss->sent_waiters, cps);
+		}
+		cps->sync_standbys_pending = 0;
+	}
+	cp_channel_depart(cps);
+	task_release(cps);
+	finalize_cp_state(cps);
+	report_result(cps);
+	cps->finished = true;
+	if (cps->mcxt != NULL)
+	{
+		MemoryContextDelete(cps->mcxt);
+		cps->mcxt = NULL;
+	}
+
+	foreach(lc, cps->dependents)
+	{
+		CopyPartState *dep = (CopyPartState *) lfirst(lc);
+
+		if (--dep->nblockers > 0)
+			continue;
+		dep->needs_init = true;
+		ready_tasks = lappend(ready_tasks, dep);
+	}
+}
+
+/*
+ * Load into dst buffer cache blocks of the partition and its indexes which
+ * are cached on src, so that queries don't hit cold cache after the switch.
+ * The load is done asynchronously, we wait for it via epoll. Prewarm is best
+ * effort: if something fails, we just log it and go on. Returns -1 if we
+ * must be wakened later, 0 if done.
+ */
+int
+mp_prewarm(MovePartState *mps)
+{
+	CopyPartState *cps = (CopyPartState *) mps;
+	PGresult *src_res = NULL;
+	PGresult *dst_res = NULL;
+	StringInfoData sql;
+	int i;
+
+	if (mps->prewarm_done)
+		return 0;
+
+	if (mps->prewarm_sent)
+	{
+		if (PQconsumeInput(cps->dst_conn) == 0)
+		{
+			shmn_elog(LOG, "mp %s: prewarm on dst failed: %s", cps->part_name,
+					  PQerrorMessage(cps->dst_conn));
+			reset_pqconn(&cps->dst_conn);
+			goto done;
+		}
+		if (PQisBusy(cps->dst_conn))
+		{
+			cps->fd_to_epoll = PQsocket(cps->dst_conn);
+			cps->exec_res = TASK_EPOLL;
+			return -1;
+		}
+		while ((dst_res = PQgetResult(cps->dst_conn)) != NULL)
+		{
+			if (PQresultStatus(dst_res) != PGRES_TUPLES_OK)
+				shmn_elog(LOG, "mp %s: prewarm on dst failed: %s",
+						  cps->part_name, PQresultErrorMessage(dst_res));
+			PQclear(dst_res);
+		}
+		shmn_elog(DEBUG1, "mp %s: dst prewarmed", cps->part_name);
+		goto done;
+	}
+
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
+		return -1;
+	report_progress(cps, "prewarm", 0, -1);
+
+	src_res = PQexec(cps->src_conn, mps->src_cached_blocks_sql);
+	if (PQresultStatus(src_res) != PGRES_TUPLES_OK)
+	{
+		shmn_elog(LOG, "mp %s: failed to learn cached blocks on src: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		goto done;
+	}
+	dst_res = PQexec(cps->dst_conn, mps->dst_layout_sql);
+	if (PQresultStatus(dst_res) != PGRES_TUPLES_OK ||
+		PQntuples(dst_res) != PQntuples(src_res))
+	{
+		shmn_elog(LOG, "mp %s: failed to pair src and dst relations: %s",
+				  cps->part_name, PQerrorMessage(cps->dst_conn));
+		goto done;
+	}
+
+	/* Relations are ordered by sig on both sides */
+	initStringInfo(&sql);
+	for (i = 0; i < PQntuples(src_res); i++)
+	{
+		if (strcmp(PQgetvalue(src_res, i, 0), PQgetvalue(dst_res, i, 1)) != 0)
+			continue;
+		appendStringInfo(&sql,
+						 "select shardman.prewarm_blocks(%s::oid::regclass, '%s', %s);",
+						 PQgetvalue(dst_res, i, 0), PQgetvalue(src_res, i, 1),
+						 PQgetvalue(src_res, i, 2));
+	}
+	if (sql.len == 0 || PQsendQuery(cps->dst_conn, sql.data) != 1)
+	{
+		if (sql.len != 0)
+			shmn_elog(LOG, "mp %s: failed to send prewarm query to dst: %s",
+					  cps->part_name, PQerrorMessage(cps->dst_conn));
+		pfree(sql.data);
+		goto done;
+	}
+	pfree(sql.data);
+	PQclear(src_res);
+	PQclear(dst_res);
+	mps->prewarm_sent = true;
+	cps->fd_to_epoll = PQsocket(cps->dst_conn);
+	cps->exec_res = TASK_EPOLL;
+	return -1;
+
+done:
+	PQclear(src_res);
+	PQclear(dst_res);
+	mps->prewarm_done = true;
+	return 0;
+}
+
+/*
+ * Execute given statement in separate transactions. In case of any failure
+ * return false, destroy connection and configure_retry on given cps.
+ * This function is used only for internal SQL, where we guarantee no ';'
+ * in statements.
+ */
+static bool remote_exec(PGconn** conn, CopyPartState *cps, char* stmts)
+{
+	char *sql = stmts;
+	char *sep;
+	PGresult *res;
+	while ((sep = strchr(sql, ';')) != NULL) {
+		*sep = '\0';
+		res = PQexec(*conn, sql);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK &&
+			PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			shmn_elog(LOG, "REMOTE_EXEC: execution of query '%s' failed for paritions %s: %s",
+					  sql, cps->part_name, PQerrorMessage(*conn));
+			*sep = ';';
+			configure_backoff(cps, pq_retry_class(*conn));
+			reset_pqconn_and_res(conn, res);
+			return false;
+		}
+		PQclear(res);
+		*sep = ';';
+		sql = sep + 1;
+	}
+	return true;
+}
+
+/*
+ * Reconfigure LR channel for moved primary: prev to moved, moved to next or
+ * both, if they exist. In star topology moved primary has several next
+ * replicas, each of them gets its own channel.
+ *
+ * We execute code on nodes in the following order: prev, dst, next, so that
+ * every time we create sub, pub already exists. Before that, shared channels
+ * to dst and next are paused, so that changes published before subscriber
+ * learns about the table are not lost, see data_sub_pause.
+ */
+int
+mp_rebuild_lr(MovePartState *mps)
+{
+	int i;
+
+	if (mps->prev_node != SHMN_INVALID_NODE_ID)
+	{
+		if (ensure_pqconn_cp((CopyPartState *) mps, ENSURE_PQCONN_DST) == -1)
+			return -1;
+		if (!remote_exec(&mps->cp.dst_conn, (CopyPartState *) mps,
+						 mps->dst_pause_sql))
+			return -1;
+	}
+	for (i = 0; i < mps->nnext; i++)
+	{
+		if (ensure_pqconn(&mps->next_conns[i], mps->next_connstrs[i],
+						  (CopyPartState *) mps) == -1)
+			return -1;
+		if (!remote_exec(&mps->next_conns[i], (CopyPartState *) mps,
+						 mps->next_pause_sqls[i]))
+			return -1;
+	}
+
+	if (mps->prev_node != SHMN_INVALID_NODE_ID)
+	{
+		if (ensure_pqconn(&mps->prev_conn, mps->prev_connstr,
+					   (CopyPartState *) mps) == -1)
+			return -1;
+		if (!remote_exec(&mps->prev_conn, (CopyPartState *) mps, mps->prev_sql))
+			return -1;
+		shmn_elog(DEBUG1, "mp %s: LR conf on prev done", mps->cp.part_name);
+	}
+
+	if (ensure_pqconn_cp((CopyPartState *) mps,
+						 ENSURE_PQCONN_DST) == -1)
+		return -1;
+	if (!remote_exec(&mps->cp.dst_conn, (CopyPartState *) mps, mps->dst_sql))
+		return -1;
+	shmn_elog(DEBUG1, "mp %s: LR conf on dst done", mps->cp.part_name);
+
+	if (mps->prev_node != SHMN_INVALID_NODE_ID &&
+		mps->cp.repmode == REPLICATION_MODE_SYNC)
+		defer_sync_standby((CopyPartState *) mps, mps->prev_node,
+						   mps->prev_connstr, mps->prev_dst_lname);
+
+	if (mps->nnext > 0)
+	{
+		for (i = 0; i < mps->nnext; i++)
+		{
+			if (ensure_pqconn(&mps->next_conns[i], mps->next_connstrs[i],
+							  (CopyPartState *) mps) == -1)
+				return -1;
+			if (!remote_exec(&mps->next_conns[i], (CopyPartState *) mps,
+							 mps->next_sql))
+				return -1;
+		}
+		shmn_elog(DEBUG1, "mp %s: LR conf on next done", mps->cp.part_name);
+
+		for (i = 0; i < mps->nnext && mps->cp.repmode == REPLICATION_MODE_SYNC;
+			 i++)
+			defer_sync_standby((CopyPartState *) mps, mps->cp.dst_node,
+							   mps->cp.dst_connstr, mps->dst_next_lnames[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * One iteration of add replica task execution.
+ *
+ * Only two nodes involved here, old and new tail of replica chain.
+ */
+void
+exec_create_replica(CreateReplicaState *crs)
+{
+	exec_cp((CopyPartState *) crs);
+	if (crs->cp.curstep != COPYPART_DONE)
+		return;
+
+	if (!crs->cp.lr_rebuilt)
+	{
+		if (cp_leave_channel((CopyPartState *) crs) == -1)
+			return;
+
+		if (cr_rebuild_lr(crs) == -1)
+			return;
+		crs->cp.lr_rebuilt = true;
+	}
+	if (await_sync_standbys((CopyPartState *) crs) == -1)
+		return;
+
+	void_spi(crs->cp.update_metadata_sql);
+	shmn_elog(LOG, "Creating replica %s on node %d successfully done",
+			  crs->cp.part_name, crs->cp.dst_node);
+	crs->cp.res = TASK_SUCCESS;
+	crs->cp.exec_res = TASK_DONE;
+}
+
+/*
+ * Reconfigure LR channels for freshly created replica.
+ *
+ * TODO: simplify things and drop cp channel in triggers, or better let cp
+ * part code itself do that.
+ *
+ * Work to do in general is described below. We execute them in steps written
+ * in parentheses so that every time we create sub, pub is already exist and
+ * every time we drop pub, sub is already dropped. Shared channel is paused on
+ * dst before the table is published, see data_sub_pause, and src is made
+ * writable only when dst is subscribed.
+ */
+int
+cr_rebuild_lr(CreateReplicaState *crs)
+{
+	if (ensure_pqconn_cp((CopyPartState *) crs,
+						 ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
+		return -1;
+
+	if (!remote_exec(&crs->cp.dst_conn, (CopyPartState *) crs,
+					 crs->drop_cp_sub_sql))
+		return -1;
+	shmn_elog(DEBUG1, "cr %s: drop_cp_sub done", crs->cp.part_name);
+
+	if (!remote_exec(&crs->cp.src_conn, (CopyPartState *) crs, crs->create_data_pub_sql))
+		return -1;
+	shmn_elog(DEBUG1, "cr %s: create_data_pub done", crs->cp.part_name);
+
+	if (!remote_exec(&crs->cp.dst_conn, (CopyPartState *) crs,
+					 crs->create_data_sub_sql))
+		return -1;
+	shmn_elog(DEBUG1, "cr %s: create_data_sub done", crs->cp.part_name);
+
+	if (!remote_exec(&crs->cp.src_conn, (CopyPartState *) crs,
+					 crs->readonly_off_sql))
+		return -1;
+
+	if (crs->cp.repmode == REPLICATION_MODE_SYNC)
+		defer_sync_standby((CopyPartState *) crs, crs->cp.src_node,
+						   crs->cp.src_connstr, crs->data_lname);
+
+	return 0;
+}
+
+/*
+ * Remember that data channel 'lname' of task cps must become sync standby on
+ * given node. Adding sync standby means rewriting synchronous_standby_names
+ * via ALTER SYSTEM and reloading config, so instead of doing that for every
+ * channel, we collect them and add all channels of the node at once in
+ * flush_sync_standbys at the end of current iteration of exec_tasks loop.
+ * Until then the channel is asynchronous, so the task must not switch
+ * metadata to it, see await_sync_standbys. Removal is still done immediately
+ * by metadata triggers, since dangling standby might block commits.
+ */
+void
+defer_sync_standby(CopyPartState *cps, int32 node, const char *connstr,
+				   const char *lname)
+{
+	ListCell *lc;
+	PendingSyncStandbys *pss = NULL;
+	MemoryContext oldcxt;
+
+	foreach(lc, pending_sync_standbys)
+	{
+		if (((PendingSyncStandbys *) lfirst(lc))->node == node)
+		{
+			pss = (PendingSyncStandbys *) lfirst(lc);
+			break;
+		}
+	}
+	/* Deferred standbys outlive the task which added them */
+	oldcxt = MemoryContextSwitchTo(exec_tasks_cxt);
+	if (pss == NULL)
+	{
+		pss = palloc(sizeof(PendingSyncStandbys));
+		pss->node = node;
+		pss->connstr = pstrdup(connstr);
+		pss->standbys = NIL;
+		pss->waiters = NIL;
+		pss->conn = NULL;
+		pss->sql = NULL;
+		pss->sent_standbys = NIL;
+		pss->sent_waiters = NIL;
+		pending_sync_standbys = lappend(pending_sync_standbys, pss);
+	}
+	/* Flush as soon as tasks being run now are done with this iteration */
+	pss->next_tm = timespec_now();
+	pending_sync_standbys_tm = pss->next_tm;
+	if (!list_member_ptr(pss->waiters, cps))
+	{
+		pss->waiters = lappend(pss->waiters, cps);
+		if (cps->sync_standbys_pending++ == 0)
+			cps->sync_standbys_deadline =
+				timespec_now_plus_millis(SYNC_STANDBYS_TIMEOUT);
+	}
+
+	foreach(lc, pss->standbys)
+	{
+		if (strcmp((char *) lfirst(lc), lname) == 0)
+		{
+			MemoryContextSwitchTo(oldcxt);
+			return;
+		}
+	}
+	pss->standbys = lappend(pss->standbys, pstrdup(lname));
+	MemoryContextSwitchTo(oldcxt);
+	shmn_elog(DEBUG1, "sync standby %s on node %d deferred", lname, node);
+}
+
+/*
+ * Returns 0 if all data channels the task has deferred are sync standbys
+ * already. Otherwise the task sleeps until flush_sync_standbys wakes it and
+ * -1 is returned. If some node can't be configured for
+ * SYNC_STANDBYS_TIMEOUT, e.g. because it is down, the task fails without
+ * switching metadata.
+ */
+int
+await_sync_standbys(CopyPartState *cps)
+{
+	if (cps->sync_standbys_pending == 0)
+		return 0;
+
+	if (timespeccmp(cps->sync_standbys_deadline, timespec_now()) <= 0)
+	{
+		shmn_elog(WARNING, "%s %s: failed to add sync standbys on %d nodes"
+				  " in %d ms, giving up", task_type_name(cps->type),
+				  cps->part_name, cps->sync_standbys_pending,
+				  SYNC_STANDBYS_TIMEOUT);
+		cps->res = TASK_FAILED;
+		cps->exec_res = TASK_DONE;
 		return -1;
-	shmn_elog(DEBUG1, "cr %s: create_data_pub done", crs->cp.part_name);
+	}
+
+	shmn_elog(DEBUG1, "%s %s: waiting for sync standbys on %d nodes",
+			  task_type_name(cps->type), cps->part_name,
+			  cps->sync_standbys_pending);
+	cps->waketm = timespec_now_plus_millis(shardman_cmd_retry_naptime);
+	cps->exec_res = TASK_WAKEMEUP;
+	return -1;
+}
+
+/* Millis left until pending sync standbys must be flushed */
+int
+sync_standbys_flush_timeout(void)
+{
+	return Max(0, timespec_diff_millis(pending_sync_standbys_tm,
+									   timespec_now()));
+}
+
+/*
+ * Add pending sync standbys, one ensure_sync_standbys per node, and wake up
+ * tasks which have nothing more to wait for. This never blocks: each node's
+ * flush is a connection and a query driven forward on every call, so a slow
+ * or dead node doesn't stall tasks of other nodes. Nodes which we failed to
+ * configure are retried after cmd_retry_naptime.
+ */
+void
+flush_sync_standbys(void)
+{
+	ListCell *lc;
+	ListCell *prev = NULL;
+	ListCell *next;
+	struct timespec curtm = timespec_now();
+	MemoryContext oldcxt = MemoryContextSwitchTo(exec_tasks_cxt);
+
+	pending_sync_standbys_tm =
+		timespec_now_plus_millis(shardman_cmd_retry_naptime);
+	for (lc = list_head(pending_sync_standbys); lc != NULL; lc = next)
+	{
+		PendingSyncStandbys *pss = (PendingSyncStandbys *) lfirst(lc);
+
+		next = lnext(lc);
+		if (pss->conn != NULL && timespeccmp(pss->next_tm, curtm) <= 0)
+			sync_standbys_flush_step(pss);
+		/*
+		 * Standbys deferred during successful flush go right after it, failed
+		 * one has postponed next_tm.
+		 */
+		if (pss->conn == NULL && pss->standbys != NIL &&
+			timespeccmp(pss->next_tm, curtm) <= 0 &&
+			start_sync_standbys_flush(pss) == -1)
+		{
+			pss->next_tm = timespec_now_plus_millis(shardman_cmd_retry_naptime);
+		}
+		if (pss->conn == NULL && pss->standbys == NIL)
+		{
+			pending_sync_standbys =
+				list_delete_cell(pending_sync_standbys, lc, prev);
+			continue;
+		}
+		if (timespeccmp(pss->next_tm, pending_sync_standbys_tm) < 0)
+			pending_sync_standbys_tm = pss->next_tm;
+		prev = lc;
+	}
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Start connecting to pss node to add its pending standbys; they are moved
+ * to sent_standbys. Returns -1 if the connection can't even be started.
+ */
+int
+start_sync_standbys_flush(PendingSyncStandbys *pss)
+{
+	const char *keywords[] = {"dbname", "options", NULL};
+	const char *values[] = {NULL, NULL, NULL};
+	StringInfoData sql;
+	ListCell *lc;
+
+	if (!node_conn_allowed(pss->connstr))
+	{
+		shmn_elog(DEBUG1, "Node %d is degraded, not adding sync standbys"
+				  " there now", pss->node);
+		return -1;
+	}
+	/* connstr is expanded in place of dbname */
+	values[0] = pss->connstr;
+	values[1] = psprintf("-c synchronous_commit=local -c statement_timeout=%d",
+						 SYNC_STANDBYS_ATTEMPT_TIMEOUT);
+	pss->conn = PQconnectStartParams(keywords, values, 1);
+	pfree((char *) values[1]);
+	if (pss->conn == NULL || PQstatus(pss->conn) == CONNECTION_BAD)
+	{
+		shmn_elog(WARNING, "Failed to add sync standbys on node %d: %s",
+				  pss->node, pss->conn == NULL ? "out of memory" :
+				  PQerrorMessage(pss->conn));
+		reset_pqconn(&pss->conn);
+		node_conn_result(pss->connstr, false);
+		return -1;
+	}
+
+	initStringInfo(&sql);
+	appendStringInfoString(&sql, "select shardman.ensure_sync_standbys(ARRAY[");
+	foreach(lc, pss->standbys)
+	{
+		appendStringInfo(&sql, "%s'%s'", lc == list_head(pss->standbys) ?
+						 "" : ", ", (char *) lfirst(lc));
+	}
+	appendStringInfoString(&sql, "]::text[]);");
+	if (pss->sql != NULL)
+		pfree(pss->sql);
+	pss->sql = sql.data;
+	pss->sent_standbys = pss->standbys;
+	pss->sent_waiters = pss->waiters;
+	pss->standbys = NIL;
+	pss->waiters = NIL;
+	pss->polling = PGRES_POLLING_WRITING;
+	pss->sent = false;
+	pss->npolls = 0;
+	pss->deadline = timespec_now_plus_millis(SYNC_STANDBYS_ATTEMPT_TIMEOUT);
+	pss->next_tm = timespec_now_plus_millis(POLL_INTERVAL_MIN);
+	return 0;
+}
+
+/*
+ * Drive flush of pss forward without blocking. When it is over, successfully
+ * or not, conn is closed; otherwise we must look again at next_tm.
+ */
+void
+sync_standbys_flush_step(PendingSyncStandbys *pss)
+{
+	PGresult *res;
+	bool failed = false;
+	ListCell *lc;
+
+	if (timespeccmp(pss->deadline, timespec_now()) <= 0)
+	{
+		shmn_elog(WARNING, "Failed to add sync standbys on node %d in %d ms",
+				  pss->node, SYNC_STANDBYS_ATTEMPT_TIMEOUT);
+		sync_standbys_flush_failed(pss);
+		return;
+	}
+
+	if (!pss->sent)
+	{
+		struct pollfd pfd;
+
+		/* PQconnectPoll may be called only when the socket is ready */
+		pfd.fd = PQsocket(pss->conn);
+		pfd.events = pss->polling == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) == 0)
+			goto wait;
+		pss->polling = PQconnectPoll(pss->conn);
+		if (pss->polling == PGRES_POLLING_FAILED)
+			goto fail;
+		if (pss->polling != PGRES_POLLING_OK)
+			goto wait;
+		node_conn_result(pss->connstr, true);
+		if (PQsendQuery(pss->conn, pss->sql) != 1)
+			goto fail;
+		pss->sent = true;
+	}
+
+	if (PQconsumeInput(pss->conn) == 0)
+		goto fail;
+	if (PQisBusy(pss->conn))
+		goto wait;
+	while ((res = PQgetResult(pss->conn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			failed = true;
+		PQclear(res);
+	}
+	if (failed)
+		goto fail;
+
+	shmn_elog(DEBUG1, "%d sync standbys added on node %d",
+			  list_length(pss->sent_standbys), pss->node);
+	foreach(lc, pss->sent_waiters)
+	{
+		CopyPartState *waiter = (CopyPartState *) lfirst(lc);
+
+		if (--waiter->sync_standbys_pending == 0)
+			waiter->waketm = timespec_now();
+	}
+	reset_pqconn(&pss->conn);
+	list_free(pss->sent_waiters);
+	pss->sent_waiters = NIL;
+	pss->sent_standbys = NIL;
+	return;
+
+wait:
+	/* like configure_poll: often at first, slower while waiting */
+	pss->next_tm = timespec_now_plus_millis(
+		Min(POLL_INTERVAL_MIN << Min(pss->npolls, 16), shardman_poll_interval));
+	pss->npolls++;
+	return;
+
+fail:
+	shmn_elog(WARNING, "Failed to add sync standbys on node %d: %s",
+			  pss->node, PQerrorMessage(pss->conn));
+	if (!pss->sent)
+		node_conn_result(pss->connstr, false);
+	sync_standbys_flush_failed(pss);
+}
+
+/*
+ * Flush of pss failed: close the connection and put what it was adding back
+ * to pending, to be retried after cmd_retry_naptime.
+ */
+void
+sync_standbys_flush_failed(PendingSyncStandbys *pss)
+{
+	ListCell *lc;
+
+	reset_pqconn(&pss->conn);
+	foreach(lc, pss->sent_standbys)
+	{
+		ListCell *slc;
+		bool found = false;
+
+		foreach(slc, pss->standbys)
+		{
+			if (strcmp((char *) lfirst(slc), (char *) lfirst(lc)) == 0)
+			{
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			pss->standbys = lappend(pss->standbys, lfirst(lc));
+	}
+	foreach(lc, pss->sent_waiters)
+	{
+		CopyPartState *waiter = (CopyPartState *) lfirst(lc);
+
+		/* deferred again meanwhile, so it is counted twice */
+		if (list_member_ptr(pss->waiters, waiter))
+			waiter->sync_standbys_pending--;
+		else
+			pss->waiters = lappend(pss->waiters, waiter);
+	}
+	list_free(pss->sent_standbys);
+	list_free(pss->sent_waiters);
+	pss->sent_standbys = NIL;
+	pss->sent_waiters = NIL;
+	pss->next_tm = timespec_now_plus_millis(shardman_cmd_retry_naptime);
+}
+
+/* Forget pending sync standbys, closing connections of flushes in progress */
+void
+abort_sync_standbys_flushes(void)
+{
+	ListCell *lc;
+
+	foreach(lc, pending_sync_standbys)
+		reset_pqconn(&((PendingSyncStandbys *) lfirst(lc))->conn);
+	pending_sync_standbys = NIL;
+}
+
+/*
+ * One iteration of fan-out replicas creation.
+ *
+ * Logical replication can't share tablesync among several subscribers, so
+ * instead of tablesync we do the following:
+ * - Create data channel repslot src -> dst_nodes[0] via replication protocol,
+ *   exporting its snapshot.
+ * - COPY the partition out of src in this snapshot and relay the stream
+ *   to COPY FROM on all dsts at once. This is the only time the partition is
+ *   read.
+ * - Create data channels between new replicas; their repslots are created
+ *   before the first change arrives, so nothing is lost.
+ * - Create subscriptions from the tail to the head of new chain part, and
+ *   the changes made on src since the snapshot start to flow through it.
+ * - Update metadata.
+ * If anything fails, we start over, all the steps are idempotent.
+ */
+void
+exec_fanout_replicas(FanoutReplicaState *frs)
+{
+	/* Mark waketm as invalid for safety */
+	frs->cp.waketm = (struct timespec) {0};
+
+	if (frs->step == FANOUT_START_COPY)
+	{
+		if (fr_start_copy(frs) == -1)
+			return;
+	}
+	if (frs->step == FANOUT_RELAY)
+	{
+		if (fr_relay(frs) == -1)
+			return;
+	}
+	if (frs->step == FANOUT_REBUILD_LR)
+	{
+		if (fr_rebuild_lr(frs) == -1)
+			return;
+		frs->step = FANOUT_AWAIT_SYNC_STANDBYS;
+	}
+	if (await_sync_standbys((CopyPartState *) frs) == -1)
+		return;
+
+	void_spi(frs->update_metadata_sql);
+	shmn_elog(LOG, "Creating %d replicas of %s from node %d successfully done,"
+			  " " INT64_FORMAT " bytes copied", frs->ndsts, frs->cp.part_name,
+			  frs->cp.src_node, frs->bytes_relayed);
+	frs->step = FANOUT_DONE;
+	frs->cp.res = TASK_SUCCESS;
+	frs->cp.exec_res = TASK_DONE;
+}
+
+/*
+ * Prepare dst tables, create repslot on src and start COPY in its snapshot
+ * on all nodes. Returns -1 if anything goes wrong, 0 otherwise.
+ */
+int
+fr_start_copy(FanoutReplicaState *frs)
+{
+	CopyPartState *cps = (CopyPartState *) frs;
+	XLogRecPtr lord_lsn = GetXLogWriteRecPtr();
+	const char *keywords[] = {"dbname", "replication", NULL};
+	const char *values[] = {cps->src_connstr, "database", NULL};
+	PGresult *res;
+	char *snapshot_sql;
+	int i;
+
+	/* Whatever was in progress during previous attempt is useless now */
+	fr_reset_conns(frs);
+	frs->bytes_relayed = 0;
+	frs->src_copy_done = false;
+
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC) == -1)
+		return -1;
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		if (ensure_pqconn(&frs->dst_conns[i], frs->dst_connstrs[i], cps) == -1)
+			return -1;
+	}
+
+	/* See cp_start_tablesync on why this is needed */
+	if (check_sub_sync("shardman_meta_sub", &cps->src_conn, lord_lsn,
+					   "meta sub", NULL) == -1)
+	{
+		configure_poll(cps, -1);
+		return -1;
+	}
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		if (check_sub_sync("shardman_meta_sub", &frs->dst_conns[i], lord_lsn,
+						   "meta sub", NULL) == -1)
+		{
+			configure_poll(cps, -1);
+			return -1;
+		}
+		if (!remote_exec(&frs->dst_conns[i], cps, frs->dst_create_tab_sql[i]))
+			return -1;
+	}
+	shmn_elog(DEBUG1, "fr %s: tables created on dsts", cps->part_name);
+
+	/* publication must exist before repslot, see pgoutput */
+	if (!remote_exec(&cps->src_conn, cps, frs->src_create_pub_sql))
+		return -1;
+	measure_src_size(cps, cps->src_conn);
+
+	frs->repl_conn = PQconnectdbParams(keywords, values, true);
+	if (PQstatus(frs->repl_conn) != CONNECTION_OK)
+	{
+		shmn_elog(NOTICE, "Replication connection to node %s failed: %s",
+				  cps->src_connstr, PQerrorMessage(frs->repl_conn));
+		reset_pqconn(&frs->repl_conn);
+		configure_backoff(cps, RETRY_CONN);
+		return -1;
+	}
+	res = PQexec(frs->repl_conn, frs->src_create_rs_cmd);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		shmn_elog(NOTICE, "fr %s: failed to create repslot on src: %s",
+				  cps->part_name, PQerrorMessage(frs->repl_conn));
+		configure_backoff(cps, pq_retry_class(frs->repl_conn));
+		reset_pqconn_and_res(&frs->repl_conn, res);
+		return -1;
+	}
+	/* snapshot lives until the next cmd on repl_conn, we never issue one */
+	snapshot_sql = psprintf(
+		"begin isolation level repeatable read;"
+		" set transaction snapshot '%s';", PQgetvalue(res, 0, 2));
+	shmn_elog(DEBUG1, "fr %s: repslot %s created, snapshot is %s",
+			  cps->part_name, cps->logname, PQgetvalue(res, 0, 2));
+	PQclear(res);
+
+	if (!remote_exec(&cps->src_conn, cps, snapshot_sql))
+		return -1;
+	pfree(snapshot_sql);
+	res = NULL;
+	if (!PQsendQuery(cps->src_conn, frs->copy_out_sql) ||
+		PQresultStatus(res = PQgetResult(cps->src_conn)) != PGRES_COPY_OUT)
+	{
+		shmn_elog(NOTICE, "fr %s: failed to start COPY on src: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		PQclear(res);
+		fr_retry(frs);
+		return -1;
+	}
+	PQclear(res);
+
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		res = PQexec(frs->dst_conns[i], frs->copy_in_sql);
+		/* slow dst must not block relaying, see fr_relay */
+		if (PQresultStatus(res) != PGRES_COPY_IN ||
+			PQsetnonblocking(frs->dst_conns[i], 1) != 0)
+		{
+			shmn_elog(NOTICE, "fr %s: failed to start COPY on node %d: %s",
+					  cps->part_name, frs->dst_nodes[i],
+					  PQerrorMessage(frs->dst_conns[i]));
+			PQclear(res);
+			fr_retry(frs);
+			return -1;
+		}
+		PQclear(res);
+	}
+	shmn_elog(DEBUG1, "fr %s: copy started", cps->part_name);
+
+	frs->step = FANOUT_RELAY;
+	return 0;
+}
+
+/*
+ * Relay COPY stream from src to all dsts. Dst connections are nonblocking:
+ * if some dst can't take more data, we stop reading src and wait until its
+ * socket becomes writable, so neither the lord nor other tasks are blocked
+ * by slow dst, and data buffered for it is bounded. Returns -1 if anything
+ * goes wrong or copy is not finished yet, 0 otherwise.
+ */
+int
+fr_relay(FanoutReplicaState *frs)
+{
+	CopyPartState *cps = (CopyPartState *) frs;
+	PGresult *res;
+	char *buf;
+	int len;
+	int chunks = 0;
+	int64 unflushed = 0;
+	int i;
+
+	/* Don't read more from src until dsts have taken what we gave them */
+	if (fr_flush_dsts(frs) != 0)
+		return -1;
+	if (frs->src_copy_done)
+		goto finish;
+
+	if (PQconsumeInput(cps->src_conn) == 0)
+	{
+		shmn_elog(NOTICE, "fr %s: failed to read COPY data from src: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		fr_retry(frs);
+		return -1;
+	}
+
+	while ((len = PQgetCopyData(cps->src_conn, &buf, true)) > 0)
+	{
+		for (i = 0; i < frs->ndsts; i++)
+		{
+			if (PQputCopyData(frs->dst_conns[i], buf, len) != 1)
+			{
+				shmn_elog(NOTICE, "fr %s: failed to send COPY data to node %d: %s",
+						  cps->part_name, frs->dst_nodes[i],
+						  PQerrorMessage(frs->dst_conns[i]));
+				PQfreemem(buf);
+				fr_retry(frs);
+				return -1;
+			}
+		}
+		PQfreemem(buf);
+		frs->bytes_relayed += len;
+		/* COPY text size is only an approximation of relation size */
+		cps->copied_bytes = frs->bytes_relayed;
+		report_progress(cps, "copy", frs->bytes_relayed,
+						Max(cps->total_bytes - frs->bytes_relayed, 0));
+
+		unflushed += len;
+		if (unflushed >= FANOUT_FLUSH_BYTES)
+		{
+			if (fr_flush_dsts(frs) != 0)
+				return -1;
+			unflushed = 0;
+		}
+		if (++chunks >= FANOUT_CHUNKS_PER_ITER)
+		{
+			/* let other tasks do their job and come back immediately */
+			configure_retry(cps, 0);
+			return -1;
+		}
+	}
+	if (len == 0)
+	{
+		if (fr_flush_dsts(frs) != 0)
+			return -1;
+		/* no complete row yet, wait for it */
+		cps->fd_to_epoll = PQsocket(cps->src_conn);
+		cps->exec_res = TASK_EPOLL;
+		return -1;
+	}
+	if (len == -2)
+	{
+		shmn_elog(NOTICE, "fr %s: COPY on src failed: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		fr_retry(frs);
+		return -1;
+	}
+
+	/* len == -1, COPY on src is finished */
+	res = PQgetResult(cps->src_conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		shmn_elog(NOTICE, "fr %s: COPY on src failed: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		PQclear(res);
+		fr_retry(frs);
+		return -1;
+	}
+	PQclear(res);
+	while ((res = PQgetResult(cps->src_conn)) != NULL)
+		PQclear(res);
+	frs->src_copy_done = true;
+	if (fr_flush_dsts(frs) != 0)
+		return -1;
+
+finish:
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		res = NULL;
+		/* everything is flushed, so switching back can't fail */
+		if (PQsetnonblocking(frs->dst_conns[i], 0) != 0 ||
+			PQputCopyEnd(frs->dst_conns[i], NULL) != 1 ||
+			PQresultStatus(res = PQgetResult(frs->dst_conns[i])) !=
+			PGRES_COMMAND_OK)
+		{
+			shmn_elog(NOTICE, "fr %s: failed to finish COPY on node %d: %s",
+					  cps->part_name, frs->dst_nodes[i],
+					  PQerrorMessage(frs->dst_conns[i]));
+			PQclear(res);
+			fr_retry(frs);
+			return -1;
+		}
+		PQclear(res);
+		while ((res = PQgetResult(frs->dst_conns[i])) != NULL)
+			PQclear(res);
+	}
+
+	/* Finish snapshot txn and release the snapshot itself */
+	res = PQexec(cps->src_conn, "end;");
+	PQclear(res);
+	reset_pqconn(&frs->repl_conn);
+	shmn_elog(DEBUG1, "fr %s: " INT64_FORMAT " bytes copied to %d nodes",
+			  cps->part_name, frs->bytes_relayed, frs->ndsts);
+
+	frs->step = FANOUT_REBUILD_LR;
+	return 0;
+}
+
+/*
+ * Send to dsts COPY data buffered in their connections. Returns 0 if
+ * everything is sent. If some dst can't take it all now, configures the task
+ * to wait until its socket becomes writable and returns 1. On failure,
+ * configures retry and returns -1.
+ */
+int
+fr_flush_dsts(FanoutReplicaState *frs)
+{
+	CopyPartState *cps = (CopyPartState *) frs;
+	int i;
+
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		int r = PQflush(frs->dst_conns[i]);
+
+		if (r == -1)
+		{
+			shmn_elog(NOTICE, "fr %s: failed to send COPY data to node %d: %s",
+					  cps->part_name, frs->dst_nodes[i],
+					  PQerrorMessage(frs->dst_conns[i]));
+			fr_retry(frs);
+			return -1;
+		}
+		if (r == 1)
+		{
+			shmn_elog(DEBUG1, "fr %s: node %d is slow, waiting for it",
+					  cps->part_name, frs->dst_nodes[i]);
+			cps->fd_to_epoll = PQsocket(frs->dst_conns[i]);
+			cps->epoll_out = true;
+			cps->exec_res = TASK_EPOLL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Build data channels src -> dst_nodes[0] -> dst_nodes[1] ... Returns -1 if
+ * anything goes wrong, 0 otherwise.
+ */
+int
+fr_rebuild_lr(FanoutReplicaState *frs)
+{
+	CopyPartState *cps = (CopyPartState *) frs;
+	int i;
 
-	if (!remote_exec(&crs->cp.dst_conn, (CopyPartState *) crs,
-					 crs->create_data_sub_sql))
-		return -1;
-	shmn_elog(DEBUG1, "cr %s: create_data_sub done", crs->cp.part_name);
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC) == -1)
+		goto fail;
+	for (i = 0; i < frs->ndsts; i++)
+	{
+		if (ensure_pqconn(&frs->dst_conns[i], frs->dst_connstrs[i], cps) == -1)
+			goto fail;
+	}
 
-	if (shardman_sync_replicas &&
-		!remote_exec(&crs->cp.src_conn, (CopyPartState *) crs,
-					 crs->sync_standby_sql))
-		return -1;
-	shmn_elog(DEBUG1, "cr %s: sync_standby done", crs->cp.part_name);
+	/*
+	 * Repslots between new replicas must be created before any change
+	 * arrives to them, so create them all first and only then subscribe.
+	 */
+	for (i = 0; i < frs->ndsts - 1; i++)
+	{
+		if (!remote_exec(&frs->dst_conns[i], cps, frs->create_data_pub_sql[i]))
+			goto fail;
+	}
+	shmn_elog(DEBUG1, "fr %s: data pubs created", cps->part_name);
+
+	for (i = frs->ndsts - 1; i >= 0; i--)
+	{
+		if (!remote_exec(&frs->dst_conns[i], cps, frs->create_data_sub_sql[i]))
+			goto fail;
+	}
+	shmn_elog(DEBUG1, "fr %s: data subs created", cps->part_name);
+
+	if (cps->repmode == REPLICATION_MODE_SYNC)
+	{
+		defer_sync_standby(cps, cps->src_node, cps->src_connstr,
+						   frs->prev_lnames[0]);
+		for (i = 1; i < frs->ndsts; i++)
+			defer_sync_standby(cps, frs->dst_nodes[i - 1],
+							   frs->dst_connstrs[i - 1], frs->prev_lnames[i]);
+	}
 
 	return 0;
+
+fail:
+	/* half-built chain is rebuilt from scratch */
+	frs->step = FANOUT_START_COPY;
+	return -1;
+}
+
+/*
+ * Close all connections of fan-out task; this also aborts COPY and releases
+ * exported snapshot, if any.
+ */
+void
+fr_reset_conns(FanoutReplicaState *frs)
+{
+	int i;
+
+	reset_pqconn(&frs->repl_conn);
+	reset_pqconn(&frs->cp.src_conn);
+	for (i = 0; i < frs->ndsts; i++)
+		reset_pqconn(&frs->dst_conns[i]);
+}
+
+/*
+ * Abort everything in progress and start fan-out over after backoff delay.
+ */
+void
+fr_retry(FanoutReplicaState *frs)
+{
+	fr_reset_conns(frs);
+	frs->step = FANOUT_START_COPY;
+	configure_backoff((CopyPartState *) frs, RETRY_QUERY);
 }
 
 /*
@@ -813,9 +3513,14 @@ cr_rebuild_lr(CreateReplicaState *crs)
  *   initial sync. Later this should be substituted with listen/notify, we use
  *   epoll here for precisely for this reason, but this is not currently
  *   implemented, we need to add hook on initial tablesync completion.
+ * - Analyze dst table, so that planner has stats for it right after the
+ *   switch, and, when moving partition, warm up dst buffer cache with blocks
+ *   cached on src. Src is still writable, so this doesn't lengthen the outage.
  * - When done, lock writes (better lock reads too to avoid stale reads, in
  *	 fact) on source and remember pg_current_wal_lsn() on it.
  * - Now final sync has started.
+ * - If we copy primary from its replica, first wait until replica receives
+ *   remembered lsn, and then remember replica's current lsn instead.
  * - Sleep & check in connection to dest waiting for completion of final sync,
  *   i.e. when received_lsn is equal to remembered lsn on src. This is harder
  *   to replace with notify, but we can try that too.
@@ -823,6 +3528,12 @@ cr_rebuild_lr(CreateReplicaState *crs)
  *   table with src locked for writes and with LR channel configured
  *   between them. TODO: drop channel here, because we don't reuse it anyway.
  *   Currently we drop the channel in metadata update triggers.
+ *
+ * If relation file copy is requested, we first try it instead: freeze src,
+ * ship heap and index pages to the table created on dst and jump right to
+ * analyze and prewarm, all while src is writable. Then take write fence on
+ * src, ship again pages changed meanwhile and commit the table on dst. If it
+ * fails, we start over with LR.
  */
 void
 exec_cp(CopyPartState *cps)
@@ -830,21 +3541,544 @@ exec_cp(CopyPartState *cps)
 	/* Mark waketm as invalid for safety */
 	cps->waketm = (struct timespec) {0};
 
+	if (cps->curstep == COPYPART_FILECOPY_START)
+	{
+		if (cp_filecopy_start(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_FILECOPY_RELAY)
+	{
+		if (cp_filecopy_relay(cps) == -1)
+			return;
+	}
 	if (cps->curstep == COPYPART_START_TABLESYNC)
 	{
 		if (cp_start_tablesync(cps) == -1)
 			return;
 	}
+	if (cps->curstep == COPYPART_WAIT_TABLESYNC)
+	{
+		if (cp_wait_tablesync(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_ANALYZE)
+	{
+		if (cp_analyze(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_PREWARM)
+	{
+		if (cp_prewarm(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_FILECOPY_VERIFY)
+	{
+		if (cp_filecopy_verify(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_FILECOPY_RESHIP)
+	{
+		if (cp_filecopy_reship(cps) == -1)
+			return;
+	}
+	if (cps->curstep == COPYPART_FILECOPY_FINISH)
+	{
+		if (cp_filecopy_finish(cps) == -1)
+			return;
+	}
 	if (cps->curstep == COPYPART_START_FINALSYNC)
 	{
 		if (cp_start_finalsync(cps) == -1)
 			return;
 	}
+	if (cps->curstep == COPYPART_CATCHUP_COPY_SRC)
+	{
+		if (cp_catchup_copy_src(cps) == -1)
+			return;
+	}
 	if (cps->curstep == COPYPART_FINALIZE)
-		cp_finalize(cps);
+	{
+		if (cp_finalize(cps) == -1)
+			return;
+	}
 	return;
 }
 
+/*
+ * Start relation file level copy: freeze src table, remember its layout and
+ * WAL position, create empty table on dst in open transaction and pair
+ * relations of both ends. Writes to src are not blocked yet. If the
+ * partition can't be copied this way (e.g. it is not cold enough), fall back
+ * to LR. Returns -1 if we must be wakened later, 0 otherwise.
+ */
+int
+cp_filecopy_start(CopyPartState *cps)
+{
+	PGresult *src_res = NULL;
+	PGresult *dst_res = NULL;
+	int i;
+
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
+		return -1;
+	if (check_meta_sub_sync(cps) == -1)
+		return -1;
+
+	/* Tuples must not reference src xids */
+	src_res = PQexec(cps->src_conn, cps->freeze_sql);
+	if (PQresultStatus(src_res) != PGRES_COMMAND_OK)
+	{
+		shmn_elog(NOTICE, "cp %s: failed to freeze src table: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		goto fallback;
+	}
+	PQclear(src_res);
+
+	src_res = PQexec(cps->src_conn, cps->layout_sql);
+	if (PQresultStatus(src_res) != PGRES_TUPLES_OK ||
+		PQntuples(src_res) == 0)
+	{
+		shmn_elog(NOTICE, "cp %s: can't copy relation files of src: %s",
+				  cps->part_name, PQerrorMessage(cps->src_conn));
+		goto fallback;
+	}
+	cps->filecopy_lsn = pg_lsn_in_c(PQgetvalue(src_res, 0, 3));
+
+	dst_res = PQexec(cps->dst_conn, cps->dst_filecopy_prepare_sql);
+	if (PQresultStatus(dst_res) != PGRES_TUPLES_OK)
+	{
+		shmn_elog(NOTICE, "cp %s: failed to prepare table on dst: %s",
+				  cps->part_name, PQerrorMessage(cps->dst_conn));
+		goto fallback;
+	}
+
+	cps->nrelfiles = PQntuples(src_res);
+	if (PQntuples(dst_res) != cps->nrelfiles)
+	{
+		shmn_elog(NOTICE, "cp %s: src and dst tables have different indexes",
+				  cps->part_name);
+		goto fallback;
+	}
+	cps->src_relfiles = palloc(sizeof(Oid) * cps->nrelfiles);
+	cps->dst_relfiles = palloc(sizeof(Oid) * cps->nrelfiles);
+	cps->relfile_nblocks = palloc(sizeof(int64) * cps->nrelfiles);
+	for (i = 0; i < cps->nrelfiles; i++)
+	{
+		if (strcmp(PQgetvalue(src_res, i, 1), PQgetvalue(dst_res, i, 1)) != 0)
+		{
+			shmn_elog(NOTICE, "cp %s: relation layouts differ, '%s' on src,"
+					  " '%s' on dst", cps->part_name, PQgetvalue(src_res, i, 1),
+					  PQgetvalue(dst_res, i, 1));
+			goto fallback;
+		}
+		cps->src_relfiles[i] = (Oid) strtoul(PQgetvalue(src_res, i, 0), NULL, 10);
+		cps->dst_relfiles[i] = (Oid) strtoul(PQgetvalue(dst_res, i, 0), NULL, 10);
+		cps->relfile_nblocks[i] = strtoll(PQgetvalue(src_res, i, 2), NULL, 10);
+	}
+	PQclear(src_res);
+	PQclear(dst_res);
+
+	cps->total_bytes = 0;
+	for (i = 0; i < cps->nrelfiles; i++)
+		cps->total_bytes += cps->relfile_nblocks[i] * BLCKSZ;
+	cps->copied_bytes = 0;
+	report_progress(cps, "file copy", 0, cps->total_bytes);
+
+	cps->cur_relfile = 0;
+	cps->cur_block = 0;
+	cps->curstep = COPYPART_FILECOPY_RELAY;
+	return 0;
+
+fallback:
+	PQclear(src_res);
+	PQclear(dst_res);
+	cp_filecopy_fallback(cps);
+	return 0;
+}
+
+/*
+ * Ship next portion of relation files from src to dst, while src is still
+ * writable. Returns -1 if we must be wakened later, 0 otherwise.
+ */
+int
+cp_filecopy_relay(CopyPartState *cps)
+{
+	int chunks = 0;
+
+	while (cps->cur_relfile < cps->nrelfiles)
+	{
+		int64 nblocks = Min(FILECOPY_BLOCKS_PER_CHUNK,
+							cps->relfile_nblocks[cps->cur_relfile] -
+							cps->cur_block);
+		int r;
+
+		if (nblocks <= 0)
+		{
+			cps->cur_relfile++;
+			cps->cur_block = 0;
+			continue;
+		}
+		if (cps->chunk_step == FILECOPY_CHUNK_IDLE &&
+			chunks++ >= FILECOPY_CHUNKS_PER_ITER)
+		{
+			/* let other tasks do their job and come back immediately */
+			configure_retry(cps, 0);
+			return -1;
+		}
+
+		r = cp_filecopy_chunk(cps, cps->src_conn, cps->cur_relfile,
+							  cps->cur_block, nblocks);
+		if (r == 1)
+			return -1;
+		if (r == -1)
+		{
+			cp_filecopy_fallback(cps);
+			return 0;
+		}
+		cps->cur_block += nblocks;
+		cps->copied_bytes += nblocks * BLCKSZ;
+		report_progress(cps, "file copy", cps->copied_bytes,
+						cps->total_bytes - cps->copied_bytes);
+	}
+
+	/* everything is flushed, so switching back can't fail */
+	PQsetnonblocking(cps->dst_conn, 0);
+	cps->curstep = COPYPART_ANALYZE;
+	return 0;
+}
+
+/*
+ * Ship nblocks pages of relfile-th relation starting with blkno from src,
+ * read via src_conn, to dst. Pages are read by one query and written by
+ * another, both are waited for via epoll; dst connection is nonblocking
+ * while pages are sent, so slow dst doesn't block the lord either. Returns
+ * 0 when the chunk is written, 1 if we must be wakened later and called
+ * with the same arguments again, and -1 on failure.
+ */
+int
+cp_filecopy_chunk(CopyPartState *cps, PGconn *src_conn, int relfile,
+				  int64 blkno, int64 nblocks)
+{
+	char src_rel[16];
+	char dst_rel[16];
+	char blkno_str[32];
+	char nblocks_str[32];
+	const char *read_params[3] = {src_rel, blkno_str, nblocks_str};
+	const char *write_params[3] = {dst_rel, blkno_str, NULL};
+	int write_lengths[3] = {0, 0, 0};
+	int write_formats[3] = {0, 0, 1};
+	PGresult *res;
+	int r;
+
+	snprintf(src_rel, sizeof(src_rel), "%u", cps->src_relfiles[relfile]);
+	snprintf(dst_rel, sizeof(dst_rel), "%u", cps->dst_relfiles[relfile]);
+	snprintf(blkno_str, sizeof(blkno_str), INT64_FORMAT, blkno);
+	snprintf(nblocks_str, sizeof(nblocks_str), INT64_FORMAT, nblocks);
+
+	if (cps->chunk_step == FILECOPY_CHUNK_IDLE)
+	{
+		if (PQsendQueryParams(src_conn,
+							  "select shardman.relfile_read($1::oid::regclass, $2, $3)",
+							  3, NULL, read_params, NULL, NULL, 1) != 1)
+		{
+			shmn_elog(NOTICE, "cp %s: failed to read relation files on src: %s",
+					  cps->part_name, PQerrorMessage(src_conn));
+			return -1;
+		}
+		cps->chunk_step = FILECOPY_CHUNK_READING;
+	}
+
+	if (cps->chunk_step == FILECOPY_CHUNK_READING)
+	{
+		if ((r = filecopy_result(cps, src_conn,
+								 "read relation files on src", &res)) != 0)
+			return r;
+		write_params[2] = PQgetvalue(res, 0, 0);
+		write_lengths[2] = PQgetlength(res, 0, 0);
+		r = PQsetnonblocking(cps->dst_conn, 1) == 0 &&
+			PQsendQueryParams(cps->dst_conn,
+							  "select shardman.relfile_write($1::oid::regclass, $2, $3)",
+							  3, NULL, write_params, write_lengths,
+							  write_formats, 0) == 1;
+		PQclear(res);
+		if (!r)
+		{
+			shmn_elog(NOTICE, "cp %s: failed to write relation files on dst: %s",
+					  cps->part_name, PQerrorMessage(cps->dst_conn));
+			return -1;
+		}
+		cps->chunk_step = FILECOPY_CHUNK_WRITING;
+	}
+
+	if ((r = filecopy_result(cps, cps->dst_conn,
+							 "write relation files on dst", &res)) != 0)
+		return r;
+	PQclear(res);
+	cps->chunk_step = FILECOPY_CHUNK_IDLE;
+	return 0;
+}
+
+/*
+ * Collect the result of query sent by relation file copy on conn without
+ * blocking, sending the rest of query first if conn is nonblocking. Returns
+ * 1 if it is not ready yet and the task waits for conn via epoll, 0 with the
+ * result of the last statement in *res (caller must PQclear it) if all
+ * statements succeeded, and -1 otherwise.
+ */
+int
+filecopy_result(CopyPartState *cps, PGconn *conn, const char *what,
+				PGresult **res)
+{
+	PGresult *r;
+	bool failed = false;
+	int flushed;
+
+	*res = NULL;
+	if ((flushed = PQflush(conn)) == 1)
+	{
+		cps->fd_to_epoll = PQsocket(conn);
+		cps->epoll_out = true;
+		cps->exec_res = TASK_EPOLL;
+		return 1;
+	}
+	if (flushed == -1 || PQconsumeInput(conn) == 0)
+	{
+		shmn_elog(NOTICE, "cp %s: failed to %s: %s", cps->part_name, what,
+				  PQerrorMessage(conn));
+		return -1;
+	}
+	if (PQisBusy(conn))
+	{
+		cps->fd_to_epoll = PQsocket(conn);
+		cps->exec_res = TASK_EPOLL;
+		return 1;
+	}
+
+	while ((r = PQgetResult(conn)) != NULL)
+	{
+		if (PQresultStatus(r) != PGRES_COMMAND_OK &&
+			PQresultStatus(r) != PGRES_TUPLES_OK)
+		{
+			if (!failed)
+				shmn_elog(NOTICE, "cp %s: failed to %s: %s", cps->part_name,
+						  what, PQresultErrorMessage(r));
+			failed = true;
+		}
+		PQclear(*res);
+		*res = r;
+	}
+	if (failed)
+	{
+		PQclear(*res);
+		*res = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pages are shipped, analyzed and prewarmed: take write fence on src and
+ * make sure the layout is still the same. The fence is held until metadata
+ * is switched to dst. Returns -1 if we must be wakened later, 0 otherwise.
+ */
+int
+cp_filecopy_verify(CopyPartState *cps)
+{
+	PGresult *res;
+	int i;
+	int r;
+
+	if (!cps->filecopy_sent)
+	{
+		if (ensure_pqconn(&cps->fence_conn, cps->src_connstr, cps) == -1)
+			return -1;
+		if (PQsendQuery(cps->fence_conn, cps->fence_sql) != 1)
+		{
+			shmn_elog(NOTICE, "cp %s: failed to take write fence on src: %s",
+					  cps->part_name, PQerrorMessage(cps->fence_conn));
+			cp_filecopy_fallback(cps);
+			return 0;
+		}
+		cps->filecopy_sent = true;
+	}
+	if ((r = filecopy_result(cps, cps->fence_conn,
+							 "copy relation files of src", &res)) == 1)
+		return -1;
+	cps->filecopy_sent = false;
+	if (r == -1)
+	{
+		cp_filecopy_fallback(cps);
+		return 0;
+	}
+	shmn_elog(DEBUG1, "cp %s: write fence on src taken", cps->part_name);
+
+	/* Relations might be rewritten or grow meanwhile */
+	for (i = 0; i < cps->nrelfiles && PQntuples(res) == cps->nrelfiles; i++)
+	{
+		if ((Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10) !=
+			cps->src_relfiles[i] ||
+			strtoll(PQgetvalue(res, i, 1), NULL, 10) != cps->relfile_nblocks[i])
+			break;
+	}
+	if (PQntuples(res) != cps->nrelfiles || i < cps->nrelfiles)
+	{
+		shmn_elog(NOTICE, "cp %s: src table changed its size while copying",
+				  cps->part_name);
+		PQclear(res);
+		cp_filecopy_fallback(cps);
+		return 0;
+	}
+	PQclear(res);
+
+	cps->cur_relfile = 0;
+	cps->nreshipped = 0;
+	cps->curstep = COPYPART_FILECOPY_RESHIP;
+	return 0;
+}
+
+/*
+ * Under write fence, ship again pages modified on src since the copy
+ * started, relation by relation. Returns -1 if we must be wakened later, 0
+ * otherwise.
+ */
+int
+cp_filecopy_reship(CopyPartState *cps)
+{
+	char src_rel[16];
+	char lsn[32];
+	const char *params[2] = {src_rel, lsn};
+	int chunks = 0;
+	int r;
+
+	snprintf(lsn, sizeof(lsn), "%X/%X", (uint32) (cps->filecopy_lsn >> 32),
+			 (uint32) cps->filecopy_lsn);
+	while (cps->cur_relfile < cps->nrelfiles)
+	{
+		if (cps->changed_blocks == NULL)
+		{
+			if (!cps->filecopy_sent)
+			{
+				snprintf(src_rel, sizeof(src_rel), "%u",
+						 cps->src_relfiles[cps->cur_relfile]);
+				if (PQsendQueryParams(cps->fence_conn,
+									  "select unnest(shardman.relfile_changed_blocks("
+									  "$1::oid::regclass, $2::pg_lsn))",
+									  2, NULL, params, NULL, NULL, 0) != 1)
+				{
+					shmn_elog(NOTICE, "cp %s: failed to find changed pages on src: %s",
+							  cps->part_name, PQerrorMessage(cps->fence_conn));
+					cp_filecopy_fallback(cps);
+					return 0;
+				}
+				cps->filecopy_sent = true;
+			}
+			if ((r = filecopy_result(cps, cps->fence_conn,
+									 "find changed pages on src",
+									 &cps->changed_blocks)) == 1)
+				return -1;
+			cps->filecopy_sent = false;
+			if (r == -1)
+			{
+				cp_filecopy_fallback(cps);
+				return 0;
+			}
+			cps->cur_changed = 0;
+		}
+
+		while (cps->cur_changed < PQntuples(cps->changed_blocks))
+		{
+			if (cps->chunk_step == FILECOPY_CHUNK_IDLE &&
+				chunks++ >= FILECOPY_CHUNKS_PER_ITER)
+			{
+				configure_retry(cps, 0);
+				return -1;
+			}
+			r = cp_filecopy_chunk(cps, cps->fence_conn, cps->cur_relfile,
+								  strtoll(PQgetvalue(cps->changed_blocks,
+													 cps->cur_changed, 0),
+										  NULL, 10), 1);
+			if (r == 1)
+				return -1;
+			if (r == -1)
+			{
+				cp_filecopy_fallback(cps);
+				return 0;
+			}
+			cps->cur_changed++;
+			cps->nreshipped++;
+		}
+		PQclear(cps->changed_blocks);
+		cps->changed_blocks = NULL;
+		cps->cur_relfile++;
+	}
+
+	cps->curstep = COPYPART_FILECOPY_FINISH;
+	return 0;
+}
+
+/*
+ * Commit table creation on dst: its pages are final now. Returns -1 if we
+ * must be wakened later, 0 otherwise.
+ */
+int
+cp_filecopy_finish(CopyPartState *cps)
+{
+	PGresult *res;
+	int r;
+
+	if (!cps->filecopy_sent)
+	{
+		/* everything is flushed, so switching back can't fail */
+		if (PQsetnonblocking(cps->dst_conn, 0) != 0 ||
+			PQsendQuery(cps->dst_conn, cps->dst_filecopy_finish_sql) != 1)
+		{
+			shmn_elog(NOTICE, "cp %s: failed to finish relation files copy on dst: %s",
+					  cps->part_name, PQerrorMessage(cps->dst_conn));
+			cp_filecopy_fallback(cps);
+			return 0;
+		}
+		cps->filecopy_sent = true;
+	}
+	if ((r = filecopy_result(cps, cps->dst_conn,
+							 "finish relation files copy on dst", &res)) == 1)
+		return -1;
+	cps->filecopy_sent = false;
+	if (r == -1)
+	{
+		cp_filecopy_fallback(cps);
+		return 0;
+	}
+	PQclear(res);
+
+	cps->curstep = COPYPART_DONE;
+	shmn_elog(DEBUG1, "Partition %s %d -> %d successfully copied at file level,"
+			  " " INT64_FORMAT " pages shipped again under write fence",
+			  cps->part_name, cps->src_node, cps->dst_node, cps->nreshipped);
+	return 0;
+}
+
+/*
+ * Give up relation file copy: release write fence, roll back table creation
+ * on dst and copy the partition via LR instead. Src connection is reset as
+ * well, since it might have page read in flight.
+ */
+void
+cp_filecopy_fallback(CopyPartState *cps)
+{
+	shmn_elog(LOG, "cp %s: falling back to logical copy", cps->part_name);
+	reset_pqconn(&cps->fence_conn);
+	reset_pqconn(&cps->dst_conn);
+	reset_pqconn(&cps->src_conn);
+	PQclear(cps->changed_blocks);
+	cps->changed_blocks = NULL;
+	cps->chunk_step = FILECOPY_CHUNK_IDLE;
+	cps->filecopy_sent = false;
+	cps->file_copy = false;
+	/* file sizes include indexes, LR progress is measured on heap only */
+	cps->total_bytes = 0;
+	cps->copied_bytes = 0;
+	cps->curstep = COPYPART_START_TABLESYNC;
+}
+
 /*
  * Set up logical replication between src and dst. If anything goes wrong,
  * configure cps properly and return -1, otherwise 0.
@@ -852,67 +4086,95 @@ exec_cp(CopyPartState *cps)
 int
 cp_start_tablesync(CopyPartState *cps)
 {
-	XLogRecPtr lord_lsn = GetXLogWriteRecPtr();
+	if (cps->channel != NULL && cps->channel->owner != cps)
+	{
+		/* Shared channel is created by its owner, we just wait for that */
+		if (!cps->channel->started)
+		{
+			configure_poll(cps, -1);
+			return -1;
+		}
+		shmn_elog(DEBUG1, "cp %s: tablesync started via shared channel %s",
+				  cps->part_name, cps->channel->logname);
+		cps->curstep = COPYPART_WAIT_TABLESYNC;
+		return 0;
+	}
 
-	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST |
+						 ENSURE_PQCONN_COPY_SRC) == -1)
 		return -1;
 
-	/*
-	 * Make sure that meta sub is up-to-date on src and dst. If not, subtle
-	 * bugs may arise: imagine we move part from x to y, and then immediately
-	 * create replica on x from y back again. During repl creation we delete
-	 * old real partition on x before meta row about part move reaches x. When
-	 * it finally arrives, we try to replace real partition with fdw one, but
-	 * the former was dropped. Interesting that I could reproduce only with
-	 * synchronous_commit set to off.
-	 *
-	 * We get current lsn and verify that lsn of src and dst is as big as
-	 * ours. Obviously, during this check other backends might increase lsn,
-	 * but we rely on fact that shardlord itself is single-threaded, so
-	 * external changes are not interesting.
-	 */
-	if (check_sub_sync("shardman_meta_sub", &cps->src_conn, lord_lsn,
-					   "meta sub") == -1)
-	{
-		goto configure_retry_and_fail;
-	}
-	if (check_sub_sync("shardman_meta_sub", &cps->dst_conn, lord_lsn,
-					   "meta sub") == -1)
-	{
-		goto configure_retry_and_fail;
-	}
+	if (check_meta_sub_sync(cps) == -1)
+		goto fail;
 
+	if (cps->channel != NULL)
+		cps->channel->creating = true;
 	if (!remote_exec(&cps->dst_conn, cps, cps->dst_drop_sub_sql))
 		goto fail;
 	shmn_elog(DEBUG1, "cp %s: sub on dst dropped, if any", cps->part_name);
 
-	if (!remote_exec(&cps->src_conn, cps, cps->src_create_pub_and_rs_sql))
+	if (!remote_exec(copy_src_conn(cps), cps, cps->src_create_pub_and_rs_sql))
 		goto fail;
-	shmn_elog(DEBUG1, "cp %s: pub and rs recreated on src", cps->part_name);
+	shmn_elog(DEBUG1, "cp %s: pub and rs recreated on node %d", cps->part_name,
+			  cps->copy_src_node);
 
 	if (!remote_exec(&cps->dst_conn, cps, cps->dst_create_tab_and_sub_sql))
 		goto fail;
 	shmn_elog(DEBUG1, "cp %s: table & sub created on dst, tablesync started",
 			  cps->part_name);
 
-	cps->curstep = COPYPART_START_FINALSYNC;
+	if (cps->channel != NULL)
+		cps->channel->started = true;
+	cps->curstep = COPYPART_WAIT_TABLESYNC;
 	return 0;
 
-configure_retry_and_fail:
-	configure_retry(cps, shardman_cmd_retry_naptime);
 fail:
 	return -1;
 }
 
+/*
+ * Make sure that meta sub is up-to-date on src and dst. If not, subtle bugs
+ * may arise: imagine we move part from x to y, and then immediately create
+ * replica on x from y back again. During repl creation we delete old real
+ * partition on x before meta row about part move reaches x. When it finally
+ * arrives, we try to replace real partition with fdw one, but the former was
+ * dropped. Interesting that I could reproduce only with synchronous_commit set
+ * to off.
+ *
+ * We get current lsn and verify that lsn of src and dst is as big as
+ * ours. Obviously, during this check other backends might increase lsn, but
+ * we rely on fact that shardlord itself is single-threaded, so external
+ * changes are not interesting.
+ *
+ * Connections to src and dst must be ensured. Returns -1 and configures retry
+ * if meta sub is not synced yet, 0 otherwise.
+ */
+int
+check_meta_sub_sync(CopyPartState *cps)
+{
+	XLogRecPtr lord_lsn = GetXLogWriteRecPtr();
+
+	if (check_sub_sync("shardman_meta_sub", &cps->src_conn, lord_lsn,
+					   "meta sub", NULL) == -1 ||
+		check_sub_sync("shardman_meta_sub", &cps->dst_conn, lord_lsn,
+					   "meta sub", NULL) == -1)
+	{
+		configure_poll(cps, -1);
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Ask node via given PGconn about last received lsn for given sub and compare
  * it to given ref_lsn. If node's lsn lags behind or libpq failed, return -1,
  * otherwise 0. Log messages are prefixed with log_pref. Subscription must
- * exist.
+ * exist. If received_lsn_out is not NULL, received lsn is stored there, if
+ * we have learned it.
  */
 int
 check_sub_sync(const char *subname, PGconn **conn, XLogRecPtr ref_lsn,
-			   const char *log_pref)
+			   const char *log_pref, XLogRecPtr *received_lsn_out)
 {
 	PGresult *res = NULL;
 	char *received_lsn_str;
@@ -945,6 +4207,8 @@ check_sub_sync(const char *subname, PGconn **conn, XLogRecPtr ref_lsn,
 	received_lsn_str = PQgetvalue(res, 0, 0);
 	shmn_elog(DEBUG1, "%s: received_lsn is %s", log_pref, received_lsn_str);
 	received_lsn = pg_lsn_in_c(received_lsn_str);
+	if (received_lsn_out != NULL)
+		*received_lsn_out = received_lsn;
 	if (received_lsn < ref_lsn)
 	{
 		shmn_elog(DEBUG1, "%s: sub is not yet synced, received_lsn is %lu, "
@@ -964,18 +4228,41 @@ fail:
 }
 
 /*
- * - wait until initial sync is done;
- * - make src read only and save its pg_current_wal() in cps;
- * - now we are ready to wait for final sync
- * Returns -1 if anything goes wrong and 0 otherwise. current wal is saved
- * in cps.
+ * Report how much of the partition is already copied to dst by tablesync.
+ * Best effort, failures are ignored. Returns estimated number of bytes left,
+ * or -1 if unknown.
+ */
+int64
+cp_report_tablesync(CopyPartState *cps)
+{
+	PGresult *res;
+	char *sql;
+	int64 remaining = -1;
+
+	measure_src_size(cps, cps->src_conn);
+	sql = psprintf("select pg_relation_size('%s');", cps->part_name);
+	res = PQexec(cps->dst_conn, sql);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+	{
+		cps->copied_bytes = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		if (cps->total_bytes != 0)
+			remaining = Max(cps->total_bytes - cps->copied_bytes, 0);
+		report_progress(cps, "tablesync", cps->copied_bytes, remaining);
+	}
+	PQclear(res);
+	pfree(sql);
+	return remaining;
+}
+
+/*
+ * Wait until initial sync is done. Returns -1 if anything goes wrong or sync
+ * is not finished yet and 0 otherwise.
  */
 int
-cp_start_finalsync(CopyPartState *cps)
+cp_wait_tablesync(CopyPartState *cps)
 {
 	PGresult *res;
 	char substate;
-	char *sync_point;
 	int ntup;
 
 	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC | ENSURE_PQCONN_DST) == -1)
@@ -986,8 +4273,8 @@ cp_start_finalsync(CopyPartState *cps)
 	{
 		shmn_elog(NOTICE, "Failed to learn sub status on dst: %s",
 				  PQerrorMessage(cps->dst_conn));
+		configure_backoff(cps, pq_retry_class(cps->dst_conn));
 		reset_pqconn_and_res(&cps->dst_conn, res);
-		configure_retry(cps, shardman_cmd_retry_naptime);
 		return -1;
 	}
 	ntup = PQntuples(res);
@@ -997,7 +4284,7 @@ cp_start_finalsync(CopyPartState *cps)
 		shmn_elog(NOTICE, "cp %s: learning sub status on dst returned %d rows, query %s",
 				  cps->logname, ntup, cps->substate_sql);
 		PQclear(res);
-		configure_retry(cps, shardman_cmd_retry_naptime);
+		configure_poll(cps, -1);
 		return -1;
 	}
 	substate = PQgetvalue(res, 0, 0)[0];
@@ -1006,19 +4293,53 @@ cp_start_finalsync(CopyPartState *cps)
 		shmn_elog(DEBUG1, "cp %s: init sync is not yet finished, its state"
 				  " is %c", cps->part_name, substate);
 		PQclear(res);
-		configure_retry(cps, shardman_poll_interval);
+		configure_poll(cps, cp_report_tablesync(cps));
 		return -1;
 	}
 	shmn_elog(DEBUG1, "cp %s: init sync finished", cps->part_name);
 	PQclear(res);
 
+	cps->curstep = COPYPART_ANALYZE;
+	return 0;
+}
+
+/*
+ * When moving partition, warm up dst buffer cache while src is still
+ * writable. Returns -1 if we must be wakened later, 0 if done.
+ */
+int
+cp_prewarm(CopyPartState *cps)
+{
+	if ((cps->type == COPYPARTTASK_MOVE_PRIMARY ||
+		 cps->type == COPYPARTTASK_MOVE_REPLICA) &&
+		shardman_prewarm && mp_prewarm((MovePartState *) cps) == -1)
+		return -1;
+
+	cps->curstep = cps->file_copy ? COPYPART_FILECOPY_VERIFY :
+		COPYPART_START_FINALSYNC;
+	return 0;
+}
+
+/*
+ * Make src read only and save its pg_current_wal() in cps; now we are ready
+ * to wait for final sync. Returns -1 if anything goes wrong and 0 otherwise.
+ */
+int
+cp_start_finalsync(CopyPartState *cps)
+{
+	PGresult *res;
+	char *sync_point;
+
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_SRC) == -1)
+		return -1;
+
 	res = PQexec(cps->src_conn, cps->readonly_sql);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
 		shmn_elog(NOTICE, "Failed to make src table read only: %s",
 				  PQerrorMessage(cps->src_conn));
+		configure_backoff(cps, pq_retry_class(cps->src_conn));
 		reset_pqconn_and_res(&cps->src_conn, res);
-		configure_retry(cps, shardman_cmd_retry_naptime);
 		return -1;
 	}
 	shmn_elog(DEBUG1, "cp %s: src made read only", cps->part_name);
@@ -1029,8 +4350,8 @@ cp_start_finalsync(CopyPartState *cps)
 	{
 		shmn_elog(NOTICE, "Failed to get current lsn on src: %s",
 				  PQerrorMessage(cps->src_conn));
+		configure_backoff(cps, pq_retry_class(cps->src_conn));
 		reset_pqconn_and_res(&cps->src_conn, res);
-		configure_retry(cps, shardman_cmd_retry_naptime);
 		return -1;
 	}
 	sync_point = PQgetvalue(res, 0, 0);
@@ -1039,6 +4360,61 @@ cp_start_finalsync(CopyPartState *cps)
 	shmn_elog(DEBUG1, "cp %s: sync lsn is %s", cps->part_name, sync_point);
 	PQclear(res);
 
+	if (CP_FROM_REPLICA(cps))
+		cps->curstep = COPYPART_CATCHUP_COPY_SRC;
+	else
+		cps->curstep = COPYPART_FINALIZE;
+	return 0;
+}
+
+/*
+ * When copying from replica, wait until it receives everything src had
+ * written before it was made read-only, and then shift sync point to
+ * replica's current lsn: that's what dst must receive to be in sync with src.
+ * Returns -1 if anything goes wrong or replica is not synced yet and 0
+ * otherwise.
+ */
+int
+cp_catchup_copy_src(CopyPartState *cps)
+{
+	PGresult *res;
+	char *sync_point;
+	XLogRecPtr received_lsn = InvalidXLogRecPtr;
+
+	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_COPY_SRC) == -1)
+		return -1;
+
+	if (check_sub_sync(cps->copy_src_lname, &cps->copy_src_conn,
+					   cps->sync_point, cps->part_name, &received_lsn) == -1)
+	{
+		int64 remaining = -1;
+
+		if (received_lsn != InvalidXLogRecPtr)
+		{
+			remaining = cps->sync_point - received_lsn;
+			report_progress(cps, "replica catch-up", received_lsn, remaining);
+		}
+		configure_poll(cps, remaining);
+		return -1;
+	}
+	shmn_elog(DEBUG1, "cp %s: replica on node %d caught up with src",
+			  cps->part_name, cps->copy_src_node);
+
+	res = PQexec(cps->copy_src_conn, "select pg_current_wal_lsn();");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		shmn_elog(NOTICE, "Failed to get current lsn on replica: %s",
+				  PQerrorMessage(cps->copy_src_conn));
+		configure_backoff(cps, pq_retry_class(cps->copy_src_conn));
+		reset_pqconn_and_res(&cps->copy_src_conn, res);
+		return -1;
+	}
+	sync_point = PQgetvalue(res, 0, 0);
+	cps->sync_point = pg_lsn_in_c(sync_point);
+	shmn_elog(DEBUG1, "cp %s: sync lsn on replica is %s", cps->part_name,
+			  sync_point);
+	PQclear(res);
+
 	cps->curstep = COPYPART_FINALIZE;
 	return 0;
 }
@@ -1050,13 +4426,22 @@ cp_start_finalsync(CopyPartState *cps)
 int
 cp_finalize(CopyPartState *cps)
 {
+	XLogRecPtr received_lsn = InvalidXLogRecPtr;
+
 	if (ensure_pqconn_cp(cps, ENSURE_PQCONN_DST) == -1)
 		return -1;
 
 	if (check_sub_sync(cps->logname, &cps->dst_conn, cps->sync_point,
-					   cps->part_name) == -1)
+					   cps->part_name, &received_lsn) == -1)
 	{
-		configure_retry(cps, shardman_poll_interval);
+		int64 remaining = -1;
+
+		if (received_lsn != InvalidXLogRecPtr)
+		{
+			remaining = cps->sync_point - received_lsn;
+			report_progress(cps, "final sync", received_lsn, remaining);
+		}
+		configure_poll(cps, remaining);
 		return -1;
 	}
 
@@ -1066,11 +4451,191 @@ cp_finalize(CopyPartState *cps)
 	return 0;
 }
 
+/*
+ * Freshly copied table has no planner stats until autovacuum gets to it, so
+ * analyze it before switching to it. This is done before src is made
+ * read-only: changes applied during final sync or pages shipped again under
+ * write fence hardly affect the stats.
+ * ANALYZE is run asynchronously, we wait for it via epoll. It is best effort:
+ * if it fails, we just log it and go on. Returns -1 if we must be wakened
+ * later, 0 if done.
+ */
+int
+cp_analyze(CopyPartState *cps)
+{
+	PGresult *res;
+
+	if (!cps->analyze_sent)
+	{
+		if (ensure_pqconn_cp(cps, ENSURE_PQCONN_DST) == -1)
+			return -1;
+		report_progress(cps, "analyze", 0, -1);
+		if (PQsendQuery(cps->dst_conn, cps->analyze_sql) != 1)
+		{
+			shmn_elog(LOG, "cp %s: failed to send analyze to dst: %s",
+					  cps->part_name, PQerrorMessage(cps->dst_conn));
+			reset_pqconn(&cps->dst_conn);
+			goto done;
+		}
+		cps->analyze_sent = true;
+	}
+	else if (PQconsumeInput(cps->dst_conn) == 0)
+	{
+		shmn_elog(LOG, "cp %s: analyze on dst failed: %s", cps->part_name,
+				  PQerrorMessage(cps->dst_conn));
+		reset_pqconn(&cps->dst_conn);
+		goto done;
+	}
+
+	if (PQisBusy(cps->dst_conn))
+	{
+		cps->fd_to_epoll = PQsocket(cps->dst_conn);
+		cps->exec_res = TASK_EPOLL;
+		return -1;
+	}
+	while ((res = PQgetResult(cps->dst_conn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			shmn_elog(LOG, "cp %s: analyze on dst failed: %s", cps->part_name,
+					  PQresultErrorMessage(res));
+		PQclear(res);
+	}
+	shmn_elog(DEBUG1, "cp %s: dst analyzed", cps->part_name);
+
+done:
+	cps->curstep = COPYPART_PREWARM;
+	return 0;
+}
+
+/*
+ * If task copied the data via shared channel, detach its table from the
+ * channel so that changes are not delivered through it anymore. The last
+ * task leaving the channel drops it. Returns -1 if anything goes wrong, 0
+ * otherwise.
+ */
+int
+cp_leave_channel(CopyPartState *cps)
+{
+	CopyChannel *ch = cps->channel;
+
+	if (ch == NULL)
+		return 0;
+
+	if (!cps->left_channel)
+	{
+		if (ensure_pqconn_cp(cps, ENSURE_PQCONN_COPY_SRC) == -1)
+			return -1;
+		if (!remote_exec(copy_src_conn(cps), cps, cps->leave_channel_sql))
+			return -1;
+		cps->left_channel = true;
+		ch->nleft++;
+		ch->members = list_delete_ptr(ch->members, cps);
+		shmn_elog(DEBUG1, "cp %s: left channel %s, %d of %d members left",
+				  cps->part_name, ch->logname, ch->nleft, ch->nmembers);
+	}
+
+	if (ch->nleft == ch->nmembers && !ch->dropped)
+	{
+		if (ensure_pqconn_cp(cps, ENSURE_PQCONN_DST | ENSURE_PQCONN_COPY_SRC)
+			== -1)
+			return -1;
+		/* sub must be dropped first to let repslot go */
+		if (!remote_exec(&cps->dst_conn, cps, ch->drop_sub_sql))
+			return -1;
+		if (!remote_exec(copy_src_conn(cps), cps, ch->drop_pub_and_rs_sql))
+			return -1;
+		ch->dropped = true;
+		shmn_elog(DEBUG1, "cp %s: channel %s dropped", cps->part_name,
+				  ch->logname);
+	}
+	return 0;
+}
+
+/*
+ * Task is done with shared channel without leaving it properly: it has
+ * failed, was aborted or is postponed by preemption. Its table stays in the
+ * publication until the channel is dropped. If the task was to create the
+ * channel and didn't, the next member takes over, so that others don't wait
+ * for it forever. If everyone has gone this way, the channel is dropped by
+ * drop_abandoned_channels.
+ */
+void
+cp_channel_depart(CopyPartState *cps)
+{
+	CopyChannel *ch = cps->channel;
+
+	if (ch == NULL || cps->left_channel)
+		return;
+	cps->left_channel = true;
+	ch->nleft++;
+	ch->members = list_delete_ptr(ch->members, cps);
+	shmn_elog(DEBUG1, "cp %s: gone from channel %s, %d of %d members left",
+			  cps->part_name, ch->logname, ch->nleft, ch->nmembers);
+	if (ch->owner == cps && !ch->started && ch->members != NIL)
+	{
+		ch->owner = (CopyPartState *) linitial(ch->members);
+		shmn_elog(DEBUG1, "cp %s: takes over creation of channel %s",
+				  ch->owner->part_name, ch->logname);
+	}
+}
+
+/*
+ * Drop shared channels which are left without members, but weren't dropped
+ * by the last of them, e.g. because it failed; otherwise their repslots would
+ * hold WAL on copy src forever. This is best effort: if some node is
+ * unreachable, next channel between the same nodes recreates everything
+ * anyway.
+ */
+void
+drop_abandoned_channels(void)
+{
+	const char *keywords[] = {"dbname", "connect_timeout", "options", NULL};
+	const char *values[] = {NULL, ABANDONED_CHANNEL_CONNECT_TIMEOUT,
+							"-c synchronous_commit=local", NULL};
+	ListCell *lc;
+
+	foreach(lc, copy_channels)
+	{
+		CopyChannel *ch = (CopyChannel *) lfirst(lc);
+		PGconn *conn;
+		PGresult *res;
+
+		if (ch->dropped || !ch->creating || ch->members != NIL)
+			continue;
+
+		/* sub goes first to let repslot go; walsender is fired otherwise */
+		if (node_conn_allowed(ch->dst_connstr))
+		{
+			/* connstr is expanded in place of dbname */
+			values[0] = ch->dst_connstr;
+			conn = PQconnectdbParams(keywords, values, true);
+			res = PQexec(conn, ch->drop_sub_sql);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				shmn_elog(WARNING, "Failed to drop sub of abandoned channel"
+						  " %s: %s", ch->logname, PQerrorMessage(conn));
+			reset_pqconn_and_res(&conn, res);
+		}
+		if (!node_conn_allowed(ch->copy_src_connstr))
+			continue;
+		values[0] = ch->copy_src_connstr;
+		conn = PQconnectdbParams(keywords, values, true);
+		res = PQexec(conn, ch->drop_pub_and_rs_sql);
+		if (PQresultStatus(res) == PGRES_TUPLES_OK)
+			shmn_elog(DEBUG1, "Abandoned channel %s dropped", ch->logname);
+		else
+			shmn_elog(WARNING, "Failed to drop pub and repslot of abandoned"
+					  " channel %s: %s", ch->logname, PQerrorMessage(conn));
+		reset_pqconn_and_res(&conn, res);
+	}
+	copy_channels = NIL;
+}
+
 /*
  * Ensure that pq connection to is CONNECTION_OK. nodes is a bitmask
- * specifying with which nodes connection must be ensured, src, dst or
- * bouth. -1 is returned if we have failed to establish connection; cps is
- * then configured to sleep retry time. 0 is returned if ok.
+ * specifying with which nodes connection must be ensured, src, dst, copy src
+ * or several of them. -1 is returned if we have failed to establish
+ * connection; cps is then configured to sleep retry time. 0 is returned if
+ * ok.
  */
 int
 ensure_pqconn_cp(CopyPartState *cps, int nodes)
@@ -1081,9 +4646,22 @@ ensure_pqconn_cp(CopyPartState *cps, int nodes)
 	if ((nodes & ENSURE_PQCONN_DST) &&
 		(ensure_pqconn(&cps->dst_conn, cps->dst_connstr, cps) == -1))
 		return -1;
+	if ((nodes & ENSURE_PQCONN_COPY_SRC) &&
+		(ensure_pqconn(copy_src_conn(cps), cps->copy_src_connstr, cps) == -1))
+		return -1;
 	return 0;
 }
 
+/*
+ * Connection to the node we read data from; it is the src connection itself
+ * unless we copy from replica.
+ */
+PGconn **
+copy_src_conn(CopyPartState *cps)
+{
+	return CP_FROM_REPLICA(cps) ? &cps->copy_src_conn : &cps->src_conn;
+}
+
 /*
  * Make sure that given conn is CONNECTION_OK, reconnect if not, and configure
  * cps to sleep if we can't.
@@ -1102,15 +4680,25 @@ ensure_pqconn(PGconn **conn, const char *connstr,
 		char s[] = "set session synchronous_commit to local;";
 
 		Assert(connstr != NULL);
+		/* Don't hammer degraded node, wait until it answers heartbeat */
+		if (!node_conn_allowed(connstr))
+		{
+			shmn_elog(DEBUG1, "Node %s is degraded, not connecting to it",
+					  connstr);
+			configure_retry(cps, probe_interval());
+			return -1;
+		}
 		*conn = PQconnectdb(connstr);
 		if (PQstatus(*conn) != CONNECTION_OK)
 		{
 			shmn_elog(NOTICE, "Connection to node %s failed: %s", connstr,
 					  PQerrorMessage(*conn));
+			node_conn_result(connstr, false);
 			reset_pqconn(conn);
-			configure_retry(cps, shardman_cmd_retry_naptime);
+			configure_backoff(cps, RETRY_CONN);
 			return -1;
 		}
+		node_conn_result(connstr, true);
 		shmn_elog(DEBUG1, "Connection to %s established", connstr);
 
 		/* All our cmds don't need to wait for sync replication */
@@ -1132,6 +4720,203 @@ void configure_retry(CopyPartState *cps, int millis)
 	cps->exec_res = TASK_WAKEMEUP;
 }
 
+/*
+ * Configure retry after failure of class rclass: exponential backoff per
+ * step, capped by cmd_retry_naptime, with jitter so that tasks failed on the
+ * same node don't come back all at once.
+ */
+void
+configure_backoff(CopyPartState *cps, RetryClass rclass)
+{
+	int64 millis = rclass == RETRY_CONN ? RETRY_CONN_BASE : RETRY_QUERY_BASE;
+
+	if (cps->curstep != cps->retry_step)
+	{
+		cps->retry_step = cps->curstep;
+		cps->nfailures = 0;
+	}
+	millis = Min(millis << Min(cps->nfailures, 16), shardman_cmd_retry_naptime);
+	cps->nfailures++;
+	/* Wait somewhere between half and full delay */
+	millis = millis / 2 + random() % (millis / 2 + 1);
+	configure_retry(cps, (int) millis);
+}
+
+/*
+ * Configure waiting for something in progress, with remaining bytes left to
+ * transfer (-1 if unknown). We start polling often, so that small partitions
+ * are done quickly, and slow down up to poll_interval while waiting. If we
+ * know the throughput, we also look again when about half of what was left
+ * should be done.
+ */
+void
+configure_poll(CopyPartState *cps, int64 remaining)
+{
+	int64 millis;
+
+	if (cps->curstep != cps->poll_step)
+	{
+		cps->poll_step = cps->curstep;
+		cps->npolls = 0;
+	}
+	/* We are waiting, not failing */
+	cps->nfailures = 0;
+
+	millis = Min((int64) POLL_INTERVAL_MIN << Min(cps->npolls, 16),
+				 shardman_poll_interval);
+	cps->npolls++;
+	if (remaining >= 0 && cps->throughput > 0)
+	{
+		int64 half_eta = (int64) (remaining * 500.0 / cps->throughput);
+
+		millis = Min(millis, Max(half_eta, POLL_INTERVAL_MIN));
+	}
+	configure_retry(cps, (int) millis);
+}
+
+/*
+ * Learn whether query on conn failed because connection is broken.
+ */
+RetryClass
+pq_retry_class(PGconn *conn)
+{
+	if (conn == NULL || PQstatus(conn) == CONNECTION_BAD)
+		return RETRY_CONN;
+	return RETRY_QUERY;
+}
+
+/*
+ * Record that task is in given phase and has reached counter there, which is
+ * bytes copied or lsn received, with remaining bytes left to transfer in this
+ * phase (-1 if unknown). Throughput is smoothed over the phase; the row in
+ * shardman.copy_tasks is updated on phase change and otherwise not more
+ * often than once per PROGRESS_REPORT_INTERVAL.
+ */
+void
+report_progress(CopyPartState *cps, const char *phase, int64 counter,
+				int64 remaining)
+{
+	struct timespec now = timespec_now();
+	bool phase_changed = cps->phase == NULL || strcmp(cps->phase, phase) != 0;
+	char *sql;
+	char remaining_str[32];
+
+	if (!IS_COPY_TASK(cps))
+		return;
+
+	if (phase_changed)
+	{
+		cps->phase = phase;
+		cps->throughput = 0;
+	}
+	else
+	{
+		int64 millis = timespec_diff_millis(now, cps->progress_tm);
+
+		if (millis < PROGRESS_REPORT_INTERVAL)
+			return;
+		if (counter >= cps->progress_counter)
+		{
+			double rate = (counter - cps->progress_counter) * 1000.0 / millis;
+
+			cps->throughput = cps->throughput == 0 ? rate :
+				0.7 * cps->throughput + 0.3 * rate;
+		}
+	}
+	cps->progress_counter = counter;
+	cps->progress_tm = now;
+
+	if (remaining >= 0)
+		snprintf(remaining_str, sizeof(remaining_str), INT64_FORMAT, remaining);
+	else
+		strcpy(remaining_str, "null");
+	sql = psprintf(
+		"insert into shardman.copy_tasks as t (part_name, dst, src, task_type,"
+		" phase, total_bytes, total_rows, copied_bytes, remaining_bytes,"
+		" throughput)"
+		" values ('%s', %d, %d, '%s', '%s', nullif(" INT64_FORMAT ", 0),"
+		" nullif(" INT64_FORMAT ", 0), " INT64_FORMAT ", %s, %f)"
+		" on conflict (part_name, dst) do update set"
+		" src = excluded.src, task_type = excluded.task_type,"
+		" phase = excluded.phase, total_bytes = excluded.total_bytes,"
+		" total_rows = excluded.total_rows,"
+		" copied_bytes = excluded.copied_bytes,"
+		" remaining_bytes = excluded.remaining_bytes,"
+		" throughput = excluded.throughput, updated = now();",
+		cps->part_name, cps->dst_node, cps->copy_src_node,
+		task_type_name(cps->type), phase, cps->total_bytes, cps->total_rows,
+		cps->copied_bytes, remaining_str, cps->throughput);
+	void_spi(sql);
+	pfree(sql);
+}
+
+/*
+ * Record final result of the task in shardman.copy_tasks.
+ */
+void
+report_result(CopyPartState *cps)
+{
+	const char *phase;
+
+	if (cps->res == TASK_SUCCESS)
+		phase = "success";
+	else if (cps->res == TASK_FAILED)
+		phase = "failed";
+	else
+		phase = "canceled";
+	cps->copied_bytes = Max(cps->copied_bytes, cps->total_bytes);
+	report_progress(cps, phase, 0, cps->res == TASK_SUCCESS ? 0 : -1);
+}
+
+const char *
+task_type_name(CopyPartTaskType type)
+{
+	switch (type)
+	{
+		case COPYPARTTASK_MOVE_PRIMARY:
+			return "move primary";
+		case COPYPARTTASK_MOVE_REPLICA:
+			return "move replica";
+		case COPYPARTTASK_CREATE_REPLICA:
+			return "create replica";
+		case COPYPARTTASK_FANOUT_REPLICAS:
+			return "create replicas";
+		case COPYPARTTASK_ADD_NODE:
+			return "add node";
+		case COPYPARTTASK_RM_NODE:
+			return "rm node";
+		case COPYPARTTASK_HASH_PARTITION:
+			return "hash partition";
+	}
+	return "unknown";
+}
+
+/*
+ * Learn size of the partition on src via given connection, if not done yet.
+ * Only for progress reporting, so failures are ignored.
+ */
+void
+measure_src_size(CopyPartState *cps, PGconn *conn)
+{
+	PGresult *res;
+	char *sql;
+
+	if (cps->total_bytes != 0)
+		return;
+
+	sql = psprintf("select pg_relation_size('%s'), reltuples::bigint"
+				   " from pg_class where oid = '%s'::regclass;",
+				   cps->part_name, cps->part_name);
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+	{
+		cps->total_bytes = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		cps->total_rows = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+	}
+	PQclear(res);
+	pfree(sql);
+}
+
 /*
  * SQL to get last received lsn for given subscription
  */
@@ -12,6 +12,7 @@
 
 #include "libpq-fe.h"
 #include "access/xlogdefs.h"
+#include "nodes/pg_list.h"
 
 #include "pg_shardman.h"
 
@@ -20,9 +21,17 @@ typedef enum
 {
 	COPYPARTTASK_MOVE_PRIMARY,
 	COPYPARTTASK_MOVE_REPLICA,
-	COPYPARTTASK_CREATE_REPLICA
+	COPYPARTTASK_CREATE_REPLICA,
+	COPYPARTTASK_FANOUT_REPLICAS,
+	/* Not copies: control plane commands running on the same engine */
+	COPYPARTTASK_ADD_NODE,
+	COPYPARTTASK_RM_NODE,
+	COPYPARTTASK_HASH_PARTITION
 } CopyPartTaskType;
 
+/* Is it a real partition copy, with progress in shardman.copy_tasks? */
+#define IS_COPY_TASK(cps) ((cps)->type < COPYPARTTASK_ADD_NODE)
+
 /* final result of 1 one task */
 typedef enum
 {
@@ -44,14 +53,62 @@ typedef enum
  */
 typedef enum
 {
+	COPYPART_FILECOPY_START, /* only when copying relation files */
+	COPYPART_FILECOPY_RELAY, /* only when copying relation files */
 	COPYPART_START_TABLESYNC,
+	COPYPART_WAIT_TABLESYNC,
+	COPYPART_ANALYZE,
+	COPYPART_PREWARM, /* only when moving partition */
+	COPYPART_FILECOPY_VERIFY, /* only when copying relation files */
+	COPYPART_FILECOPY_RESHIP, /* only when copying relation files */
+	COPYPART_FILECOPY_FINISH, /* only when copying relation files */
 	COPYPART_START_FINALSYNC,
+	COPYPART_CATCHUP_COPY_SRC, /* only when copying from replica */
 	COPYPART_FINALIZE,
 	COPYPART_DONE
 } CopyPartStep;
 
+/*
+ * Where shipping of relation pages chunk is, see cp_filecopy_chunk.
+ */
+typedef enum
+{
+	FILECOPY_CHUNK_IDLE,
+	FILECOPY_CHUNK_READING, /* waiting for pages from src */
+	FILECOPY_CHUNK_WRITING /* waiting until dst writes them */
+} FileCopyChunkStep;
+
+/*
+ * Current step of creating several replicas at once.
+ */
+typedef enum
+{
+	FANOUT_START_COPY,
+	FANOUT_RELAY,
+	FANOUT_REBUILD_LR,
+	FANOUT_AWAIT_SYNC_STANDBYS,
+	FANOUT_DONE
+} FanoutStep;
+
+/*
+ * Current step of adding node. Each step is one query sent to the node.
+ */
+typedef enum
+{
+	ADDNODE_CHECK_INSTALLED,
+	ADDNODE_CHECK_ID,
+	ADDNODE_REINSTALL,
+	ADDNODE_SUBSCRIBE,
+	ADDNODE_ALTER_SYSTEM, /* alter system can't be sent with other stmts */
+	ADDNODE_RELOAD,
+	ADDNODE_WAIT_SYNC,
+	ADDNODE_DONE
+} AddNodeStep;
+
+typedef struct CopyChannel CopyChannel;
+
 /* State of copy part task */
-typedef struct
+typedef struct CopyPartState
 {
 	CopyPartTaskType type;
 	/* wake me up at waketm to do the job. Try to keep it zero when invalid	*/
@@ -60,6 +117,7 @@ typedef struct
 	 /* exec_copypart sets fd here when it wants to be wakened by epoll */
 	int fd_to_epoll;
 	int fd_in_epoll_set; /* socket *currently* in epoll set. -1 of none */
+	bool epoll_out; /* wait for fd_to_epoll to become writable, not readable */
 
 	const char *part_name; /* partition name */
 	int32 src_node; /* node we are copying partition from */
@@ -68,6 +126,14 @@ typedef struct
 	const char *dst_connstr;
 	PGconn *src_conn; /* connection to src */
 	PGconn *dst_conn; /* connection to dst */
+	/*
+	 * Node we actually read the data from. Normally this is src_node, but
+	 * primary might be copied from its replica to take the load off the
+	 * former; then src is touched only during the final catch-up.
+	 */
+	int32 copy_src_node;
+	const char *copy_src_connstr;
+	PGconn *copy_src_conn; /* used only if copy_src_node != src_node */
 
 	/*
 	 * The following strs are constant during execution; we allocate them
@@ -77,18 +143,121 @@ typedef struct
 	char *dst_drop_sub_sql; /* sql to drop sub on dst node */
 	char *src_create_pub_and_rs_sql; /* create publ and repslot on src */
 	char *relation; /* name of sharded relation */
+	ReplicationMode repmode; /* of relation */
 	char *dst_create_tab_and_sub_sql; /* create table and sub on dst */
 	char *substate_sql; /* get current state of subscription */
 	char *readonly_sql; /* make src table read-only */
 	char *received_lsn_sql; /* get last received lsn on dst */
+	char *copy_src_lname; /* data channel src -> copy_src, if copying from it */
+	char *analyze_sql; /* collect planner stats on dst */
+	bool analyze_sent;
+
+	/* Progress reported to shardman.copy_tasks, see report_progress */
+	const char *phase;
+	int64 total_bytes; /* size of src table, 0 if unknown */
+	int64 total_rows;
+	int64 copied_bytes;
+	int64 progress_counter; /* what throughput is measured on */
+	double throughput; /* bytes per second in current phase */
+	struct timespec progress_tm; /* when progress_counter was measured */
+
+	/* Adaptive retry and poll state, see configure_backoff/configure_poll */
+	CopyPartStep retry_step; /* step nfailures counts failures of */
+	int nfailures;
+	CopyPartStep poll_step; /* step npolls counts polls of */
+	int npolls;
+	/* shared copy channel we are member of, NULL if we have our own */
+	CopyChannel *channel;
+	char *leave_channel_sql; /* detach part from shared channel on copy src */
+	bool left_channel;
 	char *update_metadata_sql;
 
+	/*
+	 * Relation file level copy, tried instead of LR if file_copy is set.
+	 * Pages are shipped, analyzed and prewarmed on dst without blocking
+	 * writes, then write fence on src is taken and changed pages are shipped
+	 * again. The fence is held by open transaction on fence_conn until
+	 * metadata is switched to dst. All queries are sent without blocking.
+	 */
+	bool file_copy;
+	PGconn *fence_conn;
+	char *freeze_sql; /* freeze src table */
+	char *layout_sql; /* get src layout and WAL position */
+	char *fence_sql; /* take write fence on src and get its layout again */
+	XLogRecPtr filecopy_lsn; /* src WAL position before pages were read */
+	char *dst_filecopy_prepare_sql; /* create empty table, get its layout */
+	char *dst_filecopy_finish_sql;
+	int nrelfiles; /* table and its indexes */
+	Oid *src_relfiles;
+	Oid *dst_relfiles;
+	int64 *relfile_nblocks;
+	int cur_relfile; /* relay or reship position */
+	int64 cur_block;
+	FileCopyChunkStep chunk_step;
+	bool filecopy_sent; /* query of current file copy step is sent */
+	PGresult *changed_blocks; /* of cur_relfile, to be shipped again */
+	int cur_changed; /* next of them to ship */
+	int64 nreshipped;
+
+	/*
+	 * Tasks touching the same partition run one after another, see
+	 * build_task_dag.
+	 */
+	int nblockers; /* unfinished tasks we must wait for */
+	List *dependents; /* of CopyPartState *, tasks waiting for us */
+	/* State is to be computed when task starts, see init_task */
+	bool needs_init;
+	/* Memory of running task, deleted when it is done; NULL if none */
+	MemoryContext mcxt;
+	bool finished; /* conns closed and result reported */
+
+	/*
+	 * Data channels are built; before switching metadata we wait until
+	 * flush_sync_standbys makes them sync standbys on that many nodes.
+	 */
+	bool lr_rebuilt;
+	int sync_standbys_pending;
+	struct timespec sync_standbys_deadline; /* fail if not flushed by then */
+
+	/* Got slot in active tasks window, see start_tasks */
+	bool started;
+	/* Its node is being failed over, see abort_failed_over_tasks */
+	bool aborted;
+	/* Task has started, see task_admitted */
+	bool admitted;
+	bool holds_copy_slots; /* counted in copies running on its nodes */
+	/* Nodes which refused to admit lazily started task, see start_tasks */
+	int32 *wait_nodes;
+	int nwait_nodes;
+
 	XLogRecPtr sync_point; /* when dst reached this point, it is synced */
 	CopyPartStep curstep; /* current step */
 	ExecTaskRes exec_res; /* result of the last iteration */
 	TaskRes res; /* result of the whole move */
 } CopyPartState;
 
+/*
+ * Copy channel (publication, repslot and subscription) shared by all copy
+ * part tasks with the same copy src and dst in one exec_tasks, so that src
+ * WAL is decoded once for all of them. Completion is tracked per table.
+ */
+struct CopyChannel
+{
+	char *logname; /* name of publication, repslot and subscription */
+	CopyPartState *owner; /* the task responsible for creating the channel */
+	List *members; /* of CopyPartState *, which haven't left yet */
+	int nmembers;
+	/* members which are synced and detached, failed or postponed */
+	int nleft;
+	bool creating; /* owner has begun creating the channel */
+	bool started; /* channel is created and tablesync is running */
+	bool dropped;
+	const char *copy_src_connstr;
+	const char *dst_connstr;
+	char *drop_sub_sql; /* executed on dst */
+	char *drop_pub_and_rs_sql; /* executed on copy src */
+};
+
 /* State of create replica task */
 typedef struct
 {
@@ -96,32 +265,133 @@ typedef struct
 	char *drop_cp_sub_sql;
 	char *create_data_pub_sql;
 	char *create_data_sub_sql;
-	char *sync_standby_sql;
+	char *readonly_off_sql; /* executed on src when dst is subscribed */
+	char *data_lname; /* channel src -> dst, becomes sync standby on src */
 } CreateReplicaState;
 
 /* State of move partition task */
 typedef struct
 {
 	CopyPartState cp;
-	int32 next_node; /* next replica, if exists */
-	const char *next_connstr;
-	PGconn *next_conn; /* connection to next replica */
+	/*
+	 * Next replicas fed by src: at most one in replica chain, all replicas of
+	 * primary in star.
+	 */
+	int nnext;
+	int32 *next_nodes;
+	const char **next_connstrs;
+	PGconn **next_conns;
 	int32 prev_node; /* previous replica, if exists */
 	const char *prev_connstr;
 	PGconn *prev_conn; /* connection to previous replica */
 	/* SQL executed to reconfigure LR channels */
+	char *dst_pause_sql; /* pause shared prev -> dst channel, if any */
+	char **next_pause_sqls; /* per next replica, pause dst -> next channel */
 	char *prev_sql;
 	char *dst_sql;
-	char *sync_standby_prev_sql;
-	char *next_sql;
-	char *sync_standby_dst_sql;
+	char *next_sql; /* executed on each next replica */
+	/* channels becoming sync standbys on prev and dst */
+	char *prev_dst_lname;
+	char **dst_next_lnames; /* per next replica */
+	/* warming up dst buffer cache before switching to it */
+	char *src_cached_blocks_sql;
+	char *dst_layout_sql;
+	bool prewarm_sent;
+	bool prewarm_done;
 } MovePartState;
 
+/*
+ * State of fan-out task: create several replicas reading the source only
+ * once. Source partition is COPYed in the snapshot exported by data channel
+ * repslot, and lord relays the stream to all new replicas simultaneously.
+ * New replicas are then chained one after another, src -> dst_nodes[0] ->
+ * dst_nodes[1] -> ...
+ */
+typedef struct
+{
+	CopyPartState cp; /* src is current chain tail, dst is dst_nodes[0] */
+	int ndsts;
+	int32 *dst_nodes;
+	const char **dst_connstrs;
+	PGconn **dst_conns;
+	PGconn *repl_conn; /* replication connection to src keeping the snapshot */
+	FanoutStep step;
+	int64 bytes_relayed;
+	bool src_copy_done; /* all data is read from src, flushing dsts is left */
+
+	char *src_create_pub_sql;
+	char *src_create_rs_cmd; /* replication command creating repslot */
+	char *copy_out_sql;
+	char *copy_in_sql;
+	char **dst_create_tab_sql; /* per dst */
+	char **create_data_pub_sql; /* per dst, NULL for the last one */
+	char **create_data_sub_sql; /* per dst */
+	char **prev_lnames; /* per dst, channel from node feeding it */
+	char *update_metadata_sql;
+} FanoutReplicaState;
+
+/*
+ * State of add node task: reinstall extension on the node and subscribe it
+ * to metadata. Of CopyPartState, only the execution state is used; part_name
+ * holds connstr for logging.
+ */
+typedef struct
+{
+	CopyPartState cp;
+	const char *connstr;
+	int32 node_id;
+	PGconn *conn;
+	AddNodeStep step;
+	bool sent; /* query of the current step is sent, waiting for result */
+} AddNodeState;
+
+/*
+ * State of rm node task: wait until removed node releases its metadata
+ * repslot and drop it. Everything is done locally on lord.
+ */
+typedef struct
+{
+	CopyPartState cp;
+	int32 node_id;
+	char *slot_name;
+	struct timespec started; /* when we started waiting for the slot */
+} RmNodeState;
+
+/*
+ * State of hash partition task: partition table on its node and get sql to
+ * create it elsewhere.
+ */
+typedef struct
+{
+	CopyPartState cp;
+	int32 node_id;
+	const char *connstr;
+	char *sql;
+	PGconn *conn;
+	bool sent;
+	char *create_table_sql; /* result, palloc'ed */
+} HashPartitionState;
+
 extern void init_mp_state(MovePartState *mps, const char *part_name,
 						  int32 src_node, int32 dst_node);
 extern void init_cr_state(CreateReplicaState *cps, const char *part_name,
 						   int32 dst_node);
+extern void init_fr_state(FanoutReplicaState *frs, const char *part_name,
+						  int32 *dst_nodes, int ndsts);
+extern void init_an_state(AddNodeState *ans, const char *connstr,
+						  int32 node_id);
+extern void plan_mp_state(MovePartState *mps, const char *part_name,
+						  int32 src_node, int32 dst_node);
+extern void plan_cr_state(CreateReplicaState *crs, const char *part_name,
+						  int32 dst_node);
+extern void plan_fr_state(FanoutReplicaState *frs, const char *part_name,
+						  int32 *dst_nodes, int ndsts);
+extern void init_rn_state(RmNodeState *rns, int32 node_id);
+extern void init_hp_state(HashPartitionState *hps, int32 node_id,
+						  const char *relation, const char *expr,
+						  int partitions_count);
 extern void exec_tasks(CopyPartState **tasks, int ntasks);
+extern bool exec_tasks_preemptible(CopyPartState **tasks, int ntasks);
 
 
 #endif							/* COPYPART_H */
@@ -0,0 +1,17 @@
+/* -------------------------------------------------------------------------
+ * Copyright (c) 2017, Postgres Professional
+ * -------------------------------------------------------------------------
+ */
+#ifndef MONITOR_H
+#define MONITOR_H
+
+extern long monitor_timeout(void);
+extern void monitor_nodes(void);
+extern int probe_interval(void);
+extern bool node_degraded(int32 node);
+extern bool node_failed_over(int32 node);
+extern int32 *get_healthy_workers(uint64 *num_workers);
+extern bool node_conn_allowed(const char *connstr);
+extern void node_conn_result(const char *connstr, bool ok);
+
+#endif							/* MONITOR_H */
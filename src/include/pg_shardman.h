@@ -81,12 +81,26 @@ extern int shardman_cmd_retry_naptime;
 extern int shardman_poll_interval;
 extern int shardman_my_id;
 extern bool shardman_sync_replicas;
+extern bool shardman_copy_from_replica;
+extern bool shardman_shared_data_channels;
+extern bool shardman_file_copy;
+extern bool shardman_prewarm;
+extern bool shardman_table_sync_commit;
+extern int shardman_replica_topology;
+extern int shardman_failover_timeout;
+extern int shardman_heartbeat_interval;
+extern int shardman_heartbeat_timeout;
+extern int shardman_rereplicate_interval;
+extern int shardman_rereplicate_max_tasks;
+extern int shardman_max_copies_per_node;
+extern int shardman_max_active_tasks;
 
 typedef struct Cmd
 {
 	int64 id;
 	char *cmd_type;
 	char *status;
+	int priority; /* higher goes first */
 	char **opts; /* array of n options, opts[n] is NULL */
 } Cmd;
 
@@ -102,6 +116,21 @@ typedef struct RepCount
 	int64 count;
 } RepCount;
 
+/* values of shardman.replica_topology */
+typedef enum
+{
+	REPLICA_TOPOLOGY_CHAIN,
+	REPLICA_TOPOLOGY_STAR
+} ReplicaTopology;
+
+/* How replicas of sharded table are fed, see tables.replication_mode */
+typedef enum
+{
+	REPLICATION_MODE_SYNC,
+	REPLICATION_MODE_ASYNC,
+	REPLICATION_MODE_NONE /* table is not replicated at all */
+} ReplicationMode;
+
 typedef enum
 {
 	SNT_LORD,
@@ -115,6 +144,10 @@ extern void shardlord_main(Datum main_arg);
 extern bool signal_pending(void);
 extern void check_for_sigterm(void);
 extern void cmd_canceled(Cmd *cmd);
+extern bool urgent_cmd_waiting(void);
+extern void cmd_postponed(Cmd *cmd);
+extern void rm_node(Cmd *cmd);
+extern bool node_in_cluster(int id);
 #define GET_SUBSTATE_SQL(subname) \
 	"select srsubstate, srrelid from pg_subscription_rel srel join" \
 	" pg_subscription s on srel.srsubid = s.oid where subname = '" subname "';"
@@ -127,10 +160,14 @@ extern char *get_node_connstr(int32 node_id, ShmnNodeType node_type);
 extern int32 *get_workers(uint64 *num_workers);
 extern int32 get_primary_owner(const char *part_name);
 extern int32 get_reptail_owner(const char *part_name);
-extern int32 get_next_node(const char *part_name, int32 node_id);
+extern int32 *get_next_nodes(const char *part_name, int32 node_id, int *nnext);
 extern int32 get_prev_node(const char *part_name, int32 node_id, bool *part_exists);
 extern char *get_partition_relation(const char *part_name);
+extern ReplicationMode get_replication_mode(const char *relation);
 extern Partition *get_parts(const char *relation, uint64 *num_parts);
+extern Partition *get_node_primaries(int32 node, uint64 *num_parts);
+extern Partition *get_node_partitions(int32 node, uint64 *num_parts);
+extern int64 *get_part_sizes(int32 node, char **part_names, int nparts);
 extern RepCount *get_repcount(const char *relation, uint64 *num_parts);
 extern bool node_has_partition(int32 node, const char *part_name);
 #endif							/* PG_SHARDMAN_H */
@@ -0,0 +1,14 @@
+/* -------------------------------------------------------------------------
+ * Copyright (c) 2017, Postgres Professional
+ * -------------------------------------------------------------------------
+ */
+#ifndef REREPLICATE_H
+#define REREPLICATE_H
+
+#include "pg_shardman.h"
+
+extern long rereplicate_timeout(void);
+extern void schedule_rereplication(void);
+extern void rereplicate(Cmd *cmd);
+
+#endif							/* REREPLICATE_H */
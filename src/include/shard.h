@@ -15,6 +15,10 @@ extern void create_hash_partitions(Cmd *cmd);
 extern void move_part(Cmd *cmd);
 extern void create_replica(Cmd *cmd);
 extern void rebalance(Cmd *cmd);
+extern void drain_node(Cmd *cmd);
 extern void set_replevel(Cmd *cmd);
+extern void promote_replica(Cmd *cmd);
+extern void failover(Cmd *cmd);
+extern void remove_node_parts(int32 node);
 
 #endif							/* SHARD_H */
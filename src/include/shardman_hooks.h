@@ -5,12 +5,36 @@
 #ifndef SHARDMAN_HOOKS_H
 #define SHARDMAN_HOOKS_H
 
+#include "access/xact.h"
+#include "catalog/objectaccess.h"
+#include "executor/executor.h"
 #include "storage/ipc.h"
+#include "tcop/utility.h"
 
 extern emit_log_hook_type old_log_hook;
 extern shmem_startup_hook_type old_shmem_startup_hook;
+extern ExecutorStart_hook_type old_executor_start_hook;
+extern ProcessUtility_hook_type old_process_utility_hook;
+extern object_access_hook_type old_object_access_hook;
 
 extern void shardman_log(ErrorData *edata);
+extern Size shardman_shmem_size(void);
 extern void shardman_shmem_startup(void);
+extern void readonly_replica_set(Oid relid, bool readonly);
+extern void primary_lease_renew(int64 acked, int64 token, int millis);
+extern void shardman_executor_start(QueryDesc *queryDesc, int eflags);
+extern void shardman_process_utility(PlannedStmt *pstmt,
+									 const char *queryString,
+									 ProcessUtilityContext context,
+									 ParamListInfo params,
+									 QueryEnvironment *queryEnv,
+									 DestReceiver *dest, char *completionTag);
+extern void shardman_object_access(ObjectAccessType access, Oid classId,
+								   Oid objectId, int subId, void *arg);
+extern void shardman_xact_callback(XactEvent event, void *arg);
+extern void shardman_subxact_callback(SubXactEvent event,
+									  SubTransactionId mySubid,
+									  SubTransactionId parentSubid,
+									  void *arg);
 
 #endif							/* SHARDMAN_HOOKS_H */
@@ -0,0 +1,645 @@
+/* -------------------------------------------------------------------------
+ *
+ * monitor.c
+ *		Shardlord-side health monitoring of worker nodes.
+ *
+ * Copyright (c) 2017, Postgres Professional
+ *
+ * Between commands and while tasks of a command are running, shardlord
+ * heartbeats all active workers every
+ * shardman.heartbeat_interval, all at once: it connects to each node and
+ * asks how far behind its slowest data channel subscriber is. Both connection
+ * and query must be done within shardman.heartbeat_timeout. Round trip time
+ * and replication lag are kept per node and shown in shardman.node_health.
+ *
+ * Node which failed FAILURES_TO_DEGRADE heartbeats or connection attempts of
+ * tasks in a row is degraded: circuit to it is open. New tasks are not
+ * assigned to it, and running tasks don't try to connect to it on each retry;
+ * instead, once in heartbeat interval one connection attempt is let through
+ * (the circuit is half-open). Any successful heartbeat or connection makes
+ * the node healthy again.
+ *
+ * If node hasn't answered for shardman.failover_timeout, failover command
+ * promoting replicas of its primaries is registered; it is registered once
+ * per outage, i.e. until the node answers again.
+ *
+ * To make sure failed over node doesn't take writes to its old primaries in
+ * the meanwhile (e.g. when it is cut off from shardlord only), heartbeats
+ * also renew node's lease: once a node hasn't heard from shardlord for 3/4 of
+ * failover_timeout, its primaries are read-only until the next heartbeat.
+ * Failed over node gets the lease back only after it has applied metadata
+ * written by the failover.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <poll.h>
+
+#include "access/xlog.h"
+#include "lib/stringinfo.h"
+#include "libpq-fe.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "monitor.h"
+#include "pg_shardman.h"
+
+/*
+ * Without heartbeats, nodes are probed for failover that many times during
+ * failover_timeout...
+ */
+#define PROBES_PER_TIMEOUT 4
+/* ...but not more often than once in that many ms */
+#define MIN_PROBE_INTERVAL 100
+/* Consecutive failures after which node is degraded */
+#define FAILURES_TO_DEGRADE 2
+/* Weight of the last heartbeat in smoothed rtt */
+#define RTT_ALPHA 0.25
+
+/*
+ * Lag of the slowest subscriber of node's data channels, in bytes; the same
+ * query renews the lease of node's primaries, see primary_lease_renew.
+ */
+#define HEARTBEAT_SQL \
+	"select coalesce(max(pg_wal_lsn_diff(pg_current_wal_lsn()," \
+	" confirmed_flush_lsn)), 0)::bigint," \
+	" shardman.renew_lease(" INT64_FORMAT ", " INT64_FORMAT ", %d)" \
+	" from pg_replication_slots where slot_name like 'shardman_data_%%';"
+
+typedef struct
+{
+	int32 node;
+	char *connstr;
+	TimestampTz last_seen; /* last successful heartbeat */
+	bool alive; /* answered the last heartbeat */
+	bool failed_over; /* failover registered since last_seen */
+	int nfailures; /* heartbeats and connections failed in a row */
+	bool degraded; /* circuit is open */
+	TimestampTz last_trial; /* last connection let through while degraded */
+	double rtt; /* smoothed heartbeat round trip in ms, -1 if unknown */
+	int64 lag; /* replication lag in bytes, -1 if unknown */
+	int64 lease_token; /* token of the last heartbeat node answered */
+	bool fenced; /* failed over, its lease is not renewed */
+	XLogRecPtr fence_lsn; /* node must apply metadata up to it to be unfenced */
+} NodeHealth;
+
+typedef enum
+{
+	HEARTBEAT_CONNECTING,
+	HEARTBEAT_QUERYING,
+	HEARTBEAT_DONE
+} HeartbeatPhase;
+
+/* in TopMemoryContext */
+static NodeHealth *nodes_health = NULL;
+static int nnodes_health = 0;
+static TimestampTz last_probe = 0;
+
+static bool monitor_enabled(void);
+static void refresh_nodes(void);
+static void probe_nodes(int timeout);
+static void heartbeat_done(NodeHealth *nh, PGconn *conn,
+						   TimestampTz started);
+static void node_succeeded(NodeHealth *nh);
+static void node_failed(NodeHealth *nh);
+static NodeHealth *find_node(int32 node);
+static NodeHealth *find_node_by_connstr(const char *connstr);
+static void save_health(void);
+static int lease_millis(void);
+static void unfence_if_caught_up(NodeHealth *nh);
+
+/*
+ * Millis until nodes must be probed again, -1 if monitoring is off.
+ * Ready for use as wait timeout.
+ */
+long
+monitor_timeout(void)
+{
+	long secs;
+	int usecs;
+
+	if (!monitor_enabled())
+		return -1;
+	TimestampDifference(GetCurrentTimestamp(),
+						TimestampTzPlusMilliseconds(last_probe,
+													probe_interval()),
+						&secs, &usecs);
+	return secs * 1000 + usecs / 1000;
+}
+
+/*
+ * Heartbeat nodes if it is time to, update their health and register
+ * failover of ones which don't answer for too long.
+ */
+void
+monitor_nodes(void)
+{
+	TimestampTz now;
+	int i;
+
+	if (!monitor_enabled() || monitor_timeout() > 0)
+		return;
+
+	refresh_nodes();
+	probe_nodes(Min(shardman_heartbeat_timeout, probe_interval()));
+	now = GetCurrentTimestamp();
+	last_probe = now;
+
+	for (i = 0; i < nnodes_health; i++)
+	{
+		NodeHealth *nh = &nodes_health[i];
+
+		if (nh->alive)
+		{
+			nh->last_seen = now;
+			nh->failed_over = false;
+			node_succeeded(nh);
+			if (nh->fenced)
+				unfence_if_caught_up(nh);
+			continue;
+		}
+		node_failed(nh);
+		if (shardman_failover_timeout <= 0 || nh->failed_over ||
+			!TimestampDifferenceExceeds(nh->last_seen, now,
+										shardman_failover_timeout))
+			continue;
+
+		shmn_elog(WARNING, "Node %d is not responding since %s, failing it over",
+				  nh->node, timestamptz_to_str(nh->last_seen));
+		void_spi(psprintf(
+					 "select shardman.register_cmd('failover', ARRAY['%d', '%s']);",
+					 nh->node, timestamptz_to_str(nh->last_seen)));
+		nh->failed_over = true;
+		nh->fenced = true;
+		nh->fence_lsn = InvalidXLogRecPtr;
+	}
+	save_health();
+}
+
+/* Heartbeats or failure detection are on? */
+bool
+monitor_enabled(void)
+{
+	return shardman_heartbeat_interval > 0 || shardman_failover_timeout > 0;
+}
+
+/*
+ * How often nodes are probed, in ms. With failover on, heartbeats renew the
+ * lease, so they are not sent more seldom than PROBES_PER_TIMEOUT times
+ * during failover_timeout.
+ */
+int
+probe_interval(void)
+{
+	int failover_interval = Max(shardman_failover_timeout / PROBES_PER_TIMEOUT,
+								MIN_PROBE_INTERVAL);
+
+	if (shardman_heartbeat_interval > 0 &&
+		(shardman_failover_timeout <= 0 ||
+		 shardman_heartbeat_interval < failover_interval))
+		return shardman_heartbeat_interval;
+	return failover_interval;
+}
+
+/*
+ * For how long a heartbeat renews the lease of node's primaries, 0 if
+ * failover is off and the lease is not needed. Node fails over
+ * failover_timeout after the last heartbeat it answered; the lease expires
+ * one probe interval earlier, leaving time for clock rate differences and
+ * for the writes which checked the lease just before that.
+ */
+int
+lease_millis(void)
+{
+	if (shardman_failover_timeout <= 0)
+		return 0;
+	return shardman_failover_timeout -
+		shardman_failover_timeout / PROBES_PER_TIMEOUT;
+}
+
+/*
+ * Failed over node answers again, but it might still think it holds the
+ * primaries promoted elsewhere. Don't renew its lease until the failover
+ * command is over and node has applied metadata written by it, i.e. old
+ * primaries are gone there.
+ */
+void
+unfence_if_caught_up(NodeHealth *nh)
+{
+	if (void_spi(psprintf(
+					 "select 1 from shardman.cmd_log where cmd_type = 'failover'"
+					 " and cmd_opts[1] = '%d'"
+					 " and status in ('waiting', 'in progress');",
+					 nh->node)) > 0)
+		return;
+	if (XLogRecPtrIsInvalid(nh->fence_lsn))
+	{
+		/* everything failover wrote is before that */
+		nh->fence_lsn = GetXLogInsertRecPtr();
+		return;
+	}
+	if (void_spi(psprintf(
+					 "select 1 from pg_replication_slots"
+					 " where slot_name = 'shardman_meta_sub_%d'"
+					 " and confirmed_flush_lsn >= '%X/%X';",
+					 nh->node, (uint32) (nh->fence_lsn >> 32),
+					 (uint32) nh->fence_lsn)) == 0)
+		return;
+	shmn_elog(LOG, "Node %d has applied its failover, renewing its lease",
+			  nh->node);
+	nh->fenced = false;
+}
+
+/*
+ * Is circuit to the node open? Nodes we know nothing about are healthy.
+ */
+bool
+node_degraded(int32 node)
+{
+	NodeHealth *nh = find_node(node);
+
+	return nh != NULL && nh->degraded;
+}
+
+/*
+ * Has failover of the node been registered during current outage?
+ */
+bool
+node_failed_over(int32 node)
+{
+	NodeHealth *nh = find_node(node);
+
+	return nh != NULL && nh->failed_over;
+}
+
+/*
+ * Active workers which are not degraded, in the same format as get_workers.
+ */
+int32 *
+get_healthy_workers(uint64 *num_workers)
+{
+	uint64 nworkers;
+	int32 *workers = get_workers(&nworkers);
+	uint64 i;
+
+	*num_workers = 0;
+	for (i = 0; i < nworkers; i++)
+	{
+		if (!node_degraded(workers[i]))
+			workers[(*num_workers)++] = workers[i];
+	}
+	return workers;
+}
+
+/*
+ * May task connect to node with given connstr now? If the node is degraded,
+ * only one attempt per heartbeat interval is allowed.
+ */
+bool
+node_conn_allowed(const char *connstr)
+{
+	NodeHealth *nh = find_node_by_connstr(connstr);
+	TimestampTz now;
+
+	if (nh == NULL || !nh->degraded)
+		return true;
+	now = GetCurrentTimestamp();
+	if (!TimestampDifferenceExceeds(nh->last_trial, now, probe_interval()))
+		return false;
+	nh->last_trial = now;
+	return true;
+}
+
+/*
+ * Account result of task's attempt to connect to node with given connstr.
+ */
+void
+node_conn_result(const char *connstr, bool ok)
+{
+	NodeHealth *nh = find_node_by_connstr(connstr);
+	bool was_degraded;
+
+	if (nh == NULL)
+		return;
+	was_degraded = nh->degraded;
+	if (ok)
+		node_succeeded(nh);
+	else
+		node_failed(nh);
+	if (nh->degraded != was_degraded)
+		save_health();
+}
+
+/*
+ * Sync nodes_health with the list of active workers, keeping state of known
+ * nodes. New nodes are considered just seen and healthy.
+ */
+void
+refresh_nodes(void)
+{
+	uint64 nworkers;
+	int32 *workers = get_workers(&nworkers);
+	NodeHealth *new_health;
+	uint64 i;
+	int j;
+
+	new_health = MemoryContextAllocZero(TopMemoryContext,
+										sizeof(NodeHealth) * Max(nworkers, 1));
+	for (i = 0; i < nworkers; i++)
+	{
+		new_health[i].node = workers[i];
+		new_health[i].last_seen = GetCurrentTimestamp();
+		new_health[i].rtt = -1;
+		new_health[i].lag = -1;
+		for (j = 0; j < nnodes_health; j++)
+		{
+			if (nodes_health[j].node == workers[i])
+			{
+				new_health[i] = nodes_health[j];
+				pfree(nodes_health[j].connstr);
+				break;
+			}
+		}
+		/* connstr might have changed, take the current one */
+		new_health[i].connstr = MemoryContextStrdup(
+			TopMemoryContext, get_node_connstr(workers[i], SNT_WORKER));
+	}
+
+	if (nodes_health != NULL)
+	{
+		/* forget connstrs of removed nodes */
+		for (j = 0; j < nnodes_health; j++)
+		{
+			for (i = 0; i < nworkers; i++)
+				if (new_health[i].node == nodes_health[j].node)
+					break;
+			if (i == nworkers)
+				pfree(nodes_health[j].connstr);
+		}
+		pfree(nodes_health);
+	}
+	nodes_health = new_health;
+	nnodes_health = nworkers;
+	pfree(workers);
+}
+
+/*
+ * Heartbeat all nodes in parallel and set their 'alive' flags according to
+ * whether they answered during 'timeout' ms. statement_timeout guards
+ * against leaving the query running on node if we give up earlier.
+ */
+void
+probe_nodes(int timeout)
+{
+	PGconn **conns = palloc0(sizeof(PGconn *) * Max(nnodes_health, 1));
+	PostgresPollingStatusType *polling =
+		palloc(sizeof(PostgresPollingStatusType) * Max(nnodes_health, 1));
+	HeartbeatPhase *phases = palloc(sizeof(HeartbeatPhase) *
+									Max(nnodes_health, 1));
+	struct pollfd *pfds = palloc(sizeof(struct pollfd) * Max(nnodes_health, 1));
+	int *pfd_nodes = palloc(sizeof(int) * Max(nnodes_health, 1));
+	const char *keywords[] = {"dbname", "options", NULL};
+	const char *values[] = {NULL, NULL, NULL};
+	TimestampTz started = GetCurrentTimestamp();
+	TimestampTz deadline = TimestampTzPlusMilliseconds(started, timeout);
+	int npending = 0;
+	int i;
+
+	values[1] = psprintf("-c statement_timeout=%d", timeout);
+	for (i = 0; i < nnodes_health; i++)
+	{
+		nodes_health[i].alive = false;
+		phases[i] = HEARTBEAT_DONE;
+		/* connstr is expanded in place of dbname */
+		values[0] = nodes_health[i].connstr;
+		conns[i] = PQconnectStartParams(keywords, values, 1);
+		if (conns[i] == NULL || PQstatus(conns[i]) == CONNECTION_BAD)
+		{
+			reset_pqconn(&conns[i]);
+			continue;
+		}
+		polling[i] = PGRES_POLLING_WRITING;
+		phases[i] = HEARTBEAT_CONNECTING;
+		npending++;
+	}
+
+	while (npending > 0 && !signal_pending())
+	{
+		long secs;
+		int usecs;
+		int npfds = 0;
+		int rc;
+		int j;
+
+		TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+		if (secs == 0 && usecs == 0)
+			break;
+
+		for (i = 0; i < nnodes_health; i++)
+		{
+			if (phases[i] == HEARTBEAT_DONE)
+				continue;
+			pfds[npfds].fd = PQsocket(conns[i]);
+			pfds[npfds].events = (phases[i] == HEARTBEAT_QUERYING ||
+								  polling[i] == PGRES_POLLING_READING) ?
+				POLLIN : POLLOUT;
+			pfds[npfds].revents = 0;
+			pfd_nodes[npfds++] = i;
+		}
+
+		rc = poll(pfds, npfds, secs * 1000 + usecs / 1000);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			shmn_elog(FATAL, "poll() failed: %s", strerror(errno));
+		}
+
+		for (j = 0; j < npfds; j++)
+		{
+			bool failed = false;
+
+			if (pfds[j].revents == 0)
+				continue;
+			i = pfd_nodes[j];
+			if (phases[i] == HEARTBEAT_CONNECTING)
+			{
+				polling[i] = PQconnectPoll(conns[i]);
+				if (polling[i] == PGRES_POLLING_FAILED)
+					failed = true;
+				else if (polling[i] == PGRES_POLLING_OK)
+				{
+					NodeHealth *nh = &nodes_health[i];
+
+					if (PQsendQuery(conns[i], psprintf(
+										HEARTBEAT_SQL,
+										nh->fenced ? 0 : nh->lease_token,
+										(int64) started, lease_millis())))
+						phases[i] = HEARTBEAT_QUERYING;
+					else
+						failed = true;
+				}
+			}
+			else
+			{
+				if (!PQconsumeInput(conns[i]))
+					failed = true;
+				else if (!PQisBusy(conns[i]))
+				{
+					heartbeat_done(&nodes_health[i], conns[i], started);
+					phases[i] = HEARTBEAT_DONE;
+				}
+			}
+
+			if (failed)
+			{
+				shmn_elog(DEBUG1, "Heartbeat of node %d failed: %s",
+						  nodes_health[i].node, PQerrorMessage(conns[i]));
+				phases[i] = HEARTBEAT_DONE;
+			}
+			if (phases[i] == HEARTBEAT_DONE)
+			{
+				reset_pqconn(&conns[i]);
+				npending--;
+			}
+		}
+	}
+
+	for (i = 0; i < nnodes_health; i++)
+		reset_pqconn(&conns[i]);
+	pfree(conns);
+	pfree(polling);
+	pfree(phases);
+	pfree(pfds);
+	pfree(pfd_nodes);
+}
+
+/*
+ * Heartbeat query of the node has finished; if successfully, node is alive,
+ * record its rtt and lag.
+ */
+void
+heartbeat_done(NodeHealth *nh, PGconn *conn, TimestampTz started)
+{
+	PGresult *res;
+	long secs;
+	int usecs;
+	double rtt;
+
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+		{
+			nh->alive = true;
+			nh->lag = atoll(PQgetvalue(res, 0, 0));
+			nh->lease_token = started;
+		}
+		else
+			shmn_elog(DEBUG1, "Heartbeat of node %d failed: %s",
+					  nh->node, PQerrorMessage(conn));
+		PQclear(res);
+	}
+	if (!nh->alive)
+		return;
+
+	TimestampDifference(started, GetCurrentTimestamp(), &secs, &usecs);
+	rtt = secs * 1000.0 + usecs / 1000.0;
+	nh->rtt = nh->rtt < 0 ? rtt : RTT_ALPHA * rtt + (1 - RTT_ALPHA) * nh->rtt;
+}
+
+/*
+ * Node answered: close the circuit.
+ */
+void
+node_succeeded(NodeHealth *nh)
+{
+	nh->nfailures = 0;
+	if (nh->degraded)
+	{
+		shmn_elog(LOG, "Node %d is healthy again", nh->node);
+		nh->degraded = false;
+	}
+}
+
+/*
+ * Node didn't answer: open the circuit if it fails too often.
+ */
+void
+node_failed(NodeHealth *nh)
+{
+	nh->nfailures++;
+	if (!nh->degraded && nh->nfailures >= FAILURES_TO_DEGRADE)
+	{
+		shmn_elog(WARNING, "Node %d failed %d times in a row, it is degraded"
+				  " now; no tasks will be assigned to it",
+				  nh->node, nh->nfailures);
+		nh->degraded = true;
+		nh->last_trial = GetCurrentTimestamp();
+	}
+}
+
+/*
+ * Health of given node, NULL if we don't monitor it.
+ */
+NodeHealth *
+find_node(int32 node)
+{
+	int i;
+
+	for (i = 0; i < nnodes_health; i++)
+	{
+		if (nodes_health[i].node == node)
+			return &nodes_health[i];
+	}
+	return NULL;
+}
+
+/*
+ * Same as find_node, but by worker connstr.
+ */
+NodeHealth *
+find_node_by_connstr(const char *connstr)
+{
+	int i;
+
+	for (i = 0; i < nnodes_health; i++)
+	{
+		if (strcmp(nodes_health[i].connstr, connstr) == 0)
+			return &nodes_health[i];
+	}
+	return NULL;
+}
+
+/*
+ * Publish nodes health in shardman.node_health.
+ */
+void
+save_health(void)
+{
+	StringInfoData sql;
+	int i;
+
+	initStringInfo(&sql);
+	appendStringInfoString(&sql, "delete from shardman.node_health;");
+	if (nnodes_health > 0)
+		appendStringInfoString(&sql, "insert into shardman.node_health values ");
+	for (i = 0; i < nnodes_health; i++)
+	{
+		NodeHealth *nh = &nodes_health[i];
+
+		appendStringInfo(&sql, "%s(%d, '%s', %s, %s, %d, '%s', now())",
+						 i == 0 ? "" : ", ",
+						 nh->node,
+						 nh->failed_over ? "failed" :
+						 (nh->degraded ? "degraded" : "healthy"),
+						 nh->rtt < 0 ? "null" : psprintf("%.3f", nh->rtt),
+						 nh->lag < 0 ? "null" : psprintf(INT64_FORMAT, nh->lag),
+						 nh->nfailures,
+						 timestamptz_to_str(nh->last_seen));
+	}
+	if (nnodes_health > 0)
+		appendStringInfoChar(&sql, ';');
+	void_spi(sql.data);
+	pfree(sql.data);
+}
@@ -32,11 +32,15 @@
 #include "access/xact.h"
 #include "commands/extension.h"
 #include "commands/sequence.h"
+#include "lib/stringinfo.h"
 #include "libpq-fe.h"
 
 #include "pg_shardman.h"
 #include "shard.h"
 #include "shardman_hooks.h"
+#include "copypart.h"
+#include "monitor.h"
+#include "rereplicate.h"
 
 
 /* ensure that extension won't load against incompatible version of Postgres */
@@ -44,15 +48,18 @@ PG_MODULE_MAGIC;
 
 static Cmd *next_cmd(void);
 static PGconn *listen_cmd_log_inserts(void);
-static void wait_notify(void);
+static void wait_notify(long timeout);
+static long min_timeout(long a, long b);
+static Partition *get_node_parts(int32 node, bool primaries_only,
+								 uint64 *num_parts);
 static void shardlord_sigterm(SIGNAL_ARGS);
 static void shardlord_sigusr1(SIGNAL_ARGS);
 static bool pg_shardman_installed_local(void);
 
 static void add_node(Cmd *cmd);
-static bool node_in_cluster(int id);
 
-static void rm_node(Cmd *cmd);
+/* priority of the command being executed, see urgent_cmd_waiting */
+static int cur_cmd_priority = 0;
 
 /* flags set by signal handlers */
 volatile sig_atomic_t got_sigterm = false;
@@ -66,6 +73,25 @@ int shardman_cmd_retry_naptime;
 int shardman_poll_interval;
 int shardman_my_id;
 bool shardman_sync_replicas;
+bool shardman_copy_from_replica;
+bool shardman_shared_data_channels;
+bool shardman_file_copy;
+bool shardman_prewarm;
+bool shardman_table_sync_commit;
+int shardman_replica_topology;
+int shardman_failover_timeout;
+int shardman_heartbeat_interval;
+int shardman_heartbeat_timeout;
+int shardman_rereplicate_interval;
+int shardman_rereplicate_max_tasks;
+int shardman_max_copies_per_node;
+int shardman_max_active_tasks;
+
+static const struct config_enum_entry replica_topology_options[] = {
+	{"chain", REPLICA_TOPOLOGY_CHAIN, false},
+	{"star", REPLICA_TOPOLOGY_STAR, false},
+	{NULL, 0, false}
+};
 
 /* Just global vars. */
 /* Connection to local server for LISTEN notifications. Is is global for easy
@@ -92,6 +118,20 @@ _PG_init()
 	/* remember & set hooks */
 	old_log_hook = emit_log_hook;
 	emit_log_hook = shardman_log;
+	old_executor_start_hook = ExecutorStart_hook;
+	ExecutorStart_hook = shardman_executor_start;
+	old_process_utility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = shardman_process_utility;
+	old_object_access_hook = object_access_hook;
+	object_access_hook = shardman_object_access;
+	RegisterXactCallback(shardman_xact_callback, NULL);
+	RegisterSubXactCallback(shardman_subxact_callback, NULL);
+
+	/* read-only replicas set */
+	RequestAddinShmemSpace(shardman_shmem_size());
+	RequestNamedLWLockTranche("pg_shardman", 1);
+	old_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = shardman_shmem_startup;
 
 	DefineCustomBoolVariable("shardman.shardlord",
 							 "This node is the shardlord?",
@@ -127,7 +167,7 @@ _PG_init()
 		);
 
 	DefineCustomIntVariable("shardman.cmd_retry_naptime",
-							"Sleep time in millisec between retrying to execute failing command",
+							"Maximal sleep time in millisec between retrying to execute failing command",
 							NULL,
 							&shardman_cmd_retry_naptime,
 							10000,
@@ -139,7 +179,8 @@ _PG_init()
 
 	desc = "Unfortunately, some actions are not yet implemented using proper"
 		"notifications and we need to poll the target node to learn progress."
-		"This variable specifies how often (in milliseconds) we do that.";
+		"This variable specifies the longest interval (in milliseconds) between"
+		" polls.";
 	DefineCustomIntVariable("shardman.poll_interval",
 							desc,
 							NULL,
@@ -188,6 +229,169 @@ _PG_init()
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("shardman.copy_from_replica",
+							 "Copy primary from its replica while moving it?",
+							 "If on, bulk copy of moved primary is done from its"
+							 " replica (if any), and primary itself is involved"
+							 " only during the final catch-up.",
+							 &shardman_copy_from_replica,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("shardman.file_copy",
+							 "Try to move cold primaries at relation file level?",
+							 "If on, heap and index pages of moved primary are"
+							 " shipped as is under write fence on src, provided"
+							 " that all its tuples are frozen; otherwise it is"
+							 " copied via logical replication.",
+							 &shardman_file_copy,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("shardman.prewarm",
+							 "Warm up buffer cache of moved partition?",
+							 "If on, blocks of moved partition and its indexes"
+							 " cached on src are loaded into dst buffer cache"
+							 " before switching to it.",
+							 &shardman_prewarm,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("shardman.replica_topology",
+							 "How new replicas are fed: 'chain' or 'star'",
+							 "In chain, new replica is fed by the last one,"
+							 " primary -> replica1 -> replica2; in star, all"
+							 " replicas are fed by primary directly.",
+							 &shardman_replica_topology,
+							 REPLICA_TOPOLOGY_CHAIN,
+							 replica_topology_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("shardman.table_sync_commit",
+							 "Wait on commit only for replicas of written tables?",
+							 "If on, transaction which hasn't modified any"
+							 " partition replicated by a sync data channel"
+							 " commits with synchronous_commit = local.",
+							 &shardman_table_sync_commit,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.failover_timeout",
+							"Fail over worker not responding that long, in ms",
+							"Shardlord probes workers between commands; if"
+							" node doesn't answer heartbeats for this long,"
+							" replicas of its primaries are promoted. Set it"
+							" on workers as well: their primaries are read"
+							" only when they haven't heard from shardlord"
+							" for 3/4 of it. 0 disables failure detection.",
+							&shardman_failover_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.heartbeat_interval",
+							"How often shardlord heartbeats workers, in ms",
+							"Between commands, shardlord connects to all"
+							" workers and measures round trip and replication"
+							" lag; node failing heartbeats or connections is"
+							" degraded and gets no new tasks until it answers"
+							" again. 0 disables heartbeats.",
+							&shardman_heartbeat_interval,
+							5000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.heartbeat_timeout",
+							"Connect and statement timeout of heartbeat, in ms",
+							NULL,
+							&shardman_heartbeat_timeout,
+							1000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.rereplicate_interval",
+							"How often shardlord looks for partitions lacking replicas, in ms",
+							"Partitions having less replicas than set_replevel"
+							" of their table asked for get them back in"
+							" batches, at most one batch per interval. 0"
+							" disables re-replication.",
+							&shardman_rereplicate_interval,
+							10000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.rereplicate_max_tasks",
+							"Max replicas created by one re-replication batch",
+							NULL,
+							&shardman_rereplicate_max_tasks,
+							2,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.max_copies_per_node",
+							"Max partition copies one node takes part in at once",
+							"Copy tasks of a command involving a node which"
+							" already is copy source or destination of that"
+							" many tasks wait until one of them is done. 0"
+							" means no limit.",
+							&shardman_max_copies_per_node,
+							4,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("shardman.max_active_tasks",
+							"Max tasks of one command in progress at once",
+							"Other tasks wait for their turn, and their state"
+							" is not even computed until then, so lord memory"
+							" and connections don't grow with number of"
+							" partitions. 0 means no limit.",
+							&shardman_max_active_tasks,
+							64,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("shardman.shared_data_channels",
+							 "Replicate all partitions between two nodes via one channel?",
+							 "If on, there is one pub, repslot and sub per pair of"
+							 " nodes instead of one per partition replica. Must"
+							 " be the same on all nodes of the cluster.",
+							 &shardman_shared_data_channels,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+
 
 	if (shardman_shardlord)
 	{
@@ -216,6 +420,10 @@ _PG_fini(void)
 {
 	/* Uninstall hooks. */
 	emit_log_hook = old_log_hook;
+	shmem_startup_hook = old_shmem_startup_hook;
+	ExecutorStart_hook = old_executor_start_hook;
+	ProcessUtility_hook = old_process_utility_hook;
+	object_access_hook = old_object_access_hook;
 }
 
 /*
@@ -262,6 +470,9 @@ shardlord_main(Datum main_arg)
 		{
 			char **opts;
 
+			/* Keep heartbeating while commands are queued */
+			monitor_nodes();
+			cur_cmd_priority = cmd->priority;
 			update_cmd_status(cmd->id, "in progress");
 			shmn_elog(DEBUG1, "Working on command %ld, %s, opts are",
 				 cmd->id, cmd->cmd_type);
@@ -281,13 +492,23 @@ shardlord_main(Datum main_arg)
 				rebalance(cmd);
 			else if (strcmp(cmd->cmd_type, "set_replevel") == 0)
 				set_replevel(cmd);
+			else if (strcmp(cmd->cmd_type, "promote_replica") == 0)
+				promote_replica(cmd);
+			else if (strcmp(cmd->cmd_type, "failover") == 0)
+				failover(cmd);
+			else if (strcmp(cmd->cmd_type, "rereplicate") == 0)
+				rereplicate(cmd);
+			else if (strcmp(cmd->cmd_type, "drain_node") == 0)
+				drain_node(cmd);
 			else
 				shmn_elog(FATAL, "Unknown cmd type %s", cmd->cmd_type);
 			MemoryContextReset(cmd_ctx);
 		}
 		MemoryContextSwitchTo(old_ctx);
-		wait_notify();
+		wait_notify(min_timeout(monitor_timeout(), rereplicate_timeout()));
 		check_for_sigterm();
+		monitor_nodes();
+		schedule_rereplication();
 	}
 }
 
@@ -336,15 +557,17 @@ listen_cmd_log_inserts(void)
 }
 
 /*
- * Wait until NOTIFY or signal arrives. If select is alerted, but there are
- * no notifcations, we also return.
+ * Wait until NOTIFY or signal arrives, or timeout millis pass (-1 means
+ * forever). If select is alerted, but there are no notifcations, we also
+ * return.
  */
 void
-wait_notify()
+wait_notify(long timeout)
 {
 	int			sock;
 	fd_set		input_mask;
     PGnotify   *notify;
+	struct timeval tv;
 
 	sock = PQsocket(conn);
 	if (sock < 0)
@@ -353,7 +576,10 @@ wait_notify()
 	FD_ZERO(&input_mask);
 	FD_SET(sock, &input_mask);
 
-	if (select(sock + 1, &input_mask, NULL, NULL, NULL) < 0)
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if (select(sock + 1, &input_mask, NULL, NULL,
+			   timeout < 0 ? NULL : &tv) < 0)
 	{
 		if (errno == EINTR)
 			return; /* signal has arrived */
@@ -373,6 +599,19 @@ wait_notify()
 	return;
 }
 
+/*
+ * Smaller of two wait timeouts, where -1 means infinity.
+ */
+long
+min_timeout(long a, long b)
+{
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return Min(a, b);
+}
+
 /*
  * Retrieve next cmd to work on -- uncompleted command with min id.
  * Returns NULL if queue is empty. Memory is allocated in the current cxt.
@@ -389,10 +628,10 @@ next_cmd(void)
 
 	SPI_PROLOG;
 
-	/* Get the oldest pending task (id + cmd_type) */
-	sql = "select id, cmd_type from shardman.cmd_log"
+	/* Get the most urgent, then the oldest pending task */
+	sql = "select id, cmd_type, priority from shardman.cmd_log"
 		  " where status in ('waiting', 'in progress')"
-		  " order by id asc"
+		  " order by priority desc, id asc"
 		  " limit 1;";
 	e = SPI_execute(sql, true, 0);
 	if (e < 0)
@@ -405,6 +644,7 @@ next_cmd(void)
 		bool			isnull;
 		int				cmd_id_attr,
 						cmd_type_attr,
+						priority_attr,
 						opt_attr;
 		uint64			i;
 
@@ -417,6 +657,8 @@ next_cmd(void)
 		Assert(cmd_id_attr != SPI_ERROR_NOATTRIBUTE);
 		cmd_type_attr = SPI_fnumber(rowdesc, "cmd_type");
 		Assert(cmd_type_attr != SPI_ERROR_NOATTRIBUTE);
+		priority_attr = SPI_fnumber(rowdesc, "priority");
+		Assert(priority_attr != SPI_ERROR_NOATTRIBUTE);
 
 		/* copy the command itself to callee context */
 		spicxt = MemoryContextSwitchTo(oldcxt);
@@ -425,6 +667,9 @@ next_cmd(void)
 											  cmd_id_attr,
 											  &isnull));
 		cmd->cmd_type = SPI_getvalue(tuple, rowdesc, cmd_type_attr);
+		cmd->priority = DatumGetInt32(SPI_getbinval(tuple, rowdesc,
+													priority_attr,
+													&isnull));
 		MemoryContextSwitchTo(spicxt);
 
 		/* Now get options. sql will be freed by SPI_finish */
@@ -543,7 +788,35 @@ cmd_canceled(Cmd *cmd)
 }
 
 /*
- * Adding node consists of
+ * Is there a waiting command more urgent than the one being executed?
+ */
+bool
+urgent_cmd_waiting(void)
+{
+	char *sql = psprintf(
+		"select 1 from shardman.cmd_log where status = 'waiting' and"
+		" priority > %d limit 1;", cur_cmd_priority);
+	bool res = void_spi(sql) > 0;
+
+	pfree(sql);
+	return res;
+}
+
+/*
+ * Command gave way to more urgent one; it will be picked up again after it,
+ * and must continue from where it stopped.
+ */
+void
+cmd_postponed(Cmd *cmd)
+{
+	shmn_elog(INFO, "Command %ld postponed in favor of more urgent one",
+			  cmd->id);
+	update_cmd_status(cmd->id, "waiting");
+}
+
+/*
+ * Add one or several nodes, cmd opts are their connstrings. Adding node
+ * consists of
  * - verifying the node is not in the cluster, i.e. 'nodes' table
  * - reinstalling extenstion
  * - recreating repslot
@@ -552,219 +825,81 @@ cmd_canceled(Cmd *cmd)
  * - waiting for initial tablesync
  * - add node to the nodes table and cmd as success
  * We do all this stuff to make all actions are idempodent to be able to retry
- * them in case of any failure.
- * TODO: orphan repslot is possible if cmd canceled.
+ * them in case of any failure. Nodes are bootstrapped in parallel by add
+ * node tasks, see exec_add_node; those which succeeded are added in one txn
+ * with cmd status update. Metadata repslots made on lord for nodes which
+ * were not added, also when the cmd is canceled, are dropped.
  */
 void
 add_node(Cmd *cmd)
 {
-	PGconn *conn = NULL;
-	const char *connstr = cmd->opts[0];
-    PGresult *res = NULL;
-	bool pg_shardman_installed;
-	int32 node_id;
-	char *sql;
-	bool tablesync_done = false;
-
-	shmn_elog(INFO, "Adding node %s", connstr);
-	/*
-	 * Generate node id beforehand to tell it to the node. This is safe since
-	 * shardlord is single-threaded.
-	 */
-	StartTransactionCommand();
-	node_id = DatumGetInt32(
-		DirectFunctionCall1Coll(
-			nextval, InvalidOid,
-			PointerGetDatum(cstring_to_text("shardman.nodes_id_seq"))));
-	CommitTransactionCommand();
-	/* Try to execute command indefinitely until it succeeded or canceled */
-	while (1948)
+	int nnodes;
+	AddNodeState **tasks;
+	StringInfoData sql;
+	int nadded = 0;
+	int i;
+
+	for (nnodes = 0; cmd->opts[nnodes] != NULL; nnodes++);
+	tasks = palloc(sizeof(AddNodeState *) * Max(nnodes, 1));
+	for (i = 0; i < nnodes; i++)
 	{
-		conn = PQconnectdb(connstr);
-		if (PQstatus(conn) != CONNECTION_OK)
-		{
-			shmn_elog(NOTICE,
-					  "add_node %s: connection to add_node node failed: %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-
-		/* Check if our extension is installed on the node */
-		res = PQexec(conn,
-					 "select installed_version from pg_available_extensions"
-					 " where name = 'pg_shardman';");
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		{
-			shmn_elog(NOTICE,
-					  "add_node %s: failed to check whether pg_shardman is installed, %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		pg_shardman_installed = PQntuples(res) == 1 && !PQgetisnull(res, 0, 0);
-		PQclear(res);
-
-		if (pg_shardman_installed)
-		{
-			/* extension is installed, so we have to check whether this node
-			 * is already in the cluster */
-			res = PQexec(conn, "select shardman.my_id();");
-			if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			{
-				shmn_elog(NOTICE, "add_node %s: failed to get node id, %s",
-						  connstr, PQerrorMessage(conn));
-				goto attempt_failed;
-			}
-
-			if (!PQgetisnull(res, 0, 0))
-			{
-				/* Node is in cluster. Was it there before we started adding? */
-				node_id = atoi(PQgetvalue(res, 0, 0));
-				elog(DEBUG1, "node in cluster, %d", node_id);
-				PQclear(res);
-				if (node_in_cluster(node_id))
-				{
-					shmn_elog(WARNING, "node %d with connstring %s is already"
-							  " in cluster, won't add it.", node_id, connstr);
-					PQfinish(conn);
-					update_cmd_status(cmd->id, "failed");
-					return;
-				}
-			}
-			else
-				PQclear(res);
-		}
+		int32 node_id;
 
+		shmn_elog(INFO, "Adding node %s", cmd->opts[i]);
 		/*
-		 * reinstall the extension to reset its state, whether is was
-		 * installed before or not.
+		 * Generate node id beforehand to tell it to the node. This is safe
+		 * since shardlord is single-threaded.
 		 */
-		res = PQexec(conn, "drop extension if exists pg_shardman;"
-					 " create extension pg_shardman;");
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		{
-			shmn_elog(NOTICE, "add_node %s: failed to reinstall pg_shardman, %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		PQclear(res);
-
-		/* Create replication slot */
-		sql = psprintf("select shardman.create_repslot('shardman_meta_sub_%d');",
-					   node_id);
-		void_spi(sql);
-		pfree(sql);
-
-		/* Create subscription and set node id on itself */
-		sql = psprintf(
-			"create subscription shardman_meta_sub connection '%s'"
-			" publication shardman_meta_pub with (create_slot = false,"
-			" slot_name = 'shardman_meta_sub_%d');"
-			" select shardman.set_my_id(%d);",
-			shardman_shardlord_connstring, node_id, node_id);
-		res = PQexec(conn, sql);
-		pfree(sql);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		{
-			shmn_elog(NOTICE, "add_node %s: failed to create subscription and set node id, %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		/* Alter system can't be executed in one multi-command string */
-		PQclear(res);
-		sql = psprintf("alter system set shardman.my_id to %d;", node_id);
-		res = PQexec(conn, sql);
-		pfree(sql);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		{
-			shmn_elog(NOTICE, "add_node %s: failed to set my_id guc, %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		PQclear(res);
-		res = PQexec(conn, "select pg_reload_conf();");
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		{
-			shmn_elog(NOTICE, "add_node %s: failed to reload conf, %s",
-					  connstr, PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		PQclear(res);
-
-		/*
-		 * Wait until initial tablesync is completed. This is necessary as
-		 * e.g. we might miss UPDATE statements on partitions table, triggers
-		 * on newly added node won't fire and metadata would be inconsistent.
-		 */
-		sql = GET_SUBSTATE_SQL("shardman_meta_sub");
-		while (!tablesync_done)
-		{
-			int i;
-
-			res = PQexec(conn, sql);
-			if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			{
-				shmn_elog(NOTICE, "add_node %s: failed to learn sub status, %s ",
-						  connstr, PQerrorMessage(conn));
-				goto attempt_failed;
-			}
-
-			tablesync_done = true;
-			for (i = 0; i < PQntuples(res); i++)
-			{
-				char subrelstate = PQgetvalue(res, i, 0)[0];
-				char *subrelid = PQgetvalue(res, i, 1);
-				if (subrelstate != SUBREL_STATE_READY)
-				{
-					tablesync_done = false;
-					shmn_elog(DEBUG1,
-							  "add_node %s: init sync is not yet finished"
-							  " for rel %s, its state is %c",
-							  connstr, subrelid, subrelstate);
-					pg_usleep(shardman_poll_interval * 1000L);
-					SHMN_CHECK_FOR_INTERRUPTS();
-					if (got_sigusr1)
-					{
-						reset_pqconn_and_res(&conn, res);
-						cmd_canceled(cmd);
-						return;
-					}
-					break;
-				}
-			}
-			PQclear(res);
-		}
-
-		reset_pqconn(&conn);
+		StartTransactionCommand();
+		node_id = DatumGetInt32(
+			DirectFunctionCall1Coll(
+				nextval, InvalidOid,
+				PointerGetDatum(cstring_to_text("shardman.nodes_id_seq"))));
+		CommitTransactionCommand();
+		tasks[i] = palloc0(sizeof(AddNodeState));
+		init_an_state(tasks[i], cmd->opts[i], node_id);
+	}
 
-		/*
-		 * Mark add_node cmd as success and node as active, we must do that in
-		 * one txn.
-		 */
-		sql = psprintf(
-			"insert into shardman.nodes values (%d, '%s', 'active', false, %ld);"
-			" update shardman.cmd_log set status = 'success' where id = %ld;",
-			node_id, connstr, cmd->id, cmd->id);
-		void_spi(sql);
-		pfree(sql);
+	exec_tasks((CopyPartState **) tasks, nnodes);
+	for (i = 0; i < nnodes; i++)
+	{
+		if (tasks[i]->cp.res != TASK_SUCCESS &&
+			tasks[i]->step >= ADDNODE_SUBSCRIBE)
+			void_spi(psprintf(
+						 "select shardman.drop_repslot('shardman_meta_sub_%d', true);",
+						 tasks[i]->node_id));
+	}
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
 
-		/* done */
+	/*
+	 * Mark add_node cmd as finished and added nodes as active, we must do
+	 * that in one txn.
+	 */
+	initStringInfo(&sql);
+	for (i = 0; i < nnodes; i++)
+	{
+		if (tasks[i]->cp.res != TASK_SUCCESS)
+			continue;
+		appendStringInfo(
+			&sql, "insert into shardman.nodes values (%d, '%s', 'active', false, %ld);",
+			tasks[i]->node_id, tasks[i]->connstr, cmd->id);
 		shmn_elog(INFO, "Node %s successfully added, it is assigned id %d",
-			 connstr, node_id);
-		return;
-
-attempt_failed: /* clean resources, sleep, check sigusr1 and try again */
-		reset_pqconn_and_res(&conn, res);
-		shmn_elog(LOG, "Attempt to execute add_node failed, sleeping and retrying");
-		/* TODO: sleep using waitlatch? */
-		pg_usleep(shardman_cmd_retry_naptime * 1000L);
-		SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+				  tasks[i]->connstr, tasks[i]->node_id);
+		nadded++;
 	}
+	appendStringInfo(&sql,
+					 " update shardman.cmd_log set status = '%s' where id = %ld;",
+					 nadded == nnodes ? "success" : "failed", cmd->id);
+	void_spi(sql.data);
+	pfree(sql.data);
+	if (nadded != nnodes)
+		shmn_elog(WARNING, "%d of %d nodes were added", nadded, nnodes);
 }
 
 /*
  * Returns true, if node 'id' is active node in cluster or rm in progress
  */
-static bool
+bool
 node_in_cluster(int id)
 {
 	char *sql;
@@ -788,10 +923,12 @@ node_in_cluster(int id)
  * Remove node, losing all data on it. We
  * - ensure that there is active node with given id in the cluster
  * - mark node as rm_in_progress and commit so this reaches node via LR
- * - wait a bit to let it unsubscribe
- * - drop replication slot, remove node row and mark cmd as success
+ * - once it unsubscribes, drop replication slot, remove node row and mark
+ *   cmd as success
  * Everything is idempotent. Note that we are not allowed to remove repl slot
- * when the walsender connection is alive, that's why we sleep here.
+ * when the walsender connection is alive, that's why rm node task waits for
+ * it to exit, see exec_rm_node. Also used by drain_node, opts[1] must be set
+ * then too.
  */
 void
 rm_node(Cmd *cmd)
@@ -801,14 +938,11 @@ rm_node(Cmd *cmd)
 	char *sql;
 	int e;
 	int64 parts_on_node;
+	RmNodeState rns = {0};
+	CopyPartState *tasks[1];
 
 	if (force)
-	{
-		sql = psprintf("delete from shardman.partitions where owner=%d",
-					   node_id);
-		void_spi(sql);
-		pfree(sql);
-	}
+		remove_node_parts(node_id);
 	else
 	{
 		bool isnull;
@@ -849,21 +983,24 @@ rm_node(Cmd *cmd)
 	void_spi(sql);
 	pfree(sql);
 
-	/* Let node drop the subscription */
-	pg_usleep(2 * 1000000L);
+	/* Wait for the node to release its meta repslot without blocking */
+	init_rn_state(&rns, node_id);
+	tasks[0] = (CopyPartState *) &rns;
+	exec_tasks(tasks, 1);
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	if (rns.cp.res != TASK_SUCCESS)
+	{
+		/* node stays rm_in_progress, so rm_node can be run again */
+		shmn_elog(WARNING, "Failed to drop metadata repslot of node %d",
+				  node_id);
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
 
-	/*
-	 * It is extremely unlikely that node still keeps walsender process
-	 * connected but ignored our node status update, so this should succeed.
-	 * If not, bgw exits, but postmaster will restart us to try again.
-	 * TODO: at this stage, user can't cancel command at all, this should be
-	 * fixed.
-	 */
 	sql = psprintf(
-		"select shardman.drop_repslot('shardman_meta_sub_%d', true);"
 		"update shardman.nodes set worker_status = 'removed' where id = %d;"
 		"update shardman.cmd_log set status = 'success' where id = %ld;",
-		node_id, node_id, cmd->id);
+		node_id, cmd->id);
 	void_spi(sql);
 	pfree(sql);
 	elog(INFO, "Node %d successfully removed", node_id);
@@ -956,7 +1093,8 @@ get_node_connstr(int32 node_id, ShmnNodeType node_type)
 int32 *
 get_workers(uint64 *num_workers)
 {
-	char *sql = "select id from shardman.nodes where worker_status = 'active'";
+	char *sql = "select id from shardman.nodes where worker_status = 'active'"
+		" order by id";
 	bool isnull;
 	int32 *workers;
 	TupleDesc rowdesc;
@@ -1054,39 +1192,43 @@ get_reptail_owner(const char *part_name)
 }
 
 /*
- * Get node on which replica next to 'node_id' node in the 'part_name' replica
- * chain resides. SHMN_INVALID_NODE_ID is returned if such partition doesn't
- * exist at all or there is no next replica.
+ * Get nodes with replicas fed from 'node_id' node, i.e. having it as prv: at
+ * most one in replica chain, but all replicas of primary in star topology.
+ * Their number is stored in *nnext.
  */
-int32
-get_next_node(const char *part_name, int32 node_id)
+int32 *
+get_next_nodes(const char *part_name, int32 node_id, int *nnext)
 {
 	char *sql;
 	bool isnull;
-	int32 next;
+	int32 *nexts;
+	MemoryContext spicxt;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	int i;
 	SPI_XACT_STATUS;
 
 	SPI_PROLOG;
 	sql = psprintf( /* allocated in SPI ctxt, freed with ctxt release */
-		"select nxt from shardman.partitions where part_name = '%s'"
-		" and owner = %d;", part_name, node_id);
+		"select owner from shardman.partitions where part_name = '%s'"
+		" and prv = %d order by owner;", part_name, node_id);
 
 	if (SPI_execute(sql, true, 0) < 0)
 		shmn_elog(FATAL, "Stmt failed : %s", sql);
 
-	if (SPI_processed == 0)
-		next = SHMN_INVALID_NODE_ID;
-	else
+	*nnext = SPI_processed;
+	/* We need to allocate in our ctxt, not spi's */
+	spicxt = MemoryContextSwitchTo(oldcxt);
+	nexts = palloc(sizeof(int32) * Max(*nnext, 1));
+	MemoryContextSwitchTo(spicxt);
+	for (i = 0; i < *nnext; i++)
 	{
-		next = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
-										   SPI_tuptable->tupdesc,
-										   1, &isnull));
-		if (isnull)
-			next = SHMN_INVALID_NODE_ID;
+		nexts[i] = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
+											   SPI_tuptable->tupdesc,
+											   1, &isnull));
 	}
 
 	SPI_EPILOG;
-	return next;
+	return nexts;
 }
 
 /*
@@ -1163,6 +1305,48 @@ node_has_partition(int32 node, const char *part_name)
 	return count != 0;
 }
 
+/*
+ * Get replication mode of sharded table 'relation'. If it is not set
+ * explicitly, shardman.sync_replicas decides between sync and async.
+ */
+ReplicationMode
+get_replication_mode(const char *relation)
+{
+	char *sql;
+	ReplicationMode mode;
+	SPI_XACT_STATUS;
+
+	SPI_PROLOG;
+
+	sql = psprintf("select replication_mode from shardman.tables"
+				   " where relation = '%s';", relation);
+
+	if (SPI_execute(sql, true, 0) < 0)
+	{
+		shmn_elog(FATAL, "Stmt failed : %s", sql);
+	}
+
+	mode = shardman_sync_replicas ? REPLICATION_MODE_SYNC :
+		REPLICATION_MODE_ASYNC;
+	if (SPI_processed != 0)
+	{
+		char *val = SPI_getvalue(SPI_tuptable->vals[0],
+								 SPI_tuptable->tupdesc, 1);
+
+		if (val == NULL)
+			;
+		else if (strcmp(val, "sync") == 0)
+			mode = REPLICATION_MODE_SYNC;
+		else if (strcmp(val, "async") == 0)
+			mode = REPLICATION_MODE_ASYNC;
+		else
+			mode = REPLICATION_MODE_NONE;
+	}
+
+	SPI_EPILOG;
+	return mode;
+}
+
 /*
  * Get relation name of partition part_name. Memory is palloc'ed.
  * NULL is returned, if there is no such partition.
@@ -1221,8 +1405,8 @@ get_parts(const char *relation, uint64 *num_parts)
 
 	SPI_PROLOG;
 	sql = psprintf( /* allocated in SPI ctxt, freed with ctxt release */
-		"select part_name, owner from shardman.partitions where relation = '%s';",
-		relation);
+		"select part_name, owner from shardman.partitions where relation = '%s'"
+		" order by part_name, owner;", relation);
 
 	if (SPI_execute(sql, true, 0) < 0)
 		shmn_elog(FATAL, "Stmt failed : %s", sql);
@@ -1245,6 +1429,124 @@ get_parts(const char *relation, uint64 *num_parts)
 	return parts;
 }
 
+/*
+ * Get array with primary partitions held by given node. Memory is palloced,
+ * size is returned in 'numparts'.
+ */
+Partition *
+get_node_primaries(int32 node, uint64 *num_parts)
+{
+	return get_node_parts(node, true, num_parts);
+}
+
+/*
+ * Same, but both primaries and replicas.
+ */
+Partition *
+get_node_partitions(int32 node, uint64 *num_parts)
+{
+	return get_node_parts(node, false, num_parts);
+}
+
+/*
+ * Partitions held by node, only primaries or all.
+ */
+Partition *
+get_node_parts(int32 node, bool primaries_only, uint64 *num_parts)
+{
+	char *sql;
+	bool isnull;
+	Partition *parts;
+	TupleDesc rowdesc;
+	MemoryContext spicxt;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	uint64 i;
+	SPI_XACT_STATUS;
+
+	SPI_PROLOG;
+	sql = psprintf( /* allocated in SPI ctxt, freed with ctxt release */
+		"select part_name, owner from shardman.partitions where owner = %d"
+		"%s;", node, primaries_only ? " and prv is null" : "");
+
+	if (SPI_execute(sql, true, 0) < 0)
+		shmn_elog(FATAL, "Stmt failed : %s", sql);
+	rowdesc = SPI_tuptable->tupdesc;
+
+	*num_parts = SPI_processed;
+	/* We need to allocate in our ctxt, not spi's */
+	spicxt = MemoryContextSwitchTo(oldcxt);
+	parts = palloc(sizeof(Partition) * Max(*num_parts, 1));
+	for (i = 0; i < *num_parts; i++)
+	{
+		HeapTuple tuple = SPI_tuptable->vals[i];
+		parts[i].part_name = SPI_getvalue(tuple, rowdesc, 1);
+		parts[i].owner = DatumGetInt32(SPI_getbinval(tuple, rowdesc, 2,
+													 &isnull));
+	}
+	MemoryContextSwitchTo(spicxt);
+
+	SPI_EPILOG;
+	return parts;
+}
+
+/*
+ * Ask node how large (with indexes and toast) given partitions are. Returns
+ * palloced array of sizes in bytes, -1 where unknown: if node is degraded or
+ * unreachable, all of them.
+ */
+int64 *
+get_part_sizes(int32 node, char **part_names, int nparts)
+{
+	int64 *sizes = palloc(sizeof(int64) * Max(nparts, 1));
+	char *connstr = get_node_connstr(node, SNT_WORKER);
+	StringInfoData sql;
+	PGconn *conn;
+	PGresult *res;
+	int i;
+	int j;
+
+	for (i = 0; i < nparts; i++)
+		sizes[i] = -1;
+	if (nparts == 0 || connstr == NULL || node_degraded(node))
+		return sizes;
+
+	initStringInfo(&sql);
+	appendStringInfoString(&sql, "select p, pg_total_relation_size(p::regclass)"
+						   " from unnest(ARRAY[");
+	for (i = 0; i < nparts; i++)
+		appendStringInfo(&sql, "%s'%s'", i == 0 ? "" : ", ", part_names[i]);
+	appendStringInfoString(&sql, "]::text[]) p;");
+
+	conn = PQconnectdb(connstr);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		shmn_elog(DEBUG1, "Failed to get part sizes from node %d: %s",
+				  node, PQerrorMessage(conn));
+		node_conn_result(connstr, false);
+		reset_pqconn(&conn);
+		pfree(sql.data);
+		return sizes;
+	}
+	res = PQexec(conn, sql.data);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK)
+	{
+		for (i = 0; i < PQntuples(res); i++)
+		{
+			for (j = 0; j < nparts; j++)
+			{
+				if (strcmp(part_names[j], PQgetvalue(res, i, 0)) == 0)
+					sizes[j] = atoll(PQgetvalue(res, i, 1));
+			}
+		}
+	}
+	else
+		shmn_elog(DEBUG1, "Failed to get part sizes from node %d: %s",
+				  node, PQerrorMessage(conn));
+	reset_pqconn_and_res(&conn, res);
+	pfree(sql.data);
+	return sizes;
+}
+
 /*
  * Calculate how many replicas has each partitions of given relation
  */
@@ -0,0 +1,157 @@
+/* -------------------------------------------------------------------------
+ *
+ * prewarm.c
+ *		SQL functions for warming up buffer cache of moved partitions.
+ *
+ * Copyright (c) 2017, Postgres Professional
+ *
+ * Before switching partition to the new location, shardlord asks src which
+ * blocks of the partition and its indexes are cached there and loads the
+ * corresponding blocks on dst, so that queries don't hit cold cache right
+ * after the move.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "storage/buf_internals.h"
+#include "storage/bufmgr.h"
+#include "utils/array.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+
+#include "pg_shardman.h"
+
+typedef struct
+{
+	BlockNumber blkno;
+	int usage_count;
+} CachedBlock;
+
+static void check_relation_select(Oid relid);
+static int cached_block_cmp(const void *a, const void *b);
+
+/*
+ * Numbers of main fork blocks of given relation which are currently in
+ * shared buffers, the most used first. Like pg_buffercache, we don't lock
+ * the whole buffer pool, so the result is not a consistent snapshot, which is
+ * fine for the purpose.
+ */
+PG_FUNCTION_INFO_V1(cached_blocks);
+Datum
+cached_blocks(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	Relation rel;
+	CachedBlock *blocks;
+	int nblocks = 0;
+	Datum *elems;
+	int i;
+
+	check_relation_select(relid);
+	rel = relation_open(relid, AccessShareLock);
+	blocks = palloc(sizeof(CachedBlock) * NBuffers);
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		uint32 buf_state = LockBufHdr(bufHdr);
+
+		if ((buf_state & BM_VALID) &&
+			RelFileNodeEquals(bufHdr->tag.rnode, rel->rd_node) &&
+			bufHdr->tag.forkNum == MAIN_FORKNUM)
+		{
+			blocks[nblocks].blkno = bufHdr->tag.blockNum;
+			blocks[nblocks].usage_count = BUF_STATE_GET_USAGECOUNT(buf_state);
+			nblocks++;
+		}
+		UnlockBufHdr(bufHdr, buf_state);
+	}
+	relation_close(rel, AccessShareLock);
+
+	qsort(blocks, nblocks, sizeof(CachedBlock), cached_block_cmp);
+	elems = palloc(sizeof(Datum) * Max(nblocks, 1));
+	for (i = 0; i < nblocks; i++)
+		elems[i] = Int64GetDatum((int64) blocks[i].blkno);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nblocks, INT8OID, 8,
+										  FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Like pg_prewarm, peeking at or loading the relation's blocks requires
+ * SELECT on it.
+ */
+void
+check_relation_select(Oid relid)
+{
+	AclResult aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(relid));
+}
+
+/* Hotter blocks first */
+int
+cached_block_cmp(const void *a, const void *b)
+{
+	const CachedBlock *ba = (const CachedBlock *) a;
+	const CachedBlock *bb = (const CachedBlock *) b;
+
+	if (ba->usage_count != bb->usage_count)
+		return bb->usage_count - ba->usage_count;
+	return ba->blkno < bb->blkno ? -1 : (ba->blkno > bb->blkno ? 1 : 0);
+}
+
+/*
+ * Load into shared buffers main fork blocks of relation listed in blocks,
+ * which are blocks cached on src with src_nblocks blocks in relation. If
+ * relation has another size here, e.g. because it was copied via LR and so
+ * tuples were packed differently, block numbers are scaled accordingly, which
+ * is only an approximation, especially for indexes. Returns number of blocks
+ * loaded.
+ */
+PG_FUNCTION_INFO_V1(prewarm_blocks);
+Datum
+prewarm_blocks(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	ArrayType *blocks_arr = PG_GETARG_ARRAYTYPE_P(1);
+	int64 src_nblocks = PG_GETARG_INT64(2);
+	Relation rel;
+	BlockNumber nblocks;
+	Datum *blocks;
+	bool *nulls;
+	int nelems;
+	int64 loaded = 0;
+	int i;
+
+	check_relation_select(relid);
+	rel = relation_open(relid, AccessShareLock);
+	nblocks = RelationGetNumberOfBlocks(rel);
+	deconstruct_array(blocks_arr, INT8OID, 8, FLOAT8PASSBYVAL, 'd',
+					  &blocks, &nulls, &nelems);
+	for (i = 0; i < nelems && src_nblocks > 0; i++)
+	{
+		int64 blkno;
+
+		if (nulls[i])
+			continue;
+		blkno = DatumGetInt64(blocks[i]);
+		if (nblocks != src_nblocks)
+			blkno = blkno * nblocks / src_nblocks;
+		if (blkno < 0 || blkno >= nblocks)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+		ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM, (BlockNumber) blkno,
+										 RBM_NORMAL, NULL));
+		loaded++;
+	}
+
+	relation_close(rel, AccessShareLock);
+	PG_RETURN_INT64(loaded);
+}
@@ -0,0 +1,377 @@
+/* -------------------------------------------------------------------------
+ *
+ * relfile.c
+ *		SQL functions for copying partitions at relation file level.
+ *
+ * Copyright (c) 2017, Postgres Professional
+ *
+ * Cold partition can be moved much faster by shipping its heap and indexes
+ * pages as is instead of reinserting every tuple via LR. Shardlord reads the
+ * pages on src with relfile_read and writes them on dst with relfile_write
+ * into freshly created table in the same transaction, so that if anything
+ * goes wrong the table just disappears on abort. Pages are shipped without
+ * blocking writes; then shardlord takes write fence on the partition and
+ * ships again only pages which relfile_changed_blocks reports as modified
+ * since the copy started, which is normally none of them.
+ *
+ * Pages are meaningful on another cluster only if they don't reference
+ * anything cluster-specific. Thus we require that
+ * - all heap tuples are frozen and not locked/updated, so xids are not
+ *   needed -- that's what makes the partition 'cold' enough;
+ * - TOAST table is empty, since toast pointers contain toast relation oid;
+ * - all indexes are btree, which doesn't keep LSNs on pages (unlike GiST's
+ *   NSN);
+ * - tuple descriptors and index definitions are the same on both ends; this is
+ *   checked by shardlord comparing relfile_layout outputs.
+ * Pages are WAL-logged on dst as full page images, which also sets their
+ * LSNs to dst ones.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/transam.h"
+#include "access/xloginsert.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+#include "catalog/storage.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "storage/smgr.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/inval.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+
+#include "pg_shardman.h"
+
+static void check_heap_page_frozen(Relation rel, Page page, BlockNumber blkno);
+static void check_created_in_xact(Relation rel);
+
+/*
+ * Check that partition can be copied at file level, ERROR if not. See top
+ * comment for the requirements; frozenness is checked later in relfile_read.
+ */
+PG_FUNCTION_INFO_V1(relfile_copy_check);
+Datum
+relfile_copy_check(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	Relation rel = heap_open(relid, AccessShareLock);
+	List *indexes;
+	ListCell *lc;
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION ||
+		rel->rd_rel->relpersistence != RELPERSISTENCE_PERMANENT)
+		elog(ERROR, "relation %s is not a permanent table",
+			 RelationGetRelationName(rel));
+
+	if (OidIsValid(rel->rd_rel->reltoastrelid))
+	{
+		Relation toastrel = heap_open(rel->rd_rel->reltoastrelid,
+									  AccessShareLock);
+
+		if (RelationGetNumberOfBlocks(toastrel) != 0)
+			elog(ERROR, "TOAST table of relation %s is not empty",
+				 RelationGetRelationName(rel));
+		heap_close(toastrel, AccessShareLock);
+	}
+
+	indexes = RelationGetIndexList(rel);
+	foreach(lc, indexes)
+	{
+		Relation indrel = index_open(lfirst_oid(lc), AccessShareLock);
+
+		if (indrel->rd_rel->relam != BTREE_AM_OID)
+			elog(ERROR, "index %s is not btree",
+				 RelationGetRelationName(indrel));
+		index_close(indrel, AccessShareLock);
+	}
+	list_free(indexes);
+
+	heap_close(rel, AccessShareLock);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Read nblocks pages of relation (heap or index) main fork starting with
+ * blkno. Less pages are returned if relation ends earlier. Pages are read
+ * through shared buffers, so dirty ones are fine. Caller must make sure the
+ * relation is not modified while copying it.
+ */
+PG_FUNCTION_INFO_V1(relfile_read);
+Datum
+relfile_read(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	int64 blkno = PG_GETARG_INT64(1);
+	int32 nblocks = PG_GETARG_INT32(2);
+	Relation rel;
+	BlockNumber relblocks;
+	bytea *pages;
+	char *ptr;
+	BlockNumber blk;
+
+	/* raw pages bypass any permissions and RLS on the relation */
+	if (!superuser())
+		elog(ERROR, "only superuser can read relation files");
+	rel = relation_open(relid, AccessShareLock);
+	relblocks = RelationGetNumberOfBlocks(rel);
+
+	if (blkno < 0 || nblocks < 0)
+		elog(ERROR, "invalid block range");
+	if (blkno > relblocks)
+		blkno = relblocks;
+	if (blkno + nblocks > relblocks)
+		nblocks = relblocks - blkno;
+
+	pages = (bytea *) palloc(VARHDRSZ + (Size) nblocks * BLCKSZ);
+	SET_VARSIZE(pages, VARHDRSZ + (Size) nblocks * BLCKSZ);
+	ptr = VARDATA(pages);
+	for (blk = blkno; blk < blkno + nblocks; blk++)
+	{
+		Buffer buf = ReadBufferExtended(rel, MAIN_FORKNUM, blk, RBM_NORMAL,
+										NULL);
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		memcpy(ptr, BufferGetPage(buf), BLCKSZ);
+		UnlockReleaseBuffer(buf);
+		if (rel->rd_rel->relkind == RELKIND_RELATION)
+			check_heap_page_frozen(rel, (Page) ptr, blk);
+		ptr += BLCKSZ;
+	}
+
+	relation_close(rel, AccessShareLock);
+	PG_RETURN_BYTEA_P(pages);
+}
+
+/*
+ * Numbers of main fork blocks of relation (heap or index) whose LSN is past
+ * 'since', i.e. which were modified after WAL insert position was 'since'.
+ * Pages of permanent relations are never modified without WAL-logging,
+ * except for hint bits which don't matter for frozen tuples.
+ */
+PG_FUNCTION_INFO_V1(relfile_changed_blocks);
+Datum
+relfile_changed_blocks(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	XLogRecPtr since = PG_GETARG_LSN(1);
+	Relation rel;
+	BlockNumber relblocks;
+	BlockNumber blk;
+	Datum *elems;
+	int nchanged = 0;
+
+	if (!superuser())
+		elog(ERROR, "only superuser can read relation files");
+	rel = relation_open(relid, AccessShareLock);
+	relblocks = RelationGetNumberOfBlocks(rel);
+	elems = palloc(sizeof(Datum) * Max(relblocks, 1));
+	for (blk = 0; blk < relblocks; blk++)
+	{
+		Buffer buf = ReadBufferExtended(rel, MAIN_FORKNUM, blk, RBM_NORMAL,
+										NULL);
+
+		CHECK_FOR_INTERRUPTS();
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		if (PageGetLSN(BufferGetPage(buf)) > since)
+			elems[nchanged++] = Int64GetDatum((int64) blk);
+		UnlockReleaseBuffer(buf);
+	}
+
+	relation_close(rel, AccessShareLock);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nchanged, INT8OID, 8,
+										  FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * ERROR if page contains tuples which are not visible without looking at
+ * xids.
+ */
+void
+check_heap_page_frozen(Relation rel, Page page, BlockNumber blkno)
+{
+	OffsetNumber off;
+	OffsetNumber maxoff;
+
+	if (PageIsNew(page))
+		return;
+
+	maxoff = PageGetMaxOffsetNumber(page);
+	for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId itemid = PageGetItemId(page, off);
+		HeapTupleHeader tup;
+
+		if (!ItemIdIsNormal(itemid))
+			continue;
+		tup = (HeapTupleHeader) PageGetItem(page, itemid);
+		if (!(HeapTupleHeaderXminFrozen(tup) ||
+			  HeapTupleHeaderGetRawXmin(tup) == FrozenTransactionId) ||
+			!(tup->t_infomask & HEAP_XMAX_INVALID ||
+			  !TransactionIdIsValid(HeapTupleHeaderGetRawXmax(tup))))
+			elog(ERROR, "relation %s has not frozen tuple at (%u, %u)",
+				 RelationGetRelationName(rel), blkno, off);
+	}
+}
+
+/*
+ * Prepare table created in current transaction and its indexes to receive
+ * pages with relfile_write: throw away whatever storage they already have.
+ */
+PG_FUNCTION_INFO_V1(relfile_copy_prepare);
+Datum
+relfile_copy_prepare(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	Relation rel = heap_open(relid, AccessExclusiveLock);
+	List *indexes;
+	ListCell *lc;
+
+	if (!superuser())
+		elog(ERROR, "only superuser can overwrite relation files");
+	check_created_in_xact(rel);
+	RelationTruncate(rel, 0);
+
+	indexes = RelationGetIndexList(rel);
+	foreach(lc, indexes)
+	{
+		Relation indrel = index_open(lfirst_oid(lc), AccessExclusiveLock);
+
+		check_created_in_xact(indrel);
+		RelationTruncate(indrel, 0);
+		index_close(indrel, NoLock);
+	}
+	list_free(indexes);
+
+	/* Let xact unlock this */
+	heap_close(rel, NoLock);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Write pages read by relfile_read to main fork of relation (heap or index)
+ * created in current transaction, starting at blkno. blkno must not be
+ * beyond the current relation size: pages are appended there, or overwrite
+ * the ones shipped before if they changed on src since then. The relation is
+ * not read by other backends until commit, so appended blocks are written
+ * directly; overwritten ones go through shared buffers, since analyze and
+ * prewarm done in this transaction might have loaded them.
+ */
+PG_FUNCTION_INFO_V1(relfile_write);
+Datum
+relfile_write(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	int64 blkno = PG_GETARG_INT64(1);
+	bytea *pages = PG_GETARG_BYTEA_P(2);
+	Relation rel = relation_open(relid, AccessExclusiveLock);
+	Size len = VARSIZE(pages) - VARHDRSZ;
+	/* palloc'ed, so properly aligned, unlike bytea contents */
+	Page page = (Page) palloc(BLCKSZ);
+	char *ptr;
+	BlockNumber blk;
+	BlockNumber relblocks;
+
+	if (!superuser())
+		elog(ERROR, "only superuser can overwrite relation files");
+	check_created_in_xact(rel);
+	if (len % BLCKSZ != 0)
+		elog(ERROR, "pages size %zu is not multiple of block size", len);
+	relblocks = RelationGetNumberOfBlocks(rel);
+	if (blkno < 0 || blkno > relblocks)
+		elog(ERROR, "relation %s has %u blocks, can't write block " INT64_FORMAT,
+			 RelationGetRelationName(rel), relblocks, blkno);
+
+	RelationOpenSmgr(rel);
+	for (ptr = VARDATA(pages), blk = blkno; ptr < VARDATA(pages) + len;
+		 ptr += BLCKSZ, blk++)
+	{
+		memcpy(page, ptr, BLCKSZ);
+		if (!PageIsVerified(page, blk))
+			elog(ERROR, "invalid page in block %u of relation %s",
+				 blk, RelationGetRelationName(rel));
+		/* src xid, harmless but useless here */
+		if (!PageIsNew(page) && rel->rd_rel->relkind == RELKIND_RELATION)
+			((PageHeader) page)->pd_prune_xid = InvalidTransactionId;
+
+		if (blk < relblocks)
+		{
+			Buffer buf = ReadBufferExtended(rel, MAIN_FORKNUM, blk,
+											RBM_ZERO_AND_LOCK, NULL);
+
+			START_CRIT_SECTION();
+			memcpy(BufferGetPage(buf), page, BLCKSZ);
+			MarkBufferDirty(buf);
+			if (RelationNeedsWAL(rel))
+				log_newpage_buffer(buf, false);
+			END_CRIT_SECTION();
+			UnlockReleaseBuffer(buf);
+			continue;
+		}
+
+		/* Like copy_relation_data does; this also sets our LSN on the page */
+		if (RelationNeedsWAL(rel))
+			log_newpage(&rel->rd_node, MAIN_FORKNUM, blk, page, false);
+		PageSetChecksumInplace(page, blk);
+		smgrextend(rel->rd_smgr, MAIN_FORKNUM, blk, page, true);
+	}
+
+	pfree(page);
+	relation_close(rel, NoLock);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Finish relfile_write'ing the table and its indexes: write out pages
+ * overwritten via buffers and fsync them, since checkpoint might have
+ * happened after pages were WAL-logged, and make backends forget cached
+ * metadata, e.g. btree metapage.
+ */
+PG_FUNCTION_INFO_V1(relfile_copy_finish);
+Datum
+relfile_copy_finish(PG_FUNCTION_ARGS)
+{
+	Oid relid = PG_GETARG_OID(0);
+	Relation rel = heap_open(relid, AccessExclusiveLock);
+	List *indexes;
+	ListCell *lc;
+
+	FlushRelationBuffers(rel);
+	RelationOpenSmgr(rel);
+	smgrimmedsync(rel->rd_smgr, MAIN_FORKNUM);
+	CacheInvalidateRelcache(rel);
+
+	indexes = RelationGetIndexList(rel);
+	foreach(lc, indexes)
+	{
+		Relation indrel = index_open(lfirst_oid(lc), AccessExclusiveLock);
+
+		FlushRelationBuffers(indrel);
+		RelationOpenSmgr(indrel);
+		smgrimmedsync(indrel->rd_smgr, MAIN_FORKNUM);
+		CacheInvalidateRelcache(indrel);
+		index_close(indrel, NoLock);
+	}
+	list_free(indexes);
+
+	heap_close(rel, NoLock);
+	PG_RETURN_VOID();
+}
+
+/*
+ * We overwrite storage only of relations created in current xact, so that
+ * nothing is left if we fail.
+ */
+void
+check_created_in_xact(Relation rel)
+{
+	if (rel->rd_createSubid == InvalidSubTransactionId)
+		elog(ERROR, "relation %s was not created in current transaction",
+			 RelationGetRelationName(rel));
+}
@@ -0,0 +1,370 @@
+/* -------------------------------------------------------------------------
+ *
+ * rereplicate.c
+ *		Restoring redundancy of under-replicated partitions.
+ *
+ * Copyright (c) 2017, Postgres Professional
+ *
+ * set_replevel remembers target replevel of the table in shardman.tables.
+ * When replicas are lost (node removed with force, failover promoted
+ * replica), partitions are left with less replicas than that. Every
+ * shardman.rereplicate_interval, between commands, shardlord looks for such
+ * partitions and, if there are some, registers 'rereplicate' command. The
+ * command creates at most shardman.rereplicate_max_tasks replicas, those of
+ * partitions with the largest deficit first and, among them, of the smallest
+ * ones first, so that as many partitions as possible get redundancy back
+ * soon. Limiting the batch and pausing between batches protects foreground
+ * load; other commands are executed between batches as usual.
+ *
+ * Partitions whose replica source (primary in star, chain tail otherwise) is
+ * degraded are skipped: the copy would fail anyway. If a batch creates
+ * nothing, the check interval is doubled, up to 2^MAX_BACKOFF_SHIFT times,
+ * so that hopeless commands are not registered every interval.
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <time.h>
+
+#include "executor/spi.h"
+#include "utils/timestamp.h"
+
+#include "copypart.h"
+#include "monitor.h"
+#include "pg_shardman.h"
+#include "rereplicate.h"
+
+/* Max power of 2 by which check interval grows after fruitless batches */
+#define MAX_BACKOFF_SHIFT 6
+
+/* Partition lacking replicas */
+typedef struct
+{
+	char *part_name;
+	int32 primary;
+	int deficit; /* how many replicas are missing */
+	int64 size; /* bytes, -1 if unknown */
+} UnderReplicated;
+
+static TimestampTz last_check = 0;
+/* batches in a row which created no replicas */
+static int nfruitless = 0;
+
+static UnderReplicated *get_under_replicated(uint64 *nparts);
+static void fill_part_sizes(UnderReplicated *parts, uint64 nparts);
+static int under_replicated_cmp(const void *a, const void *b);
+static int replica_candidates(const char *part_name, int32 *healthy,
+							  uint64 num_healthy, int32 *candidates);
+static bool replica_src_degraded(const char *part_name);
+
+/*
+ * Millis until we must look for under-replicated partitions again, -1 if
+ * re-replication is off. Ready for use as wait timeout.
+ */
+long
+rereplicate_timeout(void)
+{
+	long secs;
+	int usecs;
+
+	if (shardman_rereplicate_interval <= 0)
+		return -1;
+	TimestampDifference(GetCurrentTimestamp(),
+						TimestampTzPlusMilliseconds(
+							last_check,
+							(int64) shardman_rereplicate_interval <<
+							Min(nfruitless, MAX_BACKOFF_SHIFT)),
+						&secs, &usecs);
+	return secs * 1000 + usecs / 1000;
+}
+
+/*
+ * Register 'rereplicate' command if it is time to check and there are
+ * under-replicated partitions with healthy replica source which some healthy
+ * node can take replica of, unless such command is already queued. Without
+ * such partition the command would do nothing, and we would log it every
+ * interval.
+ */
+void
+schedule_rereplication(void)
+{
+	uint64 nparts;
+	UnderReplicated *parts;
+	uint64 num_healthy;
+	int32 *healthy;
+	int32 *candidates;
+	uint64 i;
+
+	if (shardman_rereplicate_interval <= 0 || rereplicate_timeout() > 0)
+		return;
+	last_check = GetCurrentTimestamp();
+
+	if (void_spi("select 1 from shardman.cmd_log where cmd_type = 'rereplicate'"
+				 " and status in ('waiting', 'in progress');") > 0)
+		return;
+	parts = get_under_replicated(&nparts);
+	if (nparts == 0)
+	{
+		pfree(parts);
+		return;
+	}
+
+	healthy = get_healthy_workers(&num_healthy);
+	candidates = palloc(sizeof(int32) * Max(num_healthy, 1));
+	for (i = 0; i < nparts; i++)
+	{
+		if (!replica_src_degraded(parts[i].part_name) &&
+			replica_candidates(parts[i].part_name, healthy, num_healthy,
+							   candidates) > 0)
+			break;
+	}
+	pfree(parts);
+	pfree(healthy);
+	pfree(candidates);
+	if (i == nparts)
+	{
+		shmn_elog(DEBUG1, "%lu partitions lack replicas, but none of them can"
+				  " be copied from and to healthy nodes", nparts);
+		return;
+	}
+
+	shmn_elog(LOG, "%lu partitions lack replicas, scheduling re-replication",
+			  nparts);
+	void_spi("select shardman.register_cmd('rereplicate', '{}');");
+}
+
+/*
+ * Create one batch of missing replicas, most needed first.
+ */
+void
+rereplicate(Cmd *cmd)
+{
+	uint64 nparts;
+	UnderReplicated *parts = get_under_replicated(&nparts);
+	uint64 num_healthy;
+	int32 *healthy = get_healthy_workers(&num_healthy);
+	int32 *candidates = palloc(sizeof(int32) * Max(num_healthy, 1));
+	int ncandidates;
+	CopyPartState **tasks =
+		palloc(sizeof(CopyPartState *) * Max(shardman_rereplicate_max_tasks, 1));
+	int ntasks = 0;
+	int ncreated = 0;
+	uint64 i;
+	int j;
+
+	fill_part_sizes(parts, nparts);
+	qsort(parts, nparts, sizeof(UnderReplicated), under_replicated_cmp);
+
+	srand(time(NULL));
+	for (i = 0; i < nparts && ntasks < shardman_rereplicate_max_tasks; i++)
+	{
+		CreateReplicaState *crs;
+
+		if (replica_src_degraded(parts[i].part_name))
+		{
+			shmn_elog(DEBUG1, "Not re-replicating %s: node to copy it from is"
+					  " degraded", parts[i].part_name);
+			continue;
+		}
+		/* Replica is created on random healthy node not having the part */
+		ncandidates = replica_candidates(parts[i].part_name, healthy,
+										 num_healthy, candidates);
+		if (ncandidates == 0)
+		{
+			shmn_elog(DEBUG1, "No healthy node to add replica of %s to",
+					  parts[i].part_name);
+			continue;
+		}
+
+		crs = palloc0(sizeof(CreateReplicaState));
+		init_cr_state(crs, parts[i].part_name,
+					  candidates[rand() % ncandidates]);
+		if (crs->cp.res == TASK_FAILED)
+			continue;
+		shmn_elog(LOG, "Re-replicating %s (%d replicas missing) to node %d",
+				  parts[i].part_name, parts[i].deficit, crs->cp.dst_node);
+		tasks[ntasks++] = (CopyPartState *) crs;
+	}
+
+	if (ntasks > 0)
+	{
+		bool preempted = exec_tasks_preemptible(tasks, ntasks);
+
+		SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+		if (preempted)
+		{
+			cmd_postponed(cmd);
+			return;
+		}
+		for (j = 0; j < ntasks; j++)
+			ncreated += tasks[j]->res == TASK_SUCCESS;
+	}
+
+	if (ncreated == 0)
+	{
+		nfruitless++;
+		shmn_elog(WARNING, "Re-replication failed, no replicas were created;"
+				  " next check in " INT64_FORMAT " ms",
+				  (int64) shardman_rereplicate_interval <<
+				  Min(nfruitless, MAX_BACKOFF_SHIFT));
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
+	nfruitless = 0;
+	shmn_elog(INFO, "Re-replication created %d replicas", ncreated);
+	update_cmd_status(cmd->id, "success");
+}
+
+/*
+ * Put into candidates healthy nodes which don't hold part_name yet, i.e. may
+ * get its replica. Returns their number.
+ */
+int
+replica_candidates(const char *part_name, int32 *healthy, uint64 num_healthy,
+				   int32 *candidates)
+{
+	int ncandidates = 0;
+	uint64 i;
+
+	for (i = 0; i < num_healthy; i++)
+	{
+		if (!node_has_partition(healthy[i], part_name))
+			candidates[ncandidates++] = healthy[i];
+	}
+	return ncandidates;
+}
+
+/*
+ * Is the node new replica of part_name would be copied from degraded? It is
+ * the primary in star topology and the chain tail otherwise, see
+ * init_cr_state.
+ */
+bool
+replica_src_degraded(const char *part_name)
+{
+	int32 src;
+
+	if (shardman_replica_topology == REPLICA_TOPOLOGY_STAR)
+		src = get_primary_owner(part_name);
+	else
+		src = get_reptail_owner(part_name);
+	return src != SHMN_INVALID_NODE_ID && node_degraded(src);
+}
+
+/*
+ * Partitions having less replicas than replevel of their table, capped by the
+ * number of active workers. Tables which were never given replevel or are
+ * not replicated are skipped.
+ */
+UnderReplicated *
+get_under_replicated(uint64 *nparts)
+{
+	char *sql;
+	bool isnull;
+	UnderReplicated *parts;
+	TupleDesc rowdesc;
+	MemoryContext spicxt;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	uint64 i;
+	SPI_XACT_STATUS;
+
+	SPI_PROLOG;
+	sql = psprintf( /* allocated in SPI ctxt, freed with ctxt release */
+		"select d.part_name, p.owner, d.deficit from"
+		" (select p.part_name,"
+		"  least(t.replevel, (select count(*) from shardman.nodes"
+		"   where worker_status = 'active') - 1) -"
+		"  count(case when p.prv is not null then 1 end) as deficit"
+		"  from shardman.partitions p join shardman.tables t"
+		"  on p.relation = t.relation"
+		"  where t.replevel > 0 and"
+		"  coalesce(t.replication_mode, '') != 'none'"
+		"  group by p.part_name, t.replevel) d"
+		" join shardman.partitions p on p.part_name = d.part_name"
+		" and p.prv is null where d.deficit > 0;");
+
+	if (SPI_execute(sql, true, 0) < 0)
+		shmn_elog(FATAL, "Stmt failed : %s", sql);
+	rowdesc = SPI_tuptable->tupdesc;
+
+	*nparts = SPI_processed;
+	/* We need to allocate in our ctxt, not spi's */
+	spicxt = MemoryContextSwitchTo(oldcxt);
+	parts = palloc(sizeof(UnderReplicated) * Max(*nparts, 1));
+	for (i = 0; i < *nparts; i++)
+	{
+		HeapTuple tuple = SPI_tuptable->vals[i];
+
+		parts[i].part_name = SPI_getvalue(tuple, rowdesc, 1);
+		parts[i].primary = DatumGetInt32(SPI_getbinval(tuple, rowdesc, 2,
+													   &isnull));
+		parts[i].deficit = (int) DatumGetInt64(SPI_getbinval(tuple, rowdesc, 3,
+															 &isnull));
+		parts[i].size = -1;
+	}
+	MemoryContextSwitchTo(spicxt);
+
+	SPI_EPILOG;
+	return parts;
+}
+
+/*
+ * Ask primaries how large the parts are, one query per node. Sizes of parts
+ * whose primaries are degraded or unreachable stay unknown.
+ */
+void
+fill_part_sizes(UnderReplicated *parts, uint64 nparts)
+{
+	char **names = palloc(sizeof(char *) * Max(nparts, 1));
+	uint64 *idx = palloc(sizeof(uint64) * Max(nparts, 1));
+	uint64 i;
+	uint64 j;
+
+	for (i = 0; i < nparts; i++)
+	{
+		int32 node = parts[i].primary;
+		int64 *sizes;
+		int n = 0;
+
+		/* Already asked this node? */
+		for (j = 0; j < i && parts[j].primary != node; j++);
+		if (j < i)
+			continue;
+
+		for (j = i; j < nparts; j++)
+		{
+			if (parts[j].primary == node)
+			{
+				names[n] = parts[j].part_name;
+				idx[n++] = j;
+			}
+		}
+		sizes = get_part_sizes(node, names, n);
+		for (j = 0; j < n; j++)
+			parts[idx[j]].size = sizes[j];
+		pfree(sizes);
+	}
+	pfree(names);
+	pfree(idx);
+}
+
+/*
+ * Larger deficit first; then smaller parts first, unknown size last.
+ */
+int
+under_replicated_cmp(const void *a, const void *b)
+{
+	const UnderReplicated *pa = (const UnderReplicated *) a;
+	const UnderReplicated *pb = (const UnderReplicated *) b;
+
+	if (pa->deficit != pb->deficit)
+		return pb->deficit - pa->deficit;
+	if (pa->size == pb->size)
+		return 0;
+	if (pa->size < 0)
+		return 1;
+	if (pb->size < 0)
+		return -1;
+	return pa->size < pb->size ? -1 : 1;
+}
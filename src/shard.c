@@ -11,16 +11,69 @@
 
 #include <time.h>
 
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+
 #include "copypart.h"
+#include "monitor.h"
 #include "pg_shardman.h"
 #include "shard.h"
 
+/*
+ * Replicas promoted by part_removed in star get their siblings subscribed
+ * that many times, cmd_retry_naptime apart, before we give up on the rest.
+ */
+#define STAR_PROMOTION_ATTEMPTS 60
+/*
+ * Seconds to wait for connection to worker; replicas are asked one by one
+ * while the cluster waits for failover, so dead ones must not hang it.
+ */
+#define NODE_CONNECT_TIMEOUT "5"
+
+/* Promotion of replica of one partition */
+typedef struct
+{
+	const char *part_name;
+	int32 primary; /* node holding primary being replaced */
+	int32 chosen; /* replica to become primary */
+	/* other replicas fed by primary; they are recreated from chosen one */
+	int32 *siblings;
+	int nsiblings;
+} Promotion;
+
+/* Partition to be moved off drained node */
+typedef struct
+{
+	const char *part_name;
+	int64 size; /* bytes, -1 if unknown */
+} DrainedPart;
+
+/* Connection to worker, NULL if it is unreachable */
+typedef struct
+{
+	int32 node;
+	PGconn *conn;
+} NodeConn;
+
 static void cmd_single_task_exec_finished(Cmd *cmd, CopyPartState *cps);
+static bool choose_promoted_replica(Promotion *prom, int32 only_node,
+									List **conns);
+static PGconn *node_conn(List **conns, int32 node);
+static void close_node_conns(List *conns);
+static int promote_parts(Promotion *proms, int nproms);
+static void recreate_siblings(Promotion *proms, int nproms);
+static void finish_star_promotions(Promotion *proms, int nproms);
+static bool star_promotion_step(Promotion *prom, bool *subscribed,
+								bool last_attempt);
+static bool node_exec(PGconn *conn, int32 node, const char *sql);
+static int drained_part_cmp(const void *a, const void *b);
 
 /*
  * Steps are:
  * - Ensure table is not partitioned already;
- * - Partition table and get sql to create it;
+ * - Partition table and get sql to create it, this is done by hash partition
+ *   task retrying until success, see exec_hash_partition;
  * - Add records about new table and partitions;
  */
 void
@@ -30,107 +83,38 @@ create_hash_partitions(Cmd *cmd)
 	const char *relation = cmd->opts[1];
 	const char *expr = cmd->opts[2];
 	int partitions_count = atoi(cmd->opts[3]);
-	char *connstr;
-	PGconn *conn = NULL;
-	PGresult *res = NULL;
+	HashPartitionState hps = {0};
+	CopyPartState *tasks[1];
 	char *sql;
-	uint64 table_exists;
-	char *create_table_sql;
 
 	shmn_elog(INFO, "Sharding table %s on node %d", relation, node_id);
 
-	/* Check that table with such name is not already sharded */
-	sql = psprintf(
-		"select relation from shardman.tables where relation = '%s'",
-		relation);
-	table_exists = void_spi(sql);
-	if (table_exists)
-	{
-		shmn_elog(WARNING, "table %s already sharded, won't partition it.",
-				  relation);
-		update_cmd_status(cmd->id, "failed");
-		return;
-	}
-	/* connstr mem freed with ctxt */
-	if ((connstr = get_node_connstr(node_id, SNT_WORKER)) == NULL)
+	init_hp_state(&hps, node_id, relation, expr, partitions_count);
+	if (hps.cp.res == TASK_FAILED)
 	{
-		shmn_elog(WARNING, "create_hash_partitions failed, no such worker node: %d",
-				  node_id);
 		update_cmd_status(cmd->id, "failed");
 		return;
 	}
+	tasks[0] = (CopyPartState *) &hps;
+	exec_tasks(tasks, 1);
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	Assert(hps.cp.res == TASK_SUCCESS);
 
 	/*
-	 * Note that we have to run statements in separate transactions, otherwise
-	 * we have a deadlock between pathman and pg_dump. pfree'd with ctxt
+	 * Insert table to 'tables' table (no pun intended), insert partitions
+	 * and mark partitioning cmd as successfull
 	 */
-	sql = psprintf(
-		"begin; select shardman.drop_parts('%s', '%d');"
-		" select create_hash_partitions('%s', '%s', %d); end;"
-		"select shardman.gen_create_table_sql('%s', '%s');",
-		relation, partitions_count,
-		relation, expr, partitions_count,
-		relation, connstr);
-
-	/* Try to execute command indefinitely until it succeeded or canceled */
-	while (1948)
-	{
-		conn = PQconnectdb(connstr);
-		if (PQstatus(conn) != CONNECTION_OK)
-		{
-			shmn_elog(NOTICE, "Connection to node failed: %s",
-					  PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-
-		/* Partition table and get sql to create it */
-		res = PQexec(conn, sql);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		{
-			shmn_elog(NOTICE, "Failed to partition table and get sql to create it: %s",
-					  PQerrorMessage(conn));
-			goto attempt_failed;
-		}
-		create_table_sql = PQgetvalue(res, 0, 0);
-
-		/* TODO: if lord fails at this moment (which is extremely unlikely
-		 * though), after restart it will try to partition table again and
-		 * fail. We should check if the table is already partitioned and don't
-		 * do that again, except for, probably, the case when it was
-		 * partitioned by someone else.
-		 */
-		/*
-		 * Insert table to 'tables' table (no pun intended), insert partitions
-		 * and mark partitioning cmd as successfull
-		 */
-		sql = psprintf("insert into shardman.tables values"
-					   " ('%s', '%s', %d, $create_table$%s$create_table$, %d);"
-					   " update shardman.cmd_log set status = 'success'"
-					   " where id = %ld;",
-					   relation, expr, partitions_count, create_table_sql,
-					   node_id, cmd->id);
-		void_spi(sql);
-		pfree(sql);
-
-		PQclear(res); /* can't free any earlier, it stores sql */
-		PQfinish(conn);
-
-		/* done */
-		elog(INFO, "Table %s successfully partitioned", relation);
-		return;
-
-attempt_failed: /* clean resources, sleep, check sigusr1 and try again */
-		if (res != NULL)
-			PQclear(res);
-		if (conn != NULL)
-			PQfinish(conn);
-
-		shmn_elog(LOG, "Attempt to execute create_hash_partitions failed,"
-				  " sleeping and retrying");
-		/* TODO: sleep using waitlatch? */
-		pg_usleep(shardman_cmd_retry_naptime * 1000L);
-		SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
-	}
+	sql = psprintf("insert into shardman.tables values"
+				   " ('%s', '%s', %d, $create_table$%s$create_table$, %d);"
+				   " update shardman.cmd_log set status = 'success'"
+				   " where id = %ld;",
+				   relation, expr, partitions_count, hps.create_table_sql,
+				   node_id, cmd->id);
+	void_spi(sql);
+	pfree(sql);
+
+	/* done */
+	elog(INFO, "Table %s successfully partitioned", relation);
 }
 
 /* Update status of cmd consisting of single task after exec_tasks finishes */
@@ -184,26 +168,481 @@ create_replica(Cmd *cmd)
 	cmd_single_task_exec_finished(cmd, (CopyPartState *) crs);
 }
 
+/*
+ * Promote replica of partition on given node to primary. The replica must be
+ * fed by primary directly, i.e. be the first in replica chain or any in star.
+ * Primary copy is dropped; if primary node is alive and the replica lags
+ * behind, the difference is lost, so this is intended for dead primaries.
+ */
+void
+promote_replica(Cmd *cmd)
+{
+	char *part_name = cmd->opts[0];
+	int32 node = atoi(cmd->opts[1]);
+	Promotion prom;
+	List *conns = NIL;
+	bool chosen;
+
+	prom.part_name = part_name;
+	prom.primary = get_primary_owner(part_name);
+	if (prom.primary == SHMN_INVALID_NODE_ID)
+	{
+		shmn_elog(WARNING, "Primary part %s doesn't exist, not promoting its"
+				  " replica", part_name);
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
+	chosen = choose_promoted_replica(&prom, node, &conns);
+	close_node_conns(conns);
+	if (!chosen)
+	{
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
+
+	promote_parts(&prom, 1);
+	shmn_elog(INFO, "Replica of %s on node %d promoted to primary", part_name,
+			  node);
+	recreate_siblings(&prom, 1);
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	update_cmd_status(cmd->id, "success");
+}
+
+/*
+ * Promote replicas of all primaries held by failed node, most up-to-date
+ * replica of each partition. Promotion of all partitions is done in one
+ * metadata transaction, so workers switch them at once. Time since node was
+ * last seen alive (opts[1], if known) until promotion is recorded as RTO in
+ * shardman.failovers. Partitions without replicas are left as is.
+ */
+void
+failover(Cmd *cmd)
+{
+	int32 node = atoi(cmd->opts[0]);
+	char *last_seen = cmd->opts[1];
+	uint64 nparts;
+	Partition *parts = get_node_primaries(node, &nparts);
+	Promotion *proms = palloc(sizeof(Promotion) * Max(nparts, 1));
+	int nproms = 0;
+	List *conns = NIL;
+	uint64 i;
+	char *sql;
+
+	shmn_elog(LOG, "Failing over node %d holding " UINT64_FORMAT " primaries",
+			  node, nparts);
+	for (i = 0; i < nparts; i++)
+	{
+		proms[nproms].part_name = parts[i].part_name;
+		proms[nproms].primary = node;
+		if (choose_promoted_replica(&proms[nproms], SHMN_INVALID_NODE_ID,
+									&conns))
+			nproms++;
+	}
+	close_node_conns(conns);
+
+	promote_parts(proms, nproms);
+	sql = psprintf(
+		"insert into shardman.failovers values (%ld, %d, %s, clock_timestamp(),"
+		" %d, clock_timestamp() - %s);",
+		cmd->id, node,
+		last_seen ? quote_literal_cstr(last_seen) : "NULL", nproms,
+		last_seen ? psprintf("%s::timestamptz", quote_literal_cstr(last_seen)) :
+		"NULL");
+	void_spi(sql);
+	shmn_elog(INFO, "Node %d failed over: %d of " UINT64_FORMAT
+			  " primaries promoted", node, nproms, nparts);
+
+	recreate_siblings(proms, nproms);
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	update_cmd_status(cmd->id, nproms == nparts ? "success" : "failed");
+}
+
+/*
+ * Choose replica of prom->part_name fed by prom->primary to promote: the one
+ * on only_node, if it is valid, or reachable replica which has applied the
+ * most of primary's WAL. Fill the rest of prom and return true on success.
+ *
+ * The position is taken from replication origin of the data channel sub
+ * rather than from pg_stat_subscription: the latter is empty when apply
+ * worker is not running, which is exactly the case after primary failure.
+ */
+bool
+choose_promoted_replica(Promotion *prom, int32 only_node, List **conns)
+{
+	int nnext;
+	int32 *next_nodes = get_next_nodes(prom->part_name, prom->primary, &nnext);
+	XLogRecPtr best_lsn = InvalidXLogRecPtr;
+	int i;
+	int j;
+
+	prom->chosen = SHMN_INVALID_NODE_ID;
+	for (i = 0; i < nnext; i++)
+	{
+		PGconn *conn;
+		PGresult *res;
+		char *sql;
+		XLogRecPtr lsn;
+
+		if (only_node != SHMN_INVALID_NODE_ID)
+		{
+			if (next_nodes[i] == only_node)
+				prom->chosen = only_node;
+			continue;
+		}
+
+		if ((conn = node_conn(conns, next_nodes[i])) == NULL)
+			continue;
+		sql = psprintf(
+			"select coalesce(max(os.remote_lsn), '0/0')"
+			" from pg_subscription s join pg_replication_origin_status os"
+			" on os.external_id = 'pg_' || s.oid"
+			" where s.subname = shardman.get_data_lname('%s', %d, %d);",
+			prom->part_name, prom->primary, next_nodes[i]);
+		res = PQexec(conn, sql);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			shmn_elog(LOG, "Failed to get position of replica %s on node %d: %s",
+					  prom->part_name, next_nodes[i], PQerrorMessage(conn));
+			PQclear(res);
+			continue;
+		}
+		lsn = DatumGetLSN(DirectFunctionCall1(
+							  pg_lsn_in, CStringGetDatum(PQgetvalue(res, 0, 0))));
+		PQclear(res);
+		shmn_elog(DEBUG1, "Replica %s on node %d applied up to %X/%X",
+				  prom->part_name, next_nodes[i],
+				  (uint32) (lsn >> 32), (uint32) lsn);
+		if (prom->chosen == SHMN_INVALID_NODE_ID || lsn > best_lsn)
+		{
+			prom->chosen = next_nodes[i];
+			best_lsn = lsn;
+		}
+	}
+
+	if (prom->chosen == SHMN_INVALID_NODE_ID)
+	{
+		shmn_elog(WARNING, "No %sreplica of %s fed by node %d found, not"
+				  " promoting it",
+				  only_node == SHMN_INVALID_NODE_ID ? "reachable " : "such ",
+				  prom->part_name, prom->primary);
+		return false;
+	}
+
+	prom->siblings = palloc(sizeof(int32) * Max(nnext - 1, 1));
+	prom->nsiblings = 0;
+	for (j = 0; j < nnext; j++)
+	{
+		if (next_nodes[j] != prom->chosen)
+			prom->siblings[prom->nsiblings++] = next_nodes[j];
+	}
+	return true;
+}
+
+/*
+ * Get cached connection to node, connecting if needed. Degraded nodes are
+ * not connected to, unless circuit to them is half-open. Caller closes them
+ * with close_node_conns.
+ */
+PGconn *
+node_conn(List **conns, int32 node)
+{
+	const char *keywords[] = {"dbname", "connect_timeout", NULL};
+	const char *values[] = {NULL, NODE_CONNECT_TIMEOUT, NULL};
+	ListCell *lc;
+	NodeConn *nc;
+
+	foreach(lc, *conns)
+	{
+		nc = (NodeConn *) lfirst(lc);
+		if (nc->node == node)
+			return nc->conn;
+	}
+
+	nc = palloc(sizeof(NodeConn));
+	nc->node = node;
+	nc->conn = NULL;
+	*conns = lappend(*conns, nc);
+	/* connstr is expanded in place of dbname */
+	values[0] = get_node_connstr(node, SNT_WORKER);
+	if (values[0] == NULL)
+		return NULL;
+	if (!node_conn_allowed(values[0]))
+	{
+		shmn_elog(LOG, "Node %d is degraded, not connecting to it", node);
+		return NULL;
+	}
+	nc->conn = PQconnectdbParams(keywords, values, 1);
+	node_conn_result(values[0], PQstatus(nc->conn) == CONNECTION_OK);
+	if (PQstatus(nc->conn) != CONNECTION_OK)
+	{
+		shmn_elog(LOG, "Connection to node %d failed: %s", node,
+				  PQerrorMessage(nc->conn));
+		reset_pqconn(&nc->conn);
+	}
+	return nc->conn;
+}
+
+/* Close connections opened by node_conn */
+void
+close_node_conns(List *conns)
+{
+	ListCell *lc;
+
+	foreach(lc, conns)
+		reset_pqconn(&((NodeConn *) lfirst(lc))->conn);
+	list_free_deep(conns);
+}
+
+/*
+ * Make chosen replicas primaries in one metadata transaction: siblings of
+ * chosen replica are removed first, so that primary removal, see
+ * part_removed, sees the only replica to promote, drops its subscription,
+ * makes it writable and reroutes fdw to it on all nodes. Returns number of
+ * promoted partitions.
+ */
+int
+promote_parts(Promotion *proms, int nproms)
+{
+	StringInfoData sql;
+	int i;
+	int j;
+
+	if (nproms == 0)
+		return 0;
+
+	initStringInfo(&sql);
+	for (i = 0; i < nproms; i++)
+	{
+		for (j = 0; j < proms[i].nsiblings; j++)
+			appendStringInfo(&sql,
+							 "delete from shardman.partitions where"
+							 " part_name = '%s' and owner = %d;",
+							 proms[i].part_name, proms[i].siblings[j]);
+		appendStringInfo(&sql,
+						 "delete from shardman.partitions where"
+						 " part_name = '%s' and owner = %d;",
+						 proms[i].part_name, proms[i].primary);
+	}
+	void_spi(sql.data);
+	pfree(sql.data);
+	return nproms;
+}
+
+/*
+ * Siblings of promoted replica were fed by old primary; recreate them from
+ * the new one.
+ */
+void
+recreate_siblings(Promotion *proms, int nproms)
+{
+	CopyPartState **tasks;
+	int ntasks = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < nproms; i++)
+		ntasks += proms[i].nsiblings;
+	if (ntasks == 0)
+		return;
+
+	tasks = palloc(sizeof(CopyPartState *) * ntasks);
+	ntasks = 0;
+	for (i = 0; i < nproms; i++)
+	{
+		for (j = 0; j < proms[i].nsiblings; j++)
+		{
+			CreateReplicaState *crs = palloc0(sizeof(CreateReplicaState));
+
+			init_cr_state(crs, proms[i].part_name, proms[i].siblings[j]);
+			tasks[ntasks++] = (CopyPartState *) crs;
+		}
+	}
+	exec_tasks(tasks, ntasks);
+}
+
+/*
+ * Forcibly remove all partitions of node being removed. Replicas of its
+ * primaries are promoted by part_removed; in star, it also repoints the rest
+ * of replicas to the promoted one, and we build their channels here.
+ */
+void
+remove_node_parts(int32 node)
+{
+	uint64 nparts;
+	Partition *parts = get_node_primaries(node, &nparts);
+	Promotion *proms = palloc(sizeof(Promotion) * Max(nparts, 1));
+	int nproms = 0;
+	uint64 i;
+	char *sql;
+
+	for (i = 0; i < nparts; i++)
+	{
+		int nnext;
+		int32 *next_nodes = get_next_nodes(parts[i].part_name, node, &nnext);
+
+		if (nnext < 2)
+			continue;
+		/* part_removed promotes the replica with the smallest node id */
+		proms[nproms].part_name = parts[i].part_name;
+		proms[nproms].primary = node;
+		proms[nproms].chosen = next_nodes[0];
+		proms[nproms].siblings = next_nodes + 1;
+		proms[nproms].nsiblings = nnext - 1;
+		nproms++;
+	}
+
+	sql = psprintf("delete from shardman.partitions where owner=%d", node);
+	void_spi(sql);
+	pfree(sql);
+	finish_star_promotions(proms, nproms);
+}
+
+/*
+ * Subscribe siblings of replicas promoted by part_removed in star to them and
+ * let the promoted ones take writes. Unreachable siblings are retried for
+ * STAR_PROMOTION_ATTEMPTS; then the partition becomes writable without them,
+ * so that it isn't held read-only by a dead node.
+ */
+void
+finish_star_promotions(Promotion *proms, int nproms)
+{
+	int i;
+
+	for (i = 0; i < nproms; i++)
+	{
+		bool *subscribed = palloc0(sizeof(bool) * proms[i].nsiblings);
+		int attempt;
+
+		for (attempt = 1; !signal_pending(); attempt++)
+		{
+			if (star_promotion_step(&proms[i], subscribed,
+									attempt == STAR_PROMOTION_ATTEMPTS))
+				break;
+			if (attempt == STAR_PROMOTION_ATTEMPTS)
+			{
+				shmn_elog(WARNING, "Failed to finish promotion of %s on node"
+						  " %d, it stays read-only", proms[i].part_name,
+						  proms[i].chosen);
+				break;
+			}
+			pg_usleep(shardman_cmd_retry_naptime * 1000L);
+		}
+		pfree(subscribed);
+	}
+}
+
+/*
+ * One attempt of finish_star_promotions. Repslots are created on promoted
+ * replica, each in its own transaction, once it has the publications; then
+ * siblings not subscribed yet subscribe, and finally writes are allowed.
+ * Everything is idempotent. Returns true if the promotion is finished.
+ */
+bool
+star_promotion_step(Promotion *prom, bool *subscribed, bool last_attempt)
+{
+	List *conns = NIL;
+	PGconn *conn;
+	StringInfoData sql;
+	bool done = false;
+	bool all_subscribed = true;
+	int i;
+
+	initStringInfo(&sql);
+	if ((conn = node_conn(&conns, prom->chosen)) == NULL)
+		goto end;
+	appendStringInfo(&sql, "select shardman.star_promotion_arrived('%s');",
+					 prom->part_name);
+	if (!node_exec(conn, prom->chosen, sql.data))
+		goto end;
+	for (i = 0; i < prom->nsiblings; i++)
+	{
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "select shardman.ensure_repslot("
+						 "shardman.get_data_lname('%s', %d, %d));",
+						 prom->part_name, prom->chosen, prom->siblings[i]);
+		if (!node_exec(conn, prom->chosen, sql.data))
+			goto end;
+	}
+
+	for (i = 0; i < prom->nsiblings; i++)
+	{
+		PGconn *sib_conn;
+
+		if (subscribed[i])
+			continue;
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "select shardman.data_sub_add_table("
+						 "shardman.get_data_lname('%s', %d, %d), %d);",
+						 prom->part_name, prom->chosen, prom->siblings[i],
+						 prom->chosen);
+		sib_conn = node_conn(&conns, prom->siblings[i]);
+		subscribed[i] = sib_conn != NULL &&
+			node_exec(sib_conn, prom->siblings[i], sql.data);
+		all_subscribed = all_subscribed && subscribed[i];
+	}
+	if (!all_subscribed && !last_attempt)
+		goto end;
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "select shardman.star_replica_promoted('%s', '{",
+					 prom->part_name);
+	for (i = 0; i < prom->nsiblings; i++)
+	{
+		if (subscribed[i])
+			appendStringInfo(&sql, "%s%d", sql.data[sql.len - 1] == '{' ?
+							 "" : ",", prom->siblings[i]);
+	}
+	appendStringInfoString(&sql, "}');");
+	if (!node_exec(conn, prom->chosen, sql.data))
+		goto end;
+	shmn_elog(LOG, "Replica of %s on node %d promoted, %s siblings fed by it",
+			  prom->part_name, prom->chosen,
+			  all_subscribed ? "all" : "some of");
+	done = true;
+
+end:
+	close_node_conns(conns);
+	pfree(sql.data);
+	return done;
+}
+
+/* Execute sql on node, logging failure. Returns true on success. */
+bool
+node_exec(PGconn *conn, int32 node, const char *sql)
+{
+	PGresult *res = PQexec(conn, sql);
+	bool ok = PQresultStatus(res) == PGRES_TUPLES_OK ||
+		PQresultStatus(res) == PGRES_COMMAND_OK;
+
+	if (!ok)
+		shmn_elog(LOG, "Query '%s' on node %d failed: %s", sql, node,
+				  PQerrorMessage(conn));
+	PQclear(res);
+	return ok;
+}
+
 /*
  * Dummiest way to distribute partitions evenly in round-robin fashion. Since
  * we ignore current distribution, some of the moves will most probably fail,
- * but the result should be more or less even.
+ * but the result should be more or less even. Degraded nodes are skipped.
  */
 void
 rebalance(Cmd *cmd)
 {
 	char *relation = cmd->opts[0];
 	uint64 num_workers;
-	int32 *workers = get_workers(&num_workers);
+	int32 *workers = get_healthy_workers(&num_workers);
 	uint64 worker_idx;
 	uint64 num_parts;
 	Partition *parts = get_parts(relation, &num_parts);
 	uint64 part_idx;
-	CopyPartState **tasks = palloc(sizeof(CopyPartState*) * num_parts);
+	CopyPartState **tasks = palloc(sizeof(CopyPartState*) * Max(num_parts, 1));
+	int ntasks = 0;
+	bool preempted;
 
 	if (num_workers == 0)
 	{
-		elog(WARNING, "Table %s will not be rebalanced: no active workers",
+		elog(WARNING, "Table %s will not be rebalanced: no healthy workers",
 			 relation);
 		update_cmd_status(cmd->id, "failed");
 		return;
@@ -221,25 +660,162 @@ rebalance(Cmd *cmd)
 	{
 		Partition part = parts[part_idx];
 		int32 worker;
-		MovePartState *mps = palloc0(sizeof(MovePartState));
+		MovePartState *mps;
 
 		worker = workers[worker_idx];
 		worker_idx = (worker_idx + 1) % num_workers;
 
-		init_mp_state(mps, part.part_name, part.owner, worker);
-		tasks[part_idx] = (CopyPartState *) mps;
+		/* Already there, e.g. we are continuing postponed rebalance */
+		if (part.owner == worker)
+			continue;
+		mps = palloc0(sizeof(MovePartState));
+		plan_mp_state(mps, part.part_name, part.owner, worker);
+		tasks[ntasks++] = (CopyPartState *) mps;
 	}
 
-	exec_tasks(tasks, num_parts);
+	preempted = exec_tasks_preemptible(tasks, ntasks);
 	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	if (preempted)
+	{
+		cmd_postponed(cmd);
+		return;
+	}
 
 	shmn_elog(INFO, "Relation %s rebalanced", relation);
 	update_cmd_status(cmd->id, "done");
 }
 
+/*
+ * Move all primaries and replicas off the node and remove it. Parts are
+ * placed greedily, largest first, on the healthy node with the least bytes
+ * planned so far which doesn't hold the part yet. All moves are executed at
+ * once, exec_tasks keeps them within max_copies_per_node. If some move
+ * fails, node is left in the cluster and the command may be just repeated.
+ */
+void
+drain_node(Cmd *cmd)
+{
+	int32 node = atoi(cmd->opts[0]);
+	uint64 nparts;
+	Partition *parts = get_node_partitions(node, &nparts);
+	DrainedPart *drained = palloc(sizeof(DrainedPart) * Max(nparts, 1));
+	char **names = palloc(sizeof(char *) * Max(nparts, 1));
+	int64 *sizes;
+	uint64 num_workers;
+	int32 *workers = get_healthy_workers(&num_workers);
+	int64 *planned;
+	CopyPartState **tasks = palloc(sizeof(CopyPartState *) * Max(nparts, 1));
+	char *rm_opts[3];
+	Cmd rm_cmd;
+	bool preempted;
+	uint64 i;
+	uint64 j;
+
+	/* Targets are all healthy workers but the drained one */
+	for (i = 0, j = 0; i < num_workers; i++)
+	{
+		if (workers[i] != node)
+			workers[j++] = workers[i];
+	}
+	if (j == num_workers)
+	{
+		shmn_elog(WARNING, "Node %d is not an active healthy worker, won't"
+				  " drain it", node);
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
+	num_workers = j;
+	planned = palloc0(sizeof(int64) * Max(num_workers, 1));
+
+	for (i = 0; i < nparts; i++)
+		names[i] = parts[i].part_name;
+	sizes = get_part_sizes(node, names, nparts);
+	for (i = 0; i < nparts; i++)
+	{
+		drained[i].part_name = parts[i].part_name;
+		drained[i].size = sizes[i];
+	}
+	qsort(drained, nparts, sizeof(DrainedPart), drained_part_cmp);
+
+	for (i = 0; i < nparts; i++)
+	{
+		MovePartState *mps;
+		int64 best = -1;
+
+		for (j = 0; j < num_workers; j++)
+		{
+			if (node_has_partition(workers[j], drained[i].part_name))
+				continue;
+			if (best == -1 || planned[j] < planned[best])
+				best = j;
+		}
+		if (best == -1)
+		{
+			shmn_elog(WARNING, "Can't drain node %d: no healthy node to move"
+					  " %s to", node, drained[i].part_name);
+			update_cmd_status(cmd->id, "failed");
+			return;
+		}
+		/* Unknown size is counted as one byte to spread such parts too */
+		planned[best] += Max(drained[i].size, 1);
+		shmn_elog(DEBUG1, "Draining %s from node %d to %d", drained[i].part_name,
+				  node, workers[best]);
+
+		mps = palloc0(sizeof(MovePartState));
+		plan_mp_state(mps, drained[i].part_name, node, workers[best]);
+		tasks[i] = (CopyPartState *) mps;
+	}
+
+	preempted = exec_tasks_preemptible(tasks, nparts);
+	SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+	if (preempted)
+	{
+		/* Moved parts are off the node, so continuing is just a rerun */
+		cmd_postponed(cmd);
+		return;
+	}
+
+	for (i = 0; i < nparts; i++)
+	{
+		if (tasks[i]->res != TASK_SUCCESS)
+		{
+			shmn_elog(WARNING, "Node %d is not drained: moving %s failed", node,
+					  tasks[i]->part_name);
+			update_cmd_status(cmd->id, "failed");
+			return;
+		}
+	}
+	shmn_elog(INFO, "Node %d drained, %lu partitions moved, removing it", node,
+			  nparts);
+
+	/* Node is empty now, so rm_node does the rest and marks cmd as success */
+	rm_opts[0] = cmd->opts[0];
+	rm_opts[1] = "false";
+	rm_opts[2] = NULL;
+	rm_cmd = *cmd;
+	rm_cmd.opts = rm_opts;
+	rm_node(&rm_cmd);
+}
+
+/*
+ * Larger parts first, unknown size last.
+ */
+int
+drained_part_cmp(const void *a, const void *b)
+{
+	const DrainedPart *pa = (const DrainedPart *) a;
+	const DrainedPart *pb = (const DrainedPart *) b;
+
+	if (pa->size == pb->size)
+		return 0;
+	return pa->size > pb->size ? -1 : 1;
+}
+
 /*
  * Add replicas to parts of given relation until we reach replevel replicas
- * for each one. Worker nodes are choosen in random manner.
+ * for each one. Worker nodes are choosen in random manner among healthy
+ * ones. If part lacks several replicas, they are all created by one fan-out
+ * task reading the part only once.
  */
 void
 set_replevel(Cmd *cmd)
@@ -248,11 +824,18 @@ set_replevel(Cmd *cmd)
 	uint32 replevel = atoi(cmd->opts[1]);
 	uint64 num_workers;
 	int32 *workers = get_workers(&num_workers);
+	uint64 num_healthy;
+	int32 *healthy;
+	int32 *candidates;
+	int ncandidates;
 	uint64 num_parts;
 	RepCount *repcounts = NULL;
 	uint64 part_idx;
 	CopyPartState **tasks = NULL;
 	int ntasks;
+	int nsucceeded;
+	bool incomplete;
+	bool preempted;
 	int i;
 
 	if (num_workers == 0)
@@ -263,6 +846,18 @@ set_replevel(Cmd *cmd)
 		return;
 	}
 
+	if (replevel > 0 && get_replication_mode(relation) == REPLICATION_MODE_NONE)
+	{
+		elog(WARNING, "Set replevel on table %s failed: table is not replicated",
+			 relation);
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
+
+	/* Remember target, so that lost replicas are recreated */
+	void_spi(psprintf("update shardman.tables set replevel = %d"
+					  " where relation = '%s';", replevel, relation));
+
 	if (replevel > num_workers - 1)
 	{
 		elog(WARNING, "Set replevel on table %s: using replevel %ld instead of"
@@ -273,48 +868,122 @@ set_replevel(Cmd *cmd)
 
 	srand(time(NULL));
 	/*
-	 * We can add only one replica per part in one exec_tasks; loop until
-	 * required number of replicas are reached.
+	 * All missing replicas of a part are created in one exec_tasks; however,
+	 * some tasks might fail, so loop until required number of replicas are
+	 * reached or no task can be started, e.g. because nodes are degraded.
 	 */
 	while (1948)
 	{
+		healthy = get_healthy_workers(&num_healthy);
+		candidates = palloc(sizeof(int32) * Max(num_healthy, 1));
 		repcounts = get_repcount(relation, &num_parts);
 		tasks = palloc(sizeof(CopyPartState*) * num_parts);
 		ntasks = 0;
+		incomplete = false;
 
 		for (part_idx = 0; part_idx < num_parts; part_idx++)
 		{
 			RepCount rc = repcounts[part_idx];
 			if (rc.count < replevel)
 			{
-				CreateReplicaState *crs = palloc0(sizeof(CreateReplicaState));
-				int32 dst_node;
-
-				do {
-					dst_node = workers[rand() % num_workers];
-				} while (node_has_partition(dst_node, rc.part_name));
-
-				init_cr_state(crs, rc.part_name, dst_node);
-
-				tasks[ntasks] = (CopyPartState *) crs;
+				int nreplicas = replevel - rc.count;
+				int32 *dst_nodes;
+
+				/*
+				 * Fan-out creates the slot on src itself to take a snapshot,
+				 * which doesn't fit shared data channels: there slot src ->
+				 * first dst might be already in use. It also can't feed
+				 * several replicas from primary, as star requires: snapshot
+				 * is consistent with only one slot. Add replicas one by one
+				 * then.
+				 */
+				if (shardman_shared_data_channels ||
+					shardman_replica_topology == REPLICA_TOPOLOGY_STAR)
+					nreplicas = 1;
+
+				ncandidates = 0;
+				for (i = 0; i < num_healthy; i++)
+				{
+					if (!node_has_partition(healthy[i], rc.part_name))
+						candidates[ncandidates++] = healthy[i];
+				}
+				if (ncandidates < nreplicas)
+				{
+					incomplete = true;
+					nreplicas = ncandidates;
+					if (nreplicas == 0)
+						continue;
+				}
+				dst_nodes = palloc(sizeof(int32) * nreplicas);
+
+				/* Partial shuffle: pick nreplicas distinct candidates */
+				for (i = 0; i < nreplicas; i++)
+				{
+					int k = i + rand() % (ncandidates - i);
+
+					dst_nodes[i] = candidates[k];
+					candidates[k] = candidates[i];
+					shmn_elog(DEBUG1, "Adding replica for shard %s on node %d",
+							  rc.part_name, dst_nodes[i]);
+				}
+
+				if (nreplicas == 1)
+				{
+					CreateReplicaState *crs =
+						palloc0(sizeof(CreateReplicaState));
+
+					plan_cr_state(crs, rc.part_name, dst_nodes[0]);
+					tasks[ntasks] = (CopyPartState *) crs;
+				}
+				else
+				{
+					FanoutReplicaState *frs =
+						palloc0(sizeof(FanoutReplicaState));
+
+					plan_fr_state(frs, rc.part_name, dst_nodes, nreplicas);
+					tasks[ntasks] = (CopyPartState *) frs;
+				}
 				ntasks++;
-				shmn_elog(DEBUG1, "Adding replica for shard %s on node %d",
-						  rc.part_name, dst_node);
 			}
 		}
 
 		if (ntasks == 0)
 			break;
 
-		exec_tasks(tasks, ntasks);
+		/* Tasks are only planned, they are checked when they start */
+		preempted = exec_tasks_preemptible(tasks, ntasks);
 		SHMN_CHECK_FOR_INTERRUPTS_CMD(cmd);
+		if (preempted)
+		{
+			/* Missing replicas are recomputed when we continue */
+			cmd_postponed(cmd);
+			return;
+		}
+
+		nsucceeded = 0;
+		for (i = 0; i < ntasks; i++)
+			nsucceeded += tasks[i]->res == TASK_SUCCESS;
+		if (nsucceeded < ntasks)
+			incomplete = true;
+		if (nsucceeded == 0)
+			break;
 
 		pfree(repcounts);
 		for (i = 0; i < ntasks; i++)
 			pfree(tasks[i]);
 		pfree(tasks);
+		pfree(candidates);
+		pfree(healthy);
 	}
 
+	if (incomplete)
+	{
+		shmn_elog(WARNING, "Some partitions of %s still have less than %d"
+				  " replicas: there are not enough healthy nodes for them",
+				  relation, replevel);
+		update_cmd_status(cmd->id, "failed");
+		return;
+	}
 	shmn_elog(INFO, "Relation %s now has at least %d replicas", relation,
 			  replevel);
 	update_cmd_status(cmd->id, "success");
@@ -9,15 +9,98 @@
  */
 
 #include "postgres.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "parser/parsetree.h"
+#include "replication/logicalworker.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
 #include "utils/elog.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
 #include "storage/proc.h"
+#include "storage/spin.h"
 
 #include "pg_shardman.h"
 #include "shardman_hooks.h"
 
+/* Max number of replica partitions (plus databases) node can keep read-only */
+#define MAX_READONLY_REPLICAS 8192
+
 emit_log_hook_type old_log_hook;
+shmem_startup_hook_type old_shmem_startup_hook;
+ExecutorStart_hook_type old_executor_start_hook;
+ProcessUtility_hook_type old_process_utility_hook;
+object_access_hook_type old_object_access_hook;
+
+/*
+ * Replica partitions are writable only by LR apply workers. Instead of
+ * triggers firing on every applied row, their relids are kept in shared hash
+ * and checked once per statement by backends only.
+ */
+typedef struct
+{
+	Oid dbid;
+	Oid relid; /* InvalidOid marks that replicas of dbid were loaded */
+} ReadonlyReplicaKey;
+
+/*
+ * With failover on, primaries of the node are writable only while it holds
+ * the lease granted by shardlord heartbeats, see primary_lease_renew.
+ */
+typedef struct
+{
+	LWLock *lock; /* protects readonly_replicas */
+	slock_t mutex; /* protects the lease fields */
+	bool lease_required;
+	TimestampTz lease_expires;
+	int64 lease_token; /* the last heartbeat seen */
+	TimestampTz lease_token_tm; /* when it was seen */
+} ShardmanShmemState;
+
+static ShardmanShmemState *shmn_state = NULL;
+static HTAB *readonly_replicas = NULL;
+/* this backend has already made sure replicas are loaded */
+static bool readonly_replicas_loaded = false;
+
+/*
+ * Change of the read-only set made by current transaction. It is applied to
+ * the shared set only on commit, so that aborted metadata update doesn't
+ * leave partition read-only or writable.
+ */
+typedef struct
+{
+	Oid relid;
+	bool readonly;
+	int nest_level; /* subtransaction which made the change */
+} ReadonlyReplicaChange;
+
+/* of ReadonlyReplicaChange, in TopTransactionContext */
+static List *readonly_replica_changes = NIL;
+
+/*
+ * With shardman.table_sync_commit or primaries lease, relations written by
+ * current transaction (in TopTransactionContext).
+ */
+static List *written_relids = NIL;
+
+static bool writes_sync_replicated(void);
+static void apply_readonly_replica_changes(void);
+static void load_readonly_replicas(void);
+static void check_readonly_replica(Oid relid);
+static bool primary_lease_expired(void);
+static void check_primary_lease(Oid relid);
+static void remember_written_relid(Oid relid);
 
 /*
  * Add [SHND x] where x is node id to each log message, if '%z' is in
@@ -43,3 +126,510 @@ shardman_log(ErrorData *edata)
 		MemoryContextSwitchTo(oldcontext);
 	}
 }
+
+/*
+ * Shared memory needed for read-only replicas set.
+ */
+Size
+shardman_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(ShardmanShmemState)),
+					hash_estimate_size(MAX_READONLY_REPLICAS,
+									   sizeof(ReadonlyReplicaKey)));
+}
+
+/*
+ * Allocate or attach to shared state. The set is empty after restart and
+ * gets filled from metadata by the first writing backend, see
+ * load_readonly_replicas.
+ */
+void
+shardman_shmem_startup(void)
+{
+	HASHCTL info;
+	bool found;
+
+	if (old_shmem_startup_hook != NULL)
+		old_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shmn_state = ShmemInitStruct("pg_shardman", sizeof(ShardmanShmemState),
+								 &found);
+	if (!found)
+	{
+		shmn_state->lock = &(GetNamedLWLockTranche("pg_shardman"))->lock;
+		SpinLockInit(&shmn_state->mutex);
+		/* after restart, wait for the lease if shardlord might fail us over */
+		shmn_state->lease_required = shardman_failover_timeout > 0;
+		shmn_state->lease_expires = 0;
+		shmn_state->lease_token = 0;
+		shmn_state->lease_token_tm = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ReadonlyReplicaKey);
+	info.entrysize = sizeof(ReadonlyReplicaKey);
+	readonly_replicas = ShmemInitHash("pg_shardman readonly replicas",
+									  MAX_READONLY_REPLICAS,
+									  MAX_READONLY_REPLICAS,
+									  &info, HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Make relation of current database read-only for all but apply workers, or
+ * writable again, once current transaction commits.
+ */
+void
+readonly_replica_set(Oid relid, bool readonly)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	ReadonlyReplicaChange *change = palloc(sizeof(ReadonlyReplicaChange));
+
+	change->relid = relid;
+	change->readonly = readonly;
+	change->nest_level = GetCurrentTransactionNestLevel();
+	readonly_replica_changes = lappend(readonly_replica_changes, change);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Transaction has committed: apply its changes of read-only set in order.
+ * The set is in shared memory, so nothing here may fail.
+ */
+void
+apply_readonly_replica_changes(void)
+{
+	ReadonlyReplicaKey key;
+	ListCell *lc;
+
+	/* not in shared_preload_libraries, no set to maintain */
+	if (shmn_state == NULL)
+		return;
+
+	key.dbid = MyDatabaseId;
+	LWLockAcquire(shmn_state->lock, LW_EXCLUSIVE);
+	foreach(lc, readonly_replica_changes)
+	{
+		ReadonlyReplicaChange *change = (ReadonlyReplicaChange *) lfirst(lc);
+
+		key.relid = change->relid;
+		if (hash_search(readonly_replicas, &key,
+						change->readonly ? HASH_ENTER_NULL : HASH_REMOVE,
+						NULL) == NULL && change->readonly)
+			elog(WARNING, "[SHMN] too many read-only replicas, relation %u"
+				 " stays writable", change->relid);
+	}
+	LWLockRelease(shmn_state->lock);
+}
+
+/*
+ * After restart, fill read-only set with replicas this node holds according
+ * to metadata. Each backend checks it at most once; the backend is marked
+ * only when the check succeeded, so failed attempt is repeated by the next
+ * write. Metadata is read via SECURITY DEFINER shardman.my_replicas, since
+ * the writer is not necessarily allowed to read shardman.partitions.
+ */
+void
+load_readonly_replicas(void)
+{
+	ReadonlyReplicaKey key;
+	bool loaded;
+	uint64 i;
+
+	if (readonly_replicas_loaded)
+		return;
+
+	key.dbid = MyDatabaseId;
+	key.relid = InvalidOid;
+	LWLockAcquire(shmn_state->lock, LW_SHARED);
+	loaded = hash_search(readonly_replicas, &key, HASH_FIND, NULL) != NULL;
+	LWLockRelease(shmn_state->lock);
+	if (loaded || !OidIsValid(get_extension_oid("pg_shardman", true)))
+	{
+		readonly_replicas_loaded = true;
+		return;
+	}
+
+	SPI_connect();
+	if (SPI_execute("select shardman.my_replicas();", true, 0) !=
+		SPI_OK_SELECT)
+		elog(ERROR, "failed to learn replicas of the node");
+
+	LWLockAcquire(shmn_state->lock, LW_EXCLUSIVE);
+	for (i = 0; i < SPI_processed; i++)
+	{
+		bool isnull;
+		Datum relid = SPI_getbinval(SPI_tuptable->vals[i],
+									SPI_tuptable->tupdesc, 1, &isnull);
+
+		if (isnull)
+			continue;
+		key.relid = DatumGetObjectId(relid);
+		hash_search(readonly_replicas, &key, HASH_ENTER, NULL);
+	}
+	key.relid = InvalidOid;
+	hash_search(readonly_replicas, &key, HASH_ENTER, NULL);
+	LWLockRelease(shmn_state->lock);
+	SPI_finish();
+	readonly_replicas_loaded = true;
+}
+
+/*
+ * ERROR if relid is read-only replica; caller checks that we are not apply
+ * worker.
+ */
+void
+check_readonly_replica(Oid relid)
+{
+	ReadonlyReplicaKey key;
+	bool readonly;
+
+	/* without shared memory nothing is read-only */
+	if (!OidIsValid(relid) || shmn_state == NULL)
+		return;
+	load_readonly_replicas();
+
+	key.dbid = MyDatabaseId;
+	key.relid = relid;
+	LWLockAcquire(shmn_state->lock, LW_SHARED);
+	readonly = hash_search(readonly_replicas, &key, HASH_FIND, NULL) != NULL;
+	LWLockRelease(shmn_state->lock);
+
+	if (readonly)
+		ereport(ERROR,
+				(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+				 errmsg("[SHMN] The \"%s\" table is read only for non-apply workers",
+						get_rel_name(relid)),
+				 errhint("If you see this, most probably node with primary"
+						 " part has failed and you need to promote replica"
+						 " with shardman.promote_replica.")));
+}
+
+/*
+ * Shardlord heartbeat: renew the lease of our primaries for millis, 0 means
+ * that shardlord doesn't fail nodes over and the lease is not needed.
+ *
+ * Heartbeat might execute here while its answer never reaches shardlord,
+ * which then fails us over as if we haven't seen it. So a heartbeat extends
+ * the lease only from the moment we saw the previous one, and only if
+ * shardlord confirms it got the answer to that one by passing its token as
+ * acked. Shardlord fails the node over failover_timeout after the last
+ * answer it got, and millis is less than that, so our primaries are
+ * read-only by then.
+ */
+void
+primary_lease_renew(int64 acked, int64 token, int millis)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (shmn_state == NULL)
+		return;
+	SpinLockAcquire(&shmn_state->mutex);
+	shmn_state->lease_required = millis > 0;
+	if (millis > 0 && acked != 0 && acked == shmn_state->lease_token)
+		shmn_state->lease_expires =
+			TimestampTzPlusMilliseconds(shmn_state->lease_token_tm, millis);
+	shmn_state->lease_token = token;
+	shmn_state->lease_token_tm = now;
+	SpinLockRelease(&shmn_state->mutex);
+}
+
+/* Do primaries of the node need the lease which they don't have? */
+bool
+primary_lease_expired(void)
+{
+	bool expired;
+
+	if (shmn_state == NULL)
+		return false;
+	SpinLockAcquire(&shmn_state->mutex);
+	expired = shmn_state->lease_required &&
+		shmn_state->lease_expires < GetCurrentTimestamp();
+	SpinLockRelease(&shmn_state->mutex);
+	return expired;
+}
+
+/*
+ * ERROR if the lease is expired and relid is our primary partition or
+ * sharded table, whose rows might go to it. Metadata is consulted only when
+ * the lease is expired, i.e. practically never.
+ */
+void
+check_primary_lease(Oid relid)
+{
+	Datum args[1];
+	Oid argtypes[1] = {OIDOID};
+	bool holds_primary;
+	bool isnull;
+
+	if (!OidIsValid(relid) || !primary_lease_expired() ||
+		!OidIsValid(get_extension_oid("pg_shardman", true)))
+		return;
+
+	args[0] = ObjectIdGetDatum(relid);
+	SPI_connect();
+	if (SPI_execute_with_args("select shardman.holds_primary($1);", 1,
+							  argtypes, args, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "failed to learn whether relation is primary");
+	holds_primary = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc, 1,
+											   &isnull));
+	SPI_finish();
+
+	if (holds_primary)
+		ereport(ERROR,
+				(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+				 errmsg("[SHMN] The \"%s\" table is read only: node has not"
+						" heard from shardlord for too long",
+						get_rel_name(relid)),
+				 errhint("Shardlord might have failed this node over and"
+						 " promoted its replicas.")));
+}
+
+/*
+ * Remember relation written by current transaction: with table_sync_commit
+ * commit waits for sync standbys only if some of them replicates it, and the
+ * lease is checked again on commit.
+ */
+void
+remember_written_relid(Oid relid)
+{
+	MemoryContext oldcontext;
+
+	if (!OidIsValid(relid) ||
+		!(shardman_table_sync_commit ||
+		  (shmn_state != NULL && shmn_state->lease_required)))
+		return;
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	written_relids = list_append_unique_oid(written_relids, relid);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Reject writes to read-only replicas and to primaries of node without the
+ * lease, and remember relations the query is going to modify, so that we
+ * know which data channels to wait for on commit.
+ */
+void
+shardman_executor_start(QueryDesc *queryDesc, int eflags)
+{
+	if (queryDesc->plannedstmt->resultRelations != NIL &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY) && !IsLogicalWorker())
+	{
+		ListCell *lc;
+
+		foreach(lc, queryDesc->plannedstmt->resultRelations)
+		{
+			Oid relid = getrelid(lfirst_int(lc),
+								 queryDesc->plannedstmt->rtable);
+
+			check_readonly_replica(relid);
+			check_primary_lease(relid);
+		}
+	}
+
+	if (old_executor_start_hook != NULL)
+		old_executor_start_hook(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (!IsLogicalWorker() &&
+		queryDesc->plannedstmt->resultRelations != NIL &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+	{
+		ListCell *lc;
+
+		foreach(lc, queryDesc->plannedstmt->resultRelations)
+			remember_written_relid(getrelid(lfirst_int(lc),
+											queryDesc->plannedstmt->rtable));
+	}
+}
+
+/*
+ * TRUNCATE and COPY FROM don't pass through executor, so check them here.
+ * Relation COPY FROM writes to is remembered as well.
+ */
+void
+shardman_process_utility(PlannedStmt *pstmt, const char *queryString,
+						 ProcessUtilityContext context, ParamListInfo params,
+						 QueryEnvironment *queryEnv, DestReceiver *dest,
+						 char *completionTag)
+{
+	Node *parsetree = pstmt->utilityStmt;
+
+	if (!IsLogicalWorker() && IsTransactionState())
+	{
+		if (IsA(parsetree, TruncateStmt))
+		{
+			ListCell *lc;
+
+			foreach(lc, ((TruncateStmt *) parsetree)->relations)
+			{
+				Oid relid = RangeVarGetRelid((RangeVar *) lfirst(lc), NoLock,
+											 true);
+
+				check_readonly_replica(relid);
+				check_primary_lease(relid);
+				remember_written_relid(relid);
+			}
+		}
+		else if (IsA(parsetree, CopyStmt) && ((CopyStmt *) parsetree)->is_from &&
+				 ((CopyStmt *) parsetree)->relation != NULL)
+		{
+			Oid relid = RangeVarGetRelid(((CopyStmt *) parsetree)->relation,
+										 NoLock, true);
+
+			check_readonly_replica(relid);
+			check_primary_lease(relid);
+			remember_written_relid(relid);
+		}
+	}
+
+	if (old_process_utility_hook != NULL)
+		old_process_utility_hook(pstmt, queryString, context, params,
+								 queryEnv, dest, completionTag);
+	else
+		standard_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, completionTag);
+}
+
+/*
+ * Dropped relation is not a replica anymore; otherwise its oid might be
+ * reused by unrelated table.
+ */
+void
+shardman_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+					   int subId, void *arg)
+{
+	if (old_object_access_hook != NULL)
+		old_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access == OAT_DROP && classId == RelationRelationId && subId == 0)
+		readonly_replica_set(objectId, false);
+}
+
+/*
+ * With shardman.table_sync_commit, transaction which hasn't written any
+ * partition replicated by a sync data channel commits with synchronous_commit
+ * lowered to local, so only commits which need sync standbys wait for them,
+ * and they do it as usual, before becoming visible. Besides, changes of
+ * read-only replicas set are applied on commit and discarded on abort here.
+ */
+void
+shardman_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			{
+				ListCell *lc;
+
+				/* the lease might have expired while we were writing */
+				foreach(lc, written_relids)
+					check_primary_lease(lfirst_oid(lc));
+				/* reverted at the end of transaction, after the wait */
+				if (shardman_table_sync_commit &&
+					synchronous_commit > SYNCHRONOUS_COMMIT_LOCAL_FLUSH &&
+					(written_relids == NIL || !writes_sync_replicated()))
+					set_config_option("synchronous_commit", "local",
+									  PGC_USERSET, PGC_S_SESSION,
+									  GUC_ACTION_LOCAL, true, 0, false);
+				written_relids = NIL;
+				break;
+			}
+		case XACT_EVENT_PRE_PREPARE:
+			if (readonly_replica_changes != NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("[SHMN] cannot PREPARE a transaction that has"
+								" changed read-only replicas")));
+			break;
+		case XACT_EVENT_COMMIT:
+			if (readonly_replica_changes != NIL)
+				apply_readonly_replica_changes();
+			readonly_replica_changes = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			written_relids = NIL;
+			readonly_replica_changes = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Forget read-only set changes of aborted subtransaction; changes of
+ * committed one now belong to its parent.
+ */
+void
+shardman_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	int nest_level = GetCurrentTransactionNestLevel();
+	ListCell *lc;
+	ListCell *prev = NULL;
+	ListCell *next;
+
+	if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB)
+		return;
+
+	for (lc = list_head(readonly_replica_changes); lc != NULL; lc = next)
+	{
+		ReadonlyReplicaChange *change = (ReadonlyReplicaChange *) lfirst(lc);
+
+		next = lnext(lc);
+		if (change->nest_level < nest_level)
+		{
+			prev = lc;
+			continue;
+		}
+		if (event == SUBXACT_EVENT_COMMIT_SUB)
+		{
+			change->nest_level = nest_level - 1;
+			prev = lc;
+		}
+		else
+			readonly_replica_changes =
+				list_delete_cell(readonly_replica_changes, lc, prev);
+	}
+}
+
+/*
+ * Ask metadata whether any of written_relids (sharded tables or their
+ * partitions) is replicated from us by a sync data channel.
+ */
+bool
+writes_sync_replicated(void)
+{
+	Datum *elems;
+	Datum args[1];
+	Oid argtypes[1] = {OIDARRAYOID};
+	ListCell *lc;
+	int nrelids = list_length(written_relids);
+	int i = 0;
+	bool isnull;
+	bool res;
+
+	if (!OidIsValid(get_extension_oid("pg_shardman", true)))
+		return false;
+
+	elems = palloc(sizeof(Datum) * nrelids);
+	foreach(lc, written_relids)
+		elems[i++] = ObjectIdGetDatum(lfirst_oid(lc));
+	args[0] = PointerGetDatum(construct_array(elems, nrelids, OIDOID,
+											  sizeof(Oid), true, 'i'));
+
+	SPI_connect();
+	if (SPI_execute_with_args(
+			"select exists(select 1 from shardman.sync_channels($1));", 1,
+			argtypes, args, NULL, true, 1) != SPI_OK_SELECT ||
+		SPI_processed != 1)
+		elog(ERROR, "failed to learn sync data channels");
+	res = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									 SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+	return res;
+}
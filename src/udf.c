@@ -10,6 +10,7 @@
 #include "postgres.h"
 #include "commands/event_trigger.h"
 #include "executor/spi.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/rel.h"
 #include "utils/lsyscache.h"
@@ -25,6 +26,13 @@
 #include "tcop/tcopprot.h"
 
 #include "pg_shardman.h"
+#include "shardman_hooks.h"
+
+static bool standby_has_slot(const char *standby, char **slots, int nslots);
+static char *form_sync_standbys(char **add, int nadd, char **slots,
+								int nslots, const char *remove,
+								int may_lag);
+static char **text_array_to_cstrings(ArrayType *arr, int *n);
 
 /*
  * Must be called iff we are dropping extension. Checks that we are dropping
@@ -284,6 +292,42 @@ pq_conninfo_parse(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
+/*
+ * Make replica partition read-only for all but LR apply workers. Enforced by
+ * hooks, see shardman_hooks.c.
+ */
+PG_FUNCTION_INFO_V1(readonly_replica_on);
+Datum
+readonly_replica_on(PG_FUNCTION_ARGS)
+{
+	readonly_replica_set(PG_GETARG_OID(0), true);
+	elog(DEBUG1, "[SHMN] table %s made read-only for all but apply workers",
+		 get_rel_name(PG_GETARG_OID(0)));
+	PG_RETURN_VOID();
+}
+
+/* And make replica writable again */
+PG_FUNCTION_INFO_V1(readonly_replica_off);
+Datum
+readonly_replica_off(PG_FUNCTION_ARGS)
+{
+	readonly_replica_set(PG_GETARG_OID(0), false);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Shardlord heartbeat renews the lease of our primaries, see
+ * primary_lease_renew.
+ */
+PG_FUNCTION_INFO_V1(renew_lease);
+Datum
+renew_lease(PG_FUNCTION_ARGS)
+{
+	primary_lease_renew(PG_GETARG_INT64(0), PG_GETARG_INT64(1),
+						PG_GETARG_INT32(2));
+	PG_RETURN_VOID();
+}
+
 /* Are we a logical apply worker? */
 PG_FUNCTION_INFO_V1(inside_apply_worker);
 Datum
@@ -293,100 +337,196 @@ inside_apply_worker(PG_FUNCTION_ARGS)
 }
 
 /*
- * Check whether 'standby' is present in current value of
- * synchronous_standby_names. If yes, return NULL. Otherwise, form properly
- * quoted new value of the setting with 'standby' appended. Currently we
- * support only the case when *all* standbys must agree on commit, so FIRST or
- * ANY doesn't matter here. '*' wildcard is not supported too.
+ * Is 'standby' a data channel with repslot among 'slots'? Standbys not
+ * managed by us and anything when nslots is -1 are considered alive.
  */
-PG_FUNCTION_INFO_V1(ensure_sync_standby_c);
-Datum
-ensure_sync_standby_c(PG_FUNCTION_ARGS)
+bool
+standby_has_slot(const char *standby, char **slots, int nslots)
+{
+	int i;
+
+	if (nslots == -1 || strncmp(standby, "shardman_data_", 14) != 0)
+		return true;
+	for (i = 0; i < nslots; i++)
+	{
+		if (strcmp(standby, slots[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Form properly quoted new value of synchronous_standby_names from its
+ * current value with nadd standbys from 'add' appended (unless they are
+ * already there) and 'remove' removed (may be NULL). If nslots is not -1,
+ * data channels without repslot among 'slots' are removed as well: they are
+ * leftovers of tasks which failed before the channel was dropped, and
+ * nothing will ever confirm commits for them. may_lag standbys are
+ * allowed to lag behind, i.e. commit waits for ANY n - may_lag of n standbys;
+ * if may_lag is 0, FIRST n form is used, so all standbys must agree on
+ * commit. Return NULL if the setting wouldn't change. '*' wildcard is not
+ * supported.
+ */
+char *
+form_sync_standbys(char **add, int nadd, char **slots, int nslots,
+				   const char *remove, int may_lag)
 {
-	char *standby = text_to_cstring(PG_GETARG_TEXT_PP(0));
 	char *cur_standby_name;
 	StringInfoData standby_list;
-	char *newval;
-	int processed = 0;
+	bool changed = false;
+	bool *add_found = palloc0(sizeof(bool) * Max(nadd, 1));
+	int nmembers = 0;
+	int num_sync;
+	int i;
 
 	initStringInfo(&standby_list);
 	if (SyncRepConfig != NULL)
 	{
-		Assert(SyncRepConfig->num_sync == SyncRepConfig->nmembers);
+		int processed;
 
 		cur_standby_name = SyncRepConfig->member_names;
-		for (; processed < SyncRepConfig->nmembers; processed++)
+		for (processed = 0; processed < SyncRepConfig->nmembers; processed++)
 		{
 			Assert(strcmp(cur_standby_name, "*") != 0);
-			if (pg_strcasecmp(cur_standby_name, standby) == 0)
+			if ((remove != NULL &&
+				 pg_strcasecmp(cur_standby_name, remove) == 0) ||
+				!standby_has_slot(cur_standby_name, slots, nslots))
+				changed = true;
+			else
 			{
-				PG_RETURN_NULL(); /* already set */
+				for (i = 0; i < nadd; i++)
+				{
+					if (pg_strcasecmp(cur_standby_name, add[i]) == 0)
+						add_found[i] = true;
+				}
+				if (nmembers != 0)
+					appendStringInfoString(&standby_list, ", ");
+				appendStringInfoString(&standby_list,
+									   quote_identifier(cur_standby_name));
+				nmembers++;
 			}
 
-			if (processed != 0)
-				appendStringInfoString(&standby_list, ", ");
-			appendStringInfoString(&standby_list, quote_identifier(cur_standby_name));
-
 			cur_standby_name += strlen(cur_standby_name) + 1;
 		}
 	}
 
-	if (processed != 0)
-		appendStringInfoString(&standby_list, ", ");
-	appendStringInfoString(&standby_list, quote_identifier(standby));
+	for (i = 0; i < nadd; i++)
+	{
+		int j;
+
+		if (add_found[i])
+			continue;
+		if (nmembers != 0)
+			appendStringInfoString(&standby_list, ", ");
+		appendStringInfoString(&standby_list, quote_identifier(add[i]));
+		nmembers++;
+		changed = true;
+		/* don't add duplicates twice */
+		for (j = i + 1; j < nadd; j++)
+		{
+			if (pg_strcasecmp(add[i], add[j]) == 0)
+				add_found[j] = true;
+		}
+	}
+
+	if (nmembers == 0)
+		return changed ? "" : NULL;
+
+	num_sync = Max(nmembers - Max(may_lag, 0), 1);
+	if (!changed && SyncRepConfig != NULL &&
+		SyncRepConfig->num_sync == num_sync &&
+		(num_sync == nmembers ||
+		 SyncRepConfig->syncrep_method == SYNC_REP_QUORUM))
+		return NULL;
+
+	if (num_sync == nmembers)
+		return psprintf("FIRST %d (%s)", num_sync, standby_list.data);
+	return psprintf("ANY %d (%s)", num_sync, standby_list.data);
+}
+
+/* Non-null elements of text array as C strings, their number in *n */
+char **
+text_array_to_cstrings(ArrayType *arr, int *n)
+{
+	Datum *elems;
+	bool *nulls;
+	int nelems;
+	char **res;
+	int i;
+
+	deconstruct_array(arr, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+	res = palloc(sizeof(char *) * Max(nelems, 1));
+	*n = 0;
+	for (i = 0; i < nelems; i++)
+	{
+		if (!nulls[i])
+			res[(*n)++] = TextDatumGetCString(elems[i]);
+	}
+	return res;
+}
+
+/*
+ * Check whether all 'standbys' are present in current value of
+ * synchronous_standby_names, no data channel there lacks repslot among
+ * 'slots' and the quorum is as requested by may_lag. If yes, return NULL.
+ * Otherwise, form new value of the setting with missing standbys appended and
+ * dead ones removed, so that any number of them is added at once.
+ */
+PG_FUNCTION_INFO_V1(ensure_sync_standbys_c);
+Datum
+ensure_sync_standbys_c(PG_FUNCTION_ARGS)
+{
+	ArrayType *standbys_arr = PG_GETARG_ARRAYTYPE_P(0);
+	int may_lag = PG_GETARG_INT32(1);
+	ArrayType *slots_arr = PG_GETARG_ARRAYTYPE_P(2);
+	char **standbys;
+	int nstandbys;
+	char **slots;
+	int nslots;
+	char *newval;
+
+	standbys = text_array_to_cstrings(standbys_arr, &nstandbys);
+	slots = text_array_to_cstrings(slots_arr, &nslots);
+	newval = form_sync_standbys(standbys, nstandbys, slots, nslots, NULL,
+								may_lag);
 
-	newval = psprintf("FIRST %d (%s)", processed + 1, standby_list.data);
+	if (newval == NULL)
+		PG_RETURN_NULL(); /* already set */
 	PG_RETURN_TEXT_P(cstring_to_text(newval));
 }
 
 /*
  * Check whether 'standby' is present in current value of
- * synchronous_standby_names. If no, return NULL. Otherwise, form properly
- * quoted new value of the setting with 'standby' removed. Currently we
- * support only the case when *all* standbys must agree on commit, so FIRST or
- * ANY doesn't matter here. '*' wildcard is not supported too.
- * All entries are removed.
+ * synchronous_standby_names. If no and the quorum is as requested by may_lag,
+ * return NULL. Otherwise, form new value of the setting with 'standby'
+ * removed. All entries are removed.
  */
 PG_FUNCTION_INFO_V1(remove_sync_standby_c);
 Datum
 remove_sync_standby_c(PG_FUNCTION_ARGS)
 {
 	char *standby = text_to_cstring(PG_GETARG_TEXT_PP(0));
-	char *cur_standby_name;
-	StringInfoData standby_list;
-	char *newval;
-	int processed;
-	int num_sync;
-
-	if (SyncRepConfig == NULL)
-		PG_RETURN_NULL();
+	int may_lag = PG_GETARG_INT32(1);
+	char *newval = form_sync_standbys(NULL, 0, NULL, -1, standby, may_lag);
 
-	initStringInfo(&standby_list);
-	Assert(SyncRepConfig->num_sync == SyncRepConfig->nmembers);
-
-	cur_standby_name = SyncRepConfig->member_names;
-	num_sync = 0;
-	for (processed = 0; processed < SyncRepConfig->nmembers; processed++)
-	{
-		Assert(strcmp(cur_standby_name, "*") != 0);
-		if (pg_strcasecmp(cur_standby_name, standby) != 0)
-		{
-			if (num_sync != 0)
-				appendStringInfoString(&standby_list, ", ");
-			appendStringInfoString(&standby_list, quote_identifier(cur_standby_name));
-			num_sync++;
-		}
-
-		cur_standby_name += strlen(cur_standby_name) + 1;
-	}
+	if (newval == NULL)
+		PG_RETURN_NULL(); /* nothing was changed */
+	PG_RETURN_TEXT_P(cstring_to_text(newval));
+}
 
-	if (SyncRepConfig->num_sync == num_sync)
-		PG_RETURN_NULL(); /* nothing was removed */
+/*
+ * Form new value of synchronous_standby_names with the same standbys, but
+ * quorum requested by may_lag. NULL if it is already so.
+ */
+PG_FUNCTION_INFO_V1(requorum_sync_standbys_c);
+Datum
+requorum_sync_standbys_c(PG_FUNCTION_ARGS)
+{
+	int may_lag = PG_GETARG_INT32(0);
+	char *newval = form_sync_standbys(NULL, 0, NULL, -1, NULL, may_lag);
 
-	if (num_sync > 0)
-		newval = psprintf("FIRST %d (%s)", num_sync, standby_list.data);
-	else
-		newval = "";
+	if (newval == NULL)
+		PG_RETURN_NULL();
 	PG_RETURN_TEXT_P(cstring_to_text(newval));
 }
 
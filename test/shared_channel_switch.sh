@@ -0,0 +1,82 @@
+#!/bin/bash
+# Check that writes made while partitions join shared data channels are not
+# lost. Run on a cluster made by bin/shardman_init.sh (all workers added) with
+# shardman.shared_data_channels = on on all nodes and at least 3 workers.
+# While a writer keeps inserting rows, replicas are added and moved; then
+# every copy of each partition must have the same rows as its primary.
+set -e
+
+script_dir=`dirname "$(readlink -f "$0")"`
+source "${script_dir}/../bin/common.sh"
+
+stop_file=`mktemp -u`
+lord="-p $lord_port -qtAX"
+
+# Wait until command registered on the lord is done; fail unless it succeeded
+function wait_cmd()
+{
+    local cmd_id=$1
+    local status
+    while true; do
+	status=`psql $lord -c "select status from shardman.cmd_log where id = $cmd_id"`
+	case $status in
+	    waiting|"in progress") sleep 1;;
+	    success|done) return 0;;
+	    *) echo "command $cmd_id finished with status $status"; exit 1;;
+	esac
+    done
+}
+
+function run_cmd()
+{
+    wait_cmd `psql $lord -c "select shardman.$1"`
+}
+
+# Insert batches of rows with unique ids until stop file appears
+function writer()
+{
+    local i=0
+    while [ ! -e $stop_file ]; do
+	psql -p ${worker_ports[0]} -qtAX -c "insert into sw select g, $i from
+	    generate_series($i * 100, $i * 100 + 99) g" > /dev/null
+	i=$((i + 1))
+    done
+}
+
+psql -p ${worker_ports[0]} -c "drop table if exists sw cascade"
+psql -p ${worker_ports[0]} -c "create table sw(id bigint not null, batch int)"
+node_id=`psql -p ${worker_ports[0]} -qtAX -c "select shardman.my_id()"`
+run_cmd "create_hash_partitions($node_id, 'sw', 'id', 8, false)"
+run_cmd "set_replevel('sw', 1)"
+
+writer &
+writer_pid=$!
+run_cmd "set_replevel('sw', 2)"
+run_cmd "rebalance('sw')"
+touch $stop_file
+wait $writer_pid
+rm -f $stop_file
+
+# Let replicas apply everything written
+sleep 5
+failed=0
+while IFS='|' read part_name owner connstring prv; do
+    rows=`psql -d "$connstring" -qtAX -c "select count(*), sum(id) from $part_name"`
+    if [ -z "$prv" ]; then
+	primary_rows[${part_name#sw_}]=$rows
+    else
+	replica_rows+=("$part_name|$owner|$rows")
+    fi
+done < <(psql $lord -c "select p.part_name, p.owner, n.connstring, p.prv
+    from shardman.partitions p join shardman.nodes n on n.id = p.owner
+    where p.relation = 'sw'")
+for r in "${replica_rows[@]}"; do
+    IFS='|' read part_name owner count sum <<< "$r"
+    if [ "${primary_rows[${part_name#sw_}]}" != "$count|$sum" ]; then
+	echo "replica of $part_name on node $owner has $count|$sum rows," \
+	     "primary has ${primary_rows[${part_name#sw_}]}"
+	failed=1
+    fi
+done
+[ $failed -eq 0 ] && echo "all replicas match their primaries"
+exit $failed